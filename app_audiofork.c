@@ -0,0 +1,2250 @@
+/*! \file
+ *
+ * \brief AudioFork() - Fork the raw audio of a channel to a WebSocket server.
+ * \ingroup applications
+ *
+ * A framehook takes the voice frames off the channel, converts them to signed
+ * linear and copies them into a ring owned by the fork. The ring has exactly
+ * one producer, the channel's media thread, and one consumer, the I/O worker
+ * the fork was placed on, so neither side ever takes a lock or waits for the
+ * other: a slow or unreachable server fills the ring and costs dropped frames,
+ * never audio jitter on the channel.
+ *
+ * A fixed pool of workers, one per CPU by default, each runs an epoll loop
+ * over the connections of many forks. Connecting blocks, so it is done by
+ * short-lived connector threads that hand the connection to the worker.
+ *
+ * \note Based on app_mixmonitor.c
+ */
+
+/*** MODULEINFO
+	<depend>res_http_websocket</depend>
+	<support_level>extended</support_level>
+ ***/
+
+
+#ifndef AST_MODULE
+#define AST_MODULE "AudioFork"
+#endif
+
+#include "asterisk.h"
+#include "asterisk/module.h"
+#include "asterisk/channel.h"
+#include "asterisk/pbx.h"
+#include "asterisk/app.h"
+#include "asterisk/astobj2.h"
+#include "asterisk/strings.h"
+#include "asterisk/cli.h"
+#include "asterisk/config.h"
+#include "asterisk/frame.h"
+#include "asterisk/format_cache.h"
+#include "asterisk/translate.h"
+#include "asterisk/framehook.h"
+#include "asterisk/http_websocket.h"
+#include "asterisk/tcptls.h"
+#include "asterisk/beep.h"
+#include "asterisk/alertpipe.h"
+#include "asterisk/lock.h"
+#include "asterisk/utils.h"
+#include "asterisk/time.h"
+
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/sockios.h>
+
+#include "audiofork/audiofork_stereo.h"
+
+/*** DOCUMENTATION
+	<application name="AudioFork" language="en_US">
+		<synopsis>
+			Fork the raw audio of a channel to a WebSocket server.
+		</synopsis>
+		<syntax>
+			<parameter name="wsserver" required="true">
+				<para>URL of the WebSocket server, <literal>ws://</literal> or
+				<literal>wss://</literal>.</para>
+			</parameter>
+			<parameter name="options">
+				<optionlist>
+					<option name="b">
+						<para>Only fork audio while the channel is bridged.</para>
+					</option>
+					<option name="B">
+						<argument name="interval">
+							<para>Seconds between beeps, default 15.</para>
+						</argument>
+						<para>Play a periodic beep to the channel while its audio
+						is forked.</para>
+					</option>
+					<option name="v">
+						<argument name="x" required="true" />
+						<para>Adjust the <emphasis>heard</emphasis> volume by a
+						factor of <replaceable>x</replaceable> (range
+						<literal>-4</literal> to <literal>4</literal>).</para>
+					</option>
+					<option name="V">
+						<argument name="x" required="true" />
+						<para>Adjust the <emphasis>spoken</emphasis> volume by a
+						factor of <replaceable>x</replaceable> (range
+						<literal>-4</literal> to <literal>4</literal>).</para>
+					</option>
+					<option name="W">
+						<argument name="x" required="true" />
+						<para>Adjust both the heard and spoken volumes by a factor
+						of <replaceable>x</replaceable> (range <literal>-4</literal>
+						to <literal>4</literal>).</para>
+					</option>
+					<option name="i">
+						<argument name="chanvar" required="true" />
+						<para>Store the AudioFork ID in this channel variable, for
+						<literal>StopAudioFork</literal>.</para>
+					</option>
+					<option name="D">
+						<argument name="direction" required="true" />
+						<para><literal>in</literal> for the audio the channel
+						speaks, <literal>out</literal> for the audio it hears, or
+						<literal>both</literal> (the default). Each direction is
+						sent on its own connection, unless <literal>S</literal> is
+						given.</para>
+					</option>
+					<option name="S">
+						<para>With both directions, send them on one connection as
+						interleaved stereo: left is the audio the channel speaks,
+						right the audio it hears, both at the sample rate of the
+						first frame. The two sides are paired by when their audio
+						was taken off the channel, within
+						<literal>stereo_jitter</literal> from
+						<filename>audiofork.conf</filename>; a side with no audio
+						is sent as silence.</para>
+					</option>
+					<option name="T">
+						<argument name="certfile" required="true" />
+						<para>Certificate to present on <literal>wss://</literal>
+						connections.</para>
+					</option>
+					<option name="R">
+						<argument name="timeout" required="true" />
+						<para>Seconds to wait between reconnection attempts.
+						Defaults to <literal>reconnect_timeout</literal> in
+						<filename>audiofork.conf</filename>.</para>
+					</option>
+					<option name="r">
+						<argument name="attempts" required="true" />
+						<para>Reconnection attempts before a direction is given
+						up. Defaults to <literal>reconnect_attempts</literal> in
+						<filename>audiofork.conf</filename>.</para>
+					</option>
+					<option name="A">
+						<argument name="ms" required="true" />
+						<para>Send <replaceable>ms</replaceable> milliseconds of
+						audio per WebSocket message, 1 to 1000, rounded up to
+						whole frames, instead of a message per frame. A message
+						that is not full goes out anyway once it has waited
+						<literal>aggregate_latency</literal> from
+						<filename>audiofork.conf</filename>. Defaults to
+						<literal>aggregate</literal> there.</para>
+					</option>
+					<option name="g">
+						<para>Gather the messages waiting for a connection and
+						write them together, in one system call. Not available
+						with <literal>wss://</literal>. Defaults to
+						<literal>gather</literal> in
+						<filename>audiofork.conf</filename>.</para>
+					</option>
+				</optionlist>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Sends the channel's audio, as signed linear at the channel's
+			sample rate, to <replaceable>wsserver</replaceable> in binary
+			WebSocket messages until the channel hangs up or
+			<literal>StopAudioFork</literal> is called.</para>
+			<para>The channel's media thread only copies each frame into a
+			preallocated ring; a separate thread does the sending. When the
+			server does not keep up the oldest audio is kept and new frames are
+			dropped and counted, see <literal>audiofork show forks</literal>.</para>
+		</description>
+		<see-also>
+			<ref type="application">StopAudioFork</ref>
+		</see-also>
+	</application>
+	<application name="StopAudioFork" language="en_US">
+		<synopsis>
+			Stop forking audio started with AudioFork.
+		</synopsis>
+		<syntax>
+			<parameter name="id">
+				<para>ID stored by the <literal>i</literal> option of
+				<literal>AudioFork</literal>. Without it every fork on the channel
+				is stopped.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Audio already taken off the channel is still sent before the
+			connections are closed.</para>
+		</description>
+		<see-also>
+			<ref type="application">AudioFork</ref>
+		</see-also>
+	</application>
+ ***/
+
+static const char app[] = "AudioFork";
+static const char app_stop[] = "StopAudioFork";
+
+static const char config_file[] = "audiofork.conf";
+
+/*! \brief Bytes of audio in a ring slot, 20 ms of slin16 */
+#define SLOT_BYTES 640
+
+/*! \brief Default number of slots in a fork's ring */
+#define RING_SLOTS 64
+
+/*! \brief Keeps the producer's and the consumer's ring indices off each other's cache line */
+#define CACHE_LINE 64
+
+/*! \brief Buckets in the container of active forks */
+#define FORK_BUCKETS 563
+
+/*! \brief Default seconds between beeps with the B option */
+#define BEEP_INTERVAL 15
+
+/*! \brief Most epoll events a worker takes per wait */
+#define WORKER_EVENTS 64
+
+/*! \brief Longest audio the A option aggregates into a message, in ms */
+#define AGGREGATE_MAX 1000
+
+/*! \brief Default for aggregate_latency, in ms */
+#define AGGREGATE_LATENCY 200
+
+/*! \brief Largest header ast_websocket_write() puts in front of a client message */
+#define WS_HEADER_MAX 14
+
+/*! \brief Smallest output buffer of a gathering connection */
+#define GATHER_BYTES 8192
+
+/*! \brief Default for stereo_jitter, in ms */
+#define STEREO_JITTER 60
+
+/*! \brief Largest stereo_jitter, in ms */
+#define STEREO_JITTER_MAX 1000
+
+enum audiofork_direction {
+	/*! Audio read from the channel, what it speaks */
+	AUDIOFORK_IN,
+	/*! Audio written to the channel, what it hears */
+	AUDIOFORK_OUT,
+	AUDIOFORK_DIRECTIONS,
+};
+
+static const char * const direction_names[AUDIOFORK_DIRECTIONS] = {
+	[AUDIOFORK_IN] = "in",
+	[AUDIOFORK_OUT] = "out",
+};
+
+enum audiofork_state {
+	/*! Not connected, waiting to (re)connect */
+	AUDIOFORK_STATE_DOWN,
+	AUDIOFORK_STATE_UP,
+	/*! Out of reconnection attempts */
+	AUDIOFORK_STATE_FAILED,
+};
+
+static const char * const state_names[] = {
+	[AUDIOFORK_STATE_DOWN] = "down",
+	[AUDIOFORK_STATE_UP] = "up",
+	[AUDIOFORK_STATE_FAILED] = "failed",
+};
+
+/*! \brief Slots per ring for new forks, a power of two */
+static unsigned int ring_slots = RING_SLOTS;
+
+/*! \brief Defaults for the R and r options */
+static unsigned int reconnect_timeout = 5;
+static unsigned int reconnect_attempts = 3;
+
+/*! \brief Defaults for the A and g options */
+static unsigned int aggregate_default;
+static int gather_default;
+
+/*! \brief Longest a partly filled message waits for more audio, in ms */
+static unsigned int aggregate_latency = AGGREGATE_LATENCY;
+
+/*! \brief Jitter window of the stereo aligner for new forks, in ms */
+static unsigned int stereo_jitter = STEREO_JITTER;
+
+/*! \brief One frame, or part of one, on its way to the server */
+struct audiofork_slot {
+	/*! Bytes of audio in data */
+	uint16_t len;
+	/*! \ref audiofork_direction */
+	uint8_t direction;
+	uint32_t rate;
+	/*! Stereo forks: microseconds from the fork's start to when the last sample was taken */
+	int64_t ts;
+	/*! Signed linear audio, gain already applied */
+	int16_t data[SLOT_BYTES / 2] __attribute__((aligned(16)));
+};
+
+/*!
+ * \brief Single producer, single consumer ring of audio slots
+ *
+ * Allocated once with the fork and never resized. head is only written by
+ * the media thread and tail only by the worker, each on its own cache line
+ * together with that side's cached copy of the other index, so the two
+ * threads only share a line when the cached copy runs out.
+ *
+ * The read and write framehook events of a channel can come from different
+ * threads, but both run with the channel locked; that lock orders them and
+ * they count as the one producer.
+ */
+struct audiofork_ring {
+	/*! Next slot to fill, written by the producer */
+	unsigned int head __attribute__((aligned(CACHE_LINE)));
+	/*! Producer's last view of tail */
+	unsigned int tail_seen;
+	/*! Next slot to drain, written by the consumer */
+	unsigned int tail __attribute__((aligned(CACHE_LINE)));
+	/*! Consumer's last view of head */
+	unsigned int head_seen;
+	unsigned int mask __attribute__((aligned(CACHE_LINE)));
+	struct audiofork_slot *slots;
+	/*! Allocation the ring and its slots are carved from */
+	void *mem;
+};
+
+struct audiofork;
+
+/*! \brief One WebSocket connection of a fork, used only by the fork's worker */
+struct audiofork_conn {
+	struct audiofork *fork;
+	enum audiofork_direction direction;
+	struct ast_websocket *ws;
+	/*! Made by a connector thread, taken over by the worker */
+	struct ast_websocket *handoff;
+	/*! Bytes the socket is known to take without blocking */
+	int room;
+	/*! Out of room, waiting for EPOLLOUT */
+	int blocked;
+	/*! The connection was up before, audio for it is dropped until it is back */
+	int reconnect;
+	/*! Aggregation: audio waiting for a message to fill up */
+	char *agg;
+	size_t agg_len;
+	size_t agg_max;
+	unsigned int agg_rate;
+	/*! Slots in agg */
+	unsigned int agg_slots;
+	/*! When agg must go out, filled up or not */
+	struct timeval agg_due;
+	/*! agg is past due but the connection had no room */
+	int agg_late;
+	/*! Links in the worker's list of partly filled messages, oldest first */
+	struct audiofork_conn *agg_prev;
+	struct audiofork_conn *agg_next;
+	int agg_listed;
+	/*! Gathering: framed and masked messages, written together */
+	char *out;
+	size_t out_len;
+	size_t out_max;
+	/*! Slots in out */
+	unsigned int out_slots;
+};
+
+struct audiofork_worker;
+
+struct audiofork {
+	/*! Identifies the fork to StopAudioFork() and the CLI */
+	char id[AST_MAX_UNIQUEID + 16];
+	char uniqueid[AST_MAX_UNIQUEID];
+	char name[AST_CHANNEL_NAME];
+	char *url;
+	struct ast_tls_config *tls_cfg;
+	/*! Bit per \ref audiofork_direction forked */
+	unsigned int directions;
+	/*! Volume factor per direction, as for ast_frame_adjust_volume() */
+	int gain[AUDIOFORK_DIRECTIONS];
+	int bridged_only;
+	unsigned int reconnect_timeout;
+	unsigned int reconnect_attempts;
+	/*! Milliseconds of audio per message, 0 for a message per slot */
+	unsigned int aggregate;
+	/*! Frame messages here and write all those pending on a connection at once */
+	int gather;
+	/*! Both directions interleaved on the in connection, left in and right out */
+	int stereo;
+	/*! Stereo: jitter window of the aligner, in ms */
+	unsigned int jitter;
+	/*! Stereo, media thread only: the rate both directions are translated to */
+	unsigned int stereo_rate;
+	/*! Stereo: time stamps of the slots count from here */
+	struct timeval start;
+	/*! Stereo, worker only: pairs the directions, set up with the first slot */
+	struct audiofork_aligner aligner;
+	/*! Stereo, worker only: interleaved audio waiting for room on the connection */
+	int16_t *pend;
+	size_t pend_len;
+	int framehook_id;
+	char beep_id[64];
+	struct audiofork_ring *ring;
+	/*! Media thread only: translation to signed linear of non-slin frames */
+	struct ast_trans_pvt *trans[AUDIOFORK_DIRECTIONS];
+	struct ast_format *trans_format[AUDIOFORK_DIRECTIONS];
+	struct audiofork_conn conn[AUDIOFORK_DIRECTIONS];
+	/*! \ref audiofork_state per direction, for the CLI */
+	int state[AUDIOFORK_DIRECTIONS];
+	/*! Slots filled by the media thread */
+	uint64_t frames;
+	/*! Slots dropped by the media thread because the ring was full */
+	uint64_t overruns;
+	/*! Slots sent by the worker */
+	uint64_t sent;
+	/*! Slots drained while their direction had no connection */
+	uint64_t lost;
+	/*! WebSocket messages sent */
+	uint64_t messages;
+	/*! Writes to the sockets it took */
+	uint64_t writes;
+	uint64_t reconnects;
+	/*! Worker the fork was placed on, for good */
+	struct audiofork_worker *worker;
+	/*! Link in the worker's ready stack */
+	struct audiofork *next;
+	/*! Set while the fork is on, or being pushed to, the ready stack */
+	int queued;
+	/*! Set once the framehook is gone */
+	int stopping;
+};
+
+/*!
+ * \brief I/O worker, one epoll loop serving the connections of many forks
+ *
+ * Producers push forks with audio to send on the ready stack and wake the
+ * worker through its alertpipe if it sleeps. The worker drains their rings
+ * into the sockets, watching only the ones that ran out of room for EPOLLOUT
+ * and every connection for messages and closes from the server.
+ */
+struct audiofork_worker {
+	/*! Lock-free stack of forks with work, pushed by any thread, emptied by the worker */
+	struct audiofork *ready __attribute__((aligned(CACHE_LINE)));
+	/*! Set while the worker waits in epoll_wait() */
+	int sleeping;
+	/*! Directions forked by the forks placed here */
+	unsigned int streams __attribute__((aligned(CACHE_LINE)));
+	/*! Connections up, for the CLI */
+	unsigned int conns;
+	/*! Per mille of the last second spent working rather than waiting */
+	unsigned int busy;
+	/*! Connections with a partly filled message, by when it is due */
+	struct audiofork_conn *agg_head;
+	struct audiofork_conn *agg_tail;
+	int epfd;
+	int alert_pipe[2];
+	int stopping;
+	pthread_t thread;
+};
+
+/*! \brief Active forks by id */
+static struct ao2_container *forks;
+
+static unsigned int fork_seq;
+
+/*! \brief Number of I/O workers, 0 for one per online CPU, read at load only */
+static unsigned int worker_setting;
+
+static struct audiofork_worker *workers;
+static unsigned int worker_count;
+
+/*! \brief Kernels for the CPU, picked at load */
+static audiofork_gain_fn audiofork_gain = audiofork_gain_scalar;
+static audiofork_interleave_fn audiofork_interleave = audiofork_interleave_scalar;
+
+/*! \brief Forks held by workers and connector threads running, waited for on unload */
+static struct {
+	ast_mutex_t lock;
+	ast_cond_t cond;
+	unsigned int count;
+} senders;
+
+static int fork_hash(const void *obj, const int flags)
+{
+	const char *key;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_KEY:
+		key = obj;
+		break;
+	case OBJ_SEARCH_OBJECT:
+		key = ((const struct audiofork *) obj)->id;
+		break;
+	default:
+		ast_assert(0);
+		return 0;
+	}
+	return ast_str_hash(key);
+}
+
+static int fork_cmp(void *obj, void *arg, int flags)
+{
+	const struct audiofork *fork = obj;
+	const char *key;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_KEY:
+		key = arg;
+		break;
+	case OBJ_SEARCH_OBJECT:
+		key = ((const struct audiofork *) arg)->id;
+		break;
+	default:
+		return 0;
+	}
+	return strcmp(fork->id, key) ? 0 : CMP_MATCH;
+}
+
+static int fork_channel_cb(void *obj, void *arg, int flags attribute_unused)
+{
+	const struct audiofork *fork = obj;
+
+	return strcmp(fork->uniqueid, arg) ? 0 : CMP_MATCH;
+}
+
+/*! \brief Connection the audio of a direction goes out on */
+static struct audiofork_conn *audiofork_conn(struct audiofork *fork,
+	enum audiofork_direction direction)
+{
+	return &fork->conn[fork->stereo ? AUDIOFORK_IN : direction];
+}
+
+/*! \brief Connections a fork makes, one per direction or one in stereo */
+static unsigned int audiofork_streams(const struct audiofork *fork)
+{
+	return fork->stereo ? 1 : __builtin_popcount(fork->directions);
+}
+
+/*! \brief Name of a connection for the logs */
+static const char *conn_name(const struct audiofork_conn *conn)
+{
+	return conn->fork->stereo ? "stereo" : direction_names[conn->direction];
+}
+
+static struct audiofork_ring *ring_alloc(unsigned int slots)
+{
+	struct audiofork_ring *ring;
+	void *mem;
+
+	mem = ast_calloc(1, sizeof(*ring) + CACHE_LINE + slots * sizeof(struct audiofork_slot));
+	if (!mem) {
+		return NULL;
+	}
+	ring = (void *) (((uintptr_t) mem + CACHE_LINE - 1) & ~(uintptr_t) (CACHE_LINE - 1));
+	ring->mem = mem;
+	ring->mask = slots - 1;
+	ring->slots = (struct audiofork_slot *) (ring + 1);
+	return ring;
+}
+
+static void ring_free(struct audiofork_ring *ring)
+{
+	if (ring) {
+		ast_free(ring->mem);
+	}
+}
+
+/*! \brief Producer: the slot to fill next, NULL if the ring is full */
+static struct audiofork_slot *ring_reserve(struct audiofork_ring *ring)
+{
+	if (ring->head - ring->tail_seen > ring->mask) {
+		ring->tail_seen = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if (ring->head - ring->tail_seen > ring->mask) {
+			return NULL;
+		}
+	}
+	return &ring->slots[ring->head & ring->mask];
+}
+
+/*! \brief Producer: hand the reserved slot to the consumer */
+static void ring_commit(struct audiofork_ring *ring)
+{
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/*! \brief Consumer: the oldest filled slot, NULL if the ring is empty */
+static struct audiofork_slot *ring_peek(struct audiofork_ring *ring)
+{
+	if (ring->tail == ring->head_seen) {
+		ring->head_seen = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (ring->tail == ring->head_seen) {
+			return NULL;
+		}
+	}
+	return &ring->slots[ring->tail & ring->mask];
+}
+
+/*! \brief Consumer: give the peeked slot back to the producer */
+static void ring_release(struct audiofork_ring *ring)
+{
+	__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+/*! \brief Map a -4..4 volume to the factor ast_frame_adjust_volume() takes */
+static int volume_factor(int volume)
+{
+	if (!volume) {
+		return 0;
+	}
+	return volume > 0 ? 1 << volume : -(1 << -volume);
+}
+
+static void audiofork_destroy(void *obj)
+{
+	struct audiofork *fork = obj;
+	int i;
+
+	for (i = 0; i < AUDIOFORK_DIRECTIONS; i++) {
+		if (fork->trans[i]) {
+			ast_translator_free_path(fork->trans[i]);
+		}
+		ao2_cleanup(fork->trans_format[i]);
+		/* Made by a connector after the worker let go of the fork */
+		ast_websocket_unref(fork->conn[i].handoff);
+		ast_free(fork->conn[i].agg);
+		ast_free(fork->conn[i].out);
+	}
+	audiofork_aligner_free(&fork->aligner);
+	ast_free(fork->pend);
+	ring_free(fork->ring);
+	if (fork->tls_cfg) {
+		ast_ssl_teardown(fork->tls_cfg);
+		ast_free(fork->tls_cfg->certfile);
+		ast_free(fork->tls_cfg);
+	}
+	ast_free(fork->url);
+	ast_module_unref(ast_module_info->self);
+}
+
+static void senders_add(void)
+{
+	ast_mutex_lock(&senders.lock);
+	senders.count++;
+	ast_mutex_unlock(&senders.lock);
+}
+
+static void senders_done(void)
+{
+	ast_mutex_lock(&senders.lock);
+	senders.count--;
+	ast_cond_signal(&senders.cond);
+	ast_mutex_unlock(&senders.lock);
+}
+
+/*!
+ * \brief Put a fork on its worker's ready stack
+ *
+ * The push and the worker's check of the stack before it sleeps are both
+ * sequentially consistent, so either the worker sees the fork or this sees
+ * the worker asleep and wakes it.
+ */
+static void worker_push(struct audiofork_worker *worker, struct audiofork *fork)
+{
+	struct audiofork *head = __atomic_load_n(&worker->ready, __ATOMIC_RELAXED);
+
+	do {
+		fork->next = head;
+	} while (!__atomic_compare_exchange_n(&worker->ready, &head, fork, 1,
+		__ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+	if (__atomic_load_n(&worker->sleeping, __ATOMIC_SEQ_CST)
+		&& __atomic_exchange_n(&worker->sleeping, 0, __ATOMIC_RELAXED)) {
+		ast_alertpipe_write(worker->alert_pipe);
+	}
+}
+
+/*!
+ * \brief Have the worker look at a fork, unless it is already due to
+ *
+ * The fence pairs with the one in worker_run(): either the worker sees the
+ * slot just committed, or this sees queued cleared and queues the fork again.
+ */
+static void audiofork_wake(struct audiofork *fork)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&fork->queued, __ATOMIC_RELAXED)
+		&& !__atomic_exchange_n(&fork->queued, 1, __ATOMIC_ACQ_REL)) {
+		worker_push(fork->worker, fork);
+	}
+}
+
+/*!
+ * \brief Copy a frame into the ring, on the media thread
+ *
+ * Frames longer than a slot are split. Nothing here blocks: a full ring
+ * drops the rest of the frame.
+ */
+static void audiofork_push(struct audiofork *fork, enum audiofork_direction direction,
+	struct ast_frame *frame)
+{
+	struct ast_frame *slin = frame;
+	struct ast_format *target = NULL;
+	const int16_t *src;
+	unsigned int rate = ast_format_get_sample_rate(frame->subclass.format);
+	int64_t now = 0;
+	size_t left;
+	int pushed = 0;
+
+	if (fork->stereo) {
+		/* Both directions at the rate of the first frame, to be paired */
+		if (!fork->stereo_rate) {
+			fork->stereo_rate = rate;
+		}
+		if (rate != fork->stereo_rate || !ast_format_cache_is_slinear(frame->subclass.format)) {
+			target = ast_format_cache_get_slin_by_rate(fork->stereo_rate);
+		}
+		now = ast_tvdiff_us(ast_tvnow(), fork->start);
+	} else if (!ast_format_cache_is_slinear(frame->subclass.format)) {
+		target = ast_format_cache_get_slin_by_rate(rate);
+	}
+	if (target) {
+		if (!fork->trans_format[direction]
+			|| ast_format_cmp(fork->trans_format[direction], frame->subclass.format)
+				!= AST_FORMAT_CMP_EQUAL) {
+			if (fork->trans[direction]) {
+				ast_translator_free_path(fork->trans[direction]);
+			}
+			fork->trans[direction] = ast_translator_build_path(target, frame->subclass.format);
+			ao2_replace(fork->trans_format[direction], frame->subclass.format);
+			if (!fork->trans[direction]) {
+				ast_log(LOG_WARNING, "AudioFork %s: unable to translate %s to %s\n", fork->id,
+					ast_format_get_name(frame->subclass.format), ast_format_get_name(target));
+			}
+		}
+		if (!fork->trans[direction]
+			|| !(slin = ast_translate(fork->trans[direction], frame, 0))) {
+			return;
+		}
+	}
+
+	rate = ast_format_get_sample_rate(slin->subclass.format);
+	src = slin->data.ptr;
+	left = slin->datalen & ~1;
+	while (left) {
+		struct audiofork_slot *slot = ring_reserve(fork->ring);
+		size_t len = MIN(left, (size_t) SLOT_BYTES);
+
+		if (!slot) {
+			ast_atomic_fetch_add(&fork->overruns, (left + SLOT_BYTES - 1) / SLOT_BYTES,
+				__ATOMIC_RELAXED);
+			break;
+		}
+		slot->len = len;
+		slot->direction = direction;
+		slot->rate = rate;
+		if (fork->stereo) {
+			/* Frames longer than a slot end with the last one */
+			slot->ts = now - (int64_t) ((left - len) / sizeof(int16_t)) * 1000000 / rate;
+		}
+		audiofork_gain(slot->data, src, len / sizeof(int16_t), fork->gain[direction]);
+		ring_commit(fork->ring);
+		ast_atomic_fetch_add(&fork->frames, 1, __ATOMIC_RELAXED);
+		src += len / sizeof(int16_t);
+		left -= len;
+		pushed = 1;
+	}
+
+	if (slin != frame) {
+		ast_frfree(slin);
+	}
+	if (pushed) {
+		audiofork_wake(fork);
+	}
+}
+
+static struct ast_frame *audiofork_framehook(struct ast_channel *chan, struct ast_frame *frame,
+	enum ast_framehook_event event, void *data)
+{
+	struct audiofork *fork = data;
+	enum audiofork_direction direction;
+
+	if (!frame || frame->frametype != AST_FRAME_VOICE) {
+		return frame;
+	}
+	if (event == AST_FRAMEHOOK_EVENT_READ) {
+		direction = AUDIOFORK_IN;
+	} else if (event == AST_FRAMEHOOK_EVENT_WRITE) {
+		direction = AUDIOFORK_OUT;
+	} else {
+		return frame;
+	}
+	if (!(fork->directions & (1 << direction))
+		|| __atomic_load_n(&fork->stopping, __ATOMIC_RELAXED)
+		|| __atomic_load_n(&fork->state[audiofork_conn(fork, direction)->direction],
+			__ATOMIC_RELAXED) == AUDIOFORK_STATE_FAILED
+		|| (fork->bridged_only && !ast_channel_is_bridged(chan))) {
+		return frame;
+	}
+	audiofork_push(fork, direction, frame);
+	return frame;
+}
+
+static int audiofork_framehook_consume(void *data attribute_unused, enum ast_frame_type type)
+{
+	return type == AST_FRAME_VOICE;
+}
+
+/*! \brief Tell the worker to flush what is left and let go of the fork */
+static void audiofork_stop(struct audiofork *fork)
+{
+	__atomic_store_n(&fork->stopping, 1, __ATOMIC_SEQ_CST);
+	audiofork_wake(fork);
+}
+
+/*! \brief The framehook is gone, on hangup or StopAudioFork() */
+static void audiofork_framehook_destroy(void *data)
+{
+	struct audiofork *fork = data;
+
+	audiofork_stop(fork);
+	ao2_unlink(forks, fork);
+	ao2_ref(fork, -1);
+}
+
+/*!
+ * \brief Connect one direction of a fork, on a connector thread
+ *
+ * Connecting blocks, so it is kept off the workers. The connection is left
+ * in the handoff for the worker, which is woken to take it over.
+ */
+static void *audiofork_connector(void *data)
+{
+	struct audiofork_conn *conn = data;
+	struct audiofork *fork = conn->fork;
+	unsigned int failures = 0;
+
+	while (!__atomic_load_n(&fork->stopping, __ATOMIC_ACQUIRE)) {
+		enum ast_websocket_result result;
+		struct ast_websocket *ws;
+		unsigned int ms;
+
+		ws = ast_websocket_client_create(fork->url, NULL, fork->tls_cfg, &result);
+		if (ws) {
+			if (conn->reconnect || failures) {
+				ast_atomic_fetch_add(&fork->reconnects, 1, __ATOMIC_RELAXED);
+			}
+			ast_debug(1, "AudioFork %s: %s connected to %s\n", fork->id,
+				conn_name(conn), fork->url);
+			__atomic_store_n(&conn->handoff, ws, __ATOMIC_RELEASE);
+			break;
+		}
+
+		if (++failures > fork->reconnect_attempts) {
+			ast_log(LOG_WARNING, "AudioFork %s: giving up on %s to %s after %u attempts\n",
+				fork->id, conn_name(conn), fork->url, failures);
+			__atomic_store_n(&fork->state[conn->direction], AUDIOFORK_STATE_FAILED,
+				__ATOMIC_RELAXED);
+			break;
+		}
+		ast_log(LOG_WARNING, "AudioFork %s: unable to connect %s to %s (%d), retrying in %us\n",
+			fork->id, conn_name(conn), fork->url, result,
+			fork->reconnect_timeout);
+		/* In steps, so a stopped fork does not hold up unloading */
+		for (ms = fork->reconnect_timeout * 1000;
+			ms && !__atomic_load_n(&fork->stopping, __ATOMIC_ACQUIRE); ms -= MIN(ms, 100U)) {
+			usleep(MIN(ms, 100U) * 1000);
+		}
+	}
+
+	audiofork_wake(fork);
+	ao2_ref(fork, -1);
+	senders_done();
+	return NULL;
+}
+
+/*! \brief Start a connector thread for one direction */
+static void audiofork_connect(struct audiofork_conn *conn)
+{
+	pthread_t thread;
+
+	senders_add();
+	ao2_ref(conn->fork, +1);
+	if (ast_pthread_create_detached_background(&thread, NULL, audiofork_connector, conn)) {
+		ast_log(LOG_WARNING, "AudioFork %s: unable to start a connector thread\n",
+			conn->fork->id);
+		__atomic_store_n(&conn->fork->state[conn->direction], AUDIOFORK_STATE_FAILED,
+			__ATOMIC_RELAXED);
+		ao2_ref(conn->fork, -1);
+		senders_done();
+	}
+}
+
+/*!
+ * \brief Bytes the socket of a connection takes before a write would block
+ *
+ * The kernel reports SO_SNDBUF doubled to cover its own overhead, only half
+ * of it is counted on for data.
+ */
+static int conn_room(struct audiofork_conn *conn)
+{
+	int fd = ast_websocket_fd(conn->ws);
+	socklen_t len = sizeof(int);
+	int sndbuf;
+	int queued;
+
+	if (ioctl(fd, SIOCOUTQ, &queued) || getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len)) {
+		return INT_MAX;
+	}
+	return MAX(0, sndbuf / 2 - queued);
+}
+
+static void conn_watch(struct audiofork_worker *worker, struct audiofork_conn *conn, int op)
+{
+	struct epoll_event event = {
+		.events = EPOLLIN | (conn->blocked ? EPOLLOUT : 0),
+		.data.ptr = conn,
+	};
+
+	if (epoll_ctl(worker->epfd, op, ast_websocket_fd(conn->ws), &event)) {
+		ast_log(LOG_WARNING, "AudioFork %s: unable to watch the %s connection: %s\n",
+			conn->fork->id, conn_name(conn), strerror(errno));
+	}
+}
+
+/*! \brief Wait for EPOLLOUT before writing to the connection again */
+static void conn_block(struct audiofork_worker *worker, struct audiofork_conn *conn)
+{
+	if (!conn->blocked) {
+		conn->blocked = 1;
+		conn_watch(worker, conn, EPOLL_CTL_MOD);
+	}
+}
+
+/*! \brief Take over a connection made by a connector */
+static void conn_install(struct audiofork_worker *worker, struct audiofork_conn *conn,
+	struct ast_websocket *ws)
+{
+	conn->ws = ws;
+	conn->blocked = 0;
+	conn->room = 0;
+	ast_websocket_set_nonblock(ws);
+	conn_watch(worker, conn, EPOLL_CTL_ADD);
+	ast_atomic_fetch_add(&worker->conns, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&conn->fork->state[conn->direction], AUDIOFORK_STATE_UP, __ATOMIC_RELAXED);
+}
+
+static void agg_unlist(struct audiofork_worker *worker, struct audiofork_conn *conn)
+{
+	if (!conn->agg_listed) {
+		return;
+	}
+	if (conn->agg_prev) {
+		conn->agg_prev->agg_next = conn->agg_next;
+	} else {
+		worker->agg_head = conn->agg_next;
+	}
+	if (conn->agg_next) {
+		conn->agg_next->agg_prev = conn->agg_prev;
+	} else {
+		worker->agg_tail = conn->agg_prev;
+	}
+	conn->agg_prev = conn->agg_next = NULL;
+	conn->agg_listed = 0;
+}
+
+/*! \brief Start the latency cap of a message that just got its first audio */
+static void agg_list(struct audiofork_worker *worker, struct audiofork_conn *conn)
+{
+	conn->agg_due = ast_tvadd(ast_tvnow(),
+		ast_samp2tv(__atomic_load_n(&aggregate_latency, __ATOMIC_RELAXED), 1000));
+	conn->agg_prev = worker->agg_tail;
+	conn->agg_next = NULL;
+	if (worker->agg_tail) {
+		worker->agg_tail->agg_next = conn;
+	} else {
+		worker->agg_head = conn;
+	}
+	worker->agg_tail = conn;
+	conn->agg_listed = 1;
+}
+
+/*! \brief Let go of a connection, optionally saying goodbye to the server */
+static void conn_close(struct audiofork_worker *worker, struct audiofork_conn *conn, int goodbye)
+{
+	struct audiofork *fork = conn->fork;
+
+	epoll_ctl(worker->epfd, EPOLL_CTL_DEL, ast_websocket_fd(conn->ws), NULL);
+	if (goodbye) {
+		ast_websocket_close(conn->ws, 1000);
+	}
+	ast_websocket_unref(conn->ws);
+	conn->ws = NULL;
+	conn->blocked = 0;
+	ast_atomic_fetch_sub(&worker->conns, 1, __ATOMIC_RELAXED);
+
+	/* Whatever was held back for the connection goes with it */
+	agg_unlist(worker, conn);
+	ast_atomic_fetch_add(&fork->lost, conn->agg_slots + conn->out_slots, __ATOMIC_RELAXED);
+	conn->agg_len = conn->agg_slots = 0;
+	conn->agg_late = 0;
+	conn->out_len = conn->out_slots = 0;
+	if (fork->stereo) {
+		audiofork_aligner_reset(&fork->aligner);
+		fork->pend_len = 0;
+	}
+}
+
+/*! \brief A connection broke, drop it and connect again */
+static void conn_drop(struct audiofork_worker *worker, struct audiofork_conn *conn)
+{
+	conn_close(worker, conn, 0);
+	conn->reconnect = 1;
+	__atomic_store_n(&conn->fork->state[conn->direction], AUDIOFORK_STATE_DOWN, __ATOMIC_RELAXED);
+	audiofork_connect(conn);
+}
+
+/*!
+ * \brief Frame a binary client message into \a buf, masked as RFC 6455 requires
+ *
+ * \return Bytes written to \a buf, at most \a len + WS_HEADER_MAX
+ */
+static size_t ws_frame(char *buf, const char *payload, size_t len)
+{
+	uint8_t *header = (uint8_t *) buf;
+	uint32_t key = ast_random();
+	uint8_t mask[4] = { key >> 24, key >> 16, key >> 8, key };
+	size_t pos = 2;
+	size_t i;
+
+	header[0] = 0x80 | AST_WEBSOCKET_OPCODE_BINARY;
+	if (len < 126) {
+		header[1] = 0x80 | len;
+	} else if (len < 65536) {
+		header[1] = 0x80 | 126;
+		header[pos++] = len >> 8;
+		header[pos++] = len;
+	} else {
+		header[1] = 0x80 | 127;
+		for (i = 0; i < 8; i++) {
+			header[pos++] = (uint64_t) len >> (56 - 8 * i);
+		}
+	}
+	memcpy(&header[pos], mask, sizeof(mask));
+	pos += sizeof(mask);
+	/* Masking is a pass over the payload anyway, it copies it in the same go */
+	for (i = 0; i < len; i++) {
+		buf[pos + i] = payload[i] ^ mask[i & 3];
+	}
+	return pos + len;
+}
+
+/*!
+ * \brief Write everything gathered for a connection, in one system call
+ *
+ * What the socket does not take stays at the front of the buffer and the
+ * connection waits for EPOLLOUT.
+ */
+static void conn_flush(struct audiofork_worker *worker, struct audiofork_conn *conn)
+{
+	struct audiofork *fork = conn->fork;
+	ssize_t res;
+
+	if (!conn->out_len) {
+		return;
+	}
+	res = send(ast_websocket_fd(conn->ws), conn->out, conn->out_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+	ast_atomic_fetch_add(&fork->writes, 1, __ATOMIC_RELAXED);
+	if (res < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			conn_block(worker, conn);
+			return;
+		}
+		ast_log(LOG_WARNING, "AudioFork %s: lost the %s connection to %s\n",
+			fork->id, conn_name(conn), fork->url);
+		conn_drop(worker, conn);
+		return;
+	}
+	if ((size_t) res < conn->out_len) {
+		memmove(conn->out, conn->out + res, conn->out_len - res);
+		conn->out_len -= res;
+		conn_block(worker, conn);
+		return;
+	}
+	ast_atomic_fetch_add(&fork->sent, conn->out_slots, __ATOMIC_RELAXED);
+	conn->out_len = conn->out_slots = 0;
+}
+
+/*!
+ * \brief Send one message made of \a slots slots
+ *
+ * \retval 0 sent, or gathered to be written with the others
+ * \retval -1 no room now, try again once the connection is writable
+ * \retval -2 the connection broke, the message is lost
+ */
+static int conn_send(struct audiofork_worker *worker, struct audiofork_conn *conn,
+	const char *payload, size_t len, unsigned int slots)
+{
+	struct audiofork *fork = conn->fork;
+	int need = len + WS_HEADER_MAX;
+
+	if (fork->gather) {
+		if (conn->out_max - conn->out_len < (size_t) need) {
+			if (!conn->blocked) {
+				conn_flush(worker, conn);
+			}
+			if (!conn->ws) {
+				return -2;
+			}
+			if (conn->out_max - conn->out_len < (size_t) need) {
+				return -1;
+			}
+		}
+		conn->out_len += ws_frame(conn->out + conn->out_len, payload, len);
+		conn->out_slots += slots;
+		ast_atomic_fetch_add(&fork->messages, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	if (conn->blocked || (conn->room < need && (conn->room = conn_room(conn)) < need)) {
+		conn_block(worker, conn);
+		return -1;
+	}
+	ast_atomic_fetch_add(&fork->writes, 1, __ATOMIC_RELAXED);
+	if (ast_websocket_write(conn->ws, AST_WEBSOCKET_OPCODE_BINARY, (char *) payload, len)) {
+		ast_log(LOG_WARNING, "AudioFork %s: lost the %s connection to %s\n",
+			fork->id, conn_name(conn), fork->url);
+		conn_drop(worker, conn);
+		return -2;
+	}
+	conn->room -= need;
+	ast_atomic_fetch_add(&fork->sent, slots, __ATOMIC_RELAXED);
+	ast_atomic_fetch_add(&fork->messages, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*! \brief Send the aggregated message of a connection, full or not */
+static int agg_send(struct audiofork_worker *worker, struct audiofork_conn *conn)
+{
+	int res;
+
+	if (!conn->agg_len) {
+		return 0;
+	}
+	res = conn_send(worker, conn, conn->agg, conn->agg_len, conn->agg_slots);
+	if (res == -1) {
+		return -1;
+	}
+	/* On -2 closing the connection counted the slots lost */
+	agg_unlist(worker, conn);
+	conn->agg_len = conn->agg_slots = 0;
+	conn->agg_late = 0;
+	return res;
+}
+
+/*! \brief Bytes of audio an aggregated message holds at \a rate */
+static size_t agg_bytes(const struct audiofork *fork, unsigned int rate)
+{
+	return ((size_t) fork->aggregate * rate / 1000) * sizeof(int16_t);
+}
+
+/*!
+ * \brief Add audio to the message being aggregated, sending it once full
+ *
+ * Messages hold whole pieces of audio as added, a slot or a stereo chunk,
+ * so they reach the aggregate size rounded up to the next piece.
+ *
+ * \param worker the worker
+ * \param conn the connection
+ * \param data the audio
+ * \param len bytes of it
+ * \param rate samples per second, over all channels
+ * \param slots slots it counts as once sent
+ *
+ * \retval 0 the audio was taken
+ * \retval -1 it was not, there is no room to send the message it fills
+ */
+static int agg_add(struct audiofork_worker *worker, struct audiofork_conn *conn,
+	const void *data, size_t len, unsigned int rate, unsigned int slots)
+{
+	struct audiofork *fork = conn->fork;
+	size_t target;
+
+	if (conn->agg_len && (conn->agg_rate != rate || conn->agg_len + len > conn->agg_max)
+		&& agg_send(worker, conn) == -1) {
+		return -1;
+	}
+	if (!conn->ws) {
+		ast_atomic_fetch_add(&fork->lost, slots, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	target = MAX(agg_bytes(fork, rate), (size_t) 1);
+	if (target + MAX(len, (size_t) SLOT_BYTES) > conn->agg_max) {
+		size_t max = target + MAX(len, (size_t) SLOT_BYTES);
+		char *grown = ast_realloc(conn->agg, max);
+
+		if (!grown) {
+			ast_atomic_fetch_add(&fork->lost, slots, __ATOMIC_RELAXED);
+			return 0;
+		}
+		conn->agg = grown;
+		conn->agg_max = max;
+	}
+	if (!conn->agg_len) {
+		conn->agg_rate = rate;
+		agg_list(worker, conn);
+	}
+	memcpy(conn->agg + conn->agg_len, data, len);
+	conn->agg_len += len;
+	conn->agg_slots += slots;
+
+	if (conn->agg_len >= target) {
+		agg_send(worker, conn);
+	}
+	return 0;
+}
+
+/*!
+ * \brief Whether a slot for a connection that is not up waits in the ring
+ *
+ * It waits while its direction makes its first connection, unless this is
+ * the final drain; after that it is dropped.
+ */
+static int conn_waiting(struct audiofork_conn *conn, int final)
+{
+	return !final && !conn->reconnect && __atomic_load_n(&conn->fork->state[conn->direction],
+		__ATOMIC_RELAXED) == AUDIOFORK_STATE_DOWN;
+}
+
+/*!
+ * \brief Send the stereo frames the aligner has paired
+ *
+ * They go out at most a slot's worth of frames per channel at a time. What
+ * the connection has no room for waits in pend.
+ *
+ * \retval 0 everything ready was sent, or dropped as \a final is set
+ * \retval -1 no room now, try again once the connection is writable
+ */
+static int stereo_send(struct audiofork_worker *worker, struct audiofork *fork, int final)
+{
+	struct audiofork_conn *conn = &fork->conn[AUDIOFORK_IN];
+
+	while (conn->ws) {
+		int res;
+
+		if (!fork->pend_len) {
+			size_t frames = audiofork_aligner_take(&fork->aligner, fork->pend,
+				SLOT_BYTES / sizeof(int16_t));
+
+			if (!frames) {
+				break;
+			}
+			fork->pend_len = frames * AUDIOFORK_STEREO_CHANNELS * sizeof(int16_t);
+		}
+		/* Slots count as sent once the aligner has them */
+		if (fork->aggregate) {
+			res = agg_add(worker, conn, fork->pend, fork->pend_len,
+				AUDIOFORK_STEREO_CHANNELS * fork->aligner.rate, 0);
+		} else {
+			res = conn_send(worker, conn, (char *) fork->pend, fork->pend_len, 0);
+		}
+		if (res == -1 && !final) {
+			return -1;
+		}
+		fork->pend_len = 0;
+	}
+	return 0;
+}
+
+/*!
+ * \brief Pair what is in the ring of a stereo fork and send it, on the worker
+ *
+ * As audiofork_drain(), but both directions go through the aligner to the in
+ * connection. A slot is only taken from the ring once everything the
+ * aligner paired before has gone out, so a slow server holds up the ring
+ * rather than the aligner. The final drain pairs what is left with silence.
+ */
+static void audiofork_drain_stereo(struct audiofork_worker *worker, struct audiofork *fork,
+	int final)
+{
+	struct audiofork_conn *conn = &fork->conn[AUDIOFORK_IN];
+	struct audiofork_slot *slot;
+
+	while (!stereo_send(worker, fork, final) && (slot = ring_peek(fork->ring))) {
+		if (!conn->ws) {
+			if (conn_waiting(conn, final)) {
+				break;
+			}
+			ast_atomic_fetch_add(&fork->lost, 1, __ATOMIC_RELAXED);
+			ring_release(fork->ring);
+			continue;
+		}
+		if (!fork->aligner.queue[AUDIOFORK_STEREO_LEFT]
+			&& audiofork_aligner_init(&fork->aligner, slot->rate, fork->jitter,
+				SLOT_BYTES / sizeof(int16_t), audiofork_interleave)) {
+			audiofork_aligner_free(&fork->aligner);
+		}
+		/* The media thread translates both directions to the first frame's rate */
+		if (!fork->aligner.queue[AUDIOFORK_STEREO_LEFT] || slot->rate != fork->aligner.rate) {
+			ast_atomic_fetch_add(&fork->lost, 1, __ATOMIC_RELAXED);
+			ring_release(fork->ring);
+			continue;
+		}
+		audiofork_aligner_add(&fork->aligner, slot->direction == AUDIOFORK_IN
+			? AUDIOFORK_STEREO_LEFT : AUDIOFORK_STEREO_RIGHT, slot->data,
+			slot->len / sizeof(int16_t), slot->ts);
+		ast_atomic_fetch_add(&fork->sent, 1, __ATOMIC_RELAXED);
+		ring_release(fork->ring);
+	}
+
+	if (final && conn->ws) {
+		audiofork_aligner_flush(&fork->aligner);
+		stereo_send(worker, fork, final);
+	}
+}
+
+/*!
+ * \brief Send what is in the ring, on the worker
+ *
+ * Slots are only written while their connection has room, so the worker
+ * never blocks on a slow server. The first slot that does not fit stops the
+ * drain until the connection is writable again; when \a final is set it is
+ * dropped instead. Slots for a direction still making its first connection
+ * wait in the ring, those for a direction that lost its connection are
+ * dropped. Gathered messages are written once the ring is empty.
+ */
+static void audiofork_drain(struct audiofork_worker *worker, struct audiofork *fork, int final)
+{
+	struct audiofork_slot *slot;
+	int i;
+
+	while (!fork->stereo && (slot = ring_peek(fork->ring))) {
+		struct audiofork_conn *conn = &fork->conn[slot->direction];
+		int res;
+
+		if (!conn->ws) {
+			if (conn_waiting(conn, final)) {
+				break;
+			}
+			ast_atomic_fetch_add(&fork->lost, 1, __ATOMIC_RELAXED);
+			ring_release(fork->ring);
+			continue;
+		}
+
+		if (fork->aggregate) {
+			res = agg_add(worker, conn, slot->data, slot->len, slot->rate, 1);
+		} else {
+			res = conn_send(worker, conn, (char *) slot->data, slot->len, 1);
+			if (res == -2) {
+				ast_atomic_fetch_add(&fork->lost, 1, __ATOMIC_RELAXED);
+			}
+		}
+		if (res == -1) {
+			if (!final) {
+				break;
+			}
+			ast_atomic_fetch_add(&fork->lost, 1, __ATOMIC_RELAXED);
+		}
+		ring_release(fork->ring);
+	}
+	if (fork->stereo) {
+		audiofork_drain_stereo(worker, fork, final);
+	}
+
+	for (i = 0; i < AUDIOFORK_DIRECTIONS; i++) {
+		struct audiofork_conn *conn = &fork->conn[i];
+
+		if (!conn->ws) {
+			continue;
+		}
+		if (final && agg_send(worker, conn) == -1) {
+			ast_atomic_fetch_add(&fork->lost, conn->agg_slots, __ATOMIC_RELAXED);
+			agg_unlist(worker, conn);
+			conn->agg_len = conn->agg_slots = 0;
+		}
+		if (conn->ws && !conn->blocked) {
+			conn_flush(worker, conn);
+		}
+	}
+}
+
+/*! \brief Send a partly filled message that waited as long as it may */
+static void agg_expire(struct audiofork_worker *worker, struct audiofork_conn *conn)
+{
+	agg_unlist(worker, conn);
+	if (agg_send(worker, conn) == -1) {
+		conn->agg_late = 1;
+	} else if (conn->ws && !conn->blocked) {
+		conn_flush(worker, conn);
+	}
+}
+
+/*! \brief Handle an epoll event on a connection */
+static void conn_event(struct audiofork_worker *worker, struct audiofork_conn *conn,
+	uint32_t events)
+{
+	struct audiofork *fork = conn->fork;
+
+	if (!conn->ws) {
+		return;
+	}
+	if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+		enum ast_websocket_opcode opcode;
+		uint64_t len;
+		char *payload;
+		int fragmented;
+
+		/* Nothing is expected from the server but control frames */
+		if (ast_websocket_read(conn->ws, &payload, &len, &opcode, &fragmented)
+			|| opcode == AST_WEBSOCKET_OPCODE_CLOSE) {
+			ast_log(LOG_WARNING, "AudioFork %s: %s closed the %s connection\n",
+				fork->id, fork->url, conn_name(conn));
+			conn_drop(worker, conn);
+			return;
+		}
+	}
+	if ((events & EPOLLOUT) && conn->blocked) {
+		conn->blocked = 0;
+		conn->room = conn_room(conn);
+		conn_watch(worker, conn, EPOLL_CTL_MOD);
+		conn_flush(worker, conn);
+		if (!conn->ws || conn->blocked) {
+			return;
+		}
+		if (conn->agg_late) {
+			agg_expire(worker, conn);
+		}
+		audiofork_drain(worker, fork, 0);
+	}
+}
+
+/*! \brief Take over the connections the connectors made since the last look */
+static void audiofork_takeover(struct audiofork_worker *worker, struct audiofork *fork)
+{
+	int i;
+
+	for (i = 0; i < AUDIOFORK_DIRECTIONS; i++) {
+		struct ast_websocket *ws = __atomic_exchange_n(&fork->conn[i].handoff, NULL,
+			__ATOMIC_ACQUIRE);
+
+		if (ws) {
+			conn_install(worker, &fork->conn[i], ws);
+		}
+	}
+}
+
+/*! \brief Flush a stopped fork, close its connections and drop the worker's reference */
+static void audiofork_finish(struct audiofork_worker *worker, struct audiofork *fork)
+{
+	int i;
+
+	audiofork_takeover(worker, fork);
+	audiofork_drain(worker, fork, 1);
+	for (i = 0; i < AUDIOFORK_DIRECTIONS; i++) {
+		if (fork->conn[i].ws) {
+			conn_close(worker, &fork->conn[i], !fork->conn[i].blocked);
+		}
+	}
+	ast_atomic_fetch_sub(&worker->streams, audiofork_streams(fork), __ATOMIC_RELAXED);
+	ast_debug(1, "AudioFork %s: stopped, %" PRIu64 " sent, %" PRIu64 " overruns\n",
+		fork->id, fork->sent, fork->overruns);
+	ao2_ref(fork, -1);
+	senders_done();
+}
+
+/*!
+ * \brief Serve every fork on the ready stack
+ *
+ * A fork is finished once stopping is seen with queued held by the worker,
+ * so nothing pushes it again: the framehook is gone and every later wake
+ * finds queued set.
+ */
+static void worker_run(struct audiofork_worker *worker)
+{
+	struct audiofork *fork = __atomic_exchange_n(&worker->ready, NULL, __ATOMIC_ACQUIRE);
+
+	while (fork) {
+		struct audiofork *next = fork->next;
+
+		if (__atomic_load_n(&fork->stopping, __ATOMIC_ACQUIRE)) {
+			audiofork_finish(worker, fork);
+		} else {
+			/* Release: next was read before anyone can push the fork again */
+			__atomic_store_n(&fork->queued, 0, __ATOMIC_RELEASE);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			audiofork_takeover(worker, fork);
+			audiofork_drain(worker, fork, 0);
+			if (__atomic_load_n(&fork->stopping, __ATOMIC_ACQUIRE)
+				&& !__atomic_exchange_n(&fork->queued, 1, __ATOMIC_ACQ_REL)) {
+				audiofork_finish(worker, fork);
+			}
+		}
+		fork = next;
+	}
+}
+
+/*! \brief Send the partly filled messages that waited as long as they may */
+static void worker_expire(struct audiofork_worker *worker)
+{
+	struct timeval now;
+
+	if (!worker->agg_head) {
+		return;
+	}
+	now = ast_tvnow();
+	while (worker->agg_head && ast_tvcmp(worker->agg_head->agg_due, now) <= 0) {
+		agg_expire(worker, worker->agg_head);
+	}
+}
+
+static void *worker_thread(void *data)
+{
+	struct audiofork_worker *worker = data;
+	struct epoll_event events[WORKER_EVENTS];
+	struct timeval window = ast_tvnow();
+	long long busy = 0;
+
+	while (!__atomic_load_n(&worker->stopping, __ATOMIC_ACQUIRE)) {
+		struct timeval start;
+		int timeout = 1000;
+		int count;
+		int i;
+
+		if (worker->agg_head) {
+			timeout = MAX(0, MIN(timeout,
+				(int) ast_tvdiff_ms(worker->agg_head->agg_due, ast_tvnow()) + 1));
+		}
+		__atomic_store_n(&worker->sleeping, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&worker->ready, __ATOMIC_SEQ_CST)) {
+			timeout = 0;
+		}
+		count = epoll_wait(worker->epfd, events, ARRAY_LEN(events), timeout);
+		__atomic_store_n(&worker->sleeping, 0, __ATOMIC_RELAXED);
+
+		start = ast_tvnow();
+		for (i = 0; i < count; i++) {
+			if (!events[i].data.ptr) {
+				ast_alertpipe_read(worker->alert_pipe);
+			} else {
+				conn_event(worker, events[i].data.ptr, events[i].events);
+			}
+		}
+		worker_run(worker);
+		worker_expire(worker);
+
+		busy += ast_tvdiff_us(ast_tvnow(), start);
+		if (ast_tvdiff_ms(start, window) >= 1000) {
+			__atomic_store_n(&worker->busy,
+				(unsigned int) MIN(1000, busy * 1000 / MAX(1, ast_tvdiff_us(start, window))),
+				__ATOMIC_RELAXED);
+			window = start;
+			busy = 0;
+		}
+	}
+	return NULL;
+}
+
+/*!
+ * \brief Pick the worker for a new fork
+ *
+ * Weighs the streams already placed on each worker by how busy it was over
+ * the last second, so forks go where the sockets are few and cheap.
+ */
+static struct audiofork_worker *worker_place(unsigned int streams)
+{
+	struct audiofork_worker *best = NULL;
+	uint64_t best_cost = UINT64_MAX;
+	unsigned int i;
+
+	for (i = 0; i < worker_count; i++) {
+		uint64_t cost = (uint64_t) (__atomic_load_n(&workers[i].streams, __ATOMIC_RELAXED) + 1)
+			* (1000 + __atomic_load_n(&workers[i].busy, __ATOMIC_RELAXED));
+
+		if (cost < best_cost) {
+			best = &workers[i];
+			best_cost = cost;
+		}
+	}
+	ast_atomic_fetch_add(&best->streams, streams, __ATOMIC_RELAXED);
+	return best;
+}
+
+static void workers_stop(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < worker_count; i++) {
+		struct audiofork_worker *worker = &workers[i];
+
+		if (worker->thread != AST_PTHREADT_NULL) {
+			__atomic_store_n(&worker->stopping, 1, __ATOMIC_RELEASE);
+			ast_alertpipe_write(worker->alert_pipe);
+			pthread_join(worker->thread, NULL);
+		}
+		if (worker->epfd > -1) {
+			close(worker->epfd);
+		}
+		ast_alertpipe_close(worker->alert_pipe);
+	}
+	ast_free(workers);
+	workers = NULL;
+	worker_count = 0;
+}
+
+static int workers_start(void)
+{
+	unsigned int count = worker_setting;
+	unsigned int i;
+
+	if (!count) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		count = cpus > 0 ? cpus : 1;
+	}
+	workers = ast_calloc(count, sizeof(*workers));
+	if (!workers) {
+		return -1;
+	}
+	worker_count = count;
+	for (i = 0; i < count; i++) {
+		workers[i].thread = AST_PTHREADT_NULL;
+		workers[i].epfd = -1;
+		workers[i].alert_pipe[0] = workers[i].alert_pipe[1] = -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		struct audiofork_worker *worker = &workers[i];
+		struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL, };
+
+		worker->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (worker->epfd < 0 || ast_alertpipe_init(worker->alert_pipe)
+			|| epoll_ctl(worker->epfd, EPOLL_CTL_ADD, ast_alertpipe_readfd(worker->alert_pipe),
+				&event)
+			|| ast_pthread_create_background(&worker->thread, NULL, worker_thread, worker)) {
+			worker->thread = AST_PTHREADT_NULL;
+			ast_log(LOG_ERROR, "AudioFork: unable to start I/O worker %u\n", i);
+			workers_stop();
+			return -1;
+		}
+	}
+	ast_debug(1, "AudioFork: started %u I/O workers\n", count);
+	return 0;
+}
+
+enum audiofork_option_flags {
+	MUXFLAG_BRIDGED = (1 << 0),
+	MUXFLAG_BEEP = (1 << 1),
+	MUXFLAG_READVOLUME = (1 << 2),
+	MUXFLAG_WRITEVOLUME = (1 << 3),
+	MUXFLAG_VOLUME = (1 << 4),
+	MUXFLAG_UID = (1 << 5),
+	MUXFLAG_DIRECTION = (1 << 6),
+	MUXFLAG_TLS = (1 << 7),
+	MUXFLAG_RECONNECTION_TIMEOUT = (1 << 8),
+	MUXFLAG_RECONNECTION_ATTEMPTS = (1 << 9),
+	MUXFLAG_AGGREGATE = (1 << 10),
+	MUXFLAG_GATHER = (1 << 11),
+	MUXFLAG_STEREO = (1 << 12),
+};
+
+enum audiofork_option_args {
+	OPT_ARG_READVOLUME,
+	OPT_ARG_WRITEVOLUME,
+	OPT_ARG_VOLUME,
+	OPT_ARG_UID,
+	OPT_ARG_BEEP_INTERVAL,
+	OPT_ARG_DIRECTION,
+	OPT_ARG_TLS,
+	OPT_ARG_RECONNECTION_TIMEOUT,
+	OPT_ARG_RECONNECTION_ATTEMPTS,
+	OPT_ARG_AGGREGATE,
+	/* note: this entry _MUST_ be the last one in the enum */
+	OPT_ARG_ARRAY_SIZE,
+};
+
+AST_APP_OPTIONS(audiofork_opts, {
+	AST_APP_OPTION('b', MUXFLAG_BRIDGED),
+	AST_APP_OPTION_ARG('B', MUXFLAG_BEEP, OPT_ARG_BEEP_INTERVAL),
+	AST_APP_OPTION_ARG('v', MUXFLAG_READVOLUME, OPT_ARG_READVOLUME),
+	AST_APP_OPTION_ARG('V', MUXFLAG_WRITEVOLUME, OPT_ARG_WRITEVOLUME),
+	AST_APP_OPTION_ARG('W', MUXFLAG_VOLUME, OPT_ARG_VOLUME),
+	AST_APP_OPTION_ARG('i', MUXFLAG_UID, OPT_ARG_UID),
+	AST_APP_OPTION_ARG('D', MUXFLAG_DIRECTION, OPT_ARG_DIRECTION),
+	AST_APP_OPTION_ARG('T', MUXFLAG_TLS, OPT_ARG_TLS),
+	AST_APP_OPTION_ARG('R', MUXFLAG_RECONNECTION_TIMEOUT, OPT_ARG_RECONNECTION_TIMEOUT),
+	AST_APP_OPTION_ARG('r', MUXFLAG_RECONNECTION_ATTEMPTS, OPT_ARG_RECONNECTION_ATTEMPTS),
+	AST_APP_OPTION_ARG('A', MUXFLAG_AGGREGATE, OPT_ARG_AGGREGATE),
+	AST_APP_OPTION('g', MUXFLAG_GATHER),
+	AST_APP_OPTION('S', MUXFLAG_STEREO),
+});
+
+/*! \brief Parse a -4..4 volume option into a gain factor, leaving \a factor alone on error */
+static void parse_volume(const char *value, char option, int *factor)
+{
+	int volume;
+
+	if (ast_strlen_zero(value) || sscanf(value, "%2d", &volume) != 1
+		|| volume < -4 || volume > 4) {
+		ast_log(LOG_WARNING, "AudioFork: volume for %c must be a number between -4 and 4\n",
+			option);
+		return;
+	}
+	*factor = volume_factor(volume);
+}
+
+/*! \brief Apply the options of an AudioFork() call to a new fork */
+static int audiofork_options(struct audiofork *fork, struct ast_flags *flags, char **opts)
+{
+	unsigned int value;
+
+	if (ast_test_flag(flags, MUXFLAG_BRIDGED)) {
+		fork->bridged_only = 1;
+	}
+	if (ast_test_flag(flags, MUXFLAG_VOLUME)) {
+		parse_volume(opts[OPT_ARG_VOLUME], 'W', &fork->gain[AUDIOFORK_IN]);
+		parse_volume(opts[OPT_ARG_VOLUME], 'W', &fork->gain[AUDIOFORK_OUT]);
+	}
+	if (ast_test_flag(flags, MUXFLAG_READVOLUME)) {
+		parse_volume(opts[OPT_ARG_READVOLUME], 'v', &fork->gain[AUDIOFORK_OUT]);
+	}
+	if (ast_test_flag(flags, MUXFLAG_WRITEVOLUME)) {
+		parse_volume(opts[OPT_ARG_WRITEVOLUME], 'V', &fork->gain[AUDIOFORK_IN]);
+	}
+	if (ast_test_flag(flags, MUXFLAG_DIRECTION)) {
+		const char *direction = S_OR(opts[OPT_ARG_DIRECTION], "");
+
+		if (!strcasecmp(direction, "in")) {
+			fork->directions = 1 << AUDIOFORK_IN;
+		} else if (!strcasecmp(direction, "out")) {
+			fork->directions = 1 << AUDIOFORK_OUT;
+		} else if (strcasecmp(direction, "both")) {
+			ast_log(LOG_WARNING, "AudioFork: invalid direction '%s', using 'both'\n",
+				direction);
+		}
+	}
+	if (ast_test_flag(flags, MUXFLAG_STEREO)) {
+		if (fork->directions != ((1 << AUDIOFORK_IN) | (1 << AUDIOFORK_OUT))) {
+			ast_log(LOG_WARNING, "AudioFork: the S option needs both directions, ignoring it\n");
+		} else {
+			fork->stereo = 1;
+		}
+	}
+	if (ast_test_flag(flags, MUXFLAG_RECONNECTION_TIMEOUT)) {
+		if (ast_strlen_zero(opts[OPT_ARG_RECONNECTION_TIMEOUT])
+			|| sscanf(opts[OPT_ARG_RECONNECTION_TIMEOUT], "%30u", &value) != 1) {
+			ast_log(LOG_WARNING, "AudioFork: invalid reconnection timeout '%s'\n",
+				S_OR(opts[OPT_ARG_RECONNECTION_TIMEOUT], ""));
+		} else {
+			fork->reconnect_timeout = value;
+		}
+	}
+	if (ast_test_flag(flags, MUXFLAG_RECONNECTION_ATTEMPTS)) {
+		if (ast_strlen_zero(opts[OPT_ARG_RECONNECTION_ATTEMPTS])
+			|| sscanf(opts[OPT_ARG_RECONNECTION_ATTEMPTS], "%30u", &value) != 1) {
+			ast_log(LOG_WARNING, "AudioFork: invalid reconnection attempts '%s'\n",
+				S_OR(opts[OPT_ARG_RECONNECTION_ATTEMPTS], ""));
+		} else {
+			fork->reconnect_attempts = value;
+		}
+	}
+	if (ast_test_flag(flags, MUXFLAG_AGGREGATE)) {
+		if (ast_strlen_zero(opts[OPT_ARG_AGGREGATE])
+			|| sscanf(opts[OPT_ARG_AGGREGATE], "%30u", &value) != 1 || value > AGGREGATE_MAX) {
+			ast_log(LOG_WARNING, "AudioFork: aggregate for A must be 0 to %d ms, not '%s'\n",
+				AGGREGATE_MAX, S_OR(opts[OPT_ARG_AGGREGATE], ""));
+		} else {
+			fork->aggregate = value;
+		}
+	}
+	if (ast_test_flag(flags, MUXFLAG_GATHER)) {
+		fork->gather = 1;
+	}
+	if (ast_test_flag(flags, MUXFLAG_TLS)) {
+		if (ast_strlen_zero(opts[OPT_ARG_TLS])) {
+			ast_log(LOG_WARNING, "AudioFork: the T option needs a certificate file\n");
+			return -1;
+		}
+		fork->tls_cfg = ast_calloc(1, sizeof(*fork->tls_cfg));
+		if (!fork->tls_cfg) {
+			return -1;
+		}
+		fork->tls_cfg->enabled = 1;
+		fork->tls_cfg->certfile = ast_strdup(opts[OPT_ARG_TLS]);
+		if (!fork->tls_cfg->certfile || !ast_ssl_setup(fork->tls_cfg)) {
+			ast_log(LOG_WARNING, "AudioFork: unable to set up TLS with '%s'\n",
+				opts[OPT_ARG_TLS]);
+			return -1;
+		}
+	}
+	/* Gathered messages are written to the socket directly, past the TLS layer */
+	if (fork->gather && fork->tls_cfg) {
+		ast_log(LOG_NOTICE, "AudioFork: messages are not gathered over TLS\n");
+		fork->gather = 0;
+	}
+	return 0;
+}
+
+static struct audiofork *audiofork_alloc(struct ast_channel *chan, const char *url,
+	struct ast_flags *flags, char **opts)
+{
+	struct audiofork *fork;
+	int i;
+
+	fork = ao2_alloc_options(sizeof(*fork), audiofork_destroy, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!fork) {
+		return NULL;
+	}
+	/* Until the framehook, worker and connectors have all let go of it */
+	ast_module_ref(ast_module_info->self);
+	fork->directions = (1 << AUDIOFORK_IN) | (1 << AUDIOFORK_OUT);
+	fork->reconnect_timeout = reconnect_timeout;
+	fork->reconnect_attempts = reconnect_attempts;
+	fork->aggregate = aggregate_default;
+	fork->gather = gather_default;
+	fork->jitter = stereo_jitter;
+	fork->start = ast_tvnow();
+	fork->framehook_id = -1;
+	ast_copy_string(fork->uniqueid, ast_channel_uniqueid(chan), sizeof(fork->uniqueid));
+	ast_copy_string(fork->name, ast_channel_name(chan), sizeof(fork->name));
+	snprintf(fork->id, sizeof(fork->id), "%s-%u", fork->uniqueid,
+		(unsigned int) ast_atomic_fetch_add(&fork_seq, 1, __ATOMIC_RELAXED));
+
+	fork->url = ast_strdup(url);
+	fork->ring = ring_alloc(ring_slots);
+	if (!fork->url || !fork->ring || audiofork_options(fork, flags, opts)) {
+		ao2_ref(fork, -1);
+		return NULL;
+	}
+	for (i = 0; i < AUDIOFORK_DIRECTIONS; i++) {
+		struct audiofork_conn *conn = &fork->conn[i];
+
+		conn->fork = fork;
+		conn->direction = i;
+		if (fork->gather && (fork->directions & (1 << i)) && audiofork_conn(fork, i) == conn) {
+			unsigned int channels = fork->stereo ? AUDIOFORK_STEREO_CHANNELS : 1;
+
+			/* Room for a couple of the largest messages, at the highest rate */
+			conn->out_max = MAX((size_t) GATHER_BYTES,
+				2 * (agg_bytes(fork, channels * 48000) + channels * SLOT_BYTES + WS_HEADER_MAX));
+			if (!(conn->out = ast_malloc(conn->out_max))) {
+				ao2_ref(fork, -1);
+				return NULL;
+			}
+		}
+	}
+	if (fork->stereo
+		&& !(fork->pend = ast_malloc(AUDIOFORK_STEREO_CHANNELS * SLOT_BYTES))) {
+		ao2_ref(fork, -1);
+		return NULL;
+	}
+	return fork;
+}
+
+/*!
+ * \brief Stop a fork and remove its framehook
+ *
+ * The core only marks the framehook, it is destroyed with the channel's next
+ * frame or at hangup, which a quiet channel may not reach for a long time.
+ * So the fork is stopped and unlisted here rather than left to that.
+ */
+static void audiofork_detach(struct ast_channel *chan, struct audiofork *fork)
+{
+	ast_channel_lock(chan);
+	if (!ast_strlen_zero(fork->beep_id)) {
+		ast_beep_stop(chan, fork->beep_id);
+	}
+	ast_framehook_detach(chan, fork->framehook_id);
+	ast_channel_unlock(chan);
+	audiofork_stop(fork);
+	ao2_unlink(forks, fork);
+}
+
+static int audiofork_exec(struct ast_channel *chan, const char *data)
+{
+	struct ast_framehook_interface interface = {
+		.version = AST_FRAMEHOOK_INTERFACE_VERSION,
+		.event_cb = audiofork_framehook,
+		.destroy_cb = audiofork_framehook_destroy,
+		.consume_cb = audiofork_framehook_consume,
+		.disable_inheritance = 1,
+	};
+	struct ast_flags flags = { 0 };
+	char *opts[OPT_ARG_ARRAY_SIZE] = { NULL, };
+	struct audiofork *fork;
+	char *parse;
+	int i;
+	AST_DECLARE_APP_ARGS(args,
+		AST_APP_ARG(wsserver);
+		AST_APP_ARG(options);
+	);
+
+	parse = ast_strdupa(S_OR(data, ""));
+	AST_STANDARD_APP_ARGS(args, parse);
+	if (ast_strlen_zero(args.wsserver)) {
+		ast_log(LOG_WARNING, "AudioFork requires an argument (wsserver[,options])\n");
+		return -1;
+	}
+	if (!ast_strlen_zero(args.options)
+		&& ast_app_parse_options(audiofork_opts, &flags, opts, args.options)) {
+		return -1;
+	}
+
+	fork = audiofork_alloc(chan, args.wsserver, &flags, opts);
+	if (!fork) {
+		return -1;
+	}
+
+	/* The worker holds a reference until it has flushed the stopped fork */
+	fork->worker = worker_place(audiofork_streams(fork));
+	ao2_ref(fork, +1);
+	senders_add();
+	for (i = 0; i < AUDIOFORK_DIRECTIONS; i++) {
+		if ((fork->directions & (1 << i)) && audiofork_conn(fork, i) == &fork->conn[i]) {
+			audiofork_connect(&fork->conn[i]);
+		}
+	}
+
+	ao2_link(forks, fork);
+	interface.data = ao2_bump(fork);
+	ast_channel_lock(chan);
+	fork->framehook_id = ast_framehook_attach(chan, &interface);
+	if (fork->framehook_id < 0) {
+		ast_channel_unlock(chan);
+		ast_log(LOG_WARNING, "AudioFork %s: unable to attach the framehook to %s\n",
+			fork->id, ast_channel_name(chan));
+		audiofork_framehook_destroy(fork);
+		ao2_ref(fork, -1);
+		return -1;
+	}
+	if (ast_test_flag(&flags, MUXFLAG_BEEP)) {
+		unsigned int interval = BEEP_INTERVAL;
+
+		if (!ast_strlen_zero(opts[OPT_ARG_BEEP_INTERVAL])
+			&& (sscanf(opts[OPT_ARG_BEEP_INTERVAL], "%30u", &interval) != 1 || !interval)) {
+			ast_log(LOG_WARNING, "AudioFork: invalid beep interval '%s', using %d\n",
+				opts[OPT_ARG_BEEP_INTERVAL], BEEP_INTERVAL);
+			interval = BEEP_INTERVAL;
+		}
+		if (ast_beep_start(chan, interval, fork->beep_id, sizeof(fork->beep_id))) {
+			ast_log(LOG_WARNING, "AudioFork %s: unable to start the periodic beep\n", fork->id);
+			fork->beep_id[0] = '\0';
+		}
+	}
+	ast_channel_unlock(chan);
+
+	if (ast_test_flag(&flags, MUXFLAG_UID) && !ast_strlen_zero(opts[OPT_ARG_UID])) {
+		pbx_builtin_setvar_helper(chan, opts[OPT_ARG_UID], fork->id);
+	}
+	ast_verb(3, "AudioFork %s: forking %s to %s\n", fork->id, ast_channel_name(chan), fork->url);
+	ao2_ref(fork, -1);
+	return 0;
+}
+
+static int stop_audiofork_exec(struct ast_channel *chan, const char *data)
+{
+	struct ao2_iterator *iter;
+	struct audiofork *fork;
+
+	if (!ast_strlen_zero(data)) {
+		fork = ao2_find(forks, data, OBJ_SEARCH_KEY);
+		if (!fork || strcmp(fork->uniqueid, ast_channel_uniqueid(chan))) {
+			ast_log(LOG_WARNING, "StopAudioFork: no fork '%s' on %s\n", data,
+				ast_channel_name(chan));
+			ao2_cleanup(fork);
+			return 0;
+		}
+		audiofork_detach(chan, fork);
+		ao2_ref(fork, -1);
+		return 0;
+	}
+
+	iter = ao2_callback(forks, OBJ_MULTIPLE, fork_channel_cb, (void *) ast_channel_uniqueid(chan));
+	if (!iter) {
+		return 0;
+	}
+	while ((fork = ao2_iterator_next(iter))) {
+		audiofork_detach(chan, fork);
+		ao2_ref(fork, -1);
+	}
+	ao2_iterator_destroy(iter);
+	return 0;
+}
+
+static char *handle_cli_audiofork_show_forks(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct ao2_iterator iter;
+	struct audiofork *fork;
+	int count = 0;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "audiofork show forks";
+		e->usage =
+			"Usage: audiofork show forks\n"
+			"       Show the active forks: frames taken off the channel, sent,\n"
+			"       dropped on a full ring (overruns) or while disconnected\n"
+			"       (lost), and the state of each direction's connection,\n"
+			"       then the WebSocket messages sent and the socket writes\n"
+			"       they took.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
+
+	ast_cli(a->fd, "Ring: %u slots of %d bytes\n\n", ring_slots, SLOT_BYTES);
+	ast_cli(a->fd, "%-32s %-24s %10s %10s %9s %8s %-8s %-8s %10s %10s\n", "ID", "Channel",
+		"Frames", "Sent", "Overruns", "Lost", "In", "Out", "Messages", "Writes");
+	iter = ao2_iterator_init(forks, 0);
+	while ((fork = ao2_iterator_next(&iter))) {
+		const char *states[AUDIOFORK_DIRECTIONS];
+		int i;
+
+		for (i = 0; i < AUDIOFORK_DIRECTIONS; i++) {
+			states[i] = (fork->directions & (1 << i)) ? state_names[__atomic_load_n(
+				&fork->state[audiofork_conn(fork, i)->direction], __ATOMIC_RELAXED)] : "-";
+		}
+		ast_cli(a->fd, "%-32s %-24s %10" PRIu64 " %10" PRIu64 " %9" PRIu64 " %8" PRIu64
+			" %-8s %-8s %10" PRIu64 " %10" PRIu64 "\n", fork->id, fork->name,
+			__atomic_load_n(&fork->frames, __ATOMIC_RELAXED),
+			__atomic_load_n(&fork->sent, __ATOMIC_RELAXED),
+			__atomic_load_n(&fork->overruns, __ATOMIC_RELAXED),
+			__atomic_load_n(&fork->lost, __ATOMIC_RELAXED),
+			states[AUDIOFORK_IN], states[AUDIOFORK_OUT],
+			__atomic_load_n(&fork->messages, __ATOMIC_RELAXED),
+			__atomic_load_n(&fork->writes, __ATOMIC_RELAXED));
+		ao2_ref(fork, -1);
+		count++;
+	}
+	ao2_iterator_destroy(&iter);
+	ast_cli(a->fd, "%d fork(s)\n", count);
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_audiofork_show_workers(struct ast_cli_entry *e, int cmd,
+	struct ast_cli_args *a)
+{
+	unsigned int i;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "audiofork show workers";
+		e->usage =
+			"Usage: audiofork show workers\n"
+			"       Show the I/O workers: the directions forked by the forks\n"
+			"       placed on each, the connections it has up and the share\n"
+			"       of the last second it spent working.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
+
+	ast_cli(a->fd, "%-8s %10s %12s %6s\n", "Worker", "Streams", "Connections", "Busy");
+	for (i = 0; i < worker_count; i++) {
+		unsigned int busy = __atomic_load_n(&workers[i].busy, __ATOMIC_RELAXED);
+
+		ast_cli(a->fd, "%-8u %10u %12u %3u.%u%%\n", i,
+			__atomic_load_n(&workers[i].streams, __ATOMIC_RELAXED),
+			__atomic_load_n(&workers[i].conns, __ATOMIC_RELAXED), busy / 10, busy % 10);
+	}
+	ast_cli(a->fd, "%u worker(s)\n", worker_count);
+	return CLI_SUCCESS;
+}
+
+static struct ast_cli_entry cli_audiofork[] = {
+	AST_CLI_DEFINE(handle_cli_audiofork_show_forks, "Show active audio forks"),
+	AST_CLI_DEFINE(handle_cli_audiofork_show_workers, "Show the AudioFork I/O workers"),
+};
+
+static int load_config(int reload)
+{
+	struct ast_flags config_flags = { reload ? CONFIG_FLAG_FILEUNCHANGED : 0 };
+	struct ast_config *cfg;
+	const char *value;
+	unsigned int slots = RING_SLOTS;
+	unsigned int timeout = 5;
+	unsigned int attempts = 3;
+	unsigned int threads = 0;
+	unsigned int aggregate = 0;
+	unsigned int latency = AGGREGATE_LATENCY;
+	unsigned int jitter = STEREO_JITTER;
+	int gather = 0;
+
+	cfg = ast_config_load(config_file, config_flags);
+	if (cfg == CONFIG_STATUS_FILEUNCHANGED) {
+		return 0;
+	}
+	if (cfg == CONFIG_STATUS_FILEINVALID) {
+		ast_log(LOG_ERROR, "Config file %s is in an invalid format\n", config_file);
+		return -1;
+	}
+
+	if (cfg) {
+		if ((value = ast_variable_retrieve(cfg, "general", "ring_slots"))
+			&& (sscanf(value, "%30u", &slots) != 1 || slots < 4 || slots > 4096)) {
+			ast_log(LOG_WARNING, "Invalid ring_slots '%s' in %s, using %d\n",
+				value, config_file, RING_SLOTS);
+			slots = RING_SLOTS;
+		}
+		if ((value = ast_variable_retrieve(cfg, "general", "reconnect_timeout"))
+			&& sscanf(value, "%30u", &timeout) != 1) {
+			ast_log(LOG_WARNING, "Invalid reconnect_timeout '%s' in %s, using 5\n",
+				value, config_file);
+			timeout = 5;
+		}
+		if ((value = ast_variable_retrieve(cfg, "general", "reconnect_attempts"))
+			&& sscanf(value, "%30u", &attempts) != 1) {
+			ast_log(LOG_WARNING, "Invalid reconnect_attempts '%s' in %s, using 3\n",
+				value, config_file);
+			attempts = 3;
+		}
+		if ((value = ast_variable_retrieve(cfg, "general", "workers"))
+			&& (sscanf(value, "%30u", &threads) != 1 || threads > 1024)) {
+			ast_log(LOG_WARNING, "Invalid workers '%s' in %s, using one per CPU\n",
+				value, config_file);
+			threads = 0;
+		}
+		if ((value = ast_variable_retrieve(cfg, "general", "aggregate"))
+			&& (sscanf(value, "%30u", &aggregate) != 1 || aggregate > AGGREGATE_MAX)) {
+			ast_log(LOG_WARNING, "Invalid aggregate '%s' in %s, using 0\n",
+				value, config_file);
+			aggregate = 0;
+		}
+		if ((value = ast_variable_retrieve(cfg, "general", "aggregate_latency"))
+			&& (sscanf(value, "%30u", &latency) != 1 || !latency || latency > 10000)) {
+			ast_log(LOG_WARNING, "Invalid aggregate_latency '%s' in %s, using %d\n",
+				value, config_file, AGGREGATE_LATENCY);
+			latency = AGGREGATE_LATENCY;
+		}
+		if ((value = ast_variable_retrieve(cfg, "general", "gather"))) {
+			gather = ast_true(value);
+		}
+		if ((value = ast_variable_retrieve(cfg, "general", "stereo_jitter"))
+			&& (sscanf(value, "%30u", &jitter) != 1 || jitter > STEREO_JITTER_MAX)) {
+			ast_log(LOG_WARNING, "Invalid stereo_jitter '%s' in %s, using %d\n",
+				value, config_file, STEREO_JITTER);
+			jitter = STEREO_JITTER;
+		}
+		ast_config_destroy(cfg);
+	}
+
+	/* Round up to a power of two */
+	while (slots & (slots - 1)) {
+		slots += slots & -slots;
+	}
+	ring_slots = slots;
+	reconnect_timeout = timeout;
+	reconnect_attempts = attempts;
+	aggregate_default = aggregate;
+	gather_default = gather;
+	stereo_jitter = jitter;
+	/* Read by the workers */
+	__atomic_store_n(&aggregate_latency, latency, __ATOMIC_RELAXED);
+	if (!reload) {
+		worker_setting = threads;
+	} else if (threads != worker_setting) {
+		ast_log(LOG_NOTICE, "AudioFork: workers takes effect when the module is loaded\n");
+	}
+	return 0;
+}
+
+static int reload_module(void)
+{
+	return load_config(1);
+}
+
+static int unload_module(void)
+{
+	struct ao2_iterator iter;
+	struct audiofork *fork;
+	int res;
+
+	ast_cli_unregister_multiple(cli_audiofork, ARRAY_LEN(cli_audiofork));
+	res = ast_unregister_application(app);
+	res |= ast_unregister_application(app_stop);
+
+	if (forks) {
+		/*
+		 * Every fork holds the module, so there are only forks left on a
+		 * forced unload. Stopping them has the workers flush and let go.
+		 */
+		iter = ao2_iterator_init(forks, 0);
+		while ((fork = ao2_iterator_next(&iter))) {
+			struct ast_channel *chan = ast_channel_get_by_name(fork->uniqueid);
+
+			if (chan) {
+				audiofork_detach(chan, fork);
+				ast_channel_unref(chan);
+			} else {
+				audiofork_stop(fork);
+				ao2_unlink(forks, fork);
+			}
+			ao2_ref(fork, -1);
+		}
+		ao2_iterator_destroy(&iter);
+	}
+
+	ast_mutex_lock(&senders.lock);
+	while (senders.count) {
+		ast_cond_wait(&senders.cond, &senders.lock);
+	}
+	ast_mutex_unlock(&senders.lock);
+	ast_cond_destroy(&senders.cond);
+	ast_mutex_destroy(&senders.lock);
+	workers_stop();
+
+	ao2_cleanup(forks);
+	forks = NULL;
+	return res;
+}
+
+static int load_module(void)
+{
+	enum audiofork_simd_isa isa;
+
+	if (load_config(0)) {
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	ast_mutex_init(&senders.lock);
+	ast_cond_init(&senders.cond, NULL);
+	senders.count = 0;
+
+	isa = audiofork_simd_best();
+	audiofork_gain = audiofork_gain_kernel(isa);
+	audiofork_interleave = audiofork_interleave_kernel(isa);
+	ast_debug(1, "AudioFork: using the %s kernels\n", audiofork_simd_name(isa));
+
+	forks = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, FORK_BUCKETS,
+		fork_hash, NULL, fork_cmp);
+	if (!forks || workers_start()) {
+		unload_module();
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	if (ast_register_application_xml(app, audiofork_exec)
+		|| ast_register_application_xml(app_stop, stop_audiofork_exec)
+		|| ast_cli_register_multiple(cli_audiofork, ARRAY_LEN(cli_audiofork))) {
+		unload_module();
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	return AST_MODULE_LOAD_SUCCESS;
+}
+
+AST_MODULE_INFO(
+	ASTERISK_GPL_KEY,
+	AST_MODFLAG_DEFAULT,
+	"Audio fork to WebSocket applications",
+	.support_level = AST_MODULE_SUPPORT_EXTENDED,
+	.load = load_module,
+	.unload = unload_module,
+	.reload = reload_module,
+	.requires = "res_http_websocket",
+);
@@ -20,65 +20,4999 @@
 #include "asterisk.h"
 #include "asterisk/module.h"
 #include "asterisk/channel.h"
+#include "asterisk/pbx.h"
+#include "asterisk/astobj2.h"
+#include "asterisk/strings.h"
+#include "asterisk/stasis_channels.h"
+#include "asterisk/stasis_message_router.h"
+#include "asterisk/datastore.h"
+#include "asterisk/bridge.h"
+#include "asterisk/bridge_channel.h"
+#include "asterisk/bridge_features.h"
+#include "asterisk/cli.h"
+#include "asterisk/manager.h"
+#include "asterisk/config.h"
+#include "asterisk/taskprocessor.h"
+#include "asterisk/stasis_bridges.h"
+#include "asterisk/vector.h"
+#include "asterisk/app.h"
+#include "asterisk/alertpipe.h"
+#include "asterisk/frame.h"
+#include "asterisk/lock.h"
+#include "asterisk/utils.h"
+#include "asterisk/time.h"
+#include "asterisk/localtime.h"
+#include "asterisk/poll-compat.h"
+#include "asterisk/core_local.h"
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+
+#include "peertable/bridgemon_feed.h"
+#include "peertable/bridgemon_peertable.h"
 
 /*** DOCUMENTATION
 	<application name="FindPeer" language="en_US">
 		<synopsis>
 			Tags the source channel with peer chanid
 		</synopsis>
-		<syntax />
+		<syntax>
+			<parameter name="options">
+				<optionlist>
+					<option name="w">
+						<argument name="timeout" required="true">
+							<para>Maximum time to wait in seconds.</para>
+						</argument>
+						<para>If the peer does not exist yet, wait for it to be
+						created instead of returning straight away. The channel is
+						woken by the peer's creation rather than by polling, and
+						<variable>FINDPEERSTATUS</variable> is set.</para>
+					</option>
+				</optionlist>
+			</parameter>
+		</syntax>
 		<description>
 			<para>This application tags the source chan of the call with peer chan id</para>
+			<para>With <literal>resolve = bridge</literal> in
+			<filename>bridgemon.conf</filename> the bridge the channel is in
+			is used instead of the linkedid: every member of the bridge gets
+			<variable>BRIDGEPEERID</variable> set to the uniqueids of the other
+			members, comma separated. This stays correct after transfers and
+			in bridges of more than two parties. A channel that is not bridged
+			falls back to the linkedid.</para>
+			<para>This application sets the following channel variable when the
+			<literal>w</literal> option is given:</para>
+			<variablelist>
+				<variable name="FINDPEERSTATUS">
+					<value name="FOUND">The peer was tagged.</value>
+					<value name="TIMEOUT">No peer appeared before the timeout.</value>
+				</variable>
+			</variablelist>
+		</description>
+	</application>
+	<function name="PEERID" language="en_US">
+		<synopsis>
+			Get the uniqueid of a channel's peer.
+		</synopsis>
+		<syntax>
+			<parameter name="uniqueid">
+				<para>Uniqueid of the channel whose peer is wanted. Defaults to
+				the current channel.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Returns the peer uniqueid recorded by <literal>FindPeer</literal>
+			or <literal>BridgeMon</literal>. When nothing has been recorded the
+			peer is derived from the linkedid: the originating channel for a
+			dialed leg, or a leg sharing its linkedid for the originator.</para>
+			<para>Unlike <variable>BRIDGEPEERID</variable> the peer channel is
+			never locked. The answer for the current channel is cached on it
+			and reused until the index records a change, so with
+			<literal>setvar = no</literal> in <filename>bridgemon.conf</filename>
+			calls that never ask for their peer cost no variable writes at
+			all.</para>
+		</description>
+	</function>
+	<function name="PEERIDS" language="en_US">
+		<synopsis>
+			Get the uniqueids of every leg sharing a linkedid.
+		</synopsis>
+		<syntax>
+			<parameter name="linkedid">
+				<para>Defaults to the linkedid of the current channel.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Returns a comma separated list, in the order the legs were
+			created, of the live channels with this linkedid other than the
+			originating channel itself. Ring groups and queues fanning out to
+			many legs can read the whole set here instead of having each leg
+			overwrite <variable>BRIDGEPEERID</variable> on the originator.</para>
+		</description>
+		<see-also>
+			<ref type="function">PEERCOUNT</ref>
+		</see-also>
+	</function>
+	<function name="PEERCOUNT" language="en_US">
+		<synopsis>
+			Get the number of legs sharing a linkedid.
+		</synopsis>
+		<syntax>
+			<parameter name="linkedid">
+				<para>Defaults to the linkedid of the current channel.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Returns the number of uniqueids <literal>PEERIDS</literal>
+			would return.</para>
+		</description>
+		<see-also>
+			<ref type="function">PEERIDS</ref>
+		</see-also>
+	</function>
+	<application name="BridgeMon" language="en_US">
+		<synopsis>
+			Set BRIDGEPEERID on a channel whenever it joins a bridge.
+		</synopsis>
+		<syntax>
+			<parameter name="uniqueid">
+				<para>Uniqueid of the channel to monitor. Defaults to the
+				current channel.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Attaches a bridge join hook to the channel. Each time the
+			channel joins a two party bridge, <variable>BRIDGEPEERID</variable>
+			is set on it to the uniqueid of the other party, and on the other
+			party to the uniqueid of the monitored channel. The hook stays in
+			place across bridge changes until <literal>StopBridgeMon</literal>
+			is called or the channel hangs up, so the dialplan only needs to
+			run this once per call.</para>
+			<para>With <literal>mode = stasis</literal> in
+			<filename>bridgemon.conf</filename> no hook is attached; the
+			channel is only flagged and peers are resolved from the module's
+			single bridge topic subscription instead.</para>
+		</description>
+		<see-also>
+			<ref type="application">StopBridgeMon</ref>
+			<ref type="application">FindPeer</ref>
+		</see-also>
+	</application>
+	<application name="StopBridgeMon" language="en_US">
+		<synopsis>
+			Stop a monitor started with BridgeMon.
+		</synopsis>
+		<syntax>
+			<parameter name="uniqueid">
+				<para>Uniqueid of the monitored channel. Defaults to the
+				current channel.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Stops setting <variable>BRIDGEPEERID</variable> on bridge
+			joins. A value already set is left alone.</para>
 		</description>
+		<see-also>
+			<ref type="application">BridgeMon</ref>
+		</see-also>
 	</application>
+	<manager name="BridgeMon" language="en_US">
+		<synopsis>
+			Start monitoring bridge joins on a channel.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+			<parameter name="Channel">
+				<para>Name of the channel to monitor.</para>
+			</parameter>
+			<parameter name="ChannelID">
+				<para>Uniqueid of the channel to monitor. Takes precedence
+				over <replaceable>Channel</replaceable>.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Same as the <literal>BridgeMon</literal> application.</para>
+		</description>
+	</manager>
+	<manager name="FindPeerSweep" language="en_US">
+		<synopsis>
+			Tag the peers of every live channel in one pass.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+			<parameter name="Parallel">
+				<para>If true, spread the tagging across the module's shard
+				taskprocessors.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Walks the channel list once, refreshes the module's index
+			and groups the channels by linkedid (or by bridge with
+			<literal>resolve = bridge</literal>) to record every peer and set
+			<variable>BRIDGEPEERID</variable> as <literal>FindPeer</literal>
+			would, without running <literal>FindPeer</literal> per channel.
+			Intended for repopulating peers after a module reload or a stasis
+			application restart. The response carries
+			<literal>Channels</literal>, <literal>Tagged</literal> and
+			<literal>Elapsed</literal> (milliseconds).</para>
+		</description>
+	</manager>
+	<manager name="FindPeerBulk" language="en_US">
+		<synopsis>
+			Look up the peers of many channels in one round trip.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+			<parameter name="UniqueID">
+				<para>Comma separated uniqueids of channels whose peers are
+				wanted. May be given more than once.</para>
+			</parameter>
+			<parameter name="LinkedID">
+				<para>Comma separated linkedids; every live channel of each
+				is looked up. May be given more than once.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Answers from the module's channel index, as
+			<literal>PEERID()</literal> would, without looking up or locking
+			any channel, so the cost grows with the number of channels
+			asked about rather than the number of live channels. The
+			response carries <literal>Requested</literal> (identifiers
+			given), <literal>Channels</literal> (channels listed) and
+			<literal>Found</literal> (channels with a peer), then
+			<literal>UniqueID<replaceable>n</replaceable></literal> and
+			<literal>PeerID<replaceable>n</replaceable></literal> for each
+			channel, <literal>PeerID<replaceable>n</replaceable></literal>
+			being empty if it has no peer yet. Identifiers that match no
+			live channel are listed in <literal>Missing</literal>.</para>
+		</description>
+	</manager>
+	<manager name="FindPeerStats" language="en_US">
+		<synopsis>
+			Show FindPeer latency histograms.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+		</syntax>
+		<description>
+			<para>Reports how long <literal>FindPeer</literal> calls took
+			since the module was loaded, split into stages:
+			<literal>Lookup</literal> (finding the peer and recording it),
+			<literal>LockWait</literal> (waiting for the channel lock to set
+			<variable>BRIDGEPEERID</variable>), <literal>SetVar</literal>
+			(setting it) and <literal>Total</literal> (the whole application,
+			including any <literal>w</literal> wait). Each stage has
+			<literal>Count</literal>, <literal>Mean</literal>,
+			<literal>P50</literal>, <literal>P99</literal>,
+			<literal>P999</literal> and <literal>Max</literal> headers in
+			nanoseconds, e.g. <literal>LockWaitP99</literal>, and a
+			<literal>Histogram</literal> header listing comma separated
+			bucket counts. Bucket 0 counts zero durations and bucket
+			<replaceable>n</replaceable> durations from
+			2^(<replaceable>n</replaceable>-1) up to
+			2^<replaceable>n</replaceable> nanoseconds; the last bucket
+			also counts anything slower. Percentiles are bucket upper
+			bounds.</para>
+		</description>
+	</manager>
+	<managerEvent language="en_US" name="BridgePeers">
+		<managerEventInstance class="EVENT_FLAG_CALL">
+			<synopsis>Raised with the peers recorded over the last
+			<literal>peer_event_window</literal>.</synopsis>
+			<syntax>
+				<parameter name="LinkedIDs">
+					<para>Number of linkedids listed.</para>
+				</parameter>
+				<parameter name="Channels">
+					<para>Number of channels listed.</para>
+				</parameter>
+				<parameter name="LinkedID0">
+					<para>First linkedid; the next ones are numbered
+					<literal>LinkedID1</literal> and so on.</para>
+				</parameter>
+				<parameter name="UniqueID0_0">
+					<para>First channel of <literal>LinkedID0</literal>;
+					<literal>UniqueID0_1</literal> is its second.</para>
+				</parameter>
+				<parameter name="Peer0_0">
+					<para>Latest peer of <literal>UniqueID0_0</literal>, or
+					the comma separated roster with
+					<literal>resolve = bridge</literal>.</para>
+				</parameter>
+			</syntax>
+			<description>
+				<para>Only raised with <literal>peer_events</literal> set in
+				<filename>bridgemon.conf</filename>. Peer changes are held for
+				<literal>peer_event_window</literal> milliseconds from the
+				first change of a linkedid. A channel whose peer changes
+				again in that time is listed once, with its latest peer.
+				Linkedids due together share one event until it lists 64
+				channels.</para>
+			</description>
+		</managerEventInstance>
+	</managerEvent>
+	<manager name="StopBridgeMon" language="en_US">
+		<synopsis>
+			Stop monitoring bridge joins on a channel.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+			<parameter name="Channel">
+				<para>Name of the monitored channel.</para>
+			</parameter>
+			<parameter name="ChannelID">
+				<para>Uniqueid of the monitored channel. Takes precedence
+				over <replaceable>Channel</replaceable>.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Same as the <literal>StopBridgeMon</literal> application.</para>
+		</description>
+	</manager>
  ***/
 
 static const char app[] = "FindPeer";
+static const char app_bridgemon[] = "BridgeMon";
+static const char app_stopbridgemon[] = "StopBridgeMon";
 
-static int findpeer_exec(struct ast_channel *chan, const char *data)
+/*! \brief Number of buckets in the channel index containers */
+#define CHAN_INDEX_BUCKETS 4099
+
+/*! \brief Number of buckets in the linkedid group container */
+#define GROUP_BUCKETS 2053
+
+/*! \brief Number of buckets in the negative lookup cache */
+#define NEGCACHE_BUCKETS 257
+
+/*! \brief Most misses remembered at once */
+#define NEGCACHE_MAX 4096
+
+/*! \brief Buckets of the Local channel chain cache */
+#define LOCAL_CHAIN_BUCKETS 257
+
+/*! \brief Local channel pairs followed before giving up on a chain */
+#define LOCAL_CHAIN_MAX 8
+
+/*! \brief Largest bridge whose roster is written, as the core does for BRIDGEPEER */
+#define MAX_ROSTER 10
+
+/*! \brief Size of a cached PEERID() answer, enough for a full roster */
+#define PEER_LIST_LEN (MAX_ROSTER * 48)
+
+/*! \brief Upper bound on the number of stasis mode shards */
+#define MAX_SHARDS 64
+
+/*! \brief Log2 buckets of the FindPeer latency histograms, the last one is open ended */
+#define STATS_BUCKETS 40
+
+/*! \brief Stripes the FindPeer statistics are spread across by thread id */
+#define STATS_STRIPES 64
+
+/*! \brief Stripes of the deferred message log, chosen by thread id */
+#define PEERLOG_STRIPES 16
+
+/*! \brief Entries kept per deferred log stripe */
+#define PEERLOG_STRIPE_SIZE 256
+
+/*! \brief How often the deferred log is written out, in ms */
+#define PEERLOG_DRAIN_MS 250
+
+/*! \brief Default number of slots of the shared memory peer table */
+#define PEERTABLE_SLOTS 65536
+
+/*! \brief Default number of records a peer feed subscriber may fall behind */
+#define FEED_QUEUE 1024
+
+/*! \brief Largest encoded peer feed record */
+#define FEED_RECORD_MAX (sizeof(struct bridgemon_feed_record) + UINT8_MAX + PEER_LIST_LEN)
+
+/*! \brief Encoded records a peer feed subscriber has in flight */
+#define FEED_OUT_LEN 65536
+
+/*! \brief Default time peer changes are held to coalesce them, in ms */
+#define PEEREVENT_WINDOW 20
+
+/*! \brief Buckets of the pending BridgePeers linkedids */
+#define PEEREVENT_BUCKETS 257
+
+/*! \brief Channels listed in one BridgePeers event before another is started */
+#define PEEREVENT_BATCH_MAX 64
+
+static const char config_file[] = "bridgemon.conf";
+
+/*! \brief How BridgeMon() learns about bridge joins */
+enum bridgemon_mode {
+	/*! A bridge join hook on every monitored channel */
+	BRIDGEMON_MODE_HOOK,
+	/*! One bridge topic subscription shared by all monitored channels */
+	BRIDGEMON_MODE_STASIS,
+};
+
+static enum bridgemon_mode monitor_mode = BRIDGEMON_MODE_HOOK;
+
+/*! \brief What a channel's peer is */
+enum bridgemon_resolve {
+	/*! The channel whose uniqueid is the linkedid, or the two party bridge peer */
+	BRIDGEMON_RESOLVE_LINKEDID,
+	/*! Every other member of the bridge the channel is in */
+	BRIDGEMON_RESOLVE_BRIDGE,
+};
+
+static enum bridgemon_resolve resolve_mode = BRIDGEMON_RESOLVE_LINKEDID;
+
+/*! \brief Configured number of shards, 0 for one per CPU */
+static unsigned int shards_configured;
+
+/*! \brief Whether resolved peers are also written to BRIDGEPEERID */
+static int setvar_enabled = 1;
+
+/*! \brief How long a failed lookup is remembered in milliseconds, 0 to disable */
+static unsigned int negcache_ttl = 1000;
+
+/*! \brief Whether channels are tagged on bridge entry without BridgeMon() */
+static int autotag_enabled;
+
+/*! \brief Contexts and technologies autotag is limited to, comma separated, empty for any */
+static char autotag_contexts[256];
+static char autotag_techs[256];
+AST_MUTEX_DEFINE_STATIC(autotag_lock);
+
+/*!
+ * \brief Index entry for a live channel
+ *
+ * Entries are keyed by uniqueid in \ref chans_by_uniqueid and listed as a
+ * member of their linkedid's \ref bridgemon_group. The channel itself is never
+ * referenced from here so the index cannot keep a hung up channel alive; the
+ * name is kept instead so the channel can be fetched through the core's name
+ * hash.
+ */
+struct bridgemon_chan {
+	/*! Channel name, may change on masquerade (protected by the object lock) */
+	char name[AST_CHANNEL_NAME];
+	/*! Linkedid, only changed by index writers */
+	char linkedid[AST_MAX_UNIQUEID];
+	/*! Uniqueid, never changes */
+	char uniqueid[AST_MAX_UNIQUEID];
+	/*! Last peer or roster recorded for the channel (protected by the object lock) */
+	char *peer;
+	/*! Bumped whenever the resolved peer may have changed */
+	unsigned int generation;
+	/*! Last PEERID() answer, NULL until read (protected by the object lock) */
+	char *peerid;
+	/*! Generation \ref peerid was resolved at (protected by the object lock) */
+	unsigned int peerid_generation;
+	/*! Non-zero if BridgeMon() is active on the channel in stasis mode (protected by the object lock) */
+	int monitored;
+	/*! Non-zero if the autotag options matched when it last entered or left a bridge (protected by the object lock) */
+	int autotag;
+	/*! Non-zero once removed from the index, nothing is published for it after (protected by the object lock) */
+	int unlinked;
+};
+
+/*! \brief Live channels keyed by uniqueid */
+static struct ao2_container *chans_by_uniqueid;
+
+/*!
+ * \brief Every live channel sharing a linkedid
+ *
+ * Updated incrementally as channels are indexed, change linkedid or go away.
+ * Membership only changes with the \ref chans_by_uniqueid write lock held, so
+ * index writers never race each other on a group.
+ */
+struct bridgemon_group {
+	/*! Member uniqueids in the order they joined, the originator included */
+	AST_VECTOR(, char *) members;
+	/*! Comma separated members other than the originator, NULL when stale */
+	char *legs;
+	/*! Number of members other than the originator */
+	unsigned int leg_count;
+	char linkedid[AST_MAX_UNIQUEID];
+};
+
+/*! \brief Linkedid groups keyed by linkedid */
+static struct ao2_container *groups;
+
+/*!
+ * \brief A uniqueid a lookup recently failed to find
+ *
+ * Dialplan retrying FindPeer() until the peer exists then stays off the
+ * channel index, whose lock the snapshot router takes for every update.
+ */
+struct negcache_entry {
+	/*! When the entry stops answering for the uniqueid */
+	struct timeval expires;
+	char uniqueid[AST_MAX_UNIQUEID];
+};
+
+/*! \brief A FindPeer() call waiting for a channel to be created */
+struct peer_waiter {
+	/*! Written to when the channel is indexed */
+	int alert_pipe[2];
+	/*! Uniqueid being waited for */
+	char uniqueid[AST_MAX_UNIQUEID];
+};
+
+/*! \brief Waiting FindPeer() calls keyed by the uniqueid they wait for */
+static struct ao2_container *waiters;
+
+/*! \brief Recent lookup misses keyed by uniqueid */
+static struct ao2_container *negcache;
+
+/*!
+ * \brief Where a call's chain of Local channels ends
+ *
+ * Keyed by linkedid. Dropped when a Local channel of the call optimizes away
+ * or hangs up, since the chain it describes no longer exists.
+ */
+struct local_chain {
+	char linkedid[AST_MAX_UNIQUEID];
+	/*! Uniqueid of the real channel at the far end */
+	char endpoint[AST_MAX_UNIQUEID];
+	/*! Comma separated uniqueids of the Local halves walked through */
+	char hops[LOCAL_CHAIN_MAX * 2 * 48];
+};
+
+/*! \brief Resolved Local channel chains keyed by linkedid */
+static struct ao2_container *local_chains;
+
+/*! \brief Negative lookup cache statistics */
+static struct {
+	/*! Lookups answered from the cache */
+	int hits;
+	/*! Lookups that were not cached and went to the index */
+	int misses;
+	/*! Entries dropped because the channel was created */
+	int invalidations;
+} negcache_stats;
+
+/*! \brief Timed stages of a FindPeer() call */
+enum findpeer_stage {
+	/*! Finding the peer and recording it in the index */
+	STAGE_LOOKUP,
+	/*! Waiting for the channel lock to set BRIDGEPEERID */
+	STAGE_LOCKWAIT,
+	/*! Setting BRIDGEPEERID with the channel lock held */
+	STAGE_SETVAR,
+	/*! The whole application, including any w() wait */
+	STAGE_TOTAL,
+	STAGE_COUNT,
+};
+
+static const char * const stage_names[STAGE_COUNT] = {
+	"lookup", "lockwait", "setvar", "total",
+};
+
+static const char * const stage_headers[STAGE_COUNT] = {
+	"Lookup", "LockWait", "SetVar", "Total",
+};
+
+/*! \brief Time one FindPeer() call spent in each stage */
+struct findpeer_timing {
+	uint64_t stage_ns[STAGE_COUNT];
+	/*! Bit per stage that was reached */
+	unsigned int timed;
+};
+
+/*!
+ * \brief Latency histogram of one stage
+ *
+ * Bucket 0 counts zero durations and bucket n durations in [2^(n-1), 2^n) ns.
+ */
+struct stats_histogram {
+	uint64_t buckets[STATS_BUCKETS];
+	uint64_t sum_ns;
+	uint64_t max_ns;
+};
+
+/*! \brief Histograms written by the threads hashing to one stripe */
+struct stats_stripe {
+	struct stats_histogram stages[STAGE_COUNT];
+} __attribute__((aligned(64)));
+
+/*! \brief FindPeer() latency, merged on read */
+static struct stats_stripe findpeer_stats[STATS_STRIPES];
+
+/*! \brief Verbose messages written through the deferred log */
+enum peerlog_type {
+	/*! FindPeer() on a channel without a linkedid */
+	PEERLOG_EMPTY_LINKEDID,
+	/*! FindPeer() found no peer */
+	PEERLOG_NO_PEER,
+	/*! FindPeer() tagged the peer */
+	PEERLOG_FOUND,
+	/*! BridgeMon() tagged a two party bridge */
+	PEERLOG_BRIDGED,
+	PEERLOG_TYPE_COUNT,
+};
+
+static const char * const peerlog_names[PEERLOG_TYPE_COUNT] = {
+	"empty linkedid", "no peer", "found", "bridged",
+};
+
+/*! \brief A message kept in binary form until it is written out or dumped */
+struct peerlog_entry {
+	struct timeval when;
+	enum peerlog_type type;
+	/*! Channel name, truncated */
+	char chan[64];
+	/*! Uniqueid of the channel, truncated */
+	char uniqueid[40];
+	/*! Uniqueid of its peer, truncated */
+	char peer[40];
+};
+
+struct peerlog_slot {
+	/*!
+	 * Twice the ticket of the entry plus two once written, plus one while
+	 * its writer holds the slot. Only ever moves forward, so a lapped writer
+	 * cannot claim a slot a later ticket has taken.
+	 */
+	uint64_t seq;
+	struct peerlog_entry entry;
+};
+
+/*! \brief Ring shared by the threads hashing to one stripe */
+struct peerlog_stripe {
+	/*! Next ticket to hand out */
+	uint64_t head;
+	/*! First ticket the drain thread has not written out */
+	uint64_t drained;
+	/*! Ticket plus one the last drain pass found unfinished, 0 for none */
+	uint64_t stalled;
+	struct peerlog_slot slots[PEERLOG_STRIPE_SIZE];
+} __attribute__((aligned(64)));
+
+static struct peerlog_stripe peerlog[PEERLOG_STRIPES];
+
+/*! \brief State of the thread writing the deferred log out */
+static struct {
+	pthread_t thread;
+	ast_mutex_t lock;
+	ast_cond_t cond;
+	int stop;
+	/*! Entries overwritten or dropped before they were written out */
+	uint64_t lost;
+	/*! Second the rate limit counts apply to */
+	time_t window;
+	/*! Messages of each type written in the current second */
+	unsigned int written[PEERLOG_TYPE_COUNT];
+	/*! Messages of each type held back in the current second */
+	unsigned int held[PEERLOG_TYPE_COUNT];
+	/*! Messages of each type held back since the module was loaded */
+	uint64_t suppressed[PEERLOG_TYPE_COUNT];
+} peerlog_drain = {
+	.thread = AST_PTHREADT_NULL,
+};
+
+/*! \brief Messages of one type written out per second, 0 for no limit */
+static unsigned int peerlog_rate = 20;
+
+/*! \brief Shared memory object name of the peer table, empty when not published */
+static char peertable_name[NAME_MAX];
+static unsigned int peertable_slots = PEERTABLE_SLOTS;
+
+/*! \brief The shared memory peer table, only written with the lock held */
+static struct {
+	ast_mutex_t lock;
+	struct bridgemon_peertable_header *header;
+	struct bridgemon_peertable_slot *slots;
+	size_t size;
+	/*! Name the table was created under */
+	char name[NAME_MAX];
+} peertable;
+
+/*! \brief A channel's latest peer waiting to go out in a BridgePeers event */
+struct peerevent_entry {
+	char *uniqueid;
+	char *peer;
+};
+
+/*! \brief Peer changes of one linkedid waiting to go out */
+struct peerevent_group {
+	/*! Channels in the order they first changed, each listed once */
+	AST_VECTOR(, struct peerevent_entry) entries;
+	char linkedid[AST_MAX_UNIQUEID];
+};
+
+AST_VECTOR(peerevent_groups, struct peerevent_group *);
+
+/*! \brief Peer changes held back to be sent as BridgePeers events */
+static struct {
+	ast_mutex_t lock;
+	ast_cond_t cond;
+	pthread_t thread;
+	int stop;
+	/*! Pending groups keyed by linkedid */
+	struct ao2_container *by_linkedid;
+	/*! The same groups in the order their linkedid first changed */
+	struct peerevent_groups pending;
+	/*! When the pending groups are due */
+	struct timeval due;
+	/*! Peer changes queued since the module was loaded */
+	uint64_t changes;
+	/*! Channels listed in the events sent */
+	uint64_t listed;
+	/*! BridgePeers events sent */
+	uint64_t events;
+} peerevent = {
+	.thread = AST_PTHREADT_NULL,
+};
+
+/*! \brief Whether peer changes are sent as BridgePeers events */
+static int peerevent_enabled;
+
+/*! \brief How long peer changes are held to coalesce them, in ms */
+static unsigned int peerevent_window = PEEREVENT_WINDOW;
+
+/*! \brief Unix socket path of the peer change feed, empty when not served */
+static char feed_path[PATH_MAX];
+static unsigned int feed_queue = FEED_QUEUE;
+
+struct feed_slot {
+	size_t len;
+	unsigned char data[FEED_RECORD_MAX];
+};
+
+/*! \brief A connection to the peer change feed, owned by the feed thread */
+struct feed_subscriber {
+	int fd;
+	/*! Sequence number of the next record to copy out of the ring */
+	uint64_t next;
+	/*! Records copied out */
+	uint64_t sent;
+	/*! Records overwritten before they could be copied out */
+	uint64_t dropped;
+	size_t out_len;
+	size_t out_off;
+	/*! Records copied out and not fully written yet */
+	unsigned char out[FEED_OUT_LEN];
+};
+
+AST_VECTOR(feed_subscribers, struct feed_subscriber *);
+
+/*! \brief The peer change feed; the ring and subscriber list are guarded by lock */
+static struct {
+	ast_mutex_t lock;
+	pthread_t thread;
+	int listen_fd;
+	int alert_pipe[2];
+	/*! Set by the unloading thread, read atomically by the feed thread */
+	int stop;
+	/*! Set when the feed thread has been woken and not run yet */
+	int signalled;
+	/*! Sequence number of the next record */
+	uint64_t head;
+	/*! The last ring_len records, record n in slot n % ring_len */
+	struct feed_slot *ring;
+	size_t ring_len;
+	/*!
+	 * Only the feed thread adds and removes subscribers, so it reads the
+	 * list without the lock; it still changes it under the lock for the CLI.
+	 */
+	struct feed_subscribers subscribers;
+	/*! Read without the lock so changes cost nothing while nobody listens */
+	int subscriber_count;
+	/*! Path the socket was bound to */
+	char path[PATH_MAX];
+} feed = {
+	.thread = AST_PTHREADT_NULL,
+	.listen_fd = -1,
+	.alert_pipe = { -1, -1 },
+};
+
+/*! \brief Router feeding the index from channel snapshot updates */
+static struct stasis_message_router *chan_router;
+
+/*! \brief Bridge topic router, only subscribed in stasis mode */
+static struct stasis_message_router *bridge_router;
+
+/*! \brief Taskprocessors bridge events are sharded across by linkedid */
+static struct ast_taskprocessor *shards[MAX_SHARDS];
+static unsigned int shard_count;
+
+static int chan_uniqueid_hash(const void *obj, const int flags)
 {
-	if (!chan)
+	const struct bridgemon_chan *entry;
+	const char *key;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_KEY:
+		key = obj;
+		break;
+	case OBJ_SEARCH_OBJECT:
+		entry = obj;
+		key = entry->uniqueid;
+		break;
+	default:
+		ast_assert(0);
 		return 0;
+	}
+	return ast_str_hash(key);
+}
 
-	if (ast_strlen_zero(ast_channel_linkedid(chan))) {
-	    ast_verb(2, "FindPeer: [%s] empty linkedid, skipping\n",
-		    ast_channel_name(chan));
-        	return 0;
-    	}
+static int chan_uniqueid_cmp(void *obj, void *arg, int flags)
+{
+	const struct bridgemon_chan *left = obj;
+	const struct bridgemon_chan *right = arg;
+	const char *right_key = arg;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_OBJECT:
+		right_key = right->uniqueid;
+		/* Fall through */
+	case OBJ_SEARCH_KEY:
+		return strcmp(left->uniqueid, right_key) ? 0 : CMP_MATCH;
+	default:
+		return 0;
+	}
+}
+
+static int group_hash(const void *obj, const int flags)
+{
+	const struct bridgemon_group *group;
+	const char *key;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_KEY:
+		key = obj;
+		break;
+	case OBJ_SEARCH_OBJECT:
+		group = obj;
+		key = group->linkedid;
+		break;
+	default:
+		ast_assert(0);
+		return 0;
+	}
+	return ast_str_hash(key);
+}
+
+static int group_cmp(void *obj, void *arg, int flags)
+{
+	const struct bridgemon_group *left = obj;
+	const struct bridgemon_group *right = arg;
+	const char *right_key = arg;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_OBJECT:
+		right_key = right->linkedid;
+		/* Fall through */
+	case OBJ_SEARCH_KEY:
+		return strcmp(left->linkedid, right_key) ? 0 : CMP_MATCH;
+	default:
+		return 0;
+	}
+}
+
+static int negcache_hash(const void *obj, const int flags)
+{
+	const struct negcache_entry *entry;
+	const char *key;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_KEY:
+		key = obj;
+		break;
+	case OBJ_SEARCH_OBJECT:
+		entry = obj;
+		key = entry->uniqueid;
+		break;
+	default:
+		ast_assert(0);
+		return 0;
+	}
+	return ast_str_hash(key);
+}
+
+static int negcache_cmp(void *obj, void *arg, int flags)
+{
+	const struct negcache_entry *left = obj;
+	const struct negcache_entry *right = arg;
+	const char *right_key = arg;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_OBJECT:
+		right_key = right->uniqueid;
+		/* Fall through */
+	case OBJ_SEARCH_KEY:
+		return strcmp(left->uniqueid, right_key) ? 0 : CMP_MATCH;
+	default:
+		return 0;
+	}
+}
+
+static int negcache_expired_cb(void *obj, void *arg, int flags attribute_unused)
+{
+	struct negcache_entry *entry = obj;
+	struct timeval *now = arg;
+
+	return ast_tvcmp(entry->expires, *now) <= 0 ? CMP_MATCH : 0;
+}
+
+/*!
+ * \internal
+ * \brief Check whether a uniqueid is known not to exist
+ *
+ * \retval 1 if a lookup for it failed less than negcache_ttl ago
+ * \retval 0 otherwise
+ */
+static int negcache_check(const char *uniqueid)
+{
+	struct negcache_entry *entry;
+	int hit = 0;
+
+	if (!negcache_ttl) {
+		return 0;
+	}
 
-	// const char *linkedid = S_OR(ast_channel_linkedid(chan), "");
-	const char *linkedid = ast_channel_linkedid(chan);
-	if (linkedid) {
-		RAII_VAR(struct ast_channel *, bridge, ast_channel_get_by_name(linkedid), ast_channel_cleanup);
-		if (!bridge) {
-	    	    ast_verb(2, "FindPeer: [%s] no peer found. skipping\n",
-		    	ast_channel_name(chan));
-        	    return 0;
+	entry = ao2_find(negcache, uniqueid, OBJ_SEARCH_KEY);
+	if (entry) {
+		if (ast_tvcmp(entry->expires, ast_tvnow()) > 0) {
+			hit = 1;
+		} else {
+			ao2_unlink(negcache, entry);
 		}
-		ast_verb(2, "FindPeer4: bridge found peer=%s, bridgepeerid=%s\n",
-			linkedid, ast_channel_uniqueid(chan));
-		ast_channel_lock(bridge);
-		pbx_builtin_setvar_helper(bridge, "BRIDGEPEERID", ast_channel_uniqueid(chan));
-		ast_channel_unlock(bridge);
+		ao2_ref(entry, -1);
 	}
-    	return 0;
+	ast_atomic_fetchadd_int(hit ? &negcache_stats.hits : &negcache_stats.misses, 1);
+	return hit;
 }
 
-static int unload_module(void)
+/*! \brief Remember that a lookup for \a uniqueid failed */
+static void negcache_add(const char *uniqueid)
+{
+	struct negcache_entry *entry;
+	struct timeval now;
+
+	if (!negcache_ttl) {
+		return;
+	}
+
+	now = ast_tvnow();
+	if (ao2_container_count(negcache) >= NEGCACHE_MAX) {
+		ao2_callback(negcache, OBJ_MULTIPLE | OBJ_NODATA | OBJ_UNLINK,
+			negcache_expired_cb, &now);
+		if (ao2_container_count(negcache) >= NEGCACHE_MAX) {
+			return;
+		}
+	}
+
+	entry = ao2_alloc_options(sizeof(*entry), NULL, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!entry) {
+		return;
+	}
+	ast_copy_string(entry->uniqueid, uniqueid, sizeof(entry->uniqueid));
+	entry->expires = ast_tvadd(now, ast_samp2tv(negcache_ttl, 1000));
+
+	ao2_wrlock(negcache);
+	ao2_find(negcache, uniqueid, OBJ_SEARCH_KEY | OBJ_UNLINK | OBJ_NODATA | OBJ_NOLOCK);
+	ao2_link_flags(negcache, entry, OBJ_NOLOCK);
+	ao2_unlock(negcache);
+	ao2_ref(entry, -1);
+}
+
+/*! \brief Forget a failed lookup because the channel now exists */
+static void negcache_invalidate(const char *uniqueid)
 {
-	return ast_unregister_application(app);
+	struct negcache_entry *entry;
+
+	if (!negcache_ttl) {
+		return;
+	}
+	entry = ao2_find(negcache, uniqueid, OBJ_SEARCH_KEY | OBJ_UNLINK);
+	if (entry) {
+		ast_atomic_fetchadd_int(&negcache_stats.invalidations, 1);
+		ao2_ref(entry, -1);
+	}
 }
 
-static int load_module(void)
+static int waiter_hash(const void *obj, const int flags)
+{
+	const struct peer_waiter *waiter;
+	const char *key;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_KEY:
+		key = obj;
+		break;
+	case OBJ_SEARCH_OBJECT:
+		waiter = obj;
+		key = waiter->uniqueid;
+		break;
+	default:
+		ast_assert(0);
+		return 0;
+	}
+	return ast_str_hash(key);
+}
+
+static int waiter_cmp(void *obj, void *arg, int flags)
+{
+	const struct peer_waiter *left = obj;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_OBJECT:
+		/* Several calls may wait for the same channel */
+		return left == arg ? CMP_MATCH : 0;
+	case OBJ_SEARCH_KEY:
+		return strcmp(left->uniqueid, arg) ? 0 : CMP_MATCH;
+	default:
+		return 0;
+	}
+}
+
+static int peerevent_hash(const void *obj, const int flags)
+{
+	const struct peerevent_group *group;
+	const char *key;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_KEY:
+		key = obj;
+		break;
+	case OBJ_SEARCH_OBJECT:
+		group = obj;
+		key = group->linkedid;
+		break;
+	default:
+		ast_assert(0);
+		return 0;
+	}
+	return ast_str_hash(key);
+}
+
+static int peerevent_cmp(void *obj, void *arg, int flags)
+{
+	const struct peerevent_group *left = obj;
+	const struct peerevent_group *right = arg;
+	const char *right_key = arg;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_OBJECT:
+		right_key = right->linkedid;
+		/* Fall through */
+	case OBJ_SEARCH_KEY:
+		return strcmp(left->linkedid, right_key) ? 0 : CMP_MATCH;
+	default:
+		return 0;
+	}
+}
+
+static void peerevent_group_destroy(void *obj)
+{
+	struct peerevent_group *group = obj;
+	size_t i;
+
+	for (i = 0; i < AST_VECTOR_SIZE(&group->entries); i++) {
+		ast_free(AST_VECTOR_GET(&group->entries, i).uniqueid);
+		ast_free(AST_VECTOR_GET(&group->entries, i).peer);
+	}
+	AST_VECTOR_FREE(&group->entries);
+}
+
+static int local_chain_hash(const void *obj, const int flags)
+{
+	const struct local_chain *chain;
+	const char *key;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_KEY:
+		key = obj;
+		break;
+	case OBJ_SEARCH_OBJECT:
+		chain = obj;
+		key = chain->linkedid;
+		break;
+	default:
+		ast_assert(0);
+		return 0;
+	}
+	return ast_str_hash(key);
+}
+
+static int local_chain_cmp(void *obj, void *arg, int flags)
 {
-	return ast_register_application_xml(app, findpeer_exec);
+	const struct local_chain *left = obj;
+	const struct local_chain *right = arg;
+	const char *right_key = arg;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_OBJECT:
+		right_key = right->linkedid;
+		/* Fall through */
+	case OBJ_SEARCH_KEY:
+		return strcmp(left->linkedid, right_key) ? 0 : CMP_MATCH;
+	default:
+		return 0;
+	}
+}
+
+static void waiter_destroy(void *obj)
+{
+	struct peer_waiter *waiter = obj;
+
+	ast_alertpipe_close(waiter->alert_pipe);
+}
+
+static int waiter_wake_cb(void *obj, void *arg attribute_unused, int flags attribute_unused)
+{
+	struct peer_waiter *waiter = obj;
+
+	ast_alertpipe_write(waiter->alert_pipe);
+	return 0;
+}
+
+/*! \brief Wake every FindPeer() call waiting for \a uniqueid */
+static void waiters_wake(const char *uniqueid)
+{
+	if (!ao2_container_count(waiters)) {
+		return;
+	}
+	ao2_callback(waiters, OBJ_SEARCH_KEY | OBJ_MULTIPLE | OBJ_NODATA,
+		waiter_wake_cb, (void *) uniqueid);
+}
+
+static void group_destroy(void *obj)
+{
+	struct bridgemon_group *group = obj;
+
+	AST_VECTOR_CALLBACK_VOID(&group->members, ast_free);
+	AST_VECTOR_FREE(&group->members);
+	ast_free(group->legs);
+}
+
+#define MEMBER_CMP(elem, value) (!strcmp(elem, value))
+
+/*!
+ * \internal
+ * \brief Add a channel to its linkedid group
+ *
+ * \pre chans_by_uniqueid is write locked
+ */
+static void group_add(const char *linkedid, const char *uniqueid)
+{
+	struct bridgemon_group *group;
+	char *member;
+
+	if (ast_strlen_zero(linkedid)) {
+		return;
+	}
+
+	group = ao2_find(groups, linkedid, OBJ_SEARCH_KEY);
+	if (!group) {
+		group = ao2_alloc(sizeof(*group), group_destroy);
+		if (!group || AST_VECTOR_INIT(&group->members, 2)) {
+			ao2_cleanup(group);
+			return;
+		}
+		ast_copy_string(group->linkedid, linkedid, sizeof(group->linkedid));
+		ao2_link(groups, group);
+	}
+
+	member = ast_strdup(uniqueid);
+	ao2_lock(group);
+	if (!member || AST_VECTOR_APPEND(&group->members, member)) {
+		ast_free(member);
+	} else if (strcmp(uniqueid, linkedid)) {
+		group->leg_count++;
+		ast_free(group->legs);
+		group->legs = NULL;
+	}
+	ao2_unlock(group);
+	ao2_ref(group, -1);
+}
+
+/*!
+ * \internal
+ * \brief Remove a channel from its linkedid group
+ *
+ * \pre chans_by_uniqueid is write locked
+ */
+static void group_remove(const char *linkedid, const char *uniqueid)
+{
+	struct bridgemon_group *group;
+	int empty;
+
+	group = ao2_find(groups, linkedid, OBJ_SEARCH_KEY);
+	if (!group) {
+		return;
+	}
+
+	ao2_lock(group);
+	if (!AST_VECTOR_REMOVE_CMP_ORDERED(&group->members, uniqueid, MEMBER_CMP, ast_free)
+		&& strcmp(uniqueid, linkedid)) {
+		group->leg_count--;
+		ast_free(group->legs);
+		group->legs = NULL;
+	}
+	empty = !AST_VECTOR_SIZE(&group->members);
+	ao2_unlock(group);
+
+	if (empty) {
+		ao2_unlink(groups, group);
+	}
+	ao2_ref(group, -1);
+}
+
+/*!
+ * \internal
+ * \brief Read the legs of a linkedid group
+ *
+ * \param linkedid Group to read
+ * \param[out] buf Comma separated legs, or the count of them
+ * \param len Size of \a buf
+ * \param count_only Non-zero for the count rather than the list
+ */
+static void group_read(const char *linkedid, char *buf, size_t len, int count_only)
+{
+	struct bridgemon_group *group;
+	struct ast_str *legs;
+	size_t i;
+
+	group = ao2_find(groups, linkedid, OBJ_SEARCH_KEY);
+	if (!group) {
+		ast_copy_string(buf, count_only ? "0" : "", len);
+		return;
+	}
+
+	ao2_lock(group);
+	if (count_only) {
+		snprintf(buf, len, "%u", group->leg_count);
+	} else {
+		if (!group->legs && (legs = ast_str_create(64))) {
+			/* Rebuilt only on the first read after a change */
+			for (i = 0; i < AST_VECTOR_SIZE(&group->members); i++) {
+				const char *member = AST_VECTOR_GET(&group->members, i);
+
+				if (strcmp(member, linkedid)) {
+					ast_str_append(&legs, 0, "%s%s",
+						ast_str_strlen(legs) ? "," : "", member);
+				}
+			}
+			group->legs = ast_strdup(ast_str_buffer(legs));
+			ast_free(legs);
+		}
+		ast_copy_string(buf, S_OR(group->legs, ""), len);
+	}
+	ao2_unlock(group);
+	ao2_ref(group, -1);
+}
+
+/*!
+ * \internal
+ * \brief Get the first leg of a linkedid group other than the originator
+ *
+ * \retval 0 if a leg was found
+ * \retval -1 otherwise
+ */
+static int group_first_leg(const char *linkedid, char *buf, size_t len)
+{
+	struct bridgemon_group *group;
+	int res = -1;
+	size_t i;
+
+	group = ao2_find(groups, linkedid, OBJ_SEARCH_KEY);
+	if (!group) {
+		return -1;
+	}
+	ao2_lock(group);
+	for (i = 0; i < AST_VECTOR_SIZE(&group->members); i++) {
+		const char *member = AST_VECTOR_GET(&group->members, i);
+
+		if (strcmp(member, linkedid)) {
+			ast_copy_string(buf, member, len);
+			res = 0;
+			break;
+		}
+	}
+	ao2_unlock(group);
+	ao2_ref(group, -1);
+	return res;
+}
+
+AST_VECTOR(bulk_ids, char *);
+
+/*!
+ * \internal
+ * \brief Copy the members of a linkedid group, the originator included
+ *
+ * \retval 0 if the group exists
+ * \retval -1 otherwise
+ */
+static int group_members(const char *linkedid, struct bulk_ids *members)
+{
+	struct bridgemon_group *group;
+	size_t i;
+
+	group = ao2_find(groups, linkedid, OBJ_SEARCH_KEY);
+	if (!group) {
+		return -1;
+	}
+	ao2_lock(group);
+	for (i = 0; i < AST_VECTOR_SIZE(&group->members); i++) {
+		char *member = ast_strdup(AST_VECTOR_GET(&group->members, i));
+
+		if (!member || AST_VECTOR_APPEND(members, member)) {
+			ast_free(member);
+		}
+	}
+	ao2_unlock(group);
+	ao2_ref(group, -1);
+	return 0;
+}
+
+/*!
+ * \internal
+ * \brief Rewrite a peer table slot under its seqlock
+ *
+ * \param peer Peer value, cut at the last whole uniqueid that fits, or NULL
+ */
+static void peertable_slot_write(struct bridgemon_peertable_slot *slot,
+	enum bridgemon_peertable_state state, uint64_t hash, const char *uniqueid, const char *peer)
+{
+	uint32_t seq = slot->seq;
+
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->state = state;
+	slot->hash = hash;
+	ast_copy_string(slot->uniqueid, S_OR(uniqueid, ""), sizeof(slot->uniqueid));
+	ast_copy_string(slot->peer, S_OR(peer, ""), sizeof(slot->peer));
+	if (peer && strlen(peer) >= sizeof(slot->peer)) {
+		char *comma = strrchr(slot->peer, ',');
+
+		if (comma) {
+			*comma = '\0';
+		}
+	}
+	__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*!
+ * \internal
+ * \brief Probe the peer table for a uniqueid
+ *
+ * \param reusable Receives the first empty or tombstone slot on the probe,
+ * NULL if there is none
+ *
+ * \return The slot holding \a uniqueid, NULL if it is not published
+ */
+static struct bridgemon_peertable_slot *peertable_find(uint64_t hash, const char *uniqueid,
+	struct bridgemon_peertable_slot **reusable)
+{
+	uint64_t mask = peertable.header->slot_count - 1;
+	uint64_t i;
+
+	*reusable = NULL;
+	for (i = 0; i <= mask; i++) {
+		struct bridgemon_peertable_slot *slot = &peertable.slots[(hash + i) & mask];
+
+		if (slot->state != BRIDGEMON_PEERTABLE_LIVE) {
+			if (!*reusable) {
+				*reusable = slot;
+			}
+			if (slot->state == BRIDGEMON_PEERTABLE_EMPTY) {
+				break;
+			}
+		} else if (slot->hash == hash && !strcmp(slot->uniqueid, uniqueid)) {
+			return slot;
+		}
+	}
+	return NULL;
+}
+
+/*!
+ * \internal
+ * \brief Rehash the live mappings to drop every tombstone
+ *
+ * Readers retry while the table wide seqlock is odd.
+ */
+static void peertable_compact(void)
+{
+	struct bridgemon_peertable_header *header = peertable.header;
+	struct bridgemon_peertable_slot *live;
+	uint64_t count = 0;
+	uint64_t i;
+
+	live = ast_malloc(MAX(header->live, 1ULL) * sizeof(*live));
+	if (!live) {
+		return;
+	}
+	for (i = 0; i < header->slot_count && count < header->live; i++) {
+		if (peertable.slots[i].state == BRIDGEMON_PEERTABLE_LIVE) {
+			live[count++] = peertable.slots[i];
+		}
+	}
+
+	__atomic_store_n(&header->seq, header->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	for (i = 0; i < header->slot_count; i++) {
+		if (peertable.slots[i].state != BRIDGEMON_PEERTABLE_EMPTY) {
+			peertable_slot_write(&peertable.slots[i], BRIDGEMON_PEERTABLE_EMPTY, 0, NULL, NULL);
+		}
+	}
+	for (i = 0; i < count; i++) {
+		struct bridgemon_peertable_slot *slot;
+
+		peertable_find(live[i].hash, live[i].uniqueid, &slot);
+		peertable_slot_write(slot, BRIDGEMON_PEERTABLE_LIVE, live[i].hash,
+			live[i].uniqueid, live[i].peer);
+	}
+	header->live = count;
+	header->tombstones = 0;
+	__atomic_store_n(&header->seq, header->seq + 1, __ATOMIC_RELEASE);
+
+	ast_free(live);
+}
+
+/*! \brief Publish the peer of a channel, if the peer table is enabled */
+static void peertable_publish(const char *uniqueid, const char *peer)
+{
+	struct bridgemon_peertable_header *header;
+	struct bridgemon_peertable_slot *slot;
+	struct bridgemon_peertable_slot *reusable;
+	uint64_t hash;
+
+	if (!peertable.header) {
+		return;
+	}
+	hash = bridgemon_peertable_hash(uniqueid);
+
+	ast_mutex_lock(&peertable.lock);
+	header = peertable.header;
+	if (!header) {
+		ast_mutex_unlock(&peertable.lock);
+		return;
+	}
+	if (strlen(uniqueid) >= BRIDGEMON_PEERTABLE_ID_LEN) {
+		header->dropped++;
+		ast_mutex_unlock(&peertable.lock);
+		return;
+	}
+
+	slot = peertable_find(hash, uniqueid, &reusable);
+	if (!slot) {
+		/* Keep probes short: at most three quarters full, tombstones included */
+		uint64_t max_fill = header->slot_count / 4 * 3;
+
+		if (header->live + header->tombstones >= max_fill && header->tombstones) {
+			peertable_compact();
+			peertable_find(hash, uniqueid, &reusable);
+		}
+		if (header->live >= max_fill || !reusable) {
+			header->dropped++;
+			ast_mutex_unlock(&peertable.lock);
+			return;
+		}
+		if (reusable->state == BRIDGEMON_PEERTABLE_TOMBSTONE) {
+			header->tombstones--;
+		}
+		header->live++;
+		slot = reusable;
+	}
+	peertable_slot_write(slot, BRIDGEMON_PEERTABLE_LIVE, hash, uniqueid, peer);
+	ast_mutex_unlock(&peertable.lock);
+}
+
+/*! \brief Withdraw the peer of a channel from the peer table */
+static void peertable_remove(const char *uniqueid)
+{
+	struct bridgemon_peertable_slot *slot;
+	struct bridgemon_peertable_slot *reusable;
+	struct bridgemon_peertable_slot *next;
+	uint64_t mask;
+
+	if (!peertable.header) {
+		return;
+	}
+
+	ast_mutex_lock(&peertable.lock);
+	if (!peertable.header) {
+		ast_mutex_unlock(&peertable.lock);
+		return;
+	}
+	slot = peertable_find(bridgemon_peertable_hash(uniqueid), uniqueid, &reusable);
+	if (slot) {
+		mask = peertable.header->slot_count - 1;
+		next = &peertable.slots[(slot - peertable.slots + 1) & mask];
+		peertable.header->live--;
+		/* The end of a probe chain needs no tombstone */
+		if (next->state == BRIDGEMON_PEERTABLE_EMPTY) {
+			peertable_slot_write(slot, BRIDGEMON_PEERTABLE_EMPTY, 0, NULL, NULL);
+		} else {
+			peertable_slot_write(slot, BRIDGEMON_PEERTABLE_TOMBSTONE, 0, NULL, NULL);
+			peertable.header->tombstones++;
+		}
+	}
+	ast_mutex_unlock(&peertable.lock);
+}
+
+/*! \brief Mark a peer table closed, so readers reopen, and unmap it */
+static void peertable_close(struct bridgemon_peertable_header *header, size_t size)
+{
+	__atomic_store_n(&header->closed, 1, __ATOMIC_RELEASE);
+	munmap(header, size);
+}
+
+/*!
+ * \internal
+ * \brief Create the shared memory peer table
+ *
+ * A table left behind under the same name is closed and replaced, so readers
+ * still mapping it move to the new one.
+ */
+static int peertable_create(const char *name, unsigned int slots)
+{
+	struct bridgemon_peertable_header *header;
+	size_t size = sizeof(*header) + (size_t) slots * sizeof(struct bridgemon_peertable_slot);
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = shm_open(name, O_RDWR, 0);
+	if (fd >= 0) {
+		if (!fstat(fd, &st) && (size_t) st.st_size >= sizeof(*header)) {
+			map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (map != MAP_FAILED) {
+				peertable_close(map, st.st_size);
+			}
+		}
+		close(fd);
+		shm_unlink(name);
+	}
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		ast_log(LOG_ERROR, "Unable to create peer table %s: %s\n", name, strerror(errno));
+		return -1;
+	}
+	if (ftruncate(fd, size)) {
+		ast_log(LOG_ERROR, "Unable to size peer table %s: %s\n", name, strerror(errno));
+		close(fd);
+		shm_unlink(name);
+		return -1;
+	}
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		ast_log(LOG_ERROR, "Unable to map peer table %s: %s\n", name, strerror(errno));
+		shm_unlink(name);
+		return -1;
+	}
+
+	header = map;
+	header->version = BRIDGEMON_PEERTABLE_VERSION;
+	header->slot_size = sizeof(struct bridgemon_peertable_slot);
+	header->slot_count = slots;
+	__atomic_store_n(&header->magic, BRIDGEMON_PEERTABLE_MAGIC, __ATOMIC_RELEASE);
+
+	ast_mutex_lock(&peertable.lock);
+	peertable.slots = (struct bridgemon_peertable_slot *) (header + 1);
+	peertable.size = size;
+	ast_copy_string(peertable.name, name, sizeof(peertable.name));
+	peertable.header = header;
+	ast_mutex_unlock(&peertable.lock);
+	return 0;
+}
+
+static void peertable_destroy(void)
+{
+	ast_mutex_lock(&peertable.lock);
+	if (peertable.header) {
+		peertable_close(peertable.header, peertable.size);
+		shm_unlink(peertable.name);
+		peertable.header = NULL;
+		peertable.slots = NULL;
+	}
+	ast_mutex_unlock(&peertable.lock);
+}
+
+/*!
+ * \brief Queue a channel's new peer for the next BridgePeers event
+ *
+ * Changes are held for peer_event_window ms from the first change of a
+ * linkedid. A channel changing again within the window only updates its
+ * entry, so a burst of FindPeer() calls on one call costs one listing.
+ */
+static void peerevent_queue(const char *linkedid, const char *uniqueid, const char *peer)
+{
+	struct peerevent_group *group;
+	struct peerevent_entry entry;
+	size_t i;
+
+	if (!peerevent_enabled || ast_strlen_zero(linkedid)) {
+		return;
+	}
+
+	ast_mutex_lock(&peerevent.lock);
+	if (!peerevent.by_linkedid) {
+		ast_mutex_unlock(&peerevent.lock);
+		return;
+	}
+	peerevent.changes++;
+	group = ao2_find(peerevent.by_linkedid, linkedid, OBJ_SEARCH_KEY | OBJ_NOLOCK);
+	if (group) {
+		/* The pending vector holds its own reference */
+		ao2_ref(group, -1);
+		for (i = 0; i < AST_VECTOR_SIZE(&group->entries); i++) {
+			struct peerevent_entry *queued = AST_VECTOR_GET_ADDR(&group->entries, i);
+
+			if (!strcmp(queued->uniqueid, uniqueid)) {
+				char *copy = ast_strdup(peer);
+
+				if (copy) {
+					ast_free(queued->peer);
+					queued->peer = copy;
+				}
+				ast_mutex_unlock(&peerevent.lock);
+				return;
+			}
+		}
+	} else {
+		group = ao2_alloc_options(sizeof(*group), peerevent_group_destroy,
+			AO2_ALLOC_OPT_LOCK_NOLOCK);
+		if (!group || AST_VECTOR_INIT(&group->entries, 2)
+			|| AST_VECTOR_APPEND(&peerevent.pending, group)) {
+			ao2_cleanup(group);
+			ast_mutex_unlock(&peerevent.lock);
+			return;
+		}
+		ast_copy_string(group->linkedid, linkedid, sizeof(group->linkedid));
+		ao2_link_flags(peerevent.by_linkedid, group, OBJ_NOLOCK);
+		if (AST_VECTOR_SIZE(&peerevent.pending) == 1) {
+			peerevent.due = ast_tvadd(ast_tvnow(), ast_tv(0, peerevent_window * 1000));
+			ast_cond_signal(&peerevent.cond);
+		}
+	}
+
+	entry.uniqueid = ast_strdup(uniqueid);
+	entry.peer = ast_strdup(peer);
+	if (!entry.uniqueid || !entry.peer || AST_VECTOR_APPEND(&group->entries, entry)) {
+		ast_free(entry.uniqueid);
+		ast_free(entry.peer);
+	}
+	ast_mutex_unlock(&peerevent.lock);
+}
+
+/*!
+ * \internal
+ * \brief Send queued groups as BridgePeers events
+ *
+ * Each event lists whole linkedids, starting a new one once
+ * PEEREVENT_BATCH_MAX channels are listed.
+ */
+static void peerevent_send(struct peerevent_groups *groups)
+{
+	struct ast_str *body = ast_str_create(1024);
+	struct ast_str *headers = ast_str_create(4096);
+	size_t linkedids = 0;
+	size_t channels = 0;
+	size_t i;
+	size_t j;
+
+	if (!body || !headers) {
+		ast_free(body);
+		ast_free(headers);
+		return;
+	}
+
+	for (i = 0; i < AST_VECTOR_SIZE(groups); i++) {
+		struct peerevent_group *group = AST_VECTOR_GET(groups, i);
+
+		ast_str_append(&headers, 0, "LinkedID%zu: %s\r\n", linkedids, group->linkedid);
+		for (j = 0; j < AST_VECTOR_SIZE(&group->entries); j++) {
+			const struct peerevent_entry *entry = AST_VECTOR_GET_ADDR(&group->entries, j);
+
+			ast_str_append(&headers, 0, "UniqueID%zu_%zu: %s\r\nPeer%zu_%zu: %s\r\n",
+				linkedids, j, entry->uniqueid, linkedids, j, entry->peer);
+		}
+		linkedids++;
+		channels += AST_VECTOR_SIZE(&group->entries);
+
+		if (channels >= PEEREVENT_BATCH_MAX || i + 1 == AST_VECTOR_SIZE(groups)) {
+			ast_str_set(&body, 0, "LinkedIDs: %zu\r\nChannels: %zu\r\n%s",
+				linkedids, channels, ast_str_buffer(headers));
+			manager_event(EVENT_FLAG_CALL, "BridgePeers", "%s", ast_str_buffer(body));
+			ast_mutex_lock(&peerevent.lock);
+			peerevent.events++;
+			peerevent.listed += channels;
+			ast_mutex_unlock(&peerevent.lock);
+			ast_str_reset(headers);
+			linkedids = 0;
+			channels = 0;
+		}
+	}
+	ast_free(body);
+	ast_free(headers);
+}
+
+/*! \brief Take the pending groups, leaving none pending */
+static void peerevent_take(struct peerevent_groups *taken)
+{
+	*taken = peerevent.pending;
+	AST_VECTOR_INIT(&peerevent.pending, AST_VECTOR_SIZE(taken));
+	ao2_callback(peerevent.by_linkedid, OBJ_MULTIPLE | OBJ_NODATA | OBJ_UNLINK | OBJ_NOLOCK,
+		NULL, NULL);
+}
+
+static void *peerevent_thread(void *data attribute_unused)
+{
+	ast_mutex_lock(&peerevent.lock);
+	while (!peerevent.stop) {
+		struct peerevent_groups taken;
+
+		if (!AST_VECTOR_SIZE(&peerevent.pending)) {
+			ast_cond_wait(&peerevent.cond, &peerevent.lock);
+			continue;
+		}
+		if (ast_tvcmp(ast_tvnow(), peerevent.due) < 0) {
+			struct timespec ts = {
+				.tv_sec = peerevent.due.tv_sec,
+				.tv_nsec = peerevent.due.tv_usec * 1000,
+			};
+
+			ast_cond_timedwait(&peerevent.cond, &peerevent.lock, &ts);
+			continue;
+		}
+
+		peerevent_take(&taken);
+		ast_mutex_unlock(&peerevent.lock);
+		peerevent_send(&taken);
+		AST_VECTOR_CALLBACK_VOID(&taken, ao2_ref, -1);
+		AST_VECTOR_FREE(&taken);
+		ast_mutex_lock(&peerevent.lock);
+	}
+	ast_mutex_unlock(&peerevent.lock);
+	return NULL;
+}
+
+static int peerevent_start(void)
+{
+	ast_mutex_init(&peerevent.lock);
+	ast_cond_init(&peerevent.cond, NULL);
+	peerevent.stop = 0;
+	peerevent.changes = 0;
+	peerevent.listed = 0;
+	peerevent.events = 0;
+	peerevent.by_linkedid = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_NOLOCK, 0,
+		PEEREVENT_BUCKETS, peerevent_hash, NULL, peerevent_cmp);
+	if (!peerevent.by_linkedid || AST_VECTOR_INIT(&peerevent.pending, 16)) {
+		return -1;
+	}
+	if (ast_pthread_create_background(&peerevent.thread, NULL, peerevent_thread, NULL)) {
+		peerevent.thread = AST_PTHREADT_NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static void peerevent_stop(void)
+{
+	struct peerevent_groups taken;
+
+	if (peerevent.thread != AST_PTHREADT_NULL) {
+		ast_mutex_lock(&peerevent.lock);
+		peerevent.stop = 1;
+		ast_cond_signal(&peerevent.cond);
+		ast_mutex_unlock(&peerevent.lock);
+		pthread_join(peerevent.thread, NULL);
+		peerevent.thread = AST_PTHREADT_NULL;
+	}
+	if (!peerevent.by_linkedid) {
+		return;
+	}
+
+	/* Whatever was still being coalesced */
+	ast_mutex_lock(&peerevent.lock);
+	peerevent_take(&taken);
+	ao2_ref(peerevent.by_linkedid, -1);
+	peerevent.by_linkedid = NULL;
+	AST_VECTOR_FREE(&peerevent.pending);
+	ast_mutex_unlock(&peerevent.lock);
+	peerevent_send(&taken);
+	AST_VECTOR_CALLBACK_VOID(&taken, ao2_ref, -1);
+	AST_VECTOR_FREE(&taken);
+	ast_cond_destroy(&peerevent.cond);
+	ast_mutex_destroy(&peerevent.lock);
+}
+
+/*!
+ * \brief Push a peer change to every feed subscriber
+ *
+ * Encodes the record once into the shared ring and wakes the feed thread,
+ * which copies it out to each subscriber.
+ */
+static void feed_publish(enum bridgemon_feed_type type, const char *uniqueid, const char *peer)
+{
+	struct bridgemon_feed_record record;
+	struct feed_slot *slot;
+	struct timeval now;
+	size_t uniqueid_len;
+	size_t peer_len;
+	int wake;
+
+	if (!__atomic_load_n(&feed.subscriber_count, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	now = ast_tvnow();
+	uniqueid_len = MIN(strlen(uniqueid), (size_t) UINT8_MAX);
+	peer_len = peer ? MIN(strlen(peer), (size_t) PEER_LIST_LEN) : 0;
+	record.length = sizeof(record) - sizeof(record.length) + uniqueid_len + peer_len;
+	record.type = type;
+	record.uniqueid_len = uniqueid_len;
+	record.peer_len = peer_len;
+	record.time_us = now.tv_sec * 1000000ULL + now.tv_usec;
+
+	ast_mutex_lock(&feed.lock);
+	if (!feed.ring) {
+		ast_mutex_unlock(&feed.lock);
+		return;
+	}
+	record.seq = feed.head;
+	slot = &feed.ring[feed.head % feed.ring_len];
+	memcpy(slot->data, &record, sizeof(record));
+	memcpy(slot->data + sizeof(record), uniqueid, uniqueid_len);
+	if (peer_len) {
+		memcpy(slot->data + sizeof(record) + uniqueid_len, peer, peer_len);
+	}
+	slot->len = sizeof(record) + uniqueid_len + peer_len;
+	feed.head++;
+	wake = !feed.signalled;
+	feed.signalled = 1;
+	ast_mutex_unlock(&feed.lock);
+
+	if (wake) {
+		ast_alertpipe_write(feed.alert_pipe);
+	}
+}
+
+/*!
+ * \internal
+ * \brief Write as much of a subscriber's backlog as its socket takes
+ *
+ * \retval 0 on success, including a full socket
+ * \retval -1 if the subscriber went away
+ */
+static int feed_subscriber_flush(struct feed_subscriber *sub)
+{
+	for (;;) {
+		ssize_t written;
+
+		if (sub->out_off == sub->out_len) {
+			sub->out_off = 0;
+			sub->out_len = 0;
+			ast_mutex_lock(&feed.lock);
+			if (feed.head - sub->next > feed.ring_len) {
+				/* Slow consumer, the oldest records are gone */
+				sub->dropped += feed.head - feed.ring_len - sub->next;
+				sub->next = feed.head - feed.ring_len;
+			}
+			for (; sub->next < feed.head; sub->next++, sub->sent++) {
+				struct feed_slot *slot = &feed.ring[sub->next % feed.ring_len];
+
+				if (sub->out_len + slot->len > sizeof(sub->out)) {
+					break;
+				}
+				memcpy(sub->out + sub->out_len, slot->data, slot->len);
+				sub->out_len += slot->len;
+			}
+			ast_mutex_unlock(&feed.lock);
+			if (!sub->out_len) {
+				return 0;
+			}
+		}
+
+		written = send(sub->fd, sub->out + sub->out_off, sub->out_len - sub->out_off,
+			MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (written < 0) {
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+		}
+		sub->out_off += written;
+		if (sub->out_off < sub->out_len) {
+			return 0;
+		}
+	}
+}
+
+static void feed_subscriber_add(int fd)
+{
+	struct feed_subscriber *sub = ast_calloc(1, sizeof(*sub));
+
+	if (!sub) {
+		close(fd);
+		return;
+	}
+	sub->fd = fd;
+
+	ast_mutex_lock(&feed.lock);
+	sub->next = feed.head;
+	if (AST_VECTOR_APPEND(&feed.subscribers, sub)) {
+		ast_mutex_unlock(&feed.lock);
+		close(fd);
+		ast_free(sub);
+		return;
+	}
+	__atomic_store_n(&feed.subscriber_count, AST_VECTOR_SIZE(&feed.subscribers), __ATOMIC_RELAXED);
+	ast_mutex_unlock(&feed.lock);
+	ast_debug(1, "BridgeMon: peer feed subscriber %d connected\n", fd);
+}
+
+static void feed_subscriber_remove(size_t idx)
+{
+	struct feed_subscriber *sub;
+
+	ast_mutex_lock(&feed.lock);
+	sub = AST_VECTOR_REMOVE_UNORDERED(&feed.subscribers, idx);
+	__atomic_store_n(&feed.subscriber_count, AST_VECTOR_SIZE(&feed.subscribers), __ATOMIC_RELAXED);
+	ast_mutex_unlock(&feed.lock);
+
+	ast_debug(1, "BridgeMon: peer feed subscriber %d gone, %" PRIu64 " sent, %" PRIu64 " dropped\n",
+		sub->fd, sub->sent, sub->dropped);
+	close(sub->fd);
+	ast_free(sub);
+}
+
+static void *feed_thread(void *data attribute_unused)
+{
+	struct pollfd *fds = NULL;
+	size_t fds_len = 0;
+
+	while (!__atomic_load_n(&feed.stop, __ATOMIC_RELAXED)) {
+		size_t count = AST_VECTOR_SIZE(&feed.subscribers);
+		size_t i;
+
+		if (fds_len < count + 2) {
+			struct pollfd *grown = ast_realloc(fds, (count + 2) * sizeof(*fds));
+
+			if (!grown) {
+				break;
+			}
+			fds = grown;
+			fds_len = count + 2;
+		}
+		fds[0].fd = ast_alertpipe_readfd(feed.alert_pipe);
+		fds[0].events = POLLIN;
+		fds[1].fd = feed.listen_fd;
+		fds[1].events = POLLIN;
+		for (i = 0; i < count; i++) {
+			struct feed_subscriber *sub = AST_VECTOR_GET(&feed.subscribers, i);
+
+			fds[i + 2].fd = sub->fd;
+			fds[i + 2].events = POLLIN | (sub->out_off < sub->out_len ? POLLOUT : 0);
+		}
+
+		if (ast_poll(fds, count + 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			ast_log(LOG_ERROR, "BridgeMon: peer feed poll failed: %s\n", strerror(errno));
+			break;
+		}
+		if (fds[0].revents) {
+			ast_alertpipe_read(feed.alert_pipe);
+			ast_mutex_lock(&feed.lock);
+			feed.signalled = 0;
+			ast_mutex_unlock(&feed.lock);
+		}
+
+		/* Backwards, removal moves the last subscriber into the hole */
+		for (i = count; i-- > 0;) {
+			struct feed_subscriber *sub = AST_VECTOR_GET(&feed.subscribers, i);
+			short revents = fds[i + 2].revents;
+			int gone = revents & (POLLERR | POLLNVAL);
+
+			if (!gone && (revents & (POLLIN | POLLHUP))) {
+				char discard[256];
+				ssize_t res = recv(sub->fd, discard, sizeof(discard), MSG_DONTWAIT);
+
+				gone = !res || (res < 0 && errno != EAGAIN && errno != EWOULDBLOCK
+					&& errno != EINTR);
+			}
+			if (gone || feed_subscriber_flush(sub)) {
+				feed_subscriber_remove(i);
+			}
+		}
+
+		if (fds[1].revents & POLLIN) {
+			int fd = accept(feed.listen_fd, NULL, NULL);
+
+			if (fd >= 0) {
+				ast_fd_set_flags(fd, O_NONBLOCK);
+				feed_subscriber_add(fd);
+			}
+		}
+	}
+
+	while (AST_VECTOR_SIZE(&feed.subscribers)) {
+		feed_subscriber_remove(0);
+	}
+	ast_free(fds);
+	return NULL;
+}
+
+/*! \brief Listen on \a path and start the feed thread */
+static int feed_start(const char *path, unsigned int queue)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX, };
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		ast_log(LOG_ERROR, "BridgeMon: peer_feed path '%s' is too long\n", path);
+		return -1;
+	}
+	ast_copy_string(addr.sun_path, path, sizeof(addr.sun_path));
+
+	feed.ring = ast_calloc(queue, sizeof(*feed.ring));
+	if (!feed.ring || AST_VECTOR_INIT(&feed.subscribers, 4)
+		|| ast_alertpipe_init(feed.alert_pipe)) {
+		return -1;
+	}
+	feed.ring_len = queue;
+	feed.head = 0;
+	feed.signalled = 0;
+	feed.stop = 0;
+
+	feed.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (feed.listen_fd < 0) {
+		ast_log(LOG_ERROR, "BridgeMon: unable to create peer feed socket: %s\n", strerror(errno));
+		return -1;
+	}
+	unlink(path);
+	if (bind(feed.listen_fd, (struct sockaddr *) &addr, sizeof(addr))
+		|| listen(feed.listen_fd, 16)) {
+		ast_log(LOG_ERROR, "BridgeMon: unable to listen on %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	ast_fd_set_flags(feed.listen_fd, O_NONBLOCK);
+	ast_copy_string(feed.path, path, sizeof(feed.path));
+
+	if (ast_pthread_create_background(&feed.thread, NULL, feed_thread, NULL)) {
+		feed.thread = AST_PTHREADT_NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static void feed_stop(void)
+{
+	if (feed.thread != AST_PTHREADT_NULL) {
+		__atomic_store_n(&feed.stop, 1, __ATOMIC_RELAXED);
+		ast_alertpipe_write(feed.alert_pipe);
+		pthread_join(feed.thread, NULL);
+		feed.thread = AST_PTHREADT_NULL;
+	}
+	if (feed.listen_fd >= 0) {
+		close(feed.listen_fd);
+		feed.listen_fd = -1;
+		unlink(feed.path);
+	}
+	if (feed.alert_pipe[0] >= 0) {
+		ast_alertpipe_close(feed.alert_pipe);
+		feed.alert_pipe[0] = feed.alert_pipe[1] = -1;
+	}
+	ast_mutex_lock(&feed.lock);
+	ast_free(feed.ring);
+	feed.ring = NULL;
+	ast_mutex_unlock(&feed.lock);
+	AST_VECTOR_FREE(&feed.subscribers);
+}
+
+/*!
+ * \internal
+ * \brief Invalidate cached peer lookups of the originator of \a linkedid
+ *
+ * Called when a leg joins or leaves the linkedid group since the derived peer
+ * of the originator may change with it.
+ */
+static void chan_index_touch(const char *linkedid, int flags)
+{
+	struct bridgemon_chan *entry;
+
+	entry = ao2_find(chans_by_uniqueid, linkedid, OBJ_SEARCH_KEY | flags);
+	if (!entry) {
+		return;
+	}
+	ao2_lock(entry);
+	entry->generation++;
+	ao2_unlock(entry);
+	ao2_ref(entry, -1);
+}
+
+/*! \brief Whether a channel name is a half of a Local channel pair */
+static int local_name(const char *name)
+{
+	return !strncasecmp(name, "Local/", 6);
+}
+
+/*! \brief Whether \a uniqueid is one of the comma separated \a hops */
+static int local_chain_has_hop(const struct local_chain *chain, const char *uniqueid)
+{
+	size_t len = strlen(uniqueid);
+	const char *hop = chain->hops;
+
+	while (*hop) {
+		size_t item = strcspn(hop, ",");
+
+		if (item == len && !strncmp(hop, uniqueid, len)) {
+			return 1;
+		}
+		hop += item + (hop[item] == ',');
+	}
+	return 0;
+}
+
+/*!
+ * \internal
+ * \brief Get the cached far end of a call's Local chain
+ *
+ * \param linkedid Call the chain belongs to
+ * \param hop A Local half the chain must pass through, NULL for any
+ * \param[out] buf Uniqueid of the real channel at the far end
+ * \param len Size of \a buf
+ *
+ * \retval 0 on a hit
+ * \retval -1 otherwise
+ */
+static int local_chain_cached(const char *linkedid, const char *hop, char *buf, size_t len)
+{
+	struct local_chain *chain;
+	struct bridgemon_chan *endpoint;
+	int res = -1;
+
+	chain = ao2_find(local_chains, linkedid, OBJ_SEARCH_KEY);
+	if (!chain) {
+		return -1;
+	}
+	if (!hop || local_chain_has_hop(chain, hop)) {
+		/* Only while the endpoint is still up */
+		endpoint = ao2_find(chans_by_uniqueid, chain->endpoint, OBJ_SEARCH_KEY);
+		if (endpoint) {
+			ast_copy_string(buf, chain->endpoint, len);
+			ao2_ref(endpoint, -1);
+			res = 0;
+		}
+	}
+	ao2_ref(chain, -1);
+	return res;
+}
+
+/*! \brief Forget the Local chain of \a linkedid */
+static void local_chain_forget(const char *linkedid)
+{
+	if (!local_chains || !ao2_container_count(local_chains)) {
+		return;
+	}
+	ao2_find(local_chains, linkedid, OBJ_SEARCH_KEY | OBJ_UNLINK | OBJ_NODATA);
+}
+
+/*!
+ * \internal
+ * \brief Follow a chain of Local channel pairs to the real channel at its far end
+ *
+ * From the ;2 half of each pair, the one that dials onwards, the next hop is
+ * its bridge peer. That is either the real endpoint or the ;1 half of the
+ * next pair in the chain. A ;1 half starts from its ;2 partner.
+ *
+ * \param chan A Local channel half
+ * \param[out] buf Uniqueid of the far end
+ * \param len Size of \a buf
+ * \param[out] hops Uniqueids of the Local halves walked through
+ *
+ * \retval 0 if a real channel was reached
+ * \retval -1 if the chain does not reach one yet
+ */
+static int local_chain_follow(struct ast_channel *chan, char *buf, size_t len, struct ast_str **hops)
+{
+	struct ast_channel *cur = ast_channel_ref(chan);
+	int i;
+
+	for (i = 0; i < LOCAL_CHAIN_MAX; i++) {
+		const char *name = ast_channel_name(cur);
+		struct ast_channel *next;
+
+		ast_str_append(hops, 0, "%s%s", ast_str_strlen(*hops) ? "," : "", ast_channel_uniqueid(cur));
+		if (strlen(name) > 2 && !strcmp(name + strlen(name) - 2, ";1")) {
+			struct ast_channel *partner = ast_local_get_peer(cur);
+
+			ast_channel_unref(cur);
+			if (!partner) {
+				return -1;
+			}
+			cur = partner;
+			ast_str_append(hops, 0, ",%s", ast_channel_uniqueid(cur));
+		}
+
+		next = ast_channel_bridge_peer(cur);
+		ast_channel_unref(cur);
+		if (!next) {
+			/* Not answered yet */
+			return -1;
+		}
+		if (!local_name(ast_channel_name(next))) {
+			ast_copy_string(buf, ast_channel_uniqueid(next), len);
+			ast_channel_unref(next);
+			return 0;
+		}
+		cur = next;
+	}
+	ast_channel_unref(cur);
+	return -1;
+}
+
+/*!
+ * \internal
+ * \brief Resolve a Local channel to the real channel at the far end of its chain
+ *
+ * The first resolution walks the chain through the core. Later ones for the
+ * same call are answered from the cache until the chain changes.
+ *
+ * \retval 0 if resolved
+ * \retval -1 if the chain does not reach a real channel yet
+ */
+static int local_chain_resolve(struct ast_channel *chan, const char *linkedid, char *buf, size_t len)
+{
+	RAII_VAR(struct ast_str *, hops, NULL, ast_free);
+	struct local_chain *chain;
+
+	if (!local_chain_cached(linkedid, ast_channel_uniqueid(chan), buf, len)) {
+		return 0;
+	}
+
+	hops = ast_str_create(128);
+	if (!hops || local_chain_follow(chan, buf, len, &hops)) {
+		return -1;
+	}
+
+	chain = ao2_alloc_options(sizeof(*chain), NULL, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (chain) {
+		ast_copy_string(chain->linkedid, linkedid, sizeof(chain->linkedid));
+		ast_copy_string(chain->endpoint, buf, sizeof(chain->endpoint));
+		ast_copy_string(chain->hops, ast_str_buffer(hops), sizeof(chain->hops));
+		ao2_wrlock(local_chains);
+		ao2_find(local_chains, linkedid, OBJ_SEARCH_KEY | OBJ_UNLINK | OBJ_NODATA | OBJ_NOLOCK);
+		ao2_link_flags(local_chains, chain, OBJ_NOLOCK);
+		ao2_unlock(local_chains);
+		ao2_ref(chain, -1);
+		chan_index_touch(linkedid, 0);
+	}
+	return 0;
+}
+
+static void local_optimization_cb(void *data attribute_unused,
+	struct stasis_subscription *sub attribute_unused, struct stasis_message *message)
+{
+	struct ast_multi_channel_blob *blob = stasis_message_data(message);
+	struct ast_channel_snapshot *one = ast_multi_channel_blob_get_channel(blob, "1");
+
+	if (one) {
+		local_chain_forget(one->peer->linkedid);
+		chan_index_touch(one->peer->linkedid, 0);
+	}
+}
+
+static void chan_entry_destroy(void *obj)
+{
+	struct bridgemon_chan *entry = obj;
+
+	ast_free(entry->peer);
+	ast_free(entry->peerid);
+}
+
+/*!
+ * \internal
+ * \brief Add or refresh a channel in the index
+ *
+ * \note Only the snapshot router thread and callers holding the channel call this.
+ */
+static void chan_index_update(const char *uniqueid, const char *linkedid, const char *name)
+{
+	struct bridgemon_chan *entry;
+
+	if (ast_strlen_zero(uniqueid)) {
+		return;
+	}
+
+	ao2_wrlock(chans_by_uniqueid);
+	entry = ao2_find(chans_by_uniqueid, uniqueid, OBJ_SEARCH_KEY | OBJ_NOLOCK);
+	if (!entry) {
+		entry = ao2_alloc(sizeof(*entry), chan_entry_destroy);
+		if (!entry) {
+			ao2_unlock(chans_by_uniqueid);
+			return;
+		}
+		ast_copy_string(entry->uniqueid, uniqueid, sizeof(entry->uniqueid));
+		ast_copy_string(entry->linkedid, S_OR(linkedid, ""), sizeof(entry->linkedid));
+		ast_copy_string(entry->name, S_OR(name, ""), sizeof(entry->name));
+		ao2_link_flags(chans_by_uniqueid, entry, OBJ_NOLOCK);
+		negcache_invalidate(entry->uniqueid);
+		waiters_wake(entry->uniqueid);
+		group_add(entry->linkedid, entry->uniqueid);
+		chan_index_touch(entry->linkedid, OBJ_NOLOCK);
+	} else {
+		if (!ast_strlen_zero(linkedid) && strcmp(entry->linkedid, linkedid)) {
+			group_remove(entry->linkedid, entry->uniqueid);
+			chan_index_touch(entry->linkedid, OBJ_NOLOCK);
+			ao2_lock(entry);
+			ast_copy_string(entry->linkedid, linkedid, sizeof(entry->linkedid));
+			entry->generation++;
+			ao2_unlock(entry);
+			group_add(entry->linkedid, entry->uniqueid);
+			chan_index_touch(entry->linkedid, OBJ_NOLOCK);
+		}
+		if (!ast_strlen_zero(name) && strcmp(entry->name, name)) {
+			ao2_lock(entry);
+			ast_copy_string(entry->name, name, sizeof(entry->name));
+			ao2_unlock(entry);
+		}
+	}
+	ao2_unlock(chans_by_uniqueid);
+	ao2_ref(entry, -1);
+}
+
+static void chan_index_remove(const char *uniqueid)
+{
+	struct bridgemon_chan *entry;
+
+	ao2_wrlock(chans_by_uniqueid);
+	entry = ao2_find(chans_by_uniqueid, uniqueid, OBJ_SEARCH_KEY | OBJ_UNLINK | OBJ_NOLOCK);
+	if (entry) {
+		int published;
+
+		group_remove(entry->linkedid, entry->uniqueid);
+		chan_index_touch(entry->linkedid, OBJ_NOLOCK);
+		if (local_name(entry->name)) {
+			local_chain_forget(entry->linkedid);
+		}
+		/*
+		 * A lookup still holding a reference may be about to record a peer.
+		 * Under the entry lock it either already has, and is withdrawn here,
+		 * or it sees the flag and publishes nothing.
+		 */
+		ao2_lock(entry);
+		entry->unlinked = 1;
+		published = entry->peer != NULL;
+		ao2_unlock(entry);
+		if (published) {
+			peertable_remove(entry->uniqueid);
+			feed_publish(BRIDGEMON_FEED_REMOVE, entry->uniqueid, NULL);
+		}
+		ao2_ref(entry, -1);
+	}
+	ao2_unlock(chans_by_uniqueid);
+}
+
+/*!
+ * \internal
+ * \brief Record \a peerid as the peer of the channel \a uniqueid
+ *
+ * \retval 0 on success
+ * \retval -1 if the channel is not indexed
+ */
+static int chan_index_set_peer(const char *uniqueid, const char *peerid)
+{
+	struct bridgemon_chan *entry;
+
+	entry = ao2_find(chans_by_uniqueid, uniqueid, OBJ_SEARCH_KEY);
+	if (!entry) {
+		return -1;
+	}
+	ao2_lock(entry);
+	if (!entry->peer || strcmp(entry->peer, peerid)) {
+		char *peer = ast_strdup(peerid);
+
+		if (peer) {
+			ast_free(entry->peer);
+			entry->peer = peer;
+			entry->generation++;
+			if (!entry->unlinked) {
+				peertable_publish(uniqueid, peer);
+				feed_publish(BRIDGEMON_FEED_ASSIGN, uniqueid, peer);
+			}
+			peerevent_queue(entry->linkedid, uniqueid, peer);
+		}
+	}
+	ao2_unlock(entry);
+	ao2_ref(entry, -1);
+	return 0;
+}
+
+/*!
+ * \internal
+ * \brief Resolve the peer of a channel from the index alone
+ *
+ * Uses the recorded peer if there is one, otherwise derives it from the
+ * linkedid group. No channel is looked up or locked.
+ *
+ * \param uniqueid Channel whose peer is wanted
+ * \param[out] buf Peer uniqueid, empty if there is no peer
+ * \param len Size of \a buf
+ * \param[out] generation Generation the answer is valid for
+ *
+ * \retval 0 on success
+ * \retval -1 if the channel is not indexed
+ */
+static int chan_index_resolve_peer(const char *uniqueid, char *buf, size_t len,
+	unsigned int *generation)
+{
+	struct bridgemon_chan *entry;
+	char linkedid[AST_MAX_UNIQUEID];
+
+	entry = ao2_find(chans_by_uniqueid, uniqueid, OBJ_SEARCH_KEY);
+	if (!entry) {
+		return -1;
+	}
+	ao2_lock(entry);
+	*generation = entry->generation;
+	ast_copy_string(buf, S_OR(entry->peer, ""), len);
+	ast_copy_string(linkedid, entry->linkedid, sizeof(linkedid));
+	ao2_unlock(entry);
+	ao2_ref(entry, -1);
+
+	if (!ast_strlen_zero(buf)) {
+		return 0;
+	}
+
+	if (strcmp(linkedid, uniqueid)) {
+		/* A dialed leg, its peer is the originator */
+		entry = ao2_find(chans_by_uniqueid, linkedid, OBJ_SEARCH_KEY);
+		if (entry) {
+			ast_copy_string(buf, entry->uniqueid, len);
+			ao2_ref(entry, -1);
+		}
+	} else if (!group_first_leg(linkedid, buf, len) && ao2_container_count(local_chains)) {
+		char leg[AST_MAX_UNIQUEID];
+
+		/* A dialed Local channel stands for whatever its chain reached */
+		ast_copy_string(leg, buf, sizeof(leg));
+		local_chain_cached(linkedid, leg, buf, len);
+	}
+	return 0;
+}
+
+/*!
+ * \internal
+ * \brief Resolve the peer of a channel, reusing the last answer
+ *
+ * The answer is kept on the index entry until its generation moves, so a
+ * repeated PEERID() costs one index lookup and never touches a channel.
+ *
+ * \retval 0 on success
+ * \retval -1 if the channel is not indexed
+ */
+static int chan_index_cached_peer(const char *uniqueid, char *buf, size_t len)
+{
+	struct bridgemon_chan *entry;
+	char peer[PEER_LIST_LEN];
+	unsigned int generation;
+
+	entry = ao2_find(chans_by_uniqueid, uniqueid, OBJ_SEARCH_KEY);
+	if (!entry) {
+		return -1;
+	}
+	ao2_lock(entry);
+	if (entry->peerid && entry->peerid_generation == entry->generation) {
+		ast_copy_string(buf, entry->peerid, len);
+		ao2_unlock(entry);
+		ao2_ref(entry, -1);
+		return 0;
+	}
+	ao2_unlock(entry);
+
+	if (chan_index_resolve_peer(uniqueid, peer, sizeof(peer), &generation)) {
+		/* Removed from the index in the meantime */
+		ao2_ref(entry, -1);
+		return -1;
+	}
+	ao2_lock(entry);
+	/* Only while still current, a concurrent change may have moved it on */
+	if (generation == entry->generation) {
+		if (!entry->peerid || strcmp(entry->peerid, peer)) {
+			ast_free(entry->peerid);
+			entry->peerid = ast_strdup(peer);
+		}
+		entry->peerid_generation = generation;
+	}
+	ao2_unlock(entry);
+	ao2_ref(entry, -1);
+
+	ast_copy_string(buf, peer, len);
+	return 0;
+}
+
+/*!
+ * \internal
+ * \brief Get a reference to a live channel by uniqueid
+ *
+ * The index resolves the uniqueid to the current channel name so the core
+ * lookup goes through the channel name hash. A uniqueid that is not indexed
+ * is not looked for in the core, which could only find it by scanning every
+ * channel: the index is seeded at load and fed by every snapshot, and a
+ * channel the snapshot router has not reached yet is waited for by
+ * FindPeer() w() instead.
+ *
+ * \retval NULL if the channel does not exist
+ * \retval non-NULL reffed channel
+ */
+static struct ast_channel *chan_index_get_channel(const char *uniqueid)
+{
+	struct bridgemon_chan *entry;
+	struct ast_channel *chan = NULL;
+	char name[AST_CHANNEL_NAME];
+
+	if (negcache_check(uniqueid)) {
+		return NULL;
+	}
+
+	entry = ao2_find(chans_by_uniqueid, uniqueid, OBJ_SEARCH_KEY);
+	if (entry) {
+		ao2_lock(entry);
+		ast_copy_string(name, entry->name, sizeof(name));
+		ao2_unlock(entry);
+		ao2_ref(entry, -1);
+
+		chan = ast_channel_get_by_name(name);
+		if (chan && strcmp(ast_channel_uniqueid(chan), uniqueid)) {
+			chan = ast_channel_unref(chan);
+		}
+		if (chan) {
+			return chan;
+		}
+	}
+
+	negcache_add(uniqueid);
+	/* Indexed meanwhile, its invalidation may have come first */
+	entry = ao2_find(chans_by_uniqueid, uniqueid, OBJ_SEARCH_KEY);
+	if (entry) {
+		negcache_invalidate(uniqueid);
+		ao2_ref(entry, -1);
+	}
+	return NULL;
+}
+
+/*!
+ * \internal
+ * \brief Set or clear the stasis mode monitor flag of a channel
+ *
+ * \retval previous value of the flag
+ * \retval -1 if the channel could not be indexed
+ */
+static int chan_index_set_monitored(struct ast_channel *chan, int monitored)
+{
+	struct bridgemon_chan *entry;
+	int was;
+
+	entry = ao2_find(chans_by_uniqueid, ast_channel_uniqueid(chan), OBJ_SEARCH_KEY);
+	if (!entry && monitored) {
+		ast_channel_lock(chan);
+		chan_index_update(ast_channel_uniqueid(chan), ast_channel_linkedid(chan),
+			ast_channel_name(chan));
+		ast_channel_unlock(chan);
+		entry = ao2_find(chans_by_uniqueid, ast_channel_uniqueid(chan), OBJ_SEARCH_KEY);
+	}
+	if (!entry) {
+		return -1;
+	}
+	ao2_lock(entry);
+	was = entry->monitored;
+	entry->monitored = monitored;
+	ao2_unlock(entry);
+	ao2_ref(entry, -1);
+	return was;
+}
+
+/*!
+ * \internal
+ * \brief Whether bridge events should tag a channel's peers
+ *
+ * True for channels BridgeMon() runs on in stasis mode and for channels the
+ * autotag options matched.
+ */
+static int chan_index_is_monitored(const char *uniqueid)
+{
+	struct bridgemon_chan *entry;
+	int monitored;
+
+	entry = ao2_find(chans_by_uniqueid, uniqueid, OBJ_SEARCH_KEY);
+	if (!entry) {
+		return 0;
+	}
+	ao2_lock(entry);
+	monitored = entry->monitored || entry->autotag;
+	ao2_unlock(entry);
+	ao2_ref(entry, -1);
+	return monitored;
+}
+
+static void chan_index_set_autotag(const char *uniqueid, int autotag)
+{
+	struct bridgemon_chan *entry;
+
+	entry = ao2_find(chans_by_uniqueid, uniqueid, OBJ_SEARCH_KEY);
+	if (entry) {
+		ao2_lock(entry);
+		entry->autotag = autotag;
+		ao2_unlock(entry);
+		ao2_ref(entry, -1);
+	}
+}
+
+/*! \brief Whether \a value is one of the comma separated \a list */
+static int autotag_list_match(const char *list, const char *value, int nocase)
+{
+	size_t len = strlen(value);
+
+	while (*list) {
+		size_t item = strcspn(list, ",");
+
+		if (item == len && !(nocase ? strncasecmp(list, value, len) : strncmp(list, value, len))) {
+			return 1;
+		}
+		list += item + (list[item] == ',');
+	}
+	return 0;
+}
+
+/*!
+ * \internal
+ * \brief Whether a channel is tagged by the autotag options
+ *
+ * Checked against the snapshot carried by the bridge event, so neither the
+ * channel nor the dialplan is touched.
+ */
+static int autotag_match(const struct ast_channel_snapshot *snapshot)
+{
+	int match;
+
+	if (!autotag_enabled) {
+		return 0;
+	}
+	ast_mutex_lock(&autotag_lock);
+	match = (ast_strlen_zero(autotag_contexts)
+			|| autotag_list_match(autotag_contexts, snapshot->dialplan->context, 0))
+		&& (ast_strlen_zero(autotag_techs)
+			|| autotag_list_match(autotag_techs, snapshot->base->type, 1));
+	ast_mutex_unlock(&autotag_lock);
+	return match;
+}
+
+static void channel_snapshot_cb(void *data attribute_unused,
+	struct stasis_subscription *sub attribute_unused, struct stasis_message *message)
+{
+	struct ast_channel_snapshot_update *update = stasis_message_data(message);
+	struct ast_channel_snapshot *old_snapshot = update->old_snapshot;
+	struct ast_channel_snapshot *new_snapshot = update->new_snapshot;
+
+	if (ast_test_flag(&new_snapshot->flags, AST_FLAG_DEAD)) {
+		chan_index_remove(new_snapshot->base->uniqueid);
+		return;
+	}
+
+	if (old_snapshot
+		&& !strcmp(old_snapshot->peer->linkedid, new_snapshot->peer->linkedid)
+		&& !strcmp(old_snapshot->base->name, new_snapshot->base->name)) {
+		/* Nothing the index cares about has changed */
+		return;
+	}
+
+	chan_index_update(new_snapshot->base->uniqueid, new_snapshot->peer->linkedid,
+		new_snapshot->base->name);
+}
+
+/*! \brief Seed the index with the channels that existed before the module loaded */
+static void chan_index_populate(void)
+{
+	struct ast_channel_iterator *iter;
+	struct ast_channel *chan;
+
+	iter = ast_channel_iterator_all_new();
+	if (!iter) {
+		return;
+	}
+	for (; (chan = ast_channel_iterator_next(iter)); ast_channel_unref(chan)) {
+		ast_channel_lock(chan);
+		chan_index_update(ast_channel_uniqueid(chan), ast_channel_linkedid(chan),
+			ast_channel_name(chan));
+		ast_channel_unlock(chan);
+	}
+	ast_channel_iterator_destroy(iter);
+}
+
+static uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*! \brief Start timing a stage, a no-op without \a timing */
+static uint64_t timing_start(struct findpeer_timing *timing)
+{
+	return timing ? stats_now() : 0;
+}
+
+/*!
+ * \brief Add the time since \a start to a stage
+ *
+ * \return The current time, to start the next stage from
+ */
+static uint64_t timing_stop(struct findpeer_timing *timing, enum findpeer_stage stage,
+	uint64_t start)
+{
+	uint64_t now;
+
+	if (!timing) {
+		return 0;
+	}
+	now = stats_now();
+	timing->stage_ns[stage] += now - start;
+	timing->timed |= 1 << stage;
+	return now;
+}
+
+static unsigned int stats_bucket(uint64_t ns)
+{
+	unsigned int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+
+	return MIN(bucket, STATS_BUCKETS - 1U);
+}
+
+/*! \brief Add a FindPeer() call to the calling thread's stripe */
+static void stats_record(const struct findpeer_timing *timing)
+{
+	struct stats_stripe *stripe = &findpeer_stats[ast_get_tid() % STATS_STRIPES];
+	int stage;
+
+	for (stage = 0; stage < STAGE_COUNT; stage++) {
+		struct stats_histogram *histogram = &stripe->stages[stage];
+		uint64_t ns = timing->stage_ns[stage];
+		uint64_t max;
+
+		if (!(timing->timed & (1 << stage))) {
+			continue;
+		}
+		ast_atomic_fetch_add(&histogram->buckets[stats_bucket(ns)], 1, __ATOMIC_RELAXED);
+		ast_atomic_fetch_add(&histogram->sum_ns, ns, __ATOMIC_RELAXED);
+		max = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+		while (ns > max && !__atomic_compare_exchange_n(&histogram->max_ns, &max, ns, 1,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		}
+	}
+}
+
+/*! \brief Sum the stripes into one histogram per stage */
+static void stats_merge(struct stats_histogram merged[STAGE_COUNT])
+{
+	int stripe;
+	int stage;
+	int bucket;
+
+	memset(merged, 0, sizeof(*merged) * STAGE_COUNT);
+	for (stripe = 0; stripe < STATS_STRIPES; stripe++) {
+		for (stage = 0; stage < STAGE_COUNT; stage++) {
+			struct stats_histogram *histogram = &findpeer_stats[stripe].stages[stage];
+			uint64_t max = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+
+			for (bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+				merged[stage].buckets[bucket] +=
+					__atomic_load_n(&histogram->buckets[bucket], __ATOMIC_RELAXED);
+			}
+			merged[stage].sum_ns += __atomic_load_n(&histogram->sum_ns, __ATOMIC_RELAXED);
+			merged[stage].max_ns = MAX(merged[stage].max_ns, max);
+		}
+	}
+}
+
+static uint64_t stats_count(const struct stats_histogram *histogram)
+{
+	uint64_t count = 0;
+	int bucket;
+
+	for (bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+		count += histogram->buckets[bucket];
+	}
+	return count;
+}
+
+/*!
+ * \brief Upper bound of the bucket holding a percentile
+ *
+ * \param histogram Merged histogram
+ * \param p Percentile between 0 and 1
+ *
+ * \return The bound in ns, capped at the largest value seen
+ */
+static uint64_t stats_percentile(const struct stats_histogram *histogram, double p)
+{
+	uint64_t count = stats_count(histogram);
+	uint64_t rank = count * p;
+	uint64_t seen = 0;
+	int bucket;
+
+	for (bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+		seen += histogram->buckets[bucket];
+		if (seen > rank) {
+			break;
+		}
+	}
+	if (!count || !bucket) {
+		return 0;
+	}
+	return bucket == STATS_BUCKETS - 1 ? histogram->max_ns
+		: MIN(1ULL << bucket, histogram->max_ns);
+}
+
+/*! \brief Print a duration in ns with a readable unit */
+static const char *stats_format(char *buf, size_t len, uint64_t ns)
+{
+	if (ns < 1000) {
+		snprintf(buf, len, "%" PRIu64 " ns", ns);
+	} else if (ns < 1000000) {
+		snprintf(buf, len, "%.1f us", ns / 1e3);
+	} else if (ns < 1000000000) {
+		snprintf(buf, len, "%.1f ms", ns / 1e6);
+	} else {
+		snprintf(buf, len, "%.1f s", ns / 1e9);
+	}
+	return buf;
+}
+
+/*!
+ * \brief Record a verbose message without formatting it
+ *
+ * Called on the hot path instead of ast_verb(). The entry is copied into
+ * the ring of the calling thread's stripe and written out later by the
+ * drain thread. Threads sharing a stripe take tickets, and a writer lapped
+ * by the ring drops its entry rather than share a slot with another one.
+ */
+static void peerlog_record(enum peerlog_type type, const char *chan, const char *uniqueid,
+	const char *peer)
+{
+	struct peerlog_stripe *stripe = &peerlog[ast_get_tid() % PEERLOG_STRIPES];
+	uint64_t ticket = ast_atomic_fetch_add(&stripe->head, 1, __ATOMIC_RELAXED);
+	struct peerlog_slot *slot = &stripe->slots[ticket % PEERLOG_STRIPE_SIZE];
+	uint64_t claim = 2 * ticket + 1;
+	uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+
+	/*
+	 * Readers see the slot as unfinished until the final sequence is stored.
+	 * If an earlier ticket is still being written to it, or a later one has
+	 * taken it, the entry is dropped and the drain counts it lost.
+	 */
+	do {
+		if ((seq & 1) || seq > claim) {
+			return;
+		}
+	} while (!__atomic_compare_exchange_n(&slot->seq, &seq, claim, 1,
+		__ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->entry.when = ast_tvnow();
+	slot->entry.type = type;
+	ast_copy_string(slot->entry.chan, S_OR(chan, ""), sizeof(slot->entry.chan));
+	ast_copy_string(slot->entry.uniqueid, S_OR(uniqueid, ""), sizeof(slot->entry.uniqueid));
+	ast_copy_string(slot->entry.peer, S_OR(peer, ""), sizeof(slot->entry.peer));
+	__atomic_store_n(&slot->seq, claim + 1, __ATOMIC_RELEASE);
+}
+
+/*!
+ * \brief Copy an entry out of a ring
+ *
+ * \retval 0 on success
+ * \retval 1 if the entry is still being written, or was dropped by its writer
+ * \retval -1 if it has been overwritten
+ */
+static int peerlog_read(struct peerlog_stripe *stripe, uint64_t ticket,
+	struct peerlog_entry *entry)
+{
+	struct peerlog_slot *slot = &stripe->slots[ticket % PEERLOG_STRIPE_SIZE];
+	uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+	if (seq != 2 * ticket + 2) {
+		return seq < 2 * ticket + 2 ? 1 : -1;
+	}
+	memcpy(entry, &slot->entry, sizeof(*entry));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+		return -1;
+	}
+	entry->chan[sizeof(entry->chan) - 1] = '\0';
+	entry->uniqueid[sizeof(entry->uniqueid) - 1] = '\0';
+	entry->peer[sizeof(entry->peer) - 1] = '\0';
+	return 0;
+}
+
+static int peerlog_cmp(const void *a, const void *b)
+{
+	const struct peerlog_entry *left = a;
+	const struct peerlog_entry *right = b;
+
+	return ast_tvcmp(left->when, right->when);
+}
+
+static void peerlog_format(const struct peerlog_entry *entry, char *buf, size_t len)
+{
+	switch (entry->type) {
+	case PEERLOG_EMPTY_LINKEDID:
+		snprintf(buf, len, "FindPeer: [%s] empty linkedid, skipping", entry->chan);
+		break;
+	case PEERLOG_NO_PEER:
+		snprintf(buf, len, "FindPeer: [%s] no peer found. skipping", entry->chan);
+		break;
+	case PEERLOG_FOUND:
+		snprintf(buf, len, "FindPeer4: bridge found peer=%s, bridgepeerid=%s",
+			entry->peer, entry->uniqueid);
+		break;
+	case PEERLOG_BRIDGED:
+		snprintf(buf, len, "BridgeMon: [%s] bridged with peer=%s", entry->chan, entry->peer);
+		break;
+	case PEERLOG_TYPE_COUNT:
+		*buf = '\0';
+		break;
+	}
+}
+
+/*! \brief Start a new rate limit second, reporting what the last one held back */
+static void peerlog_window(time_t now)
+{
+	int type;
+
+	if (now <= peerlog_drain.window) {
+		return;
+	}
+	for (type = 0; type < PEERLOG_TYPE_COUNT; type++) {
+		if (peerlog_drain.held[type]) {
+			ast_verb(2, "FindPeer: suppressed %u '%s' messages\n",
+				peerlog_drain.held[type], peerlog_names[type]);
+		}
+		peerlog_drain.written[type] = 0;
+		peerlog_drain.held[type] = 0;
+	}
+	peerlog_drain.window = now;
+}
+
+/*! \brief Write an entry to the verbose log unless its type is over the rate limit */
+static void peerlog_write(const struct peerlog_entry *entry)
+{
+	char buf[256];
+
+	peerlog_window(entry->when.tv_sec);
+	if (peerlog_rate && peerlog_drain.written[entry->type] >= peerlog_rate) {
+		peerlog_drain.held[entry->type]++;
+		peerlog_drain.suppressed[entry->type]++;
+		return;
+	}
+	peerlog_drain.written[entry->type]++;
+	peerlog_format(entry, buf, sizeof(buf));
+	ast_verb(2, "%s\n", buf);
+}
+
+/*!
+ * \brief Write out everything recorded since the last drain, oldest first
+ *
+ * Only called from the drain thread, or once it has been joined.
+ */
+static void peerlog_flush(void)
+{
+	static struct peerlog_entry entries[PEERLOG_STRIPES * PEERLOG_STRIPE_SIZE];
+	size_t count = 0;
+	size_t i;
+
+	for (i = 0; i < PEERLOG_STRIPES; i++) {
+		struct peerlog_stripe *stripe = &peerlog[i];
+		uint64_t head = __atomic_load_n(&stripe->head, __ATOMIC_ACQUIRE);
+		uint64_t ticket = stripe->drained;
+
+		if (head - ticket > PEERLOG_STRIPE_SIZE) {
+			peerlog_drain.lost += head - ticket - PEERLOG_STRIPE_SIZE;
+			ticket = head - PEERLOG_STRIPE_SIZE;
+		}
+		for (; ticket < head; ticket++) {
+			int res = peerlog_read(stripe, ticket, &entries[count]);
+
+			if (res > 0) {
+				if (stripe->stalled != ticket + 1) {
+					/* Picked up on the next pass */
+					stripe->stalled = ticket + 1;
+					break;
+				}
+				/* Still unfinished a whole pass later, its writer dropped it */
+				res = -1;
+			}
+			if (res) {
+				peerlog_drain.lost++;
+			} else {
+				count++;
+			}
+		}
+		stripe->drained = ticket;
+	}
+
+	qsort(entries, count, sizeof(*entries), peerlog_cmp);
+	for (i = 0; i < count; i++) {
+		peerlog_write(&entries[i]);
+	}
+	peerlog_window(ast_tvnow().tv_sec);
+}
+
+static void *peerlog_drain_thread(void *data attribute_unused)
+{
+	ast_mutex_lock(&peerlog_drain.lock);
+	while (!peerlog_drain.stop) {
+		struct timeval wake = ast_tvadd(ast_tvnow(), ast_tv(0, PEERLOG_DRAIN_MS * 1000));
+		struct timespec ts = {
+			.tv_sec = wake.tv_sec,
+			.tv_nsec = wake.tv_usec * 1000,
+		};
+
+		ast_cond_timedwait(&peerlog_drain.cond, &peerlog_drain.lock, &ts);
+		ast_mutex_unlock(&peerlog_drain.lock);
+		peerlog_flush();
+		ast_mutex_lock(&peerlog_drain.lock);
+	}
+	ast_mutex_unlock(&peerlog_drain.lock);
+	return NULL;
+}
+
+static int peerlog_start(void)
+{
+	memset(peerlog, 0, sizeof(peerlog));
+	ast_mutex_init(&peerlog_drain.lock);
+	ast_cond_init(&peerlog_drain.cond, NULL);
+	peerlog_drain.stop = 0;
+	if (ast_pthread_create_background(&peerlog_drain.thread, NULL, peerlog_drain_thread, NULL)) {
+		peerlog_drain.thread = AST_PTHREADT_NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static void peerlog_stop(void)
+{
+	if (peerlog_drain.thread == AST_PTHREADT_NULL) {
+		return;
+	}
+	ast_mutex_lock(&peerlog_drain.lock);
+	peerlog_drain.stop = 1;
+	ast_cond_signal(&peerlog_drain.cond);
+	ast_mutex_unlock(&peerlog_drain.lock);
+	pthread_join(peerlog_drain.thread, NULL);
+	peerlog_drain.thread = AST_PTHREADT_NULL;
+
+	/* Whatever was recorded after the last pass */
+	peerlog_flush();
+	ast_cond_destroy(&peerlog_drain.cond);
+	ast_mutex_destroy(&peerlog_drain.lock);
+}
+
+/*!
+ * \brief Set BRIDGEPEERID on \a chan
+ *
+ * \param timing Accumulates the lock wait and setvar time, may be NULL
+ */
+static void set_bridgepeerid(struct ast_channel *chan, const char *peerid,
+	struct findpeer_timing *timing)
+{
+	uint64_t start = timing_start(timing);
+
+	ast_channel_lock(chan);
+	start = timing_stop(timing, STAGE_LOCKWAIT, start);
+	pbx_builtin_setvar_helper(chan, "BRIDGEPEERID", peerid);
+	timing_stop(timing, STAGE_SETVAR, start);
+	ast_channel_unlock(chan);
+}
+
+/*!
+ * \internal
+ * \brief Record the peer of a channel and set BRIDGEPEERID if configured
+ *
+ * \param uniqueid Channel being tagged
+ * \param chan The channel if the caller already holds a reference, else NULL
+ * \param peerid Uniqueid of its peer
+ * \param timing Accumulates the time spent per stage, may be NULL
+ *
+ * \retval 0 on success
+ * \retval -1 if the channel does not exist
+ */
+static int tag_peer(const char *uniqueid, struct ast_channel *chan, const char *peerid,
+	struct findpeer_timing *timing)
+{
+	RAII_VAR(struct ast_channel *, found, NULL, ast_channel_cleanup);
+	uint64_t start = timing_start(timing);
+	int recorded;
+
+	recorded = !chan_index_set_peer(uniqueid, peerid);
+	if (recorded && !setvar_enabled) {
+		timing_stop(timing, STAGE_LOOKUP, start);
+		return 0;
+	}
+
+	if (!chan) {
+		chan = found = chan_index_get_channel(uniqueid);
+		if (!chan) {
+			timing_stop(timing, STAGE_LOOKUP, start);
+			return -1;
+		}
+	}
+
+	if (!recorded) {
+		/* The caller holds a channel the snapshot router has not reached yet */
+		ast_channel_lock(chan);
+		chan_index_update(uniqueid, ast_channel_linkedid(chan), ast_channel_name(chan));
+		ast_channel_unlock(chan);
+		chan_index_set_peer(uniqueid, peerid);
+	}
+	timing_stop(timing, STAGE_LOOKUP, start);
+
+	if (setvar_enabled) {
+		set_bridgepeerid(chan, peerid, timing);
+	}
+	return 0;
+}
+
+/*!
+ * \internal
+ * \brief Tag every member of a bridge with the uniqueids of the others
+ *
+ * \param ids Member uniqueids
+ * \param chans Member channels in the same order, NULL to look them up
+ * \param count Number of members
+ */
+static void roster_tag(const char * const *ids, struct ast_channel * const *chans, size_t count)
+{
+	struct ast_str *others;
+	size_t i;
+	size_t j;
+
+	if (count < 2) {
+		/* A lone channel keeps its last peer, like BRIDGEPEER does */
+		return;
+	}
+	if (count > MAX_ROSTER) {
+		ast_debug(1, "BridgeMon: not tagging roster of %zu channels\n", count);
+		return;
+	}
+
+	others = ast_str_create(count * 32);
+	if (!others) {
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		ast_str_reset(others);
+		for (j = 0; j < count; j++) {
+			if (j != i) {
+				ast_str_append(&others, 0, "%s%s",
+					ast_str_strlen(others) ? "," : "", ids[j]);
+			}
+		}
+		tag_peer(ids[i], chans ? chans[i] : NULL, ast_str_buffer(others), NULL);
+	}
+	ast_free(others);
+}
+
+/*!
+ * \internal
+ * \brief Tag every member of a live bridge with the others
+ *
+ * \param bridge Bridge to read the roster of, must not be locked
+ * \param leaving Channel on its way out to leave off the roster, or NULL
+ */
+static void roster_tag_bridge(struct ast_bridge *bridge, struct ast_channel *leaving)
+{
+	struct ao2_container *members;
+	struct ao2_iterator iter;
+	struct ast_channel *chans[MAX_ROSTER + 1];
+	const char *ids[MAX_ROSTER + 1];
+	struct ast_channel *member;
+	size_t count = 0;
+	size_t i;
+
+	members = ast_bridge_peers(bridge);
+	if (!members) {
+		return;
+	}
+
+	iter = ao2_iterator_init(members, 0);
+	while ((member = ao2_iterator_next(&iter))) {
+		if (member == leaving || count == ARRAY_LEN(chans)) {
+			ast_channel_unref(member);
+			continue;
+		}
+		chans[count] = member;
+		ids[count++] = ast_channel_uniqueid(member);
+	}
+	ao2_iterator_destroy(&iter);
+	ao2_ref(members, -1);
+
+	roster_tag(ids, chans, count);
+
+	for (i = 0; i < count; i++) {
+		ast_channel_unref(chans[i]);
+	}
+}
+
+enum findpeer_option_flags {
+	OPT_WAIT = (1 << 0),
+};
+
+enum findpeer_option_args {
+	OPT_ARG_WAIT,
+	/* note: this entry _MUST_ be the last one in the enum */
+	OPT_ARG_ARRAY_SIZE,
+};
+
+AST_APP_OPTIONS(findpeer_opts, {
+	AST_APP_OPTION_ARG('w', OPT_WAIT, OPT_ARG_WAIT),
+});
+
+/*!
+ * \internal
+ * \brief Wait for the linkedid channel to exist and tag it
+ *
+ * The channel services its own frames while parked so media and hangups are
+ * handled, and is woken by the index as soon as the peer is created.
+ *
+ * \retval 0 if the peer was tagged
+ * \retval 1 on timeout
+ * \retval -1 if the channel hung up
+ */
+static int findpeer_wait(struct ast_channel *chan, const char *linkedid, int timeout_ms,
+	struct findpeer_timing *timing)
+{
+	struct peer_waiter *waiter;
+	struct timeval start = ast_tvnow();
+	int res = 1;
+
+	waiter = ao2_alloc_options(sizeof(*waiter), waiter_destroy, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!waiter) {
+		return 1;
+	}
+	if (ast_alertpipe_init(waiter->alert_pipe)) {
+		ao2_ref(waiter, -1);
+		return 1;
+	}
+	ast_copy_string(waiter->uniqueid, linkedid, sizeof(waiter->uniqueid));
+	ao2_link(waiters, waiter);
+
+	/* Registered before checking again, a creation in between wakes us */
+	for (;;) {
+		int fd = ast_alertpipe_readfd(waiter->alert_pipe);
+		int outfd = -1;
+		int ms;
+		struct ast_channel *winner;
+		struct ast_frame *f;
+
+		if (!tag_peer(linkedid, NULL, ast_channel_uniqueid(chan), timing)) {
+			res = 0;
+			break;
+		}
+
+		ms = timeout_ms - ast_tvdiff_ms(ast_tvnow(), start);
+		if (ms <= 0) {
+			break;
+		}
+
+		winner = ast_waitfor_nandfds(&chan, 1, &fd, 1, NULL, &outfd, &ms);
+		if (outfd == fd) {
+			ast_alertpipe_read(waiter->alert_pipe);
+		} else if (winner) {
+			f = ast_read(chan);
+			if (!f) {
+				res = -1;
+				break;
+			}
+			ast_frfree(f);
+		}
+	}
+
+	ao2_unlink(waiters, waiter);
+	ao2_ref(waiter, -1);
+	return res;
+}
+
+/*! \brief FindPeer() itself, timed stage by stage into \a timing */
+static int findpeer_run(struct ast_channel *chan, const char *data,
+	struct findpeer_timing *timing)
+{
+	struct ast_flags flags = { 0 };
+	char *opts[OPT_ARG_ARRAY_SIZE] = { NULL, };
+	char *parse;
+	int timeout_ms = 0;
+	int res;
+	AST_DECLARE_APP_ARGS(args,
+		AST_APP_ARG(options);
+	);
+
+	parse = ast_strdupa(S_OR(data, ""));
+	AST_STANDARD_APP_ARGS(args, parse);
+	if (!ast_strlen_zero(args.options)
+		&& ast_app_parse_options(findpeer_opts, &flags, opts, args.options)) {
+		return 0;
+	}
+	if (ast_test_flag(&flags, OPT_WAIT)) {
+		double timeout;
+
+		if (ast_strlen_zero(opts[OPT_ARG_WAIT])
+			|| sscanf(opts[OPT_ARG_WAIT], "%30lf", &timeout) != 1 || timeout < 0) {
+			ast_log(LOG_WARNING, "FindPeer: invalid wait timeout '%s'\n",
+				S_OR(opts[OPT_ARG_WAIT], ""));
+		} else {
+			timeout_ms = timeout * 1000;
+		}
+	}
+
+	if (ast_strlen_zero(ast_channel_linkedid(chan))) {
+		peerlog_record(PEERLOG_EMPTY_LINKEDID, ast_channel_name(chan),
+			ast_channel_uniqueid(chan), NULL);
+		return 0;
+	}
+
+	if (resolve_mode == BRIDGEMON_RESOLVE_BRIDGE) {
+		struct ast_bridge *bridge;
+
+		ast_channel_lock(chan);
+		bridge = ast_channel_get_bridge(chan);
+		ast_channel_unlock(chan);
+		if (bridge) {
+			roster_tag_bridge(bridge, NULL);
+			ao2_ref(bridge, -1);
+			if (ast_test_flag(&flags, OPT_WAIT)) {
+				pbx_builtin_setvar_helper(chan, "FINDPEERSTATUS", "FOUND");
+			}
+			return 0;
+		}
+	}
+
+	const char *linkedid = ast_strdupa(ast_channel_linkedid(chan));
+	char endpoint[AST_MAX_UNIQUEID];
+	const char *peerid = ast_channel_uniqueid(chan);
+
+	if (local_name(ast_channel_name(chan))
+		&& !local_chain_resolve(chan, linkedid, endpoint, sizeof(endpoint))) {
+		peerid = endpoint;
+	}
+	res = tag_peer(linkedid, NULL, peerid, timing) ? 1 : 0;
+	if (res && ast_test_flag(&flags, OPT_WAIT)) {
+		res = findpeer_wait(chan, linkedid, timeout_ms, timing);
+		if (res < 0) {
+			return -1;
+		}
+	}
+	if (ast_test_flag(&flags, OPT_WAIT)) {
+		pbx_builtin_setvar_helper(chan, "FINDPEERSTATUS", res ? "TIMEOUT" : "FOUND");
+	}
+	if (res) {
+		peerlog_record(PEERLOG_NO_PEER, ast_channel_name(chan),
+			ast_channel_uniqueid(chan), linkedid);
+		return 0;
+	}
+	peerlog_record(PEERLOG_FOUND, ast_channel_name(chan),
+		ast_channel_uniqueid(chan), linkedid);
+	return 0;
+}
+
+static int findpeer_exec(struct ast_channel *chan, const char *data)
+{
+	struct findpeer_timing timing = { .timed = 0, };
+	uint64_t start;
+	int res;
+
+	if (!chan)
+		return 0;
+
+	start = timing_start(&timing);
+	res = findpeer_run(chan, data, &timing);
+	timing_stop(&timing, STAGE_TOTAL, start);
+	stats_record(&timing);
+	return res;
+}
+
+static int peerid_read(struct ast_channel *chan, const char *cmd, char *data,
+	char *buf, size_t len)
+{
+	*buf = '\0';
+
+	if (ast_strlen_zero(data)) {
+		if (!chan) {
+			ast_log(LOG_WARNING, "%s requires a channel or a uniqueid\n", cmd);
+			return -1;
+		}
+		data = (char *) ast_channel_uniqueid(chan);
+	}
+	chan_index_cached_peer(data, buf, len);
+	return 0;
+}
+
+static struct ast_custom_function peerid_function = {
+	.name = "PEERID",
+	.read = peerid_read,
+};
+
+static int peerids_read(struct ast_channel *chan, const char *cmd, char *data,
+	char *buf, size_t len)
+{
+	const char *linkedid = data;
+
+	if (ast_strlen_zero(linkedid)) {
+		if (!chan) {
+			ast_log(LOG_WARNING, "%s requires a channel or a linkedid\n", cmd);
+			return -1;
+		}
+		linkedid = ast_strdupa(ast_channel_linkedid(chan));
+	}
+	group_read(linkedid, buf, len, !strcasecmp(cmd, "PEERCOUNT"));
+	return 0;
+}
+
+static struct ast_custom_function peerids_function = {
+	.name = "PEERIDS",
+	.read = peerids_read,
+};
+
+static struct ast_custom_function peercount_function = {
+	.name = "PEERCOUNT",
+	.read = peerids_read,
+};
+
+/*!
+ * \brief State of a BridgeMon() monitor
+ *
+ * Shared between the channel datastore and the join hook. Stopping a monitor
+ * only clears \ref active; the hook removes itself the next time it fires.
+ * Each monitor holds a reference on the module, so it cannot be unloaded
+ * while its hooks or datastore are still attached to a channel.
+ */
+struct bridgemon_monitor {
+	/*! Non-zero while the monitor should tag peers */
+	int active;
+};
+
+static void bridgemon_monitor_destroy(void *obj attribute_unused)
+{
+	ast_module_unref(ast_module_info->self);
+}
+
+static void bridgemon_datastore_destroy(void *data)
+{
+	ao2_cleanup(data);
+}
+
+static const struct ast_datastore_info bridgemon_datastore = {
+	.type = "bridgemon",
+	.destroy = bridgemon_datastore_destroy,
+};
+
+static void bridgemon_hook_pvt_destroy(void *hook_pvt)
+{
+	ao2_cleanup(hook_pvt);
+}
+
+/*!
+ * \internal
+ * \brief Tag both sides of a two party bridge with each other's uniqueid
+ *
+ * Both channels are tagged because whichever channel joined first had no
+ * peer to see when its own join hook ran.
+ */
+static void bridgemon_tag_peer(struct ast_bridge *bridge, struct ast_channel *chan)
+{
+	RAII_VAR(struct ast_channel *, peer, ast_bridge_peer(bridge, chan), ast_channel_cleanup);
+
+	if (!peer) {
+		ast_debug(1, "BridgeMon: [%s] no two party peer in bridge\n",
+			ast_channel_name(chan));
+		return;
+	}
+	peerlog_record(PEERLOG_BRIDGED, ast_channel_name(chan),
+		ast_channel_uniqueid(chan), ast_channel_uniqueid(peer));
+	tag_peer(ast_channel_uniqueid(chan), chan, ast_channel_uniqueid(peer), NULL);
+	tag_peer(ast_channel_uniqueid(peer), peer, ast_channel_uniqueid(chan), NULL);
+}
+
+static int bridgemon_join_cb(struct ast_bridge_channel *bridge_channel, void *hook_pvt)
+{
+	struct bridgemon_monitor *monitor = hook_pvt;
+
+	if (!monitor->active) {
+		/* Returning non-zero removes the hook */
+		return -1;
+	}
+	if (resolve_mode == BRIDGEMON_RESOLVE_BRIDGE) {
+		roster_tag_bridge(bridge_channel->bridge, NULL);
+	} else {
+		bridgemon_tag_peer(bridge_channel->bridge, bridge_channel->chan);
+	}
+	return 0;
+}
+
+static int bridgemon_leave_cb(struct ast_bridge_channel *bridge_channel, void *hook_pvt)
+{
+	struct bridgemon_monitor *monitor = hook_pvt;
+
+	if (!monitor->active) {
+		return -1;
+	}
+	if (resolve_mode == BRIDGEMON_RESOLVE_BRIDGE) {
+		/* The channel is still on the roster while its leave hooks run */
+		roster_tag_bridge(bridge_channel->bridge, bridge_channel->chan);
+	}
+	return 0;
+}
+
+/*!
+ * \internal
+ * \brief Attach the join hook to a channel
+ *
+ * \pre chan is locked
+ *
+ * \retval 0 on success, including when the hook is already attached
+ * \retval -1 on error
+ */
+static int bridgemon_hook_attach(struct ast_channel *chan)
+{
+	struct ast_datastore *datastore;
+	struct bridgemon_monitor *monitor;
+	struct ast_bridge_features *features;
+
+	if (ast_channel_datastore_find(chan, &bridgemon_datastore, NULL)) {
+		return 0;
+	}
+
+	monitor = ao2_alloc_options(sizeof(*monitor), bridgemon_monitor_destroy,
+		AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (monitor) {
+		ast_module_ref(ast_module_info->self);
+	}
+	datastore = ast_datastore_alloc(&bridgemon_datastore, NULL);
+	features = ast_bridge_features_new();
+	if (!monitor || !datastore || !features) {
+		goto failure;
+	}
+	monitor->active = 1;
+
+	if (ast_bridge_join_hook(features, bridgemon_join_cb, ao2_bump(monitor),
+		bridgemon_hook_pvt_destroy, 0)) {
+		ao2_ref(monitor, -1);
+		goto failure;
+	}
+	if (ast_bridge_leave_hook(features, bridgemon_leave_cb, ao2_bump(monitor),
+		bridgemon_hook_pvt_destroy, 0)) {
+		ao2_ref(monitor, -1);
+		goto failure;
+	}
+	if (ast_channel_feature_hooks_append(chan, features)) {
+		goto failure;
+	}
+	ast_bridge_features_destroy(features);
+
+	datastore->data = monitor;
+	ast_channel_datastore_add(chan, datastore);
+	return 0;
+
+failure:
+	ast_bridge_features_destroy(features);
+	if (datastore) {
+		ast_datastore_free(datastore);
+	}
+	ao2_cleanup(monitor);
+	return -1;
+}
+
+/*!
+ * \internal
+ * \brief Start monitoring bridge joins on a channel
+ *
+ * \retval 0 on success, including when the channel is already monitored
+ * \retval -1 on error
+ */
+static int bridgemon_start(struct ast_channel *chan)
+{
+	struct ast_bridge *bridge;
+	int res;
+
+	if (monitor_mode == BRIDGEMON_MODE_STASIS) {
+		res = chan_index_set_monitored(chan, 1) < 0 ? -1 : 0;
+		ast_channel_lock(chan);
+	} else {
+		ast_channel_lock(chan);
+		res = bridgemon_hook_attach(chan);
+	}
+	if (res) {
+		ast_channel_unlock(chan);
+		return -1;
+	}
+
+	/* Joins are only seen from now on, catch up if already bridged */
+	bridge = ast_channel_get_bridge(chan);
+	ast_channel_unlock(chan);
+
+	if (bridge) {
+		if (resolve_mode == BRIDGEMON_RESOLVE_BRIDGE) {
+			roster_tag_bridge(bridge, NULL);
+		} else {
+			bridgemon_tag_peer(bridge, chan);
+		}
+		ao2_ref(bridge, -1);
+	}
+	return 0;
+}
+
+/*!
+ * \internal
+ * \brief Stop monitoring bridge joins on a channel
+ *
+ * \retval 0 on success
+ * \retval -1 if the channel was not being monitored
+ */
+static int bridgemon_stop(struct ast_channel *chan)
+{
+	struct ast_datastore *datastore;
+	struct bridgemon_monitor *monitor;
+	int flagged;
+
+	/* The mode may have changed since the monitor started, check both */
+	flagged = chan_index_set_monitored(chan, 0) > 0;
+
+	ast_channel_lock(chan);
+	datastore = ast_channel_datastore_find(chan, &bridgemon_datastore, NULL);
+	if (!datastore) {
+		ast_channel_unlock(chan);
+		return flagged ? 0 : -1;
+	}
+	monitor = datastore->data;
+	monitor->active = 0;
+	ast_channel_datastore_remove(chan, datastore);
+	ast_channel_unlock(chan);
+
+	ast_datastore_free(datastore);
+	return 0;
+}
+
+/*! \brief Get the shard serializing work for a key */
+static struct ast_taskprocessor *shard_get(const char *key)
+{
+	return shards[ast_str_hash(key) % shard_count];
+}
+
+/*!
+ * \internal
+ * \brief Tag the roster of a bridge snapshot if any member is monitored
+ *
+ * The snapshot is taken after the channel entered or left, so it is the
+ * roster as it stands after the event.
+ */
+static void roster_tag_snapshot(struct ast_bridge_snapshot *snapshot)
+{
+	const char *ids[MAX_ROSTER + 1];
+	struct ao2_iterator iter;
+	size_t count = 0;
+	int monitored = 0;
+	char *id;
+
+	iter = ao2_iterator_init(snapshot->channels, 0);
+	for (; (id = ao2_iterator_next(&iter)); ao2_ref(id, -1)) {
+		if (count < ARRAY_LEN(ids)) {
+			ids[count++] = ast_strdupa(id);
+			monitored |= chan_index_is_monitored(id);
+		}
+	}
+	ao2_iterator_destroy(&iter);
+
+	if (monitored) {
+		roster_tag(ids, NULL, count);
+	}
+}
+
+/*!
+ * \internal
+ * \brief Resolve peers for a channel entering or leaving a bridge
+ *
+ * Runs on a shard, never on a bridge thread. Events are sharded by bridge in
+ * bridge resolve mode so roster updates for one bridge stay ordered, and by
+ * linkedid otherwise.
+ */
+static int bridge_event_task(void *data)
+{
+	struct stasis_message *message = data;
+	struct ast_bridge_blob *blob = stasis_message_data(message);
+	const char *uniqueid = blob->channel->base->uniqueid;
+	const char *peerid = NULL;
+	struct ao2_iterator iter;
+	char *id;
+
+	if (autotag_enabled) {
+		/* Remembered so the other members' events see it too */
+		chan_index_set_autotag(uniqueid, autotag_match(blob->channel));
+	}
+
+	if (resolve_mode == BRIDGEMON_RESOLVE_BRIDGE) {
+		roster_tag_snapshot(blob->bridge);
+		ao2_ref(message, -1);
+		return 0;
+	}
+
+	if (stasis_message_type(message) != ast_channel_entered_bridge_type()
+		|| ao2_container_count(blob->bridge->channels) != 2) {
+		ao2_ref(message, -1);
+		return 0;
+	}
+
+	iter = ao2_iterator_init(blob->bridge->channels, 0);
+	for (; (id = ao2_iterator_next(&iter)); ao2_ref(id, -1)) {
+		if (strcmp(id, uniqueid)) {
+			peerid = ast_strdupa(id);
+		}
+	}
+	ao2_iterator_destroy(&iter);
+
+	if (peerid && (chan_index_is_monitored(uniqueid) || chan_index_is_monitored(peerid))) {
+		peerlog_record(PEERLOG_BRIDGED, blob->channel->base->name, uniqueid, peerid);
+		tag_peer(uniqueid, NULL, peerid, NULL);
+		tag_peer(peerid, NULL, uniqueid, NULL);
+	}
+
+	ao2_ref(message, -1);
+	return 0;
+}
+
+static void bridge_event_cb(void *data attribute_unused,
+	struct stasis_subscription *sub attribute_unused, struct stasis_message *message)
+{
+	struct ast_bridge_blob *blob = stasis_message_data(message);
+	const char *key;
+
+	if (!blob->channel || !blob->bridge) {
+		return;
+	}
+	if (resolve_mode == BRIDGEMON_RESOLVE_BRIDGE) {
+		key = blob->bridge->uniqueid;
+	} else if (stasis_message_type(message) == ast_channel_entered_bridge_type()) {
+		key = blob->channel->peer->linkedid;
+	} else {
+		/* Leaving does not change a linkedid peer */
+		return;
+	}
+	if (ast_taskprocessor_push(shard_get(key), bridge_event_task, ao2_bump(message))) {
+		ao2_ref(message, -1);
+	}
+}
+
+/*! \brief Create the shard taskprocessors if they do not exist yet */
+static int shards_create(void)
+{
+	char name[AST_TASKPROCESSOR_MAX_NAME + 1];
+	unsigned int count = shards_configured;
+	unsigned int i;
+
+	if (shard_count) {
+		if (count && count != shard_count) {
+			ast_log(LOG_NOTICE, "BridgeMon: shards = %u takes effect on module load\n", count);
+		}
+		return 0;
+	}
+
+	if (!count) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		count = cpus > 0 ? cpus : 1;
+	}
+	if (count > MAX_SHARDS) {
+		count = MAX_SHARDS;
+	}
+
+	for (i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "app_bridgemon/shard-%02u", i);
+		shards[i] = ast_taskprocessor_get(name, TPS_REF_DEFAULT);
+		if (!shards[i]) {
+			break;
+		}
+	}
+	shard_count = i;
+	return shard_count ? 0 : -1;
+}
+
+static void shards_destroy(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < shard_count; i++) {
+		ast_taskprocessor_unreference(shards[i]);
+		shards[i] = NULL;
+	}
+	shard_count = 0;
+}
+
+/*! \brief Subscribe to or unsubscribe from the bridge topic to match the mode and autotag */
+static int bridge_router_apply(void)
+{
+	if (monitor_mode != BRIDGEMON_MODE_STASIS && !autotag_enabled) {
+		stasis_message_router_unsubscribe_and_join(bridge_router);
+		bridge_router = NULL;
+		return 0;
+	}
+	if (bridge_router) {
+		return 0;
+	}
+
+	if (shards_create()) {
+		return -1;
+	}
+	bridge_router = stasis_message_router_create(ast_bridge_topic_all());
+	if (!bridge_router) {
+		return -1;
+	}
+	if (stasis_message_router_add(bridge_router, ast_channel_entered_bridge_type(),
+			bridge_event_cb, NULL)
+		|| stasis_message_router_add(bridge_router, ast_channel_left_bridge_type(),
+			bridge_event_cb, NULL)) {
+		stasis_message_router_unsubscribe_and_join(bridge_router);
+		bridge_router = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/*! \brief A channel seen by a sweep */
+struct sweep_chan {
+	const char *linkedid;
+	/*! Uniqueid of the bridge the channel was in, empty if none */
+	const char *bridgeid;
+	char uniqueid[0];
+};
+
+/*! \brief A peer a sweep is going to record */
+struct sweep_assignment {
+	/*! Uniqueid of the channel being tagged */
+	char *target;
+	/*! Its peer uniqueid or roster */
+	char *peer;
+};
+
+AST_VECTOR(sweep_chans, struct sweep_chan *);
+AST_VECTOR(sweep_assignments, struct sweep_assignment);
+
+/*! \brief Completion tracking for a sweep spread across the shards */
+struct sweep_state {
+	ast_mutex_t lock;
+	ast_cond_t cond;
+	/*! Batches not finished yet */
+	int pending;
+	/*! Channels successfully tagged */
+	int tagged;
+};
+
+/*! \brief A slice of a sweep run on one shard */
+struct sweep_batch {
+	struct sweep_state *state;
+	struct sweep_assignment *assignments;
+	size_t count;
+};
+
+static struct sweep_chan *sweep_chan_alloc(const char *uniqueid, const char *linkedid,
+	const char *bridgeid)
+{
+	size_t uniqueid_len = strlen(uniqueid) + 1;
+	size_t linkedid_len = strlen(linkedid) + 1;
+	struct sweep_chan *item;
+
+	item = ast_malloc(sizeof(*item) + uniqueid_len + linkedid_len + strlen(bridgeid) + 1);
+	if (!item) {
+		return NULL;
+	}
+	strcpy(item->uniqueid, uniqueid); /* Safe */
+	item->linkedid = item->uniqueid + uniqueid_len;
+	strcpy((char *) item->linkedid, linkedid); /* Safe */
+	item->bridgeid = item->linkedid + linkedid_len;
+	strcpy((char *) item->bridgeid, bridgeid); /* Safe */
+	return item;
+}
+
+static int sweep_cmp_linkedid(const void *a, const void *b)
+{
+	const struct sweep_chan *left = *(const struct sweep_chan **) a;
+	const struct sweep_chan *right = *(const struct sweep_chan **) b;
+
+	return strcmp(left->linkedid, right->linkedid);
+}
+
+static int sweep_cmp_bridgeid(const void *a, const void *b)
+{
+	const struct sweep_chan *left = *(const struct sweep_chan **) a;
+	const struct sweep_chan *right = *(const struct sweep_chan **) b;
+
+	return strcmp(left->bridgeid, right->bridgeid);
+}
+
+static void sweep_assign(struct sweep_assignments *assignments, const char *target,
+	const char *peer)
+{
+	struct sweep_assignment assignment = {
+		.target = ast_strdup(target),
+		.peer = ast_strdup(peer),
+	};
+
+	if (!assignment.target || !assignment.peer
+		|| AST_VECTOR_APPEND(assignments, assignment)) {
+		ast_free(assignment.target);
+		ast_free(assignment.peer);
+	}
+}
+
+/*!
+ * \internal
+ * \brief Work out one linkedid group's assignment
+ *
+ * The originator is tagged once, with the leg it is bridged with if there is
+ * one, otherwise with its first leg.
+ */
+static void sweep_group_linkedid(struct sweep_assignments *assignments,
+	struct sweep_chan **run, size_t count)
+{
+	struct sweep_chan *originator = NULL;
+	struct sweep_chan *peer = NULL;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		if (!strcmp(run[i]->uniqueid, run[i]->linkedid)) {
+			originator = run[i];
+			break;
+		}
+	}
+	if (!originator) {
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		if (run[i] == originator) {
+			continue;
+		}
+		if (!ast_strlen_zero(originator->bridgeid)
+			&& !strcmp(run[i]->bridgeid, originator->bridgeid)) {
+			peer = run[i];
+			break;
+		}
+		if (!peer) {
+			peer = run[i];
+		}
+	}
+	if (peer) {
+		sweep_assign(assignments, originator->uniqueid, peer->uniqueid);
+	}
+}
+
+/*! \brief Work out the roster assignments of one bridge */
+static void sweep_group_bridge(struct sweep_assignments *assignments,
+	struct sweep_chan **run, size_t count)
+{
+	struct ast_str *others;
+	size_t i;
+	size_t j;
+
+	if (ast_strlen_zero(run[0]->bridgeid) || count < 2 || count > MAX_ROSTER) {
+		return;
+	}
+	others = ast_str_create(count * 32);
+	if (!others) {
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		ast_str_reset(others);
+		for (j = 0; j < count; j++) {
+			if (j != i) {
+				ast_str_append(&others, 0, "%s%s",
+					ast_str_strlen(others) ? "," : "", run[j]->uniqueid);
+			}
+		}
+		sweep_assign(assignments, run[i]->uniqueid, ast_str_buffer(others));
+	}
+	ast_free(others);
+}
+
+static int sweep_batch_task(void *data)
+{
+	struct sweep_batch *batch = data;
+	int tagged = 0;
+	size_t i;
+
+	for (i = 0; i < batch->count; i++) {
+		tagged += !tag_peer(batch->assignments[i].target, NULL, batch->assignments[i].peer, NULL);
+	}
+
+	ast_mutex_lock(&batch->state->lock);
+	batch->state->tagged += tagged;
+	if (!--batch->state->pending) {
+		ast_cond_signal(&batch->state->cond);
+	}
+	ast_mutex_unlock(&batch->state->lock);
+	ast_free(batch);
+	return 0;
+}
+
+/*!
+ * \internal
+ * \brief Record the peers of every live channel in one pass
+ *
+ * \param parallel Spread the tagging across the shard taskprocessors
+ * \param[out] channels Number of channels seen
+ * \param[out] elapsed_ms Time taken
+ *
+ * \return Number of channels tagged
+ */
+static int sweep_run(int parallel, int *channels, long long *elapsed_ms)
+{
+	struct timeval start = ast_tvnow();
+	struct sweep_chans chans;
+	struct sweep_assignments assignments;
+	struct ast_channel_iterator *iter;
+	struct ast_channel *chan;
+	struct sweep_state state = { .pending = 0, };
+	int by_bridge = resolve_mode == BRIDGEMON_RESOLVE_BRIDGE;
+	size_t i;
+	size_t j;
+
+	*channels = 0;
+	*elapsed_ms = 0;
+	if (AST_VECTOR_INIT(&chans, 256) || AST_VECTOR_INIT(&assignments, 128)) {
+		AST_VECTOR_FREE(&chans);
+		return 0;
+	}
+
+	/* The only walk over the channel container */
+	iter = ast_channel_iterator_all_new();
+	for (; iter && (chan = ast_channel_iterator_next(iter)); ast_channel_unref(chan)) {
+		struct ast_bridge *bridge;
+		struct sweep_chan *item;
+
+		ast_channel_lock(chan);
+		bridge = ast_channel_get_bridge(chan);
+		chan_index_update(ast_channel_uniqueid(chan), ast_channel_linkedid(chan),
+			ast_channel_name(chan));
+		item = sweep_chan_alloc(ast_channel_uniqueid(chan), ast_channel_linkedid(chan),
+			bridge ? bridge->uniqueid : "");
+		ast_channel_unlock(chan);
+		ao2_cleanup(bridge);
+
+		if (item && AST_VECTOR_APPEND(&chans, item)) {
+			ast_free(item);
+		}
+	}
+	if (iter) {
+		ast_channel_iterator_destroy(iter);
+	}
+	*channels = AST_VECTOR_SIZE(&chans);
+
+	/* Group by sorting, then work out one set of assignments per group */
+	qsort(chans.elems, AST_VECTOR_SIZE(&chans), sizeof(struct sweep_chan *),
+		by_bridge ? sweep_cmp_bridgeid : sweep_cmp_linkedid);
+	for (i = 0; i < AST_VECTOR_SIZE(&chans); i = j) {
+		const char *key = by_bridge
+			? AST_VECTOR_GET(&chans, i)->bridgeid : AST_VECTOR_GET(&chans, i)->linkedid;
+
+		for (j = i + 1; j < AST_VECTOR_SIZE(&chans); j++) {
+			struct sweep_chan *item = AST_VECTOR_GET(&chans, j);
+
+			if (strcmp(by_bridge ? item->bridgeid : item->linkedid, key)) {
+				break;
+			}
+		}
+		if (by_bridge) {
+			sweep_group_bridge(&assignments, &chans.elems[i], j - i);
+		} else {
+			sweep_group_linkedid(&assignments, &chans.elems[i], j - i);
+		}
+	}
+
+	if (parallel && AST_VECTOR_SIZE(&assignments) && !shards_create()) {
+		size_t per_batch = (AST_VECTOR_SIZE(&assignments) + shard_count - 1) / shard_count;
+
+		ast_mutex_init(&state.lock);
+		ast_cond_init(&state.cond, NULL);
+
+		ast_mutex_lock(&state.lock);
+		for (i = 0, j = 0; i < AST_VECTOR_SIZE(&assignments); i += per_batch, j++) {
+			struct sweep_batch *batch = ast_calloc(1, sizeof(*batch));
+
+			if (!batch) {
+				continue;
+			}
+			batch->state = &state;
+			batch->assignments = &assignments.elems[i];
+			batch->count = MIN(per_batch, AST_VECTOR_SIZE(&assignments) - i);
+			state.pending++;
+			if (ast_taskprocessor_push(shards[j % shard_count], sweep_batch_task, batch)) {
+				/* Run it here instead, the lock is recursive */
+				sweep_batch_task(batch);
+			}
+		}
+		while (state.pending) {
+			ast_cond_wait(&state.cond, &state.lock);
+		}
+		ast_mutex_unlock(&state.lock);
+
+		ast_cond_destroy(&state.cond);
+		ast_mutex_destroy(&state.lock);
+	} else {
+		for (i = 0; i < AST_VECTOR_SIZE(&assignments); i++) {
+			struct sweep_assignment *assignment = AST_VECTOR_GET_ADDR(&assignments, i);
+
+			state.tagged += !tag_peer(assignment->target, NULL, assignment->peer, NULL);
+		}
+	}
+
+	for (i = 0; i < AST_VECTOR_SIZE(&assignments); i++) {
+		ast_free(AST_VECTOR_GET(&assignments, i).target);
+		ast_free(AST_VECTOR_GET(&assignments, i).peer);
+	}
+	AST_VECTOR_FREE(&assignments);
+	AST_VECTOR_CALLBACK_VOID(&chans, ast_free);
+	AST_VECTOR_FREE(&chans);
+
+	*elapsed_ms = ast_tvdiff_ms(ast_tvnow(), start);
+	return state.tagged;
+}
+
+/*!
+ * \internal
+ * \brief Get the channel an application, CLI or AMI request refers to
+ *
+ * \param chan Channel the request runs on, may be NULL
+ * \param id Uniqueid or name of the target, empty for \a chan itself
+ *
+ * \retval NULL if there is no such channel
+ * \retval non-NULL reffed channel
+ */
+static struct ast_channel *bridgemon_target_get(struct ast_channel *chan, const char *id)
+{
+	if (ast_strlen_zero(id)) {
+		return chan ? ast_channel_ref(chan) : NULL;
+	}
+	if (chan && !strcmp(id, ast_channel_uniqueid(chan))) {
+		return ast_channel_ref(chan);
+	}
+	/* Channel names always carry a technology, the core finds those by hash */
+	if (strchr(id, '/')) {
+		return ast_channel_get_by_name(id);
+	}
+	return chan_index_get_channel(id);
+}
+
+static int bridgemon_exec(struct ast_channel *chan, const char *data)
+{
+	RAII_VAR(struct ast_channel *, target, bridgemon_target_get(chan, data), ast_channel_cleanup);
+
+	if (!target) {
+		ast_log(LOG_WARNING, "BridgeMon: no channel with uniqueid '%s'\n", data);
+		return 0;
+	}
+	if (bridgemon_start(target)) {
+		ast_log(LOG_WARNING, "BridgeMon: [%s] unable to attach bridge hook\n",
+			ast_channel_name(target));
+	}
+	return 0;
+}
+
+static int stopbridgemon_exec(struct ast_channel *chan, const char *data)
+{
+	RAII_VAR(struct ast_channel *, target, bridgemon_target_get(chan, data), ast_channel_cleanup);
+
+	if (!target) {
+		ast_log(LOG_WARNING, "StopBridgeMon: no channel with uniqueid '%s'\n", data);
+		return 0;
+	}
+	if (bridgemon_stop(target)) {
+		ast_debug(1, "StopBridgeMon: [%s] not monitored\n", ast_channel_name(target));
+	}
+	return 0;
+}
+
+static char *handle_cli_bridgemon_start_stop(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	RAII_VAR(struct ast_channel *, target, NULL, ast_channel_cleanup);
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "bridgemon {start|stop}";
+		e->usage =
+			"Usage: bridgemon {start|stop} <channel>\n"
+			"       Start or stop setting BRIDGEPEERID on <channel> when it joins\n"
+			"       a bridge. <channel> is a channel name or uniqueid.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return ast_complete_channels(a->line, a->word, a->pos, a->n, 2);
+	}
+
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
+
+	target = bridgemon_target_get(NULL, a->argv[2]);
+	if (!target) {
+		ast_cli(a->fd, "No channel named '%s' found\n", a->argv[2]);
+		return CLI_SUCCESS;
+	}
+
+	if (!strcasecmp(a->argv[1], "start")) {
+		if (bridgemon_start(target)) {
+			ast_cli(a->fd, "Unable to monitor %s\n", ast_channel_name(target));
+		} else {
+			ast_cli(a->fd, "Monitoring %s\n", ast_channel_name(target));
+		}
+	} else if (bridgemon_stop(target)) {
+		ast_cli(a->fd, "%s is not being monitored\n", ast_channel_name(target));
+	} else {
+		ast_cli(a->fd, "Stopped monitoring %s\n", ast_channel_name(target));
+	}
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_findpeer_show_cache(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "findpeer show cache";
+		e->usage =
+			"Usage: findpeer show cache\n"
+			"       Show the negative lookup cache used when a peer does not exist yet.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
+
+	ast_cli(a->fd, "TTL:           %u ms%s\n", negcache_ttl, negcache_ttl ? "" : " (disabled)");
+	ast_cli(a->fd, "Entries:       %d\n", ao2_container_count(negcache));
+	ast_cli(a->fd, "Hits:          %d\n", negcache_stats.hits);
+	ast_cli(a->fd, "Misses:        %d\n", negcache_stats.misses);
+	ast_cli(a->fd, "Invalidations: %d\n", negcache_stats.invalidations);
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_findpeer_show_stats(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct stats_histogram merged[STAGE_COUNT];
+	char values[5][16];
+	int stage;
+	int bucket;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "findpeer show stats";
+		e->usage =
+			"Usage: findpeer show stats\n"
+			"       Show FindPeer() latency, split into the peer lookup, the wait\n"
+			"       for the channel lock and setting BRIDGEPEERID. Percentiles are\n"
+			"       the upper bounds of power of two buckets.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
+
+	stats_merge(merged);
+	ast_cli(a->fd, "%-9s %10s %10s %10s %10s %10s %10s\n",
+		"Stage", "Count", "Mean", "p50", "p99", "p99.9", "Max");
+	for (stage = 0; stage < STAGE_COUNT; stage++) {
+		uint64_t count = stats_count(&merged[stage]);
+
+		ast_cli(a->fd, "%-9s %10" PRIu64 " %10s %10s %10s %10s %10s\n",
+			stage_names[stage], count,
+			stats_format(values[0], sizeof(values[0]), count ? merged[stage].sum_ns / count : 0),
+			stats_format(values[1], sizeof(values[1]), stats_percentile(&merged[stage], 0.50)),
+			stats_format(values[2], sizeof(values[2]), stats_percentile(&merged[stage], 0.99)),
+			stats_format(values[3], sizeof(values[3]), stats_percentile(&merged[stage], 0.999)),
+			stats_format(values[4], sizeof(values[4]), merged[stage].max_ns));
+	}
+
+	ast_cli(a->fd, "\n%-10s %10s %10s %10s %10s\n",
+		"Below", stage_names[STAGE_LOOKUP], stage_names[STAGE_LOCKWAIT],
+		stage_names[STAGE_SETVAR], stage_names[STAGE_TOTAL]);
+	for (bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+		uint64_t row = 0;
+
+		for (stage = 0; stage < STAGE_COUNT; stage++) {
+			row += merged[stage].buckets[bucket];
+		}
+		if (!row) {
+			continue;
+		}
+		if (bucket == STATS_BUCKETS - 1) {
+			snprintf(values[0], sizeof(values[0]), "more");
+		} else {
+			stats_format(values[0], sizeof(values[0]), 1ULL << bucket);
+		}
+		ast_cli(a->fd, "%-10s %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+			values[0], merged[STAGE_LOOKUP].buckets[bucket],
+			merged[STAGE_LOCKWAIT].buckets[bucket], merged[STAGE_SETVAR].buckets[bucket],
+			merged[STAGE_TOTAL].buckets[bucket]);
+	}
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_findpeer_show_log(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct peerlog_entry *entries;
+	unsigned int wanted = 20;
+	size_t count = 0;
+	size_t i;
+	int type;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "findpeer show log";
+		e->usage =
+			"Usage: findpeer show log [count]\n"
+			"       Show the last messages recorded by FindPeer and BridgeMon,\n"
+			"       20 by default, including those the rate limit kept out of\n"
+			"       the verbose log.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc == 4 && (sscanf(a->argv[3], "%30u", &wanted) != 1 || !wanted)) {
+		return CLI_SHOWUSAGE;
+	}
+	if (a->argc != 3 && a->argc != 4) {
+		return CLI_SHOWUSAGE;
+	}
+
+	entries = ast_calloc(PEERLOG_STRIPES * PEERLOG_STRIPE_SIZE, sizeof(*entries));
+	if (!entries) {
+		return CLI_FAILURE;
+	}
+	for (i = 0; i < PEERLOG_STRIPES; i++) {
+		uint64_t head = __atomic_load_n(&peerlog[i].head, __ATOMIC_ACQUIRE);
+		uint64_t ticket = head > PEERLOG_STRIPE_SIZE ? head - PEERLOG_STRIPE_SIZE : 0;
+
+		for (; ticket < head; ticket++) {
+			count += !peerlog_read(&peerlog[i], ticket, &entries[count]);
+		}
+	}
+	qsort(entries, count, sizeof(*entries), peerlog_cmp);
+
+	for (i = count > wanted ? count - wanted : 0; i < count; i++) {
+		struct ast_tm tm;
+		char when[32];
+		char buf[256];
+
+		ast_localtime(&entries[i].when, &tm, NULL);
+		ast_strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+		peerlog_format(&entries[i], buf, sizeof(buf));
+		ast_cli(a->fd, "[%s.%06ld] %s\n", when, (long) entries[i].when.tv_usec, buf);
+	}
+	ast_free(entries);
+
+	ast_cli(a->fd, "\nRate limit: %u per type per second%s\n", peerlog_rate,
+		peerlog_rate ? "" : " (disabled)");
+	ast_cli(a->fd, "Lost before written out: %" PRIu64 "\n", peerlog_drain.lost);
+	for (type = 0; type < PEERLOG_TYPE_COUNT; type++) {
+		ast_cli(a->fd, "Suppressed '%s': %" PRIu64 "\n", peerlog_names[type],
+			peerlog_drain.suppressed[type]);
+	}
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_findpeer_show_feed(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	size_t i;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "findpeer show feed";
+		e->usage =
+			"Usage: findpeer show feed\n"
+			"       Show the subscribers of the peer change feed, how many\n"
+			"       records each was sent or lost to a full queue, and how\n"
+			"       far behind each is.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
+
+	ast_mutex_lock(&feed.lock);
+	if (!feed.ring) {
+		ast_mutex_unlock(&feed.lock);
+		ast_cli(a->fd, "Peer feed is not enabled\n");
+		return CLI_SUCCESS;
+	}
+	ast_cli(a->fd, "Socket: %s\nQueue: %zu records\nRecords: %" PRIu64 "\n\n",
+		feed.path, feed.ring_len, feed.head);
+	ast_cli(a->fd, "%-6s %12s %12s %8s\n", "FD", "Sent", "Dropped", "Lag");
+	for (i = 0; i < AST_VECTOR_SIZE(&feed.subscribers); i++) {
+		struct feed_subscriber *sub = AST_VECTOR_GET(&feed.subscribers, i);
+
+		ast_cli(a->fd, "%-6d %12" PRIu64 " %12" PRIu64 " %8" PRIu64 "\n",
+			sub->fd, sub->sent, sub->dropped, feed.head - sub->next);
+	}
+	ast_cli(a->fd, "%zu subscriber(s)\n", AST_VECTOR_SIZE(&feed.subscribers));
+	ast_mutex_unlock(&feed.lock);
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_findpeer_show_events(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "findpeer show events";
+		e->usage =
+			"Usage: findpeer show events\n"
+			"       Show how many peer changes were coalesced into how many\n"
+			"       BridgePeers manager events.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
+
+	ast_mutex_lock(&peerevent.lock);
+	ast_cli(a->fd, "BridgePeers events: %s, %u ms window\n",
+		peerevent_enabled ? "enabled" : "disabled", peerevent_window);
+	ast_cli(a->fd, "Peer changes: %" PRIu64 "\n", peerevent.changes);
+	ast_cli(a->fd, "Channels listed: %" PRIu64 "\n", peerevent.listed);
+	ast_cli(a->fd, "Events sent: %" PRIu64 "\n", peerevent.events);
+	ast_cli(a->fd, "Linkedids pending: %zu\n", AST_VECTOR_SIZE(&peerevent.pending));
+	ast_mutex_unlock(&peerevent.lock);
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_findpeer_sweep(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	long long elapsed_ms;
+	int channels;
+	int tagged;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "findpeer sweep [parallel]";
+		e->usage =
+			"Usage: findpeer sweep [parallel]\n"
+			"       Tag the peer of every live channel in a single pass over the\n"
+			"       channel list, as FindPeer would. With 'parallel' the tagging\n"
+			"       is spread across the module's shard taskprocessors.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc == 3 && strcasecmp(a->argv[2], "parallel")) {
+		return CLI_SHOWUSAGE;
+	}
+	if (a->argc != 2 && a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
+
+	tagged = sweep_run(a->argc == 3, &channels, &elapsed_ms);
+	ast_cli(a->fd, "Tagged %d peers across %d channels in %lld ms\n",
+		tagged, channels, elapsed_ms);
+	return CLI_SUCCESS;
+}
+
+static struct ast_cli_entry cli_bridgemon[] = {
+	AST_CLI_DEFINE(handle_cli_bridgemon_start_stop, "Start or stop monitoring a channel's bridge peer"),
+	AST_CLI_DEFINE(handle_cli_findpeer_show_cache, "Show FindPeer negative lookup cache statistics"),
+	AST_CLI_DEFINE(handle_cli_findpeer_show_stats, "Show FindPeer latency histograms"),
+	AST_CLI_DEFINE(handle_cli_findpeer_show_log, "Show the last FindPeer and BridgeMon messages"),
+	AST_CLI_DEFINE(handle_cli_findpeer_show_feed, "Show peer change feed subscribers"),
+	AST_CLI_DEFINE(handle_cli_findpeer_show_events, "Show BridgePeers event coalescing"),
+	AST_CLI_DEFINE(handle_cli_findpeer_sweep, "Tag the peers of every live channel"),
+};
+
+/*! \brief Resolve the ChannelID or Channel header of a manager action */
+static struct ast_channel *manager_target_get(const struct message *m)
+{
+	const char *id = astman_get_header(m, "ChannelID");
+
+	if (ast_strlen_zero(id)) {
+		id = astman_get_header(m, "Channel");
+	}
+	if (ast_strlen_zero(id)) {
+		return NULL;
+	}
+	return bridgemon_target_get(NULL, id);
+}
+
+static int manager_bridgemon_start(struct mansession *s, const struct message *m)
+{
+	RAII_VAR(struct ast_channel *, target, manager_target_get(m), ast_channel_cleanup);
+
+	if (!target) {
+		astman_send_error(s, m, "No such channel");
+		return AMI_SUCCESS;
+	}
+	if (bridgemon_start(target)) {
+		astman_send_error(s, m, "Could not start monitoring channel");
+		return AMI_SUCCESS;
+	}
+	astman_send_ack(s, m, "Started monitoring channel");
+	return AMI_SUCCESS;
+}
+
+static int manager_bridgemon_stop(struct mansession *s, const struct message *m)
+{
+	RAII_VAR(struct ast_channel *, target, manager_target_get(m), ast_channel_cleanup);
+
+	if (!target) {
+		astman_send_error(s, m, "No such channel");
+		return AMI_SUCCESS;
+	}
+	if (bridgemon_stop(target)) {
+		astman_send_error(s, m, "Channel is not being monitored");
+		return AMI_SUCCESS;
+	}
+	astman_send_ack(s, m, "Stopped monitoring channel");
+	return AMI_SUCCESS;
+}
+
+static int manager_findpeer_sweep(struct mansession *s, const struct message *m)
+{
+	long long elapsed_ms;
+	int channels;
+	int tagged;
+
+	tagged = sweep_run(ast_true(astman_get_header(m, "Parallel")), &channels, &elapsed_ms);
+
+	astman_start_ack(s, m);
+	astman_append(s,
+		"Channels: %d\r\n"
+		"Tagged: %d\r\n"
+		"Elapsed: %lld\r\n"
+		"\r\n",
+		channels, tagged, elapsed_ms);
+	return AMI_SUCCESS;
+}
+
+/*!
+ * \internal
+ * \brief Add the peer of one channel to a FindPeerBulk response
+ *
+ * \retval 0 if the channel is indexed
+ * \retval -1 otherwise
+ */
+static int bulk_resolve(struct ast_str **entries, const char *uniqueid, size_t *channels,
+	size_t *found)
+{
+	char peer[PEER_LIST_LEN];
+	unsigned int generation;
+
+	if (chan_index_resolve_peer(uniqueid, peer, sizeof(peer), &generation)) {
+		return -1;
+	}
+	ast_str_append(entries, 0, "UniqueID%zu: %s\r\nPeerID%zu: %s\r\n",
+		*channels, uniqueid, *channels, peer);
+	(*channels)++;
+	*found += !ast_strlen_zero(peer);
+	return 0;
+}
+
+static int manager_findpeer_bulk(struct mansession *s, const struct message *m)
+{
+	RAII_VAR(struct ast_str *, entries, ast_str_create(1024), ast_free);
+	RAII_VAR(struct ast_str *, missing, ast_str_create(64), ast_free);
+	struct bulk_ids members;
+	size_t requested = 0;
+	size_t channels = 0;
+	size_t found = 0;
+	unsigned int i;
+
+	if (!entries || !missing || AST_VECTOR_INIT(&members, 8)) {
+		astman_send_error(s, m, "Internal error");
+		return AMI_SUCCESS;
+	}
+
+	for (i = 0; i < m->hdrcount; i++) {
+		const char *header = m->headers[i];
+		char *list;
+		char *cur;
+		char *id;
+		int linkedid;
+
+		if (!strncasecmp(header, "UniqueID:", 9)) {
+			linkedid = 0;
+		} else if (!strncasecmp(header, "LinkedID:", 9)) {
+			linkedid = 1;
+		} else {
+			continue;
+		}
+		list = ast_strdup(header + 9);
+		for (cur = list; cur && (id = strsep(&cur, ","));) {
+			size_t j;
+
+			id = ast_strip(id);
+			if (ast_strlen_zero(id)) {
+				continue;
+			}
+			requested++;
+			if (!linkedid) {
+				if (bulk_resolve(&entries, id, &channels, &found)) {
+					ast_str_append(&missing, 0, "%s%s", ast_str_strlen(missing) ? "," : "", id);
+				}
+				continue;
+			}
+			if (group_members(id, &members)) {
+				ast_str_append(&missing, 0, "%s%s", ast_str_strlen(missing) ? "," : "", id);
+				continue;
+			}
+			for (j = 0; j < AST_VECTOR_SIZE(&members); j++) {
+				/* Gone since the group was read, leave it out */
+				bulk_resolve(&entries, AST_VECTOR_GET(&members, j), &channels, &found);
+			}
+			AST_VECTOR_RESET(&members, ast_free);
+		}
+		ast_free(list);
+	}
+	AST_VECTOR_FREE(&members);
+
+	if (!requested) {
+		astman_send_error(s, m, "UniqueID or LinkedID is required");
+		return AMI_SUCCESS;
+	}
+
+	astman_start_ack(s, m);
+	astman_append(s,
+		"Requested: %zu\r\n"
+		"Channels: %zu\r\n"
+		"Found: %zu\r\n",
+		requested, channels, found);
+	if (ast_str_strlen(missing)) {
+		astman_append(s, "Missing: %s\r\n", ast_str_buffer(missing));
+	}
+	astman_append(s, "%s\r\n", ast_str_buffer(entries));
+	return AMI_SUCCESS;
+}
+
+static int manager_findpeer_stats(struct mansession *s, const struct message *m)
+{
+	struct stats_histogram merged[STAGE_COUNT];
+	RAII_VAR(struct ast_str *, buckets, ast_str_create(STATS_BUCKETS * 4), ast_free);
+	int stage;
+	int bucket;
+
+	if (!buckets) {
+		astman_send_error(s, m, "Internal error");
+		return AMI_SUCCESS;
+	}
+	stats_merge(merged);
+
+	astman_start_ack(s, m);
+	for (stage = 0; stage < STAGE_COUNT; stage++) {
+		const char *name = stage_headers[stage];
+		uint64_t count = stats_count(&merged[stage]);
+
+		ast_str_reset(buckets);
+		for (bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+			ast_str_append(&buckets, 0, "%s%" PRIu64, bucket ? "," : "",
+				merged[stage].buckets[bucket]);
+		}
+		astman_append(s,
+			"%sCount: %" PRIu64 "\r\n"
+			"%sMean: %" PRIu64 "\r\n"
+			"%sP50: %" PRIu64 "\r\n"
+			"%sP99: %" PRIu64 "\r\n"
+			"%sP999: %" PRIu64 "\r\n"
+			"%sMax: %" PRIu64 "\r\n"
+			"%sHistogram: %s\r\n",
+			name, count,
+			name, count ? merged[stage].sum_ns / count : 0,
+			name, stats_percentile(&merged[stage], 0.50),
+			name, stats_percentile(&merged[stage], 0.99),
+			name, stats_percentile(&merged[stage], 0.999),
+			name, merged[stage].max_ns,
+			name, ast_str_buffer(buckets));
+	}
+	astman_append(s, "\r\n");
+	return AMI_SUCCESS;
+}
+
+/*! \brief Copy a comma separated list, dropping blanks and empty items */
+static void autotag_list_copy(char *buf, const char *value, size_t len)
+{
+	char *list = ast_strdupa(value);
+	char *item;
+
+	*buf = '\0';
+	while ((item = strsep(&list, ","))) {
+		size_t used = strlen(buf);
+
+		item = ast_strip(item);
+		if (!ast_strlen_zero(item)) {
+			snprintf(buf + used, len - used, "%s%s", used ? "," : "", item);
+		}
+	}
+}
+
+static int load_config(int reload)
+{
+	struct ast_flags config_flags = { reload ? CONFIG_FLAG_FILEUNCHANGED : 0 };
+	struct ast_config *cfg;
+	const char *value;
+	enum bridgemon_mode mode = BRIDGEMON_MODE_HOOK;
+	enum bridgemon_resolve resolve = BRIDGEMON_RESOLVE_LINKEDID;
+	unsigned int shards_value = 0;
+	int setvar = 1;
+	unsigned int ttl = 1000;
+	unsigned int log_rate = 20;
+	unsigned int table_slots = PEERTABLE_SLOTS;
+	const char *table_name = "";
+	unsigned int queue = FEED_QUEUE;
+	const char *feed_socket = "";
+	int events = 0;
+	unsigned int window = PEEREVENT_WINDOW;
+	int autotag = 0;
+	char contexts[sizeof(autotag_contexts)] = "";
+	char techs[sizeof(autotag_techs)] = "";
+
+	cfg = ast_config_load(config_file, config_flags);
+	if (cfg == CONFIG_STATUS_FILEUNCHANGED) {
+		return 0;
+	}
+	if (cfg == CONFIG_STATUS_FILEINVALID) {
+		ast_log(LOG_ERROR, "Config file %s is in an invalid format\n", config_file);
+		return -1;
+	}
+
+	if (cfg) {
+		if ((value = ast_variable_retrieve(cfg, "general", "mode"))) {
+			if (!strcasecmp(value, "stasis")) {
+				mode = BRIDGEMON_MODE_STASIS;
+			} else if (strcasecmp(value, "hook")) {
+				ast_log(LOG_WARNING, "Invalid mode '%s' in %s, using 'hook'\n",
+					value, config_file);
+			}
+		}
+		if ((value = ast_variable_retrieve(cfg, "general", "resolve"))) {
+			if (!strcasecmp(value, "bridge")) {
+				resolve = BRIDGEMON_RESOLVE_BRIDGE;
+			} else if (strcasecmp(value, "linkedid")) {
+				ast_log(LOG_WARNING, "Invalid resolve '%s' in %s, using 'linkedid'\n",
+					value, config_file);
+			}
+		}
+		if ((value = ast_variable_retrieve(cfg, "general", "shards"))
+			&& sscanf(value, "%30u", &shards_value) != 1) {
+			ast_log(LOG_WARNING, "Invalid shards '%s' in %s, using one per CPU\n",
+				value, config_file);
+			shards_value = 0;
+		}
+		if ((value = ast_variable_retrieve(cfg, "general", "setvar"))) {
+			setvar = ast_true(value);
+		}
+		if ((value = ast_variable_retrieve(cfg, "general", "negative_cache_ttl"))
+			&& sscanf(value, "%30u", &ttl) != 1) {
+			ast_log(LOG_WARNING, "Invalid negative_cache_ttl '%s' in %s, using 1000\n",
+				value, config_file);
+			ttl = 1000;
+		}
+		if ((value = ast_variable_retrieve(cfg, "general", "log_rate"))
+			&& sscanf(value, "%30u", &log_rate) != 1) {
+			ast_log(LOG_WARNING, "Invalid log_rate '%s' in %s, using 20\n",
+				value, config_file);
+			log_rate = 20;
+		}
+		if ((value = ast_variable_retrieve(cfg, "general", "peer_table"))) {
+			table_name = ast_strdupa(value);
+		}
+		if ((value = ast_variable_retrieve(cfg, "general", "peer_table_slots"))
+			&& (sscanf(value, "%30u", &table_slots) != 1 || table_slots < 16
+				|| table_slots > (1U << 24))) {
+			ast_log(LOG_WARNING, "Invalid peer_table_slots '%s' in %s, using %d\n",
+				value, config_file, PEERTABLE_SLOTS);
+			table_slots = PEERTABLE_SLOTS;
+		}
+		if ((value = ast_variable_retrieve(cfg, "general", "peer_feed"))) {
+			feed_socket = ast_strdupa(value);
+		}
+		if ((value = ast_variable_retrieve(cfg, "general", "peer_feed_queue"))
+			&& (sscanf(value, "%30u", &queue) != 1 || queue < 16 || queue > (1U << 20))) {
+			ast_log(LOG_WARNING, "Invalid peer_feed_queue '%s' in %s, using %d\n",
+				value, config_file, FEED_QUEUE);
+			queue = FEED_QUEUE;
+		}
+		if ((value = ast_variable_retrieve(cfg, "general", "peer_events"))) {
+			events = ast_true(value);
+		}
+		if ((value = ast_variable_retrieve(cfg, "general", "peer_event_window"))
+			&& (sscanf(value, "%30u", &window) != 1 || window > 1000)) {
+			ast_log(LOG_WARNING, "Invalid peer_event_window '%s' in %s, using %d\n",
+				value, config_file, PEEREVENT_WINDOW);
+			window = PEEREVENT_WINDOW;
+		}
+		if ((value = ast_variable_retrieve(cfg, "general", "autotag"))) {
+			autotag = ast_true(value);
+		}
+		if ((value = ast_variable_retrieve(cfg, "general", "autotag_context"))) {
+			autotag_list_copy(contexts, value, sizeof(contexts));
+		}
+		if ((value = ast_variable_retrieve(cfg, "general", "autotag_tech"))) {
+			autotag_list_copy(techs, value, sizeof(techs));
+		}
+		ast_config_destroy(cfg);
+	}
+
+	monitor_mode = mode;
+	resolve_mode = resolve;
+	shards_configured = shards_value;
+	setvar_enabled = setvar;
+	negcache_ttl = ttl;
+	peerlog_rate = log_rate;
+	peerevent_enabled = events;
+	peerevent_window = window;
+	ast_mutex_lock(&autotag_lock);
+	ast_copy_string(autotag_contexts, contexts, sizeof(autotag_contexts));
+	ast_copy_string(autotag_techs, techs, sizeof(autotag_techs));
+	ast_mutex_unlock(&autotag_lock);
+	autotag_enabled = autotag;
+	/* Round up to a power of two */
+	while (table_slots & (table_slots - 1)) {
+		table_slots += table_slots & -table_slots;
+	}
+	if (reload && (strcmp(table_name, peertable_name) || table_slots != peertable_slots)) {
+		ast_log(LOG_NOTICE, "BridgeMon: peer_table changes take effect on module load\n");
+	} else {
+		ast_copy_string(peertable_name, table_name, sizeof(peertable_name));
+		peertable_slots = table_slots;
+	}
+	if (reload && (strcmp(feed_socket, feed_path) || queue != feed_queue)) {
+		ast_log(LOG_NOTICE, "BridgeMon: peer_feed changes take effect on module load\n");
+	} else {
+		ast_copy_string(feed_path, feed_socket, sizeof(feed_path));
+		feed_queue = queue;
+	}
+	if (!ttl && negcache) {
+		ao2_callback(negcache, OBJ_MULTIPLE | OBJ_NODATA | OBJ_UNLINK, NULL, NULL);
+	}
+	return 0;
+}
+
+static int reload_module(void)
+{
+	if (load_config(1)) {
+		return -1;
+	}
+	return bridge_router_apply();
+}
+
+static int unload_module(void)
+{
+	int res;
+
+	ast_cli_unregister_multiple(cli_bridgemon, ARRAY_LEN(cli_bridgemon));
+	ast_manager_unregister("BridgeMon");
+	ast_manager_unregister("StopBridgeMon");
+	ast_manager_unregister("FindPeerSweep");
+	ast_manager_unregister("FindPeerStats");
+	ast_manager_unregister("FindPeerBulk");
+	res = ast_unregister_application(app);
+	res |= ast_custom_function_unregister(&peerid_function);
+	res |= ast_custom_function_unregister(&peerids_function);
+	res |= ast_custom_function_unregister(&peercount_function);
+	res |= ast_unregister_application(app_bridgemon);
+	res |= ast_unregister_application(app_stopbridgemon);
+
+	stasis_message_router_unsubscribe_and_join(bridge_router);
+	bridge_router = NULL;
+	shards_destroy();
+	peerlog_stop();
+	stasis_message_router_unsubscribe_and_join(chan_router);
+	chan_router = NULL;
+	peertable_destroy();
+	feed_stop();
+	peerevent_stop();
+	ao2_cleanup(groups);
+	groups = NULL;
+	ao2_cleanup(negcache);
+	negcache = NULL;
+	ao2_cleanup(waiters);
+	waiters = NULL;
+	ao2_cleanup(local_chains);
+	local_chains = NULL;
+	ao2_cleanup(chans_by_uniqueid);
+	chans_by_uniqueid = NULL;
+	ast_mutex_destroy(&feed.lock);
+	ast_mutex_destroy(&peertable.lock);
+
+	return res;
+}
+
+static int load_module(void)
+{
+	if (load_config(0)) {
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	memset(findpeer_stats, 0, sizeof(findpeer_stats));
+	memset(peerlog_drain.suppressed, 0, sizeof(peerlog_drain.suppressed));
+	peerlog_drain.lost = 0;
+	if (peerlog_start()) {
+		return AST_MODULE_LOAD_DECLINE;
+	}
+	/* Before the first failure path, unload_module() destroys them */
+	ast_mutex_init(&peertable.lock);
+	ast_mutex_init(&feed.lock);
+	if (peerevent_start()) {
+		unload_module();
+		return AST_MODULE_LOAD_DECLINE;
+	}
+	if (!ast_strlen_zero(peertable_name) && peertable_create(peertable_name, peertable_slots)) {
+		unload_module();
+		return AST_MODULE_LOAD_DECLINE;
+	}
+	if (!ast_strlen_zero(feed_path) && feed_start(feed_path, feed_queue)) {
+		unload_module();
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	chans_by_uniqueid = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_RWLOCK, 0,
+		CHAN_INDEX_BUCKETS, chan_uniqueid_hash, NULL, chan_uniqueid_cmp);
+	groups = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_RWLOCK, 0,
+		GROUP_BUCKETS, group_hash, NULL, group_cmp);
+	negcache = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_RWLOCK, 0,
+		NEGCACHE_BUCKETS, negcache_hash, NULL, negcache_cmp);
+	waiters = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0,
+		NEGCACHE_BUCKETS, waiter_hash, NULL, waiter_cmp);
+	local_chains = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_RWLOCK, 0,
+		LOCAL_CHAIN_BUCKETS, local_chain_hash, NULL, local_chain_cmp);
+	if (!chans_by_uniqueid || !groups || !negcache || !waiters || !local_chains) {
+		unload_module();
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	chan_router = stasis_message_router_create(ast_channel_topic_all());
+	if (!chan_router
+		|| stasis_message_router_add(chan_router, ast_channel_snapshot_type(),
+			channel_snapshot_cb, NULL)
+		|| stasis_message_router_add(chan_router, ast_local_optimization_end_type(),
+			local_optimization_cb, NULL)) {
+		unload_module();
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	/* Subscribe before seeding so no channel created in between is missed */
+	chan_index_populate();
+
+	if (bridge_router_apply()) {
+		unload_module();
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	if (ast_register_application_xml(app, findpeer_exec)
+		|| ast_register_application_xml(app_bridgemon, bridgemon_exec)
+		|| ast_register_application_xml(app_stopbridgemon, stopbridgemon_exec)
+		|| ast_custom_function_register(&peerid_function)
+		|| ast_custom_function_register(&peerids_function)
+		|| ast_custom_function_register(&peercount_function)
+		|| ast_cli_register_multiple(cli_bridgemon, ARRAY_LEN(cli_bridgemon))
+		|| ast_manager_register_xml("BridgeMon", EVENT_FLAG_CALL, manager_bridgemon_start)
+		|| ast_manager_register_xml("StopBridgeMon", EVENT_FLAG_CALL, manager_bridgemon_stop)
+		|| ast_manager_register_xml("FindPeerSweep", EVENT_FLAG_CALL, manager_findpeer_sweep)
+		|| ast_manager_register_xml("FindPeerStats", EVENT_FLAG_REPORTING, manager_findpeer_stats)
+		|| ast_manager_register_xml("FindPeerBulk", EVENT_FLAG_CALL, manager_findpeer_bulk)) {
+		unload_module();
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	return AST_MODULE_LOAD_SUCCESS;
 }
 
 AST_MODULE_INFO(
-	ASTERISK_GPL_KEY, 
+	ASTERISK_GPL_KEY,
 	AST_MODFLAG_DEFAULT,
-	"Find Peer application",
+	"Bridge peer monitor applications",
 	.support_level = AST_MODULE_SUPPORT_CORE,
 	.load = load_module,
 	.unload = unload_module,
+	.reload = reload_module,
 );
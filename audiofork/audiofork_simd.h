@@ -0,0 +1,302 @@
+/*
+ * app_audiofork sample kernels
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the COPYING file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Signed linear sample kernels of the AudioFork media path
+ *
+ * The framehook applies the v, V and W volumes while it copies each frame
+ * into the fork's ring. The volume maps to the factor
+ * ast_frame_adjust_volume() takes: a positive factor multiplies every sample
+ * and saturates at the 16 bit limits, a negative one divides by -factor and
+ * truncates toward zero, 0 copies.
+ *
+ * With the S option the worker interleaves the two directions of a fork
+ * into stereo frames, see audiofork_stereo.h.
+ *
+ * Every kernel gives the same output as its scalar version, the reference.
+ * On x86 there are SSE2 and AVX2 versions as well, built with target
+ * attributes so no special compiler flags are needed; audiofork_simd_best()
+ * picks the widest instruction set the CPU runs. The vector gain kernels
+ * divide only by powers of two, which is all the -4..4 volumes give, and fall
+ * back to the reference for any other divisor. Pointers need no particular
+ * alignment.
+ *
+ * The module and its tests include this header; nothing links against it.
+ */
+
+#ifndef _AUDIOFORK_SIMD_H
+#define _AUDIOFORK_SIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AUDIOFORK_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+/*! \brief Copy \a samples samples from \a src to \a dst, scaled by \a factor */
+typedef void (*audiofork_gain_fn)(int16_t *dst, const int16_t *src, size_t samples, int factor);
+
+/*! \brief Write \a samples frames of \a left and \a right to \a dst, left first */
+typedef void (*audiofork_interleave_fn)(int16_t *dst, const int16_t *left, const int16_t *right,
+	size_t samples);
+
+enum audiofork_simd_isa {
+	AUDIOFORK_SIMD_SCALAR,
+	AUDIOFORK_SIMD_SSE2,
+	AUDIOFORK_SIMD_AVX2,
+	AUDIOFORK_SIMD_ISAS,
+};
+
+/*! \brief Reference gain kernel, one sample at a time */
+static inline void audiofork_gain_scalar(int16_t *dst, const int16_t *src, size_t samples,
+	int factor)
+{
+	size_t i;
+
+	if (!factor) {
+		memcpy(dst, src, samples * sizeof(*dst));
+	} else if (factor > 0) {
+		for (i = 0; i < samples; i++) {
+			int value = src[i] * factor;
+
+			dst[i] = value > INT16_MAX ? INT16_MAX : value < INT16_MIN ? INT16_MIN : value;
+		}
+	} else {
+		for (i = 0; i < samples; i++) {
+			dst[i] = src[i] / -factor;
+		}
+	}
+}
+
+/*! \brief log2 of \a divisor, or -1 if it is not a power of two the kernels shift by */
+static inline int audiofork_gain_shift(int divisor)
+{
+	int shift = 0;
+
+	if (divisor <= 0 || divisor > 1 << 14 || (divisor & (divisor - 1))) {
+		return -1;
+	}
+	while (divisor >> (shift + 1)) {
+		shift++;
+	}
+	return shift;
+}
+
+/*! \brief Reference interleave kernel */
+static inline void audiofork_interleave_scalar(int16_t *dst, const int16_t *left,
+	const int16_t *right, size_t samples)
+{
+	size_t i;
+
+	for (i = 0; i < samples; i++) {
+		dst[2 * i] = left[i];
+		dst[2 * i + 1] = right[i];
+	}
+}
+
+#ifdef AUDIOFORK_SIMD_X86
+
+/*
+ * Multiplying: the 32 bit products are rebuilt from their low and high
+ * halves and packed back with signed saturation. Dividing: negative samples
+ * get divisor - 1 added before the arithmetic shift, which turns its
+ * rounding toward minus infinity into C's truncation toward zero.
+ */
+
+__attribute__((target("sse2")))
+static inline void audiofork_gain_sse2(int16_t *dst, const int16_t *src, size_t samples,
+	int factor)
+{
+	size_t i = 0;
+
+	if (factor > 0 && factor <= INT16_MAX) {
+		const __m128i mul = _mm_set1_epi16((int16_t) factor);
+
+		for (; i + 8 <= samples; i += 8) {
+			__m128i in = _mm_loadu_si128((const __m128i *) (src + i));
+			__m128i lo = _mm_mullo_epi16(in, mul);
+			__m128i hi = _mm_mulhi_epi16(in, mul);
+
+			_mm_storeu_si128((__m128i *) (dst + i), _mm_packs_epi32(
+				_mm_unpacklo_epi16(lo, hi), _mm_unpackhi_epi16(lo, hi)));
+		}
+	} else if (factor < 0) {
+		int shift = audiofork_gain_shift(-factor);
+		const __m128i bias = _mm_set1_epi16((int16_t) (-factor - 1));
+		const __m128i count = _mm_cvtsi32_si128(shift);
+
+		for (; shift >= 0 && i + 8 <= samples; i += 8) {
+			__m128i in = _mm_loadu_si128((const __m128i *) (src + i));
+			__m128i neg = _mm_srai_epi16(in, 15);
+
+			_mm_storeu_si128((__m128i *) (dst + i),
+				_mm_sra_epi16(_mm_add_epi16(in, _mm_and_si128(neg, bias)), count));
+		}
+	}
+	audiofork_gain_scalar(dst + i, src + i, samples - i, factor);
+}
+
+__attribute__((target("avx2")))
+static inline void audiofork_gain_avx2(int16_t *dst, const int16_t *src, size_t samples,
+	int factor)
+{
+	size_t i = 0;
+
+	/* unpack and pack both work within 128 bit lanes, so the order holds */
+	if (factor > 0 && factor <= INT16_MAX) {
+		const __m256i mul = _mm256_set1_epi16((int16_t) factor);
+
+		for (; i + 16 <= samples; i += 16) {
+			__m256i in = _mm256_loadu_si256((const __m256i *) (src + i));
+			__m256i lo = _mm256_mullo_epi16(in, mul);
+			__m256i hi = _mm256_mulhi_epi16(in, mul);
+
+			_mm256_storeu_si256((__m256i *) (dst + i), _mm256_packs_epi32(
+				_mm256_unpacklo_epi16(lo, hi), _mm256_unpackhi_epi16(lo, hi)));
+		}
+	} else if (factor < 0) {
+		int shift = audiofork_gain_shift(-factor);
+		const __m256i bias = _mm256_set1_epi16((int16_t) (-factor - 1));
+		const __m128i count = _mm_cvtsi32_si128(shift);
+
+		for (; shift >= 0 && i + 16 <= samples; i += 16) {
+			__m256i in = _mm256_loadu_si256((const __m256i *) (src + i));
+			__m256i neg = _mm256_srai_epi16(in, 15);
+
+			_mm256_storeu_si256((__m256i *) (dst + i),
+				_mm256_sra_epi16(_mm256_add_epi16(in, _mm256_and_si256(neg, bias)), count));
+		}
+	}
+	/* The rest of a 20 ms frame at 8 kHz, 160 samples, never gets here */
+	audiofork_gain_sse2(dst + i, src + i, samples - i, factor);
+}
+
+__attribute__((target("sse2")))
+static inline void audiofork_interleave_sse2(int16_t *dst, const int16_t *left,
+	const int16_t *right, size_t samples)
+{
+	size_t i = 0;
+
+	for (; i + 8 <= samples; i += 8) {
+		__m128i l = _mm_loadu_si128((const __m128i *) (left + i));
+		__m128i r = _mm_loadu_si128((const __m128i *) (right + i));
+
+		_mm_storeu_si128((__m128i *) (dst + 2 * i), _mm_unpacklo_epi16(l, r));
+		_mm_storeu_si128((__m128i *) (dst + 2 * i + 8), _mm_unpackhi_epi16(l, r));
+	}
+	audiofork_interleave_scalar(dst + 2 * i, left + i, right + i, samples - i);
+}
+
+__attribute__((target("avx2")))
+static inline void audiofork_interleave_avx2(int16_t *dst, const int16_t *left,
+	const int16_t *right, size_t samples)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= samples; i += 16) {
+		__m256i l = _mm256_loadu_si256((const __m256i *) (left + i));
+		__m256i r = _mm256_loadu_si256((const __m256i *) (right + i));
+		/* Frames 0-3 and 8-11, then 4-7 and 12-15: put the lanes back in order */
+		__m256i lo = _mm256_unpacklo_epi16(l, r);
+		__m256i hi = _mm256_unpackhi_epi16(l, r);
+
+		_mm256_storeu_si256((__m256i *) (dst + 2 * i), _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *) (dst + 2 * i + 16),
+			_mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	audiofork_interleave_sse2(dst + 2 * i, left + i, right + i, samples - i);
+}
+
+#endif /* AUDIOFORK_SIMD_X86 */
+
+/*! \brief Name of an instruction set, for logs and benchmarks */
+static inline const char *audiofork_simd_name(enum audiofork_simd_isa isa)
+{
+	switch (isa) {
+	case AUDIOFORK_SIMD_SSE2:
+		return "SSE2";
+	case AUDIOFORK_SIMD_AVX2:
+		return "AVX2";
+	default:
+		return "scalar";
+	}
+}
+
+/*! \brief Whether this build and CPU run the kernels of \a isa */
+static inline int audiofork_simd_supported(enum audiofork_simd_isa isa)
+{
+	switch (isa) {
+	case AUDIOFORK_SIMD_SCALAR:
+		return 1;
+#ifdef AUDIOFORK_SIMD_X86
+	case AUDIOFORK_SIMD_SSE2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("sse2");
+	case AUDIOFORK_SIMD_AVX2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+#endif
+	default:
+		return 0;
+	}
+}
+
+/*! \brief The widest instruction set the CPU runs */
+static inline enum audiofork_simd_isa audiofork_simd_best(void)
+{
+	int isa;
+
+	for (isa = AUDIOFORK_SIMD_ISAS - 1; isa > AUDIOFORK_SIMD_SCALAR; isa--) {
+		if (audiofork_simd_supported(isa)) {
+			break;
+		}
+	}
+	return isa;
+}
+
+/*! \brief The gain kernel of \a isa, or NULL if this build or CPU cannot run it */
+static inline audiofork_gain_fn audiofork_gain_kernel(enum audiofork_simd_isa isa)
+{
+	if (!audiofork_simd_supported(isa)) {
+		return NULL;
+	}
+	switch (isa) {
+#ifdef AUDIOFORK_SIMD_X86
+	case AUDIOFORK_SIMD_SSE2:
+		return audiofork_gain_sse2;
+	case AUDIOFORK_SIMD_AVX2:
+		return audiofork_gain_avx2;
+#endif
+	default:
+		return audiofork_gain_scalar;
+	}
+}
+
+/*! \brief The interleave kernel of \a isa, or NULL if this build or CPU cannot run it */
+static inline audiofork_interleave_fn audiofork_interleave_kernel(enum audiofork_simd_isa isa)
+{
+	if (!audiofork_simd_supported(isa)) {
+		return NULL;
+	}
+	switch (isa) {
+#ifdef AUDIOFORK_SIMD_X86
+	case AUDIOFORK_SIMD_SSE2:
+		return audiofork_interleave_sse2;
+	case AUDIOFORK_SIMD_AVX2:
+		return audiofork_interleave_avx2;
+#endif
+	default:
+		return audiofork_interleave_scalar;
+	}
+}
+
+#endif /* _AUDIOFORK_SIMD_H */
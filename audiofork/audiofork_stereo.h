@@ -0,0 +1,251 @@
+/*
+ * app_audiofork stereo aligner
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the COPYING file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Pairing the two directions of a fork into interleaved stereo
+ *
+ * With the S option a fork sends a single stream: left is the audio the
+ * channel speaks (in), right is the audio it hears (out). The read and
+ * write sides of a channel deliver their frames independently and with
+ * jitter, and either side may go quiet with no frames at all, so the worker
+ * cannot just pair the slots in the order they leave the ring.
+ *
+ * The aligner places the audio of each side on a common timeline, in
+ * samples, from the time the media thread took it off the channel. Audio
+ * arriving within the jitter window of where its side left off continues
+ * it seamlessly. A side that stays quiet for longer than the window gets
+ * silence, and a gap in both sides is cut out rather than sent as silence.
+ * Audio waits until the other side has covered the same stretch, or until
+ * it is more than the window older than the newest audio of either side,
+ * so the channels are never further apart than the window and the aligner
+ * adds no more delay than that. A side delivering more audio than the time
+ * that passed, a burst of late frames, is trimmed so that it runs no more
+ * than the window ahead of its arrival, and a side that stayed ahead of its
+ * arrival for a whole second drops the lead it kept, so it comes back in
+ * line once the jitter settles.
+ *
+ * Callers take every pair audiofork_aligner_ready() reports before adding
+ * more audio; the queues are sized for that.
+ */
+
+#ifndef _AUDIOFORK_STEREO_H
+#define _AUDIOFORK_STEREO_H
+
+#include <stdlib.h>
+
+#include "audiofork_simd.h"
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+enum audiofork_stereo_channel {
+	/*! What the channel speaks */
+	AUDIOFORK_STEREO_LEFT,
+	/*! What the channel hears */
+	AUDIOFORK_STEREO_RIGHT,
+	AUDIOFORK_STEREO_CHANNELS,
+};
+
+struct audiofork_aligner {
+	/*! Samples per second of each channel */
+	unsigned int rate;
+	/*! Jitter window, in samples */
+	unsigned int window;
+	/*! Samples a queue holds */
+	size_t cap;
+	/*! Audio not paired yet, both queues starting at the timeline position start */
+	int16_t *queue[AUDIOFORK_STEREO_CHANNELS];
+	size_t len[AUDIOFORK_STEREO_CHANNELS];
+	int64_t start;
+	int started;
+	audiofork_interleave_fn interleave;
+	/*! Samples of silence put in, per channel */
+	uint64_t padded[AUDIOFORK_STEREO_CHANNELS];
+	/*! Samples of late audio left out, per channel */
+	uint64_t trimmed[AUDIOFORK_STEREO_CHANNELS];
+	/*! Least a channel ran ahead of its arrival, over the samples seen since the last check */
+	int64_t lead_min[AUDIOFORK_STEREO_CHANNELS];
+	size_t lead_seen[AUDIOFORK_STEREO_CHANNELS];
+};
+
+/*!
+ * \brief Set up an aligner for \a rate samples per second and a jitter
+ * window of \a window_ms, taking up to \a max_add samples at a time
+ *
+ * \retval 0 on success
+ * \retval -1 out of memory
+ */
+static inline int audiofork_aligner_init(struct audiofork_aligner *aligner, unsigned int rate,
+	unsigned int window_ms, size_t max_add, audiofork_interleave_fn interleave)
+{
+	int i;
+
+	memset(aligner, 0, sizeof(*aligner));
+	aligner->rate = rate;
+	aligner->window = (uint64_t) rate * window_ms / 1000;
+	/* Up to two windows of silence and one of audio waiting for the other side */
+	aligner->cap = 3 * (size_t) aligner->window + max_add;
+	aligner->interleave = interleave;
+	for (i = 0; i < AUDIOFORK_STEREO_CHANNELS; i++) {
+		if (!(aligner->queue[i] = malloc(aligner->cap * sizeof(int16_t)))) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static inline void audiofork_aligner_free(struct audiofork_aligner *aligner)
+{
+	int i;
+
+	for (i = 0; i < AUDIOFORK_STEREO_CHANNELS; i++) {
+		free(aligner->queue[i]);
+		aligner->queue[i] = NULL;
+	}
+}
+
+/*! \brief Drop what waits to be paired, the next audio starts the timeline afresh */
+static inline void audiofork_aligner_reset(struct audiofork_aligner *aligner)
+{
+	aligner->len[AUDIOFORK_STEREO_LEFT] = aligner->len[AUDIOFORK_STEREO_RIGHT] = 0;
+	aligner->lead_seen[AUDIOFORK_STEREO_LEFT] = aligner->lead_seen[AUDIOFORK_STEREO_RIGHT] = 0;
+	aligner->started = 0;
+}
+
+/*! \brief Append \a samples samples of silence to a channel */
+static inline void audiofork_aligner_pad(struct audiofork_aligner *aligner, int channel,
+	int64_t samples)
+{
+	size_t count = MIN((size_t) MAX(samples, 0), aligner->cap - aligner->len[channel]);
+
+	memset(aligner->queue[channel] + aligner->len[channel], 0, count * sizeof(int16_t));
+	aligner->len[channel] += count;
+	aligner->padded[channel] += count;
+}
+
+/*!
+ * \brief Add audio of one channel
+ *
+ * \param aligner the aligner
+ * \param channel \ref audiofork_stereo_channel
+ * \param samples the audio
+ * \param count samples in it
+ * \param end_us when the last of it was taken off the channel, in microseconds
+ * from any fixed point, the same for both channels
+ */
+static inline void audiofork_aligner_add(struct audiofork_aligner *aligner, int channel,
+	const int16_t *samples, size_t count, int64_t end_us)
+{
+	int64_t arrival = end_us * aligner->rate / 1000000;
+	int64_t pos = arrival - (int64_t) count;
+	int64_t window = aligner->window;
+	int64_t longest;
+	int64_t end;
+	int64_t lead;
+	size_t room;
+	int i;
+
+	if (!aligner->started) {
+		aligner->start = pos;
+		aligner->started = 1;
+	}
+	longest = MAX(aligner->len[AUDIOFORK_STEREO_LEFT], aligner->len[AUDIOFORK_STEREO_RIGHT]);
+	if (pos > aligner->start + longest + window) {
+		/* Both sides were quiet for longer than the window: pair what is left, cut the gap */
+		for (i = 0; i < AUDIOFORK_STEREO_CHANNELS; i++) {
+			audiofork_aligner_pad(aligner, i, longest - (int64_t) aligner->len[i]);
+		}
+		aligner->start = pos - longest;
+	}
+
+	end = aligner->start + aligner->len[channel];
+	if (pos > end + window) {
+		audiofork_aligner_pad(aligner, channel, pos - end);
+	} else if (end + (int64_t) count > arrival + window) {
+		size_t late = MIN((size_t) (end + (int64_t) count - (arrival + window)), count);
+
+		samples += late;
+		count -= late;
+		aligner->trimmed[channel] += late;
+	}
+	room = aligner->cap - aligner->len[channel];
+	if (count > room) {
+		aligner->trimmed[channel] += count - room;
+		count = room;
+	}
+	memcpy(aligner->queue[channel] + aligner->len[channel], samples, count * sizeof(int16_t));
+	aligner->len[channel] += count;
+
+	lead = aligner->start + (int64_t) aligner->len[channel] - arrival;
+	aligner->lead_min[channel] = aligner->lead_seen[channel]
+		? MIN(aligner->lead_min[channel], lead) : lead;
+	aligner->lead_seen[channel] += count;
+	if (aligner->lead_seen[channel] >= aligner->rate) {
+		if (aligner->lead_min[channel] > 0) {
+			size_t drop = MIN((size_t) aligner->lead_min[channel], aligner->len[channel]);
+
+			aligner->len[channel] -= drop;
+			aligner->trimmed[channel] += drop;
+		}
+		aligner->lead_seen[channel] = 0;
+	}
+
+	/* Nothing waits for the other side longer than the window */
+	longest = MAX(aligner->len[AUDIOFORK_STEREO_LEFT], aligner->len[AUDIOFORK_STEREO_RIGHT]);
+	for (i = 0; i < AUDIOFORK_STEREO_CHANNELS; i++) {
+		audiofork_aligner_pad(aligner, i, longest - window - (int64_t) aligner->len[i]);
+	}
+}
+
+/*! \brief Stereo frames ready to be taken */
+static inline size_t audiofork_aligner_ready(const struct audiofork_aligner *aligner)
+{
+	return MIN(aligner->len[AUDIOFORK_STEREO_LEFT], aligner->len[AUDIOFORK_STEREO_RIGHT]);
+}
+
+/*! \brief Pair everything that waits with silence, to take the rest at the end */
+static inline void audiofork_aligner_flush(struct audiofork_aligner *aligner)
+{
+	size_t longest = MAX(aligner->len[AUDIOFORK_STEREO_LEFT], aligner->len[AUDIOFORK_STEREO_RIGHT]);
+	int i;
+
+	for (i = 0; i < AUDIOFORK_STEREO_CHANNELS; i++) {
+		audiofork_aligner_pad(aligner, i, longest - aligner->len[i]);
+	}
+}
+
+/*!
+ * \brief Interleave up to \a max ready stereo frames into \a dst
+ *
+ * \return Stereo frames written, 2 samples each
+ */
+static inline size_t audiofork_aligner_take(struct audiofork_aligner *aligner, int16_t *dst,
+	size_t max)
+{
+	size_t count = MIN(audiofork_aligner_ready(aligner), max);
+	int i;
+
+	if (!count) {
+		return 0;
+	}
+	aligner->interleave(dst, aligner->queue[AUDIOFORK_STEREO_LEFT],
+		aligner->queue[AUDIOFORK_STEREO_RIGHT], count);
+	for (i = 0; i < AUDIOFORK_STEREO_CHANNELS; i++) {
+		aligner->len[i] -= count;
+		memmove(aligner->queue[i], aligner->queue[i] + count, aligner->len[i] * sizeof(int16_t));
+	}
+	aligner->start += count;
+	return count;
+}
+
+#endif /* _AUDIOFORK_STEREO_H */
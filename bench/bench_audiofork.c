@@ -0,0 +1,337 @@
+/*
+ * app_audiofork benchmarks
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the COPYING file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief AudioFork streaming benchmark against a local WebSocket sink
+ *
+ * Forks the spoken audio of a number of channels to test/ws_sink.c, one
+ * connection per channel, and plays the media threads: every 20 ms each
+ * channel gets a 20 ms slin frame through its framehooks, spread over a few
+ * media threads. For every combination of stream and worker counts it
+ * reports the frames forked, dropped on full rings (overruns) or without a
+ * connection (lost) and received by the sink, the time the media threads
+ * spent in the framehooks, how late their 20 ms ticks ran, the WebSocket
+ * messages and socket writes it took and the CPU the whole process used.
+ *
+ * Usage: bench_audiofork [-s stream counts] [-w worker counts]
+ *                        [-m media threads] [-d seconds]
+ *                        [-a aggregate ms] [-g]
+ * where the lists are comma separated and 0 workers means one per CPU;
+ * -a and -g fork with the A() and g options.
+ * "make bench" runs the defaults.
+ */
+
+#include <inttypes.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "shim.h"
+#include "ws_sink.h"
+
+#define MAX_LIST 16
+#define SAMPLES 160
+#define TICK_NS 20000000ULL
+
+struct bench_list {
+	unsigned int values[MAX_LIST];
+	size_t count;
+};
+
+struct media {
+	pthread_t thread;
+	struct ast_channel **chans;
+	size_t chan_count;
+	uint64_t end_ns;
+	/*! Time spent passing each frame through the framehooks */
+	uint64_t *latencies;
+	size_t latency_max;
+	size_t count;
+	/*! Latest a tick started after it was due */
+	uint64_t late_ns;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t cpu_ns(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ULL
+		+ (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ULL;
+}
+
+static int parse_list(const char *arg, struct bench_list *list)
+{
+	char *copy = ast_strdupa(arg);
+	char *value;
+
+	list->count = 0;
+	while ((value = strsep(&copy, ",")) && list->count < MAX_LIST) {
+		if (sscanf(value, "%30u", &list->values[list->count]) != 1) {
+			return -1;
+		}
+		list->count++;
+	}
+	return list->count ? 0 : -1;
+}
+
+static void *media_run(void *data)
+{
+	struct media *media = data;
+	int16_t samples[SAMPLES] = { 0, };
+	uint64_t due = now_ns();
+	size_t i;
+
+	for (i = 0; i < SAMPLES; i++) {
+		samples[i] = (int16_t) (i * 97);
+	}
+	while (due < media->end_ns) {
+		struct timespec ts = { due / 1000000000ULL, due % 1000000000ULL };
+		uint64_t start;
+
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		start = now_ns();
+		media->late_ns = MAX(media->late_ns, start - due);
+		for (i = 0; i < media->chan_count; i++) {
+			struct ast_frame frame = {
+				.frametype = AST_FRAME_VOICE,
+				.subclass.format = ast_format_slin,
+				.datalen = sizeof(samples),
+				.samples = SAMPLES,
+				.data.ptr = samples,
+			};
+			uint64_t before = now_ns();
+
+			shim_channel_frame(media->chans[i], &frame, 0);
+			if (media->count < media->latency_max) {
+				media->latencies[media->count++] = now_ns() - before;
+			}
+		}
+		due += TICK_NS;
+	}
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t left = *(const uint64_t *) a;
+	uint64_t right = *(const uint64_t *) b;
+
+	return left < right ? -1 : left > right;
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t count, double p)
+{
+	return count ? sorted[(size_t) (p * (count - 1))] : 0;
+}
+
+/*! \brief Add up the counters of every fork in "audiofork show forks" */
+static void fork_totals(uint64_t *frames, uint64_t *sent, uint64_t *overruns, uint64_t *lost,
+	uint64_t *messages, uint64_t *writes)
+{
+	size_t len = 1024 * 1024;
+	char *buf = ast_malloc(len);
+	char *line;
+	char *next;
+
+	*frames = *sent = *overruns = *lost = *messages = *writes = 0;
+	if (!buf || shim_cli_exec("audiofork show forks", buf, len) != RESULT_SUCCESS) {
+		ast_free(buf);
+		return;
+	}
+	for (line = buf; line; line = next) {
+		unsigned long long values[6];
+
+		if ((next = strchr(line, '\n'))) {
+			*next++ = '\0';
+		}
+		if (sscanf(line, "%*s %*s %llu %llu %llu %llu %*s %*s %llu %llu", &values[0],
+			&values[1], &values[2], &values[3], &values[4], &values[5]) == 6) {
+			*frames += values[0];
+			*sent += values[1];
+			*overruns += values[2];
+			*lost += values[3];
+			*messages += values[4];
+			*writes += values[5];
+		}
+	}
+	ast_free(buf);
+}
+
+static int run(unsigned int streams, unsigned int worker_setting, unsigned int media_threads,
+	unsigned int seconds, const char *options)
+{
+	struct media media[media_threads];
+	struct ast_channel **chans;
+	struct ws_sink *sink;
+	uint64_t frames, sent, overruns, lost, messages, writes;
+	uint64_t *latencies;
+	uint64_t start, elapsed, cpu;
+	uint64_t late = 0;
+	size_t per_thread = (streams + media_threads - 1) / media_threads;
+	size_t ticks = seconds * (1000000000ULL / TICK_NS) + 1;
+	size_t count = 0;
+	char value[16];
+	char data[128];
+	char workers[4096];
+	size_t i;
+
+	snprintf(value, sizeof(value), "%u", worker_setting);
+	shim_config_clear("audiofork.conf");
+	shim_config_set("audiofork.conf", "general", "workers", value);
+	if (shim_module_load() != AST_MODULE_LOAD_SUCCESS) {
+		fprintf(stderr, "Unable to load app_audiofork\n");
+		return -1;
+	}
+	sink = ws_sink_start(0, NULL, NULL);
+	chans = ast_calloc(streams, sizeof(*chans));
+	latencies = ast_malloc(per_thread * ticks * media_threads * sizeof(*latencies));
+	if (!sink || !chans || !latencies) {
+		fprintf(stderr, "Unable to set up %u streams\n", streams);
+		return -1;
+	}
+
+	snprintf(data, sizeof(data), "ws://127.0.0.1:%d/bench,D(in)%s", ws_sink_port(sink), options);
+	for (i = 0; i < streams; i++) {
+		char name[AST_CHANNEL_NAME];
+
+		snprintf(name, sizeof(name), "PJSIP/bench-%08zx", i);
+		chans[i] = shim_channel_alloc(name, NULL);
+		if (!chans[i] || shim_app_exec("AudioFork", chans[i], data)) {
+			fprintf(stderr, "Unable to fork stream %zu\n", i);
+			return -1;
+		}
+	}
+	if (ws_sink_wait_connections(sink, streams, streams, 60000)) {
+		fprintf(stderr, "Only %zu of %u streams connected\n", ws_sink_open(sink), streams);
+	}
+	shim_cli_exec("audiofork show workers", workers, sizeof(workers));
+
+	start = now_ns();
+	cpu = cpu_ns();
+	for (i = 0; i < media_threads; i++) {
+		size_t first = MIN(i * per_thread, (size_t) streams);
+
+		media[i].chans = chans + first;
+		media[i].chan_count = MIN(per_thread, streams - first);
+		media[i].end_ns = start + seconds * 1000000000ULL;
+		media[i].latencies = latencies + i * per_thread * ticks;
+		media[i].latency_max = per_thread * ticks;
+		media[i].count = 0;
+		media[i].late_ns = 0;
+		pthread_create(&media[i].thread, NULL, media_run, &media[i]);
+	}
+	for (i = 0; i < media_threads; i++) {
+		pthread_join(media[i].thread, NULL);
+		memmove(latencies + count, media[i].latencies, media[i].count * sizeof(*latencies));
+		count += media[i].count;
+		late = MAX(late, media[i].late_ns);
+	}
+
+	/* Let the workers catch up before counting what arrived */
+	for (i = 0; i < 5000; i++) {
+		fork_totals(&frames, &sent, &overruns, &lost, &messages, &writes);
+		if (sent + lost == frames && ws_sink_messages(sink) >= messages) {
+			break;
+		}
+		usleep(1000);
+	}
+	elapsed = now_ns() - start;
+	cpu = cpu_ns() - cpu;
+	qsort(latencies, count, sizeof(*latencies), cmp_u64);
+
+	printf("%7u %7u %9zu %9" PRIu64 " %8" PRIu64 " %6" PRIu64 " %9" PRIu64 " %9" PRIu64
+		" %9" PRIu64 " %7" PRIu64 " %7" PRIu64 " %8" PRIu64 " %7.2f %6.1f%% %8.1f\n",
+		streams, worker_setting, count, frames, overruns, lost, ws_sink_messages(sink),
+		writes, ws_sink_bytes(sink) / 320, percentile(latencies, count, 0.50), percentile(latencies, count, 0.99),
+		latencies[count ? count - 1 : 0], late / 1e6, 100.0 * cpu / elapsed,
+		(double) cpu / 1000.0 / streams / (elapsed / 1e9));
+	fflush(stdout);
+
+	for (i = 0; i < streams; i++) {
+		shim_channel_hangup(chans[i]);
+	}
+	shim_module_unload();
+	ws_sink_stop(sink);
+	ast_free(latencies);
+	ast_free(chans);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_list streams = { { 500, 1000, 2000 }, 3 };
+	struct bench_list workers = { { 0 }, 1 };
+	unsigned int media_threads = 4;
+	unsigned int seconds = 3;
+	unsigned int aggregate = 0;
+	int gather = 0;
+	char options[32];
+	struct rlimit limit;
+	size_t s, w;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:w:m:d:a:g")) != -1) {
+		int res = 0;
+
+		switch (opt) {
+		case 's':
+			res = parse_list(optarg, &streams);
+			break;
+		case 'w':
+			res = parse_list(optarg, &workers);
+			break;
+		case 'm':
+			res = sscanf(optarg, "%30u", &media_threads) == 1 && media_threads ? 0 : -1;
+			break;
+		case 'd':
+			res = sscanf(optarg, "%30u", &seconds) == 1 && seconds ? 0 : -1;
+			break;
+		case 'a':
+			res = sscanf(optarg, "%30u", &aggregate) == 1 && aggregate <= 1000 ? 0 : -1;
+			break;
+		case 'g':
+			gather = 1;
+			break;
+		default:
+			res = -1;
+		}
+		if (res) {
+			fprintf(stderr, "Usage: %s [-s streams] [-w workers] [-m media threads] "
+				"[-d seconds] [-a aggregate ms] [-g]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	/* Both ends of every connection live in this process */
+	if (!getrlimit(RLIMIT_NOFILE, &limit)) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	snprintf(options, sizeof(options), "A(%u)%s", aggregate, gather ? "g" : "");
+	printf("%7s %7s %9s %9s %8s %6s %9s %9s %9s %7s %7s %8s %7s %7s %8s\n",
+		"streams", "workers", "offered", "forked", "overruns", "lost", "messages",
+		"writes", "received", "p50 ns", "p99 ns", "max ns", "late ms", "cpu", "us/s/str");
+	for (s = 0; s < streams.count; s++) {
+		for (w = 0; w < workers.count; w++) {
+			if (run(streams.values[s], workers.values[w], media_threads, seconds, options)) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,374 @@
+/*
+ * app_bridgemon benchmarks
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the COPYING file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief FindPeer microbenchmark across channel populations
+ *
+ * Builds a synthetic channel population out of calls made of an originator
+ * and a number of outbound legs sharing its linkedid, hangs up the
+ * originators of a share of the calls so their legs miss, then runs FindPeer
+ * on randomly picked legs from one or more threads. For every combination it
+ * reports the mean cost, latency percentiles and the time spent waiting on
+ * contended ao2 locks (channel locks included).
+ *
+ * With -l every combination is also run through the lookup FindPeer used
+ * before the module kept an index, ast_channel_get_by_name() on the
+ * linkedid, which the core can only answer by scanning every channel. The
+ * two rows side by side are the before and after of the index.
+ *
+ * Usage: bench_findpeer [-p populations] [-f fanouts] [-m miss percents]
+ *                       [-t thread counts] [-n ops per thread] [-d max seconds] [-l]
+ * where every list is comma separated. A run stops early once it has taken
+ * the -d limit, so expensive combinations report fewer ops instead of
+ * stalling the suite. "make bench" runs the defaults.
+ */
+
+#include <inttypes.h>
+#include <time.h>
+
+#include "shim.h"
+
+#define MAX_LIST 16
+
+struct bench_list {
+	unsigned int values[MAX_LIST];
+	size_t count;
+};
+
+struct population {
+	struct ast_channel **legs;
+	size_t leg_count;
+	struct ast_channel **originators;
+	size_t call_count;
+};
+
+struct worker {
+	pthread_t thread;
+	struct population *population;
+	/*! Non-zero to time legacy_findpeer() instead of FindPeer() */
+	int legacy;
+	unsigned int ops;
+	/*! Ops completed before the deadline */
+	unsigned int done;
+	unsigned int seed;
+	uint64_t *latencies;
+	struct shim_lock_stats locks;
+};
+
+static pthread_barrier_t start_barrier;
+static uint64_t deadline_ns;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int xorshift(unsigned int *state)
+{
+	unsigned int x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+/*!
+ * \brief FindPeer() as it was before the index: look the linkedid up in the core
+ *
+ * A linkedid is a uniqueid, which misses the core's name hash and falls back
+ * to a walk over every channel.
+ */
+static void legacy_findpeer(struct ast_channel *chan)
+{
+	struct ast_channel *originator;
+
+	originator = ast_channel_get_by_name(ast_channel_linkedid(chan));
+	if (!originator) {
+		return;
+	}
+	ast_channel_lock(originator);
+	pbx_builtin_setvar_helper(originator, "BRIDGEPEERID", ast_channel_uniqueid(chan));
+	ast_channel_unlock(originator);
+	ast_channel_unref(originator);
+}
+
+static int parse_list(const char *arg, struct bench_list *list)
+{
+	char *copy = ast_strdupa(arg);
+	char *value;
+
+	list->count = 0;
+	while ((value = strsep(&copy, ",")) && list->count < MAX_LIST) {
+		if (sscanf(value, "%30u", &list->values[list->count]) != 1) {
+			return -1;
+		}
+		list->count++;
+	}
+	return list->count ? 0 : -1;
+}
+
+/*!
+ * \brief Create about \a size channels in calls of one originator and \a fanout legs
+ *
+ * The originators of \a miss_percent of the calls are hung up so FindPeer on
+ * their legs finds nothing.
+ */
+static int population_create(struct population *pop, unsigned int size, unsigned int fanout,
+	unsigned int miss_percent)
+{
+	size_t i;
+	size_t j;
+
+	pop->call_count = MAX(1U, size / (fanout + 1));
+	pop->leg_count = pop->call_count * fanout;
+	pop->legs = ast_calloc(pop->leg_count, sizeof(*pop->legs));
+	pop->originators = ast_calloc(pop->call_count, sizeof(*pop->originators));
+	if (!pop->legs || !pop->originators) {
+		return -1;
+	}
+
+	for (i = 0; i < pop->call_count; i++) {
+		char name[AST_CHANNEL_NAME];
+		struct ast_channel *originator;
+
+		snprintf(name, sizeof(name), "PJSIP/caller-%08zx", i);
+		originator = shim_channel_alloc(name, NULL);
+		if (!originator) {
+			return -1;
+		}
+		for (j = 0; j < fanout; j++) {
+			snprintf(name, sizeof(name), "PJSIP/callee-%08zx;%zu", i, j);
+			pop->legs[i * fanout + j] = shim_channel_alloc(name, ast_channel_uniqueid(originator));
+			if (!pop->legs[i * fanout + j]) {
+				return -1;
+			}
+		}
+		/* Spread the misses evenly over the population */
+		if ((i * miss_percent) / 100 != ((i + 1) * miss_percent) / 100) {
+			shim_channel_hangup(originator);
+		} else {
+			pop->originators[i] = originator;
+		}
+	}
+	return 0;
+}
+
+static void population_destroy(struct population *pop)
+{
+	size_t i;
+
+	for (i = 0; pop->legs && i < pop->leg_count; i++) {
+		if (pop->legs[i]) {
+			shim_channel_hangup(pop->legs[i]);
+		}
+	}
+	for (i = 0; pop->originators && i < pop->call_count; i++) {
+		if (pop->originators[i]) {
+			shim_channel_hangup(pop->originators[i]);
+		}
+	}
+	ast_free(pop->legs);
+	ast_free(pop->originators);
+	memset(pop, 0, sizeof(*pop));
+}
+
+static void *worker_run(void *data)
+{
+	struct worker *worker = data;
+	struct population *pop = worker->population;
+	unsigned int i;
+
+	pthread_barrier_wait(&start_barrier);
+	shim_lock_stats_reset();
+	for (i = 0; i < worker->ops; i++) {
+		struct ast_channel *leg = pop->legs[xorshift(&worker->seed) % pop->leg_count];
+		uint64_t start = now_ns();
+		uint64_t end;
+
+		if (worker->legacy) {
+			legacy_findpeer(leg);
+		} else {
+			shim_app_exec("FindPeer", leg, "");
+		}
+		end = now_ns();
+		worker->latencies[i] = end - start;
+		if (end > deadline_ns) {
+			i++;
+			break;
+		}
+	}
+	worker->done = i;
+	shim_lock_stats_get(&worker->locks);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t left = *(const uint64_t *) a;
+	uint64_t right = *(const uint64_t *) b;
+
+	return left < right ? -1 : left > right;
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t count, double p)
+{
+	size_t idx = (size_t) (p * (count - 1));
+
+	return sorted[idx];
+}
+
+static int run(struct population *pop, unsigned int size, unsigned int fanout,
+	unsigned int miss_percent, unsigned int threads, unsigned int ops, unsigned int max_seconds,
+	int legacy)
+{
+	struct worker workers[threads];
+	struct shim_lock_stats locks = { 0, };
+	uint64_t *latencies;
+	uint64_t start;
+	uint64_t elapsed;
+	uint64_t total = 0;
+	size_t count = 0;
+	size_t i;
+
+	latencies = ast_malloc((size_t) threads * ops * sizeof(*latencies));
+	if (!latencies) {
+		return -1;
+	}
+
+	pthread_barrier_init(&start_barrier, NULL, threads + 1);
+	for (i = 0; i < threads; i++) {
+		workers[i].population = pop;
+		workers[i].legacy = legacy;
+		workers[i].ops = ops;
+		workers[i].seed = 2463534242U + i * 7919;
+		workers[i].latencies = latencies + i * ops;
+		pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+	}
+	start = now_ns();
+	deadline_ns = start + max_seconds * 1000000000ULL;
+	pthread_barrier_wait(&start_barrier);
+	for (i = 0; i < threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		/* Pack each worker's results behind the previous one's */
+		memmove(latencies + count, workers[i].latencies, workers[i].done * sizeof(*latencies));
+		count += workers[i].done;
+		locks.acquired += workers[i].locks.acquired;
+		locks.contended += workers[i].locks.contended;
+		locks.wait_ns += workers[i].locks.wait_ns;
+	}
+	elapsed = now_ns() - start;
+	pthread_barrier_destroy(&start_barrier);
+
+	for (i = 0; i < count; i++) {
+		total += latencies[i];
+	}
+	qsort(latencies, count, sizeof(*latencies), cmp_u64);
+
+	printf("%-6s %7u %6u %5u%% %7u %9zu %8.0f %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %10.1f %9.3f%% %10.0f\n",
+		legacy ? "legacy" : "index", size, fanout, miss_percent, threads, count,
+		(double) total / count,
+		percentile(latencies, count, 0.50),
+		percentile(latencies, count, 0.99),
+		percentile(latencies, count, 0.999),
+		(double) locks.wait_ns / count,
+		locks.acquired ? 100.0 * locks.contended / locks.acquired : 0.0,
+		count * 1e9 / elapsed);
+	fflush(stdout);
+
+	ast_free(latencies);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_list sizes = { { 100, 1000, 10000, 50000, 100000 }, 5 };
+	struct bench_list fanouts = { { 1, 8 }, 2 };
+	struct bench_list misses = { { 0, 10, 50 }, 3 };
+	struct bench_list threads = { { 1, 4 }, 2 };
+	unsigned int ops = 100000;
+	unsigned int max_seconds = 2;
+	int legacy = 0;
+	size_t s, f, m, t;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "p:f:m:t:n:d:l")) != -1) {
+		int res = 0;
+
+		switch (opt) {
+		case 'p':
+			res = parse_list(optarg, &sizes);
+			break;
+		case 'f':
+			res = parse_list(optarg, &fanouts);
+			break;
+		case 'm':
+			res = parse_list(optarg, &misses);
+			break;
+		case 't':
+			res = parse_list(optarg, &threads);
+			break;
+		case 'n':
+			res = sscanf(optarg, "%30u", &ops) == 1 && ops ? 0 : -1;
+			break;
+		case 'd':
+			res = sscanf(optarg, "%30u", &max_seconds) == 1 && max_seconds ? 0 : -1;
+			break;
+		case 'l':
+			legacy = 1;
+			break;
+		default:
+			res = -1;
+		}
+		if (res) {
+			fprintf(stderr, "Usage: %s [-p populations] [-f fanouts] [-m miss%%] "
+				"[-t threads] [-n ops] [-d seconds] [-l]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (shim_module_load() != AST_MODULE_LOAD_SUCCESS) {
+		fprintf(stderr, "Unable to load app_bridgemon\n");
+		return 1;
+	}
+
+	printf("%-6s %7s %6s %6s %7s %9s %8s %8s %8s %8s %10s %10s %10s\n",
+		"mode", "chans", "fanout", "miss", "threads", "ops", "ns/op", "p50", "p99", "p999",
+		"lockwait", "contended", "ops/s");
+	for (s = 0; s < sizes.count; s++) {
+		for (f = 0; f < fanouts.count; f++) {
+			for (m = 0; m < misses.count; m++) {
+				struct population pop = { 0, };
+
+				if (population_create(&pop, sizes.values[s], fanouts.values[f],
+					misses.values[m]) || !pop.leg_count) {
+					fprintf(stderr, "Unable to create a population of %u\n", sizes.values[s]);
+					population_destroy(&pop);
+					continue;
+				}
+				for (t = 0; t < threads.count; t++) {
+					run(&pop, sizes.values[s], fanouts.values[f], misses.values[m],
+						threads.values[t], ops, max_seconds, 0);
+					if (legacy) {
+						run(&pop, sizes.values[s], fanouts.values[f], misses.values[m],
+							threads.values[t], ops, max_seconds, 1);
+					}
+				}
+				population_destroy(&pop);
+			}
+		}
+	}
+
+	shim_taskprocessors_wait();
+	shim_module_unload();
+	return 0;
+}
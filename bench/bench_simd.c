@@ -0,0 +1,214 @@
+/*
+ * app_audiofork benchmarks
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the COPYING file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Throughput of the AudioFork sample kernels
+ *
+ * Runs every gain kernel this CPU supports over 20 ms frames, as the
+ * framehook does when copying a frame into a ring slot, for a range of frame
+ * sizes and volume factors, then every interleave kernel over the same frame
+ * sizes, as a stereo fork's worker does. For every combination it reports the
+ * time per frame, samples per second and the speedup over the scalar
+ * reference. The frames rotate through a buffer larger than the L1 cache, so
+ * it measures the warm-L2 case of many channels rather than one frame in a
+ * tight loop.
+ *
+ * Usage: bench_simd [-n samples per frame list] [-f factor list] [-d seconds]
+ * where the lists are comma separated. "make bench" runs the defaults.
+ */
+
+#include <inttypes.h>
+#include <time.h>
+
+#include "shim.h"
+#include "audiofork/audiofork_simd.h"
+
+#define MAX_LIST 16
+/*! \brief Bytes the frames rotate through */
+#define WORKING_SET (256 * 1024)
+
+struct bench_list {
+	int values[MAX_LIST];
+	size_t count;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int parse_list(const char *arg, struct bench_list *list)
+{
+	char *copy = ast_strdupa(arg);
+	char *value;
+
+	list->count = 0;
+	while ((value = strsep(&copy, ",")) && list->count < MAX_LIST) {
+		if (sscanf(value, "%30d", &list->values[list->count]) != 1) {
+			return -1;
+		}
+		list->count++;
+	}
+	return list->count ? 0 : -1;
+}
+
+/*! \brief Nanoseconds per frame of \a fn over \a samples sample frames */
+static double run_gain(audiofork_gain_fn fn, int16_t *dst, const int16_t *src, size_t samples,
+	int factor, double seconds)
+{
+	size_t frames = WORKING_SET / sizeof(*src) / samples;
+	uint64_t end;
+	uint64_t start;
+	uint64_t count = 0;
+	size_t i;
+
+	/* Warm up, then time whole passes over the working set */
+	for (i = 0; i < frames; i++) {
+		fn(dst + i * samples, src + i * samples, samples, factor);
+	}
+	start = now_ns();
+	end = start + (uint64_t) (seconds * 1e9);
+	do {
+		for (i = 0; i < frames; i++) {
+			fn(dst + i * samples, src + i * samples, samples, factor);
+		}
+		count += frames;
+	} while (now_ns() < end);
+	return (double) (now_ns() - start) / count;
+}
+
+/*! \brief Nanoseconds per frame of \a fn over \a samples sample frames per side */
+static double run_interleave(audiofork_interleave_fn fn, int16_t *dst, const int16_t *src,
+	size_t samples, double seconds)
+{
+	/* Both sides come from the working set, the output is twice as long */
+	size_t frames = WORKING_SET / sizeof(*src) / samples / 2;
+	uint64_t end;
+	uint64_t start;
+	uint64_t count = 0;
+	size_t i;
+
+	for (i = 0; i < frames; i++) {
+		fn(dst + 2 * i * samples, src + 2 * i * samples, src + (2 * i + 1) * samples, samples);
+	}
+	start = now_ns();
+	end = start + (uint64_t) (seconds * 1e9);
+	do {
+		for (i = 0; i < frames; i++) {
+			fn(dst + 2 * i * samples, src + 2 * i * samples, src + (2 * i + 1) * samples,
+				samples);
+		}
+		count += frames;
+	} while (now_ns() < end);
+	return (double) (now_ns() - start) / count;
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_list sizes = { { 160, 320, 960 }, 3 };
+	struct bench_list factors = { { 2, 16, -2, -16 }, 4 };
+	double seconds = 0.3;
+	int16_t *src;
+	int16_t *dst;
+	size_t n, f;
+	size_t i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:f:d:")) != -1) {
+		int res = 0;
+
+		switch (opt) {
+		case 'n':
+			res = parse_list(optarg, &sizes);
+			for (i = 0; !res && i < sizes.count; i++) {
+				res = sizes.values[i] > 0 && sizes.values[i] <= WORKING_SET / 4 ? 0 : -1;
+			}
+			break;
+		case 'f':
+			res = parse_list(optarg, &factors);
+			break;
+		case 'd':
+			res = sscanf(optarg, "%30lf", &seconds) == 1 && seconds > 0 ? 0 : -1;
+			break;
+		default:
+			res = -1;
+		}
+		if (res) {
+			fprintf(stderr, "Usage: %s [-n samples] [-f factors] [-d seconds]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	src = ast_malloc(WORKING_SET);
+	dst = ast_malloc(WORKING_SET);
+	if (!src || !dst) {
+		return 1;
+	}
+	srandom(1);
+	for (i = 0; i < WORKING_SET / sizeof(*src); i++) {
+		src[i] = (int16_t) random();
+	}
+
+	printf("Best kernel: %s\n", audiofork_simd_name(audiofork_simd_best()));
+	printf("\nGain\n%-7s %7s %7s %10s %10s %8s\n", "kernel", "samples", "factor", "ns/frame",
+		"Msample/s", "speedup");
+	for (n = 0; n < sizes.count; n++) {
+		for (f = 0; f < factors.count; f++) {
+			double scalar = 0;
+			int isa;
+
+			for (isa = AUDIOFORK_SIMD_SCALAR; isa < AUDIOFORK_SIMD_ISAS; isa++) {
+				audiofork_gain_fn fn = audiofork_gain_kernel(isa);
+				double ns;
+
+				if (!fn) {
+					continue;
+				}
+				ns = run_gain(fn, dst, src, sizes.values[n], factors.values[f], seconds);
+				if (isa == AUDIOFORK_SIMD_SCALAR) {
+					scalar = ns;
+				}
+				printf("%-7s %7d %7d %10.1f %10.1f %7.2fx\n", audiofork_simd_name(isa),
+					sizes.values[n], factors.values[f], ns, sizes.values[n] / ns * 1e3,
+					scalar / ns);
+			}
+		}
+	}
+
+	printf("\nInterleave\n%-7s %7s %10s %10s %8s\n", "kernel", "samples", "ns/frame",
+		"Msample/s", "speedup");
+	for (n = 0; n < sizes.count; n++) {
+		double scalar = 0;
+		int isa;
+
+		for (isa = AUDIOFORK_SIMD_SCALAR; isa < AUDIOFORK_SIMD_ISAS; isa++) {
+			audiofork_interleave_fn fn = audiofork_interleave_kernel(isa);
+			double ns;
+
+			if (!fn) {
+				continue;
+			}
+			ns = run_interleave(fn, dst, src, sizes.values[n], seconds);
+			if (isa == AUDIOFORK_SIMD_SCALAR) {
+				scalar = ns;
+			}
+			/* Samples of both sides */
+			printf("%-7s %7d %10.1f %10.1f %7.2fx\n", audiofork_simd_name(isa),
+				sizes.values[n], ns, 2 * sizes.values[n] / ns * 1e3, scalar / ns);
+		}
+	}
+	fflush(stdout);
+
+	ast_free(src);
+	ast_free(dst);
+	return 0;
+}
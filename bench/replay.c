@@ -0,0 +1,737 @@
+/*
+ * app_bridgemon benchmarks
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the COPYING file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Call trace replayer for the bridge peer subsystem
+ *
+ * Replays a call trace through the module on the API shim at its recorded
+ * pace or at a target call rate, and reports how long BRIDGEPEERID took to
+ * become available and how much CPU each call cost.
+ *
+ * A trace is a text file with one event per line, sorted or not:
+ *
+ * \verbatim
+   <time ms> <call> create <chan> [<chan whose linkedid it inherits>]
+   <time ms> <call> findpeer <chan>
+   <time ms> <call> bridgemon <chan>
+   <time ms> <call> enter <bridge> <chan>
+   <time ms> <call> leave <chan>
+   <time ms> <call> hangup <chan>
+   \endverbatim
+ *
+ * Calls, channels and bridges are arbitrary labels. Channel and bridge labels
+ * are global to the trace, so a transfer can move a channel into another
+ * call's bridge. Lines starting with '#' are comments. A transfer is a leave
+ * followed by an enter; entering a bridge while in another one moves the
+ * channel.
+ *
+ * Per call, the clock starts at the first findpeer, or the first enter that
+ * leaves a bridge with two or more channels, at its scheduled time. It stops
+ * when BRIDGEPEERID is first set on any of the call's channels, so the
+ * latency includes replay scheduling lag and any asynchronous processing in
+ * the module.
+ *
+ * Usage: replay [-c cps list] [-s speed] [-t threads] [-o option=value] trace|-
+ *        replay -g calls [-G cps] > trace
+ *
+ * -c rescales call arrivals to each listed rate in turn, -s divides the time
+ * between a call's own events (ringing, talk time), -o sets a bridgemon.conf
+ * [general] option and -g writes a synthetic trace.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "shim.h"
+
+#define LABEL_BUCKETS 4099
+#define MAX_RATES 16
+#define MAX_OPTIONS 16
+
+enum replay_op {
+	OP_CREATE,
+	OP_FINDPEER,
+	OP_BRIDGEMON,
+	OP_ENTER,
+	OP_LEAVE,
+	OP_HANGUP,
+};
+
+struct replay_event {
+	/*! Trace time in microseconds */
+	int64_t at_us;
+	/*! Time in the current run, in nanoseconds from its start */
+	int64_t run_ns;
+	unsigned int call;
+	enum replay_op op;
+	/*! Channel index */
+	int chan;
+	/*! Bridge index for enter, inherited channel index for create, else -1 */
+	int other;
+};
+
+struct replay_call {
+	/*! Trace time of the call's first event */
+	int64_t start_us;
+	/*! When the call's first event actually ran */
+	int64_t started_ns;
+	/*! When the peer should have become available, 0 if never */
+	int64_t trigger_ns;
+	/*! When BRIDGEPEERID was first set, 0 if never */
+	int64_t peer_ns;
+};
+
+struct label {
+	int index;
+	char name[0];
+};
+
+AST_VECTOR(replay_events, struct replay_event);
+
+struct trace {
+	struct replay_events events;
+	struct replay_call *calls;
+	size_t call_count;
+	/*! Call of every channel, by channel index */
+	unsigned int *chan_calls;
+	size_t chan_count;
+	size_t bridge_count;
+};
+
+struct worker {
+	pthread_t thread;
+	struct replay_events events;
+	/*! Scheduling lag of every event, ns */
+	int64_t *lags;
+	size_t lag_count;
+};
+
+static struct trace trace;
+static struct ast_channel **chans;
+static struct ast_bridge **bridges;
+static ast_mutex_t bridges_lock;
+static int64_t run_base_ns;
+static pthread_barrier_t start_barrier;
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_until(int64_t when_ns)
+{
+	struct timespec ts = {
+		.tv_sec = when_ns / 1000000000LL,
+		.tv_nsec = when_ns % 1000000000LL,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+	}
+}
+
+static int label_hash(const void *obj, int flags)
+{
+	return ast_str_hash((flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY
+		? obj : ((const struct label *) obj)->name);
+}
+
+static int label_cmp(void *obj, void *arg, int flags)
+{
+	const char *name = (flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY
+		? arg : ((const struct label *) arg)->name;
+
+	return strcmp(((struct label *) obj)->name, name) ? 0 : CMP_MATCH | CMP_STOP;
+}
+
+/*! \brief Index of a label, allocating the next one if it is new */
+static int label_index(struct ao2_container *labels, const char *name, size_t *count)
+{
+	struct label *label = ao2_find(labels, name, OBJ_SEARCH_KEY);
+	int index;
+
+	if (!label) {
+		label = ao2_alloc_options(sizeof(*label) + strlen(name) + 1, NULL,
+			AO2_ALLOC_OPT_LOCK_NOLOCK);
+		if (!label) {
+			return -1;
+		}
+		label->index = (*count)++;
+		strcpy(label->name, name); /* Safe */
+		ao2_link(labels, label);
+	}
+	index = label->index;
+	ao2_ref(label, -1);
+	return index;
+}
+
+static int event_cmp_trace(const void *a, const void *b)
+{
+	const struct replay_event *left = a;
+	const struct replay_event *right = b;
+
+	return left->at_us < right->at_us ? -1 : left->at_us > right->at_us;
+}
+
+static int event_cmp_run(const void *a, const void *b)
+{
+	const struct replay_event *left = a;
+	const struct replay_event *right = b;
+
+	return left->run_ns < right->run_ns ? -1 : left->run_ns > right->run_ns;
+}
+
+static int trace_load(FILE *f)
+{
+	struct ao2_container *calls;
+	struct ao2_container *channels;
+	struct ao2_container *bridge_labels;
+	AST_VECTOR(, unsigned int) chan_calls;
+	char line[512];
+	int lineno = 0;
+	int res = -1;
+	size_t i;
+
+	calls = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_NOLOCK, 0, LABEL_BUCKETS,
+		label_hash, NULL, label_cmp);
+	channels = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_NOLOCK, 0, LABEL_BUCKETS,
+		label_hash, NULL, label_cmp);
+	bridge_labels = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_NOLOCK, 0, LABEL_BUCKETS,
+		label_hash, NULL, label_cmp);
+	if (!calls || !channels || !bridge_labels || AST_VECTOR_INIT(&trace.events, 1024)
+		|| AST_VECTOR_INIT(&chan_calls, 1024)) {
+		goto done;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		struct replay_event event = { .other = -1, };
+		char call[128];
+		char op[32];
+		char arg1[128];
+		char arg2[128] = "";
+		double at_ms;
+		int fields;
+		int call_index;
+
+		lineno++;
+		if (line[strspn(line, " \t")] == '#' || line[strspn(line, " \t\r\n")] == '\0') {
+			continue;
+		}
+		fields = sscanf(line, "%30lf %127s %31s %127s %127s", &at_ms, call, op, arg1, arg2);
+		if (fields < 4) {
+			fprintf(stderr, "line %d: expected <time ms> <call> <event> <args>\n", lineno);
+			goto done;
+		}
+		event.at_us = llround(at_ms * 1000);
+		call_index = label_index(calls, call, &trace.call_count);
+		if (call_index < 0) {
+			goto done;
+		}
+		event.call = call_index;
+
+		if (!strcmp(op, "create")) {
+			event.op = OP_CREATE;
+		} else if (!strcmp(op, "findpeer")) {
+			event.op = OP_FINDPEER;
+		} else if (!strcmp(op, "bridgemon")) {
+			event.op = OP_BRIDGEMON;
+		} else if (!strcmp(op, "enter") && fields == 5) {
+			event.op = OP_ENTER;
+		} else if (!strcmp(op, "leave")) {
+			event.op = OP_LEAVE;
+		} else if (!strcmp(op, "hangup")) {
+			event.op = OP_HANGUP;
+		} else {
+			fprintf(stderr, "line %d: unknown event '%s'\n", lineno, op);
+			goto done;
+		}
+
+		if (event.op == OP_ENTER) {
+			event.other = label_index(bridge_labels, arg1, &trace.bridge_count);
+			event.chan = label_index(channels, arg2, &trace.chan_count);
+		} else {
+			event.chan = label_index(channels, arg1, &trace.chan_count);
+			if (event.op == OP_CREATE && fields == 5) {
+				event.other = label_index(channels, arg2, &trace.chan_count);
+			}
+		}
+		/* A channel belongs to the call that creates it */
+		while (AST_VECTOR_SIZE(&chan_calls) < trace.chan_count) {
+			AST_VECTOR_APPEND(&chan_calls, event.call);
+		}
+		if (event.op == OP_CREATE) {
+			AST_VECTOR_GET(&chan_calls, event.chan) = event.call;
+		}
+		if (AST_VECTOR_APPEND(&trace.events, event)) {
+			goto done;
+		}
+	}
+
+	qsort(trace.events.elems, AST_VECTOR_SIZE(&trace.events), sizeof(struct replay_event),
+		event_cmp_trace);
+	trace.calls = ast_calloc(MAX(trace.call_count, 1U), sizeof(*trace.calls));
+	if (!trace.calls) {
+		goto done;
+	}
+	for (i = 0; i < trace.call_count; i++) {
+		trace.calls[i].start_us = -1;
+	}
+	for (i = 0; i < AST_VECTOR_SIZE(&trace.events); i++) {
+		struct replay_event *event = AST_VECTOR_GET_ADDR(&trace.events, i);
+
+		if (trace.calls[event->call].start_us < 0) {
+			trace.calls[event->call].start_us = event->at_us;
+		}
+	}
+	trace.chan_calls = chan_calls.elems;
+	chan_calls.elems = NULL;
+	res = 0;
+
+done:
+	AST_VECTOR_FREE(&chan_calls);
+	ao2_cleanup(calls);
+	ao2_cleanup(channels);
+	ao2_cleanup(bridge_labels);
+	return res;
+}
+
+/*! \brief Note when BRIDGEPEERID first shows up on a call's channel */
+static void setvar_observer(struct ast_channel *chan, const char *name, const char *value)
+{
+	const char *slot;
+	struct replay_call *call;
+	int index;
+
+	if (strcmp(name, "BRIDGEPEERID") || ast_strlen_zero(value)) {
+		return;
+	}
+	slot = strchr(ast_channel_name(chan), '/');
+	if (!slot || sscanf(slot + 1, "%30d", &index) != 1
+		|| index < 0 || (size_t) index >= trace.chan_count) {
+		return;
+	}
+	call = &trace.calls[trace.chan_calls[index]];
+	if (!call->peer_ns) {
+		__sync_bool_compare_and_swap(&call->peer_ns, 0, now_ns() - run_base_ns);
+	}
+}
+
+static struct ast_bridge *bridge_get(int index)
+{
+	struct ast_bridge *bridge;
+
+	ast_mutex_lock(&bridges_lock);
+	if (!bridges[index]) {
+		bridges[index] = shim_bridge_alloc();
+	}
+	bridge = bridges[index];
+	ast_mutex_unlock(&bridges_lock);
+	return bridge;
+}
+
+static void trigger(struct replay_call *call, int64_t when_ns)
+{
+	if (!call->trigger_ns) {
+		call->trigger_ns = MAX(when_ns, 1);
+	}
+}
+
+static void event_run(struct replay_event *event)
+{
+	struct replay_call *call = &trace.calls[event->call];
+	struct ast_channel *chan = chans[event->chan];
+	char name[AST_CHANNEL_NAME];
+
+	if (event->op != OP_CREATE && !chan) {
+		return;
+	}
+
+	switch (event->op) {
+	case OP_CREATE:
+		if (chan) {
+			return;
+		}
+		snprintf(name, sizeof(name), "Replay/%d", event->chan);
+		chan = event->other >= 0 ? chans[event->other] : NULL;
+		chans[event->chan] = shim_channel_alloc(name, chan ? ast_channel_linkedid(chan) : NULL);
+		break;
+	case OP_FINDPEER:
+		trigger(call, event->run_ns);
+		shim_app_exec("FindPeer", chan, "");
+		break;
+	case OP_BRIDGEMON:
+		shim_app_exec("BridgeMon", chan, "");
+		break;
+	case OP_ENTER: {
+		struct ast_bridge *bridge = bridge_get(event->other);
+
+		if (!bridge) {
+			return;
+		}
+		shim_bridge_join(bridge, chan);
+		if (ao2_container_count(bridge->channels) >= 2) {
+			trigger(call, event->run_ns);
+		}
+		break;
+	}
+	case OP_LEAVE:
+		shim_bridge_leave(chan);
+		break;
+	case OP_HANGUP:
+		chans[event->chan] = NULL;
+		shim_channel_hangup(chan);
+		break;
+	}
+}
+
+static void *worker_run(void *data)
+{
+	struct worker *worker = data;
+	size_t i;
+
+	pthread_barrier_wait(&start_barrier);
+	for (i = 0; i < AST_VECTOR_SIZE(&worker->events); i++) {
+		struct replay_event *event = AST_VECTOR_GET_ADDR(&worker->events, i);
+		int64_t when = run_base_ns + event->run_ns;
+		int64_t lag;
+
+		sleep_until(when);
+		lag = now_ns() - when;
+		worker->lags[worker->lag_count++] = lag;
+		if (!trace.calls[event->call].started_ns) {
+			trace.calls[event->call].started_ns = when + lag - run_base_ns;
+		}
+		event_run(event);
+	}
+	return NULL;
+}
+
+static int cmp_i64(const void *a, const void *b)
+{
+	int64_t left = *(const int64_t *) a;
+	int64_t right = *(const int64_t *) b;
+
+	return left < right ? -1 : left > right;
+}
+
+static double pct_us(const int64_t *sorted, size_t count, double p)
+{
+	return count ? sorted[(size_t) (p * (count - 1))] / 1000.0 : 0;
+}
+
+static double rusage_us(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec * 1e6 + usage.ru_utime.tv_usec
+		+ usage.ru_stime.tv_sec * 1e6 + usage.ru_stime.tv_usec;
+}
+
+/*!
+ * \brief Replay the trace once
+ *
+ * \param cps Target call rate, 0 for the trace's own pace
+ * \param speed Divisor applied to the time within each call
+ * \param threads Number of replay threads
+ */
+static int replay_run(double cps, double speed, unsigned int threads)
+{
+	struct worker workers[threads];
+	int64_t first_start = trace.call_count ? trace.calls[0].start_us : 0;
+	int64_t last_start = first_start;
+	int64_t *latencies;
+	int64_t *lags;
+	size_t latency_count = 0;
+	size_t lag_count = 0;
+	size_t unresolved = 0;
+	int64_t first_started = INT64_MAX;
+	int64_t last_started = 0;
+	double arrival_scale = 1.0;
+	double cpu_us;
+	int64_t elapsed;
+	size_t i;
+
+	for (i = 0; i < trace.call_count; i++) {
+		first_start = MIN(first_start, trace.calls[i].start_us);
+		last_start = MAX(last_start, trace.calls[i].start_us);
+		trace.calls[i].started_ns = 0;
+		trace.calls[i].trigger_ns = 0;
+		trace.calls[i].peer_ns = 0;
+	}
+	if (cps > 0 && trace.call_count > 1 && last_start > first_start) {
+		double trace_cps = (trace.call_count - 1) * 1e6 / (last_start - first_start);
+
+		arrival_scale = trace_cps / cps;
+	}
+
+	chans = ast_calloc(MAX(trace.chan_count, 1U), sizeof(*chans));
+	bridges = ast_calloc(MAX(trace.bridge_count, 1U), sizeof(*bridges));
+	latencies = ast_calloc(MAX(trace.call_count, 1U), sizeof(*latencies));
+	lags = ast_calloc(MAX(AST_VECTOR_SIZE(&trace.events), 1U), sizeof(*lags));
+	if (!chans || !bridges || !latencies || !lags) {
+		return -1;
+	}
+
+	/* Calls stay on one thread so their own events run in order */
+	for (i = 0; i < threads; i++) {
+		AST_VECTOR_INIT(&workers[i].events, AST_VECTOR_SIZE(&trace.events) / threads + 1);
+		workers[i].lags = lags;
+		workers[i].lag_count = 0;
+	}
+	for (i = 0; i < AST_VECTOR_SIZE(&trace.events); i++) {
+		struct replay_event event = AST_VECTOR_GET(&trace.events, i);
+		struct replay_call *call = &trace.calls[event.call];
+
+		event.run_ns = ((call->start_us - first_start) * arrival_scale
+			+ (event.at_us - call->start_us) / speed) * 1000;
+		AST_VECTOR_APPEND(&workers[event.call % threads].events, event);
+	}
+	for (i = 0; i < threads; i++) {
+		qsort(workers[i].events.elems, AST_VECTOR_SIZE(&workers[i].events),
+			sizeof(struct replay_event), event_cmp_run);
+		workers[i].lags = lags + lag_count;
+		lag_count += AST_VECTOR_SIZE(&workers[i].events);
+	}
+
+	pthread_barrier_init(&start_barrier, NULL, threads + 1);
+	for (i = 0; i < threads; i++) {
+		pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+	}
+	cpu_us = rusage_us();
+	run_base_ns = now_ns() + 10000000;
+	pthread_barrier_wait(&start_barrier);
+	for (i = 0; i < threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	shim_taskprocessors_wait();
+	elapsed = now_ns() - run_base_ns;
+	cpu_us = rusage_us() - cpu_us;
+
+	/* Whatever the trace left up */
+	for (i = 0; i < trace.chan_count; i++) {
+		if (chans[i]) {
+			shim_channel_hangup(chans[i]);
+		}
+	}
+	for (i = 0; i < trace.bridge_count; i++) {
+		ao2_cleanup(bridges[i]);
+	}
+	shim_taskprocessors_wait();
+
+	for (i = 0; i < trace.call_count; i++) {
+		struct replay_call *call = &trace.calls[i];
+
+		first_started = MIN(first_started, call->started_ns);
+		last_started = MAX(last_started, call->started_ns);
+		if (!call->trigger_ns) {
+			continue;
+		}
+		if (!call->peer_ns) {
+			unresolved++;
+			continue;
+		}
+		latencies[latency_count++] = MAX(call->peer_ns - call->trigger_ns, 0);
+	}
+	qsort(latencies, latency_count, sizeof(*latencies), cmp_i64);
+	qsort(lags, lag_count, sizeof(*lags), cmp_i64);
+
+	printf("%8.0f %7zu %8.2f %8.1f %9.1f %9.1f %9.1f %9.1f %7zu %9.1f %9.1f\n",
+		cps > 0 ? cps : (trace.call_count - 1) * 1e6 / MAX(last_start - first_start, 1),
+		trace.call_count, elapsed / 1e9,
+		last_started > first_started ? (trace.call_count - 1) * 1e9 / (last_started - first_started) : 0,
+		pct_us(latencies, latency_count, 0.50),
+		pct_us(latencies, latency_count, 0.99),
+		pct_us(latencies, latency_count, 0.999),
+		latency_count ? latencies[latency_count - 1] / 1000.0 : 0,
+		unresolved,
+		cpu_us / MAX(trace.call_count, 1U),
+		pct_us(lags, lag_count, 0.99));
+	fflush(stdout);
+
+	for (i = 0; i < threads; i++) {
+		AST_VECTOR_FREE(&workers[i].events);
+	}
+	ast_free(chans);
+	ast_free(bridges);
+	ast_free(latencies);
+	ast_free(lags);
+	chans = NULL;
+	bridges = NULL;
+	return 0;
+}
+
+static double uniform(unsigned int *seed)
+{
+	return (rand_r(seed) + 1.0) / (RAND_MAX + 2.0);
+}
+
+/*!
+ * \brief Write a synthetic trace
+ *
+ * Poisson arrivals; each call rings for 1-5 s, talks for an exponentially
+ * distributed time averaging 60 s, and one in ten is blind transferred to a
+ * third party half way through.
+ */
+static void trace_generate(unsigned int calls, double cps)
+{
+	unsigned int seed = 42;
+	double t = 0;
+	unsigned int i;
+
+	printf("# bridgemon call trace: <time ms> <call> <event> <args>\n");
+	printf("# synthetic, %u calls at %.0f cps\n", calls, cps);
+	for (i = 0; i < calls; i++) {
+		double ring = 1000 + 4000 * uniform(&seed);
+		double talk = -60000 * log(uniform(&seed));
+		double answer = t + ring;
+		double end = answer + talk;
+
+		printf("%.3f c%u create a%u\n", t, i, i);
+		printf("%.3f c%u bridgemon a%u\n", t, i, i);
+		printf("%.3f c%u create b%u a%u\n", t + 2, i, i, i);
+		printf("%.3f c%u findpeer b%u\n", answer, i, i);
+		printf("%.3f c%u enter br%u a%u\n", answer + 1, i, i, i);
+		printf("%.3f c%u enter br%u b%u\n", answer + 1, i, i, i);
+		if (rand_r(&seed) % 10 == 0) {
+			double transfer = answer + talk / 2;
+
+			printf("%.3f c%u leave b%u\n", transfer, i, i);
+			printf("%.3f c%u hangup b%u\n", transfer, i, i);
+			printf("%.3f c%u create x%u a%u\n", transfer + 1, i, i, i);
+			printf("%.3f c%u enter br%u x%u\n", transfer + 3000, i, i, i);
+			printf("%.3f c%u hangup x%u\n", end, i, i);
+		} else {
+			printf("%.3f c%u hangup b%u\n", end, i, i);
+		}
+		printf("%.3f c%u hangup a%u\n", end, i, i);
+		t += -1000.0 / cps * log(uniform(&seed));
+	}
+}
+
+static int parse_rates(const char *arg, double *rates, size_t *count)
+{
+	char *copy = ast_strdupa(arg);
+	char *value;
+
+	*count = 0;
+	while ((value = strsep(&copy, ",")) && *count < MAX_RATES) {
+		if (sscanf(value, "%30lf", &rates[*count]) != 1 || rates[*count] <= 0) {
+			return -1;
+		}
+		(*count)++;
+	}
+	return *count ? 0 : -1;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-c cps,...] [-s speed] [-t threads] [-o option=value] trace|-\n"
+		"       %s -g calls [-G cps]\n", argv0, argv0);
+}
+
+int main(int argc, char *argv[])
+{
+	double rates[MAX_RATES] = { 0 };
+	size_t rate_count = 1;
+	double speed = 1.0;
+	double generate_cps = 100;
+	unsigned int generate = 0;
+	unsigned int threads = 4;
+	FILE *f;
+	size_t i;
+	int opt;
+
+	ast_mutex_init(&bridges_lock);
+	shim_config_clear("bridgemon.conf");
+
+	while ((opt = getopt(argc, argv, "c:s:t:o:g:G:")) != -1) {
+		char *value;
+		int res = 0;
+
+		switch (opt) {
+		case 'c':
+			res = parse_rates(optarg, rates, &rate_count);
+			break;
+		case 's':
+			res = sscanf(optarg, "%30lf", &speed) == 1 && speed > 0 ? 0 : -1;
+			break;
+		case 't':
+			res = sscanf(optarg, "%30u", &threads) == 1 && threads ? 0 : -1;
+			break;
+		case 'o':
+			value = strchr(optarg, '=');
+			if (!value) {
+				res = -1;
+				break;
+			}
+			*value++ = '\0';
+			shim_config_set("bridgemon.conf", "general", optarg, value);
+			break;
+		case 'g':
+			res = sscanf(optarg, "%30u", &generate) == 1 && generate ? 0 : -1;
+			break;
+		case 'G':
+			res = sscanf(optarg, "%30lf", &generate_cps) == 1 && generate_cps > 0 ? 0 : -1;
+			break;
+		default:
+			res = -1;
+		}
+		if (res) {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (generate) {
+		trace_generate(generate, generate_cps);
+		return 0;
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	f = strcmp(argv[optind], "-") ? fopen(argv[optind], "r") : stdin;
+	if (!f) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (trace_load(f)) {
+		return 1;
+	}
+	if (f != stdin) {
+		fclose(f);
+	}
+
+	if (shim_module_load() != AST_MODULE_LOAD_SUCCESS) {
+		fprintf(stderr, "Unable to load app_bridgemon\n");
+		return 1;
+	}
+	shim_setvar_observer_set(setvar_observer);
+
+	printf("%d calls, %zu channels, %zu bridges, %zu events, %u threads, speed %.1fx\n",
+		(int) trace.call_count, trace.chan_count, trace.bridge_count,
+		AST_VECTOR_SIZE(&trace.events), threads, speed);
+	printf("Latencies in us from the event that makes the peer known to BRIDGEPEERID being set\n");
+	printf("%8s %7s %8s %8s %9s %9s %9s %9s %7s %9s %9s\n",
+		"cps", "calls", "seconds", "achieved", "p50", "p99", "p999", "max",
+		"nopeer", "cpu/call", "lag p99");
+	for (i = 0; i < rate_count; i++) {
+		replay_run(rates[i], speed, threads);
+	}
+
+	shim_setvar_observer_set(NULL);
+	shim_module_unload();
+	return 0;
+}
@@ -0,0 +1,54 @@
+/*
+ * app_bridgemon peer change feed
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the COPYING file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Record format of the peer change feed
+ *
+ * With peer_feed set in bridgemon.conf the module listens on that Unix
+ * domain stream socket and pushes a record to every connected subscriber
+ * each time it records a channel's peer or forgets it on hangup. Subscribers
+ * only read; records start from the moment they connect.
+ *
+ * Each record is a struct bridgemon_feed_record in host byte order followed
+ * by uniqueid_len bytes of uniqueid and peer_len bytes of peer, neither NUL
+ * terminated. length covers everything after the length field itself, so a
+ * reader can skip record types it does not know.
+ *
+ * A subscriber that falls more than peer_feed_queue records behind loses the
+ * oldest ones. seq is module wide and increases by one per record, so a gap
+ * tells the subscriber how many it missed; resynchronise from the peer
+ * table or PEERID() if it matters.
+ */
+
+#ifndef _BRIDGEMON_FEED_H
+#define _BRIDGEMON_FEED_H
+
+#include <stdint.h>
+
+enum bridgemon_feed_type {
+	/*! The channel's peer was recorded or changed */
+	BRIDGEMON_FEED_ASSIGN = 1,
+	/*! The channel hung up, peer_len is 0 */
+	BRIDGEMON_FEED_REMOVE = 2,
+};
+
+struct bridgemon_feed_record {
+	/*! Bytes following this field */
+	uint32_t length;
+	/*! \ref bridgemon_feed_type */
+	uint8_t type;
+	uint8_t uniqueid_len;
+	uint16_t peer_len;
+	/*! Module wide sequence number */
+	uint64_t seq;
+	/*! When the change was recorded, microseconds since the epoch */
+	uint64_t time_us;
+};
+
+#endif /* _BRIDGEMON_FEED_H */
@@ -0,0 +1,188 @@
+/*
+ * app_bridgemon shared memory peer table
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the COPYING file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Reader side of the shared memory peer table
+ *
+ * Plain C with no Asterisk dependency, for linking into the processes that
+ * consume the table.
+ */
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bridgemon_peertable.h"
+
+struct bridgemon_peertable {
+	const struct bridgemon_peertable_header *header;
+	const struct bridgemon_peertable_slot *slots;
+	size_t size;
+	char name[256];
+};
+
+static int table_map(struct bridgemon_peertable *table)
+{
+	const struct bridgemon_peertable_header *header;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = shm_open(table->name, O_RDONLY, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st) || (size_t) st.st_size < sizeof(*header)) {
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+
+	header = map;
+	if (header->magic != BRIDGEMON_PEERTABLE_MAGIC
+		|| header->version != BRIDGEMON_PEERTABLE_VERSION
+		|| header->slot_size != sizeof(struct bridgemon_peertable_slot)
+		|| !header->slot_count || (header->slot_count & (header->slot_count - 1))
+		|| sizeof(*header) + header->slot_count * sizeof(struct bridgemon_peertable_slot)
+			> (size_t) st.st_size) {
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	table->header = header;
+	table->slots = (const struct bridgemon_peertable_slot *) (header + 1);
+	table->size = st.st_size;
+	return 0;
+}
+
+static void table_unmap(struct bridgemon_peertable *table)
+{
+	if (table->header) {
+		munmap((void *) table->header, table->size);
+		table->header = NULL;
+		table->slots = NULL;
+	}
+}
+
+struct bridgemon_peertable *bridgemon_peertable_open(const char *name)
+{
+	struct bridgemon_peertable *table;
+
+	if (!name || strlen(name) >= sizeof(table->name)) {
+		return NULL;
+	}
+	table = calloc(1, sizeof(*table));
+	if (!table) {
+		return NULL;
+	}
+	strcpy(table->name, name); /* Safe */
+	if (table_map(table)) {
+		free(table);
+		return NULL;
+	}
+	return table;
+}
+
+void bridgemon_peertable_close(struct bridgemon_peertable *table)
+{
+	if (!table) {
+		return;
+	}
+	table_unmap(table);
+	free(table);
+}
+
+/*!
+ * \brief Take a consistent copy of a slot
+ *
+ * Spins while the module is writing it, which is a few stores long.
+ */
+static void slot_read(const struct bridgemon_peertable_slot *slot,
+	struct bridgemon_peertable_slot *copy)
+{
+	uint32_t seq;
+
+	for (;;) {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			continue;
+		}
+		memcpy(copy, slot, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+			break;
+		}
+	}
+	copy->uniqueid[sizeof(copy->uniqueid) - 1] = '\0';
+	copy->peer[sizeof(copy->peer) - 1] = '\0';
+}
+
+int bridgemon_peertable_lookup(struct bridgemon_peertable *table, const char *uniqueid,
+	char *peer, size_t len)
+{
+	uint64_t hash = bridgemon_peertable_hash(uniqueid);
+
+	for (;;) {
+		const struct bridgemon_peertable_header *header = table->header;
+		struct bridgemon_peertable_slot copy;
+		uint64_t mask;
+		uint64_t seq;
+		uint64_t i;
+		int res = -1;
+
+		if (!header || __atomic_load_n(&header->closed, __ATOMIC_ACQUIRE)) {
+			/* The module was unloaded or made a new table */
+			table_unmap(table);
+			if (table_map(table)) {
+				return -2;
+			}
+			continue;
+		}
+
+		seq = __atomic_load_n(&header->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+
+		mask = header->slot_count - 1;
+		for (i = 0; i <= mask; i++) {
+			slot_read(&table->slots[(hash + i) & mask], &copy);
+			if (copy.state == BRIDGEMON_PEERTABLE_EMPTY) {
+				break;
+			}
+			if (copy.state == BRIDGEMON_PEERTABLE_LIVE && copy.hash == hash
+				&& !strcmp(copy.uniqueid, uniqueid)) {
+				res = 0;
+				break;
+			}
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&header->seq, __ATOMIC_RELAXED) != seq) {
+			continue;
+		}
+		if (!res && len) {
+			size_t n = strlen(copy.peer);
+
+			n = n < len - 1 ? n : len - 1;
+			memcpy(peer, copy.peer, n);
+			peer[n] = '\0';
+		}
+		return res;
+	}
+}
@@ -0,0 +1,131 @@
+/*
+ * app_bridgemon shared memory peer table
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the COPYING file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Layout and reader API of the shared memory peer table
+ *
+ * With peer_table set in bridgemon.conf the module publishes every
+ * uniqueid to peer uniqueid mapping it records into a POSIX shared memory
+ * object (/dev/shm/<name>), so processes on the same host can read peers
+ * without going through ARI or AMI.
+ *
+ * The object is a header followed by a power of two number of fixed size
+ * slots, open addressed with linear probing on bridgemon_peertable_hash().
+ * The module is the only writer. Every slot is guarded by its own seqlock,
+ * odd while the slot is being written, and the header carries a table wide
+ * one that is odd while the module compacts the table; readers retry on
+ * either. Removed mappings leave tombstones until the next compaction.
+ *
+ * Readers link bridgemon_peertable.c, or follow the same protocol.
+ */
+
+#ifndef _BRIDGEMON_PEERTABLE_H
+#define _BRIDGEMON_PEERTABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*! \brief "BMPEERS\0" in the header of a table in use */
+#define BRIDGEMON_PEERTABLE_MAGIC 0x0053524545504d42ULL
+
+#define BRIDGEMON_PEERTABLE_VERSION 1
+
+/*! \brief Longest uniqueid published, including the terminator */
+#define BRIDGEMON_PEERTABLE_ID_LEN 64
+
+/*! \brief Longest peer value published, including the terminator */
+#define BRIDGEMON_PEERTABLE_PEER_LEN 176
+
+enum bridgemon_peertable_state {
+	/*! Never used since the last compaction, ends a probe */
+	BRIDGEMON_PEERTABLE_EMPTY,
+	/*! Holds a mapping */
+	BRIDGEMON_PEERTABLE_LIVE,
+	/*! Held a mapping that was removed, probes continue past it */
+	BRIDGEMON_PEERTABLE_TOMBSTONE,
+};
+
+struct bridgemon_peertable_header {
+	uint64_t magic;
+	uint32_t version;
+	/*! Size of a slot in bytes */
+	uint32_t slot_size;
+	/*! Number of slots, a power of two */
+	uint64_t slot_count;
+	/*! Table wide seqlock, odd while the table is being compacted */
+	uint64_t seq;
+	/*! Non-zero once the module has stopped writing; reopen the table */
+	uint32_t closed;
+	uint32_t reserved;
+	/*! Live mappings */
+	uint64_t live;
+	/*! Tombstones */
+	uint64_t tombstones;
+	/*! Mappings not published because the table was full or the uniqueid too long */
+	uint64_t dropped;
+	uint8_t pad[64];
+};
+
+struct bridgemon_peertable_slot {
+	/*! Slot seqlock, odd while the slot is being written */
+	uint32_t seq;
+	/*! \ref bridgemon_peertable_state */
+	uint32_t state;
+	/*! bridgemon_peertable_hash() of the uniqueid */
+	uint64_t hash;
+	char uniqueid[BRIDGEMON_PEERTABLE_ID_LEN];
+	/*! Peer uniqueid, or comma separated roster with resolve = bridge */
+	char peer[BRIDGEMON_PEERTABLE_PEER_LEN];
+};
+
+/*! \brief FNV-1a of a uniqueid, never 0 */
+static inline uint64_t bridgemon_peertable_hash(const char *uniqueid)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for (; *uniqueid; uniqueid++) {
+		hash = (hash ^ (unsigned char) *uniqueid) * 0x100000001b3ULL;
+	}
+	return hash ? hash : 1;
+}
+
+/*! \brief A reader's mapping of the table */
+struct bridgemon_peertable;
+
+/*!
+ * \brief Map a peer table for reading
+ *
+ * \param name Shared memory object name, as set with peer_table
+ *
+ * \return The table, NULL if it does not exist or is not a peer table
+ */
+struct bridgemon_peertable *bridgemon_peertable_open(const char *name);
+
+/*! \brief Unmap a peer table */
+void bridgemon_peertable_close(struct bridgemon_peertable *table);
+
+/*!
+ * \brief Look up the peer of a channel
+ *
+ * Lock free; never blocks the module. If the module has recreated the table
+ * since it was opened, the new one is mapped first.
+ *
+ * \param table Table from bridgemon_peertable_open()
+ * \param uniqueid Channel uniqueid
+ * \param peer Receives the peer value
+ * \param len Size of \a peer
+ *
+ * \retval 0 if found
+ * \retval -1 if the channel has no published peer
+ * \retval -2 if the table is unavailable
+ */
+int bridgemon_peertable_lookup(struct bridgemon_peertable *table, const char *uniqueid,
+	char *peer, size_t len);
+
+#endif /* _BRIDGEMON_PEERTABLE_H */
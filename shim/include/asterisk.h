@@ -0,0 +1,1100 @@
+/*
+ * Asterisk API shim
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the COPYING file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Minimal stand-in for the Asterisk headers used by the modules
+ *
+ * Only the declarations app_bridgemon.c and app_audiofork.c need are
+ * provided, with the same names and calling conventions as Asterisk 18, so
+ * the modules compile unchanged. The implementations live in shim/shim.c.
+ * Every asterisk/xxx.h include resolves to this file.
+ */
+
+#ifndef _SHIM_ASTERISK_H
+#define _SHIM_ASTERISK_H
+
+#include <alloca.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ASTERISK_GPL_KEY "This paragraph is copyright (c) 2006 by Digium, Inc."
+
+#define AST_CHANNEL_NAME 80
+#define AST_MAX_UNIQUEID 150
+#define AST_MAX_CONTEXT 80
+
+/* utils */
+
+#define ARRAY_LEN(a) (size_t) (sizeof(a) / sizeof(0[a]))
+#define MIN(a, b) ({ typeof(a) __a = (a); typeof(b) __b = (b); ((__a > __b) ? __b : __a); })
+#define MAX(a, b) ({ typeof(a) __a = (a); typeof(b) __b = (b); ((__a < __b) ? __b : __a); })
+#define S_OR(a, b) ({ typeof(&((a)[0])) __x = (a); (__x && *__x) ? __x : (b); })
+#define RAII_VAR(vartype, varname, initval, dtor) \
+	auto void _dtor_ ## varname (vartype * v); \
+	void _dtor_ ## varname (vartype * v) { dtor(*v); } \
+	vartype varname __attribute__((cleanup(_dtor_ ## varname))) = (initval)
+#define ast_assert(a) do { if (!(a)) { abort(); } } while (0)
+#define attribute_unused __attribute__((unused))
+
+#define ast_malloc(len) malloc(len)
+#define ast_calloc(num, len) calloc(num, len)
+#define ast_realloc(p, len) realloc(p, len)
+#define ast_free(p) free(p)
+#define ast_strdup(str) ({ const char *__s = (str); __s ? strdup(__s) : NULL; })
+#define ast_strdupa(s) ({ \
+	const char *__old = (s); \
+	size_t __len = strlen(__old) + 1; \
+	char *__new = __builtin_alloca(__len); \
+	memcpy(__new, __old, __len); \
+	__new; \
+})
+void ast_free_ptr(void *ptr);
+
+struct ast_flags {
+	unsigned int flags;
+};
+
+#define ast_test_flag(p, flag) ((p)->flags & (flag))
+#define ast_set_flag(p, flag) do { (p)->flags |= (flag); } while (0)
+#define ast_clear_flag(p, flag) do { (p)->flags &= ~(flag); } while (0)
+
+static inline int ast_atomic_fetchadd_int(volatile int *p, int v)
+{
+	return __sync_fetch_and_add(p, v);
+}
+
+static inline int ast_atomic_dec_and_test(volatile int *p)
+{
+	return __sync_sub_and_fetch(p, 1) == 0;
+}
+
+#define ast_atomic_fetch_add(ptr, val, memorder) __atomic_fetch_add((ptr), (val), (memorder))
+#define ast_atomic_fetch_sub(ptr, val, memorder) __atomic_fetch_sub((ptr), (val), (memorder))
+
+/*! \brief Kernel thread id of the calling thread */
+int ast_get_tid(void);
+
+long int ast_random(void);
+
+/* strings */
+
+static inline int ast_strlen_zero(const char *s)
+{
+	return !s || !*s;
+}
+
+static inline void ast_copy_string(char *dst, const char *src, size_t size)
+{
+	while (*src && size > 1) {
+		*dst++ = *src++;
+		size--;
+	}
+	*dst = '\0';
+}
+
+static inline char *ast_skip_blanks(const char *str)
+{
+	while (*str && ((unsigned char) *str) < 33) {
+		str++;
+	}
+	return (char *) str;
+}
+
+static inline char *ast_trim_blanks(char *str)
+{
+	char *work = str + strlen(str);
+
+	while (work > str && ((unsigned char) work[-1]) < 33) {
+		*--work = '\0';
+	}
+	return str;
+}
+
+static inline char *ast_strip(char *s)
+{
+	return ast_trim_blanks(ast_skip_blanks(s));
+}
+
+static inline int ast_str_hash(const char *str)
+{
+	unsigned int hash = 5381;
+
+	while (*str) {
+		hash = hash * 33 ^ (unsigned char) *str++;
+	}
+	return (int) (hash & 0x7fffffff);
+}
+
+int ast_true(const char *val);
+int ast_false(const char *val);
+
+struct ast_str;
+
+struct ast_str *ast_str_create(size_t init_len);
+int ast_str_set(struct ast_str **buf, ssize_t max_len, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+int ast_str_append(struct ast_str **buf, ssize_t max_len, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+char *ast_str_buffer(const struct ast_str *buf);
+size_t ast_str_strlen(const struct ast_str *buf);
+void ast_str_reset(struct ast_str *buf);
+
+/* logger */
+
+#define _A_ __FILE__, __LINE__, __PRETTY_FUNCTION__
+#define __LOG_DEBUG 0
+#define __LOG_NOTICE 2
+#define __LOG_WARNING 3
+#define __LOG_ERROR 4
+#define LOG_DEBUG __LOG_DEBUG, _A_
+#define LOG_NOTICE __LOG_NOTICE, _A_
+#define LOG_WARNING __LOG_WARNING, _A_
+#define LOG_ERROR __LOG_ERROR, _A_
+
+extern int option_verbose;
+extern int option_debug;
+
+void ast_log(int level, const char *file, int line, const char *function, const char *fmt, ...)
+	__attribute__((format(printf, 5, 6)));
+void __ast_verbose(const char *file, int line, const char *func, int level, const char *fmt, ...)
+	__attribute__((format(printf, 5, 6)));
+
+#define VERBOSITY_ATLEAST(level) (option_verbose >= (level))
+#define ast_verb(level, ...) do { \
+	if (VERBOSITY_ATLEAST(level)) { \
+		__ast_verbose(_A_, level, __VA_ARGS__); \
+	} \
+} while (0)
+#define ast_debug(level, ...) do { \
+	if (option_debug >= (level)) { \
+		ast_log(__LOG_DEBUG, _A_, __VA_ARGS__); \
+	} \
+} while (0)
+
+/* lock */
+
+typedef pthread_mutex_t ast_mutex_t;
+#define AST_MUTEX_DEFINE_STATIC(mutex) static ast_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER
+typedef pthread_cond_t ast_cond_t;
+
+int ast_mutex_init(ast_mutex_t *m);
+#define ast_mutex_destroy(m) pthread_mutex_destroy(m)
+#define ast_mutex_lock(m) pthread_mutex_lock(m)
+#define ast_mutex_unlock(m) pthread_mutex_unlock(m)
+#define ast_cond_init(c, a) pthread_cond_init(c, a)
+#define ast_cond_destroy(c) pthread_cond_destroy(c)
+#define ast_cond_wait(c, m) pthread_cond_wait(c, m)
+#define ast_cond_timedwait(c, m, t) pthread_cond_timedwait(c, m, t)
+#define ast_cond_signal(c) pthread_cond_signal(c)
+#define ast_cond_broadcast(c) pthread_cond_broadcast(c)
+
+#define AST_PTHREADT_NULL (pthread_t) -1
+#define ast_pthread_create_background(a, b, c, d) pthread_create(a, b, c, d)
+int ast_pthread_create_detached_background(pthread_t *thread, pthread_attr_t *attr,
+	void *(*start_routine)(void *), void *data);
+
+/* time */
+
+static inline struct timeval ast_tvnow(void)
+{
+	struct timeval t;
+
+	gettimeofday(&t, NULL);
+	return t;
+}
+
+static inline struct timeval ast_tv(long sec, long usec)
+{
+	struct timeval t = { .tv_sec = sec, .tv_usec = usec };
+
+	return t;
+}
+
+static inline int ast_tvzero(const struct timeval t)
+{
+	return t.tv_sec == 0 && t.tv_usec == 0;
+}
+
+static inline int ast_tvcmp(struct timeval a, struct timeval b)
+{
+	if (a.tv_sec != b.tv_sec) {
+		return a.tv_sec < b.tv_sec ? -1 : 1;
+	}
+	if (a.tv_usec != b.tv_usec) {
+		return a.tv_usec < b.tv_usec ? -1 : 1;
+	}
+	return 0;
+}
+
+static inline long long ast_tvdiff_us(struct timeval end, struct timeval start)
+{
+	return (end.tv_sec - start.tv_sec) * 1000000LL + end.tv_usec - start.tv_usec;
+}
+
+static inline long long ast_tvdiff_ms(struct timeval end, struct timeval start)
+{
+	return ((end.tv_sec - start.tv_sec) * 1000LL)
+		+ (((1000000 + end.tv_usec - start.tv_usec) / 1000) - 1000);
+}
+
+static inline struct timeval ast_samp2tv(unsigned int nsamp, unsigned int rate)
+{
+	return ast_tv(nsamp / rate, (nsamp % rate) * (1000000 / (float) rate));
+}
+
+struct timeval ast_tvadd(struct timeval a, struct timeval b);
+struct timeval ast_tvsub(struct timeval a, struct timeval b);
+
+/* localtime */
+
+struct ast_tm {
+	int tm_sec;
+	int tm_min;
+	int tm_hour;
+	int tm_mday;
+	int tm_mon;
+	int tm_year;
+	int tm_wday;
+	int tm_yday;
+	int tm_isdst;
+	long tm_gmtoff;
+	char *tm_zone;
+	int tm_usec;
+};
+
+struct ast_tm *ast_localtime(const struct timeval *timep, struct ast_tm *p_tm, const char *zone);
+int ast_strftime(char *buf, size_t len, const char *format, const struct ast_tm *tm);
+
+/* astobj2 */
+
+enum search_flags {
+	OBJ_UNLINK = (1 << 0),
+	OBJ_NODATA = (1 << 1),
+	OBJ_MULTIPLE = (1 << 2),
+	OBJ_NOLOCK = (1 << 4),
+	OBJ_SEARCH_MASK = (0x07 << 5),
+	OBJ_SEARCH_NONE = (0 << 5),
+	OBJ_SEARCH_OBJECT = (1 << 5),
+	OBJ_SEARCH_KEY = (2 << 5),
+	OBJ_SEARCH_PARTIAL_KEY = (4 << 5),
+	OBJ_POINTER = OBJ_SEARCH_OBJECT,
+	OBJ_KEY = OBJ_SEARCH_KEY,
+	OBJ_PARTIAL_KEY = OBJ_SEARCH_PARTIAL_KEY,
+};
+
+enum _cb_results {
+	CMP_MATCH = 0x1,
+	CMP_STOP = 0x2,
+};
+
+enum ao2_alloc_opts {
+	AO2_ALLOC_OPT_LOCK_MUTEX = (0 << 0),
+	AO2_ALLOC_OPT_LOCK_RWLOCK = (1 << 0),
+	AO2_ALLOC_OPT_LOCK_NOLOCK = (2 << 0),
+	AO2_ALLOC_OPT_LOCK_MASK = (3 << 0),
+};
+
+enum ao2_container_opts {
+	AO2_CONTAINER_ALLOC_OPT_DUPS_ALLOW = (0 << 1),
+	AO2_CONTAINER_ALLOC_OPT_DUPS_REJECT = (1 << 1),
+};
+
+enum ao2_iterator_flags {
+	AO2_ITERATOR_DONTLOCK = (1 << 0),
+	AO2_ITERATOR_UNLINK = (1 << 2),
+};
+
+struct ao2_container;
+
+/*!
+ * \brief Container iterator
+ *
+ * The shim takes a referenced snapshot of the container when the iterator is
+ * initialised instead of walking it under the container lock.
+ */
+struct ao2_iterator {
+	struct ao2_container *c;
+	void **objs;
+	size_t count;
+	size_t next;
+	int flags;
+};
+
+typedef void (*ao2_destructor_fn)(void *vdoomed);
+typedef int (ao2_hash_fn)(const void *obj, int flags);
+typedef int (ao2_sort_fn)(const void *obj_left, const void *obj_right, int flags);
+typedef int (ao2_callback_fn)(void *obj, void *arg, int flags);
+
+void *ao2_alloc_options(size_t data_size, ao2_destructor_fn destructor_fn, unsigned int options);
+#define ao2_alloc(data_size, destructor_fn) \
+	ao2_alloc_options(data_size, destructor_fn, AO2_ALLOC_OPT_LOCK_MUTEX)
+int ao2_ref(void *o, int delta);
+#define ao2_t_ref(o, delta, tag) ao2_ref(o, delta)
+#define ao2_bump(obj) ({ typeof(obj) __obj = (obj); if (__obj) { ao2_ref(__obj, +1); } __obj; })
+void ao2_cleanup(void *obj);
+#define ao2_replace(dst, src) ({ \
+	typeof(src) __src = (src); \
+	int __changed = (dst) != __src; \
+	if (__changed) { \
+		if (__src) { \
+			ao2_ref(__src, +1); \
+		} \
+		if (dst) { \
+			ao2_ref(dst, -1); \
+		} \
+		(dst) = __src; \
+	} \
+	__changed; \
+})
+
+int ao2_lock(void *obj);
+int ao2_unlock(void *obj);
+int ao2_trylock(void *obj);
+int ao2_rdlock(void *obj);
+int ao2_wrlock(void *obj);
+
+struct ao2_container *ao2_container_alloc_hash(unsigned int ao2_options,
+	unsigned int container_options, unsigned int n_buckets, ao2_hash_fn *hash_fn,
+	ao2_sort_fn *sort_fn, ao2_callback_fn *cmp_fn);
+struct ao2_container *ao2_container_alloc_list(unsigned int ao2_options,
+	unsigned int container_options, ao2_sort_fn *sort_fn, ao2_callback_fn *cmp_fn);
+int ao2_container_count(struct ao2_container *c);
+int ao2_link_flags(struct ao2_container *c, void *obj_new, int flags);
+#define ao2_link(container, obj) ao2_link_flags(container, obj, 0)
+void *ao2_unlink_flags(struct ao2_container *c, void *obj, int flags);
+#define ao2_unlink(container, obj) ao2_unlink_flags(container, obj, 0)
+void *ao2_callback(struct ao2_container *c, int flags, ao2_callback_fn *cb_fn, void *arg);
+void *ao2_find(struct ao2_container *c, const void *arg, int flags);
+int ao2_match_by_addr(void *obj, void *arg, int flags);
+
+struct ao2_iterator ao2_iterator_init(struct ao2_container *c, int flags);
+void *ao2_iterator_next(struct ao2_iterator *iter);
+void ao2_iterator_destroy(struct ao2_iterator *iter);
+
+/* vector */
+
+#define AST_VECTOR(name, type) \
+	struct name { \
+		type *elems; \
+		size_t max; \
+		size_t current; \
+	}
+
+#define AST_VECTOR_INIT(vec, size) ({ \
+	size_t __size = (size); \
+	(vec)->elems = __size ? ast_calloc(__size, sizeof(*(vec)->elems)) : NULL; \
+	(vec)->max = (vec)->elems ? __size : 0; \
+	(vec)->current = 0; \
+	(__size && !(vec)->elems) ? -1 : 0; \
+})
+
+#define AST_VECTOR_FREE(vec) do { \
+	ast_free((vec)->elems); \
+	(vec)->elems = NULL; \
+	(vec)->max = 0; \
+	(vec)->current = 0; \
+} while (0)
+
+#define AST_VECTOR_SIZE(vec) (vec)->current
+#define AST_VECTOR_GET(vec, idx) ((vec)->elems[(idx)])
+#define AST_VECTOR_GET_ADDR(vec, idx) (&(vec)->elems[(idx)])
+
+#define AST_VECTOR_APPEND(vec, elem) ({ \
+	int __res = 0; \
+	if ((vec)->current + 1 > (vec)->max) { \
+		size_t __new_max = (vec)->max ? 2 * (vec)->max : 1; \
+		typeof((vec)->elems) __new = ast_realloc((vec)->elems, __new_max * sizeof(*(vec)->elems)); \
+		if (__new) { \
+			(vec)->elems = __new; \
+			(vec)->max = __new_max; \
+		} else { \
+			__res = -1; \
+		} \
+	} \
+	if (!__res) { \
+		(vec)->elems[(vec)->current++] = (elem); \
+	} \
+	__res; \
+})
+
+#define AST_VECTOR_REMOVE_ORDERED(vec, idx) ({ \
+	size_t __idx = (idx); \
+	typeof((vec)->elems[0]) __removed = (vec)->elems[__idx]; \
+	memmove(&(vec)->elems[__idx], &(vec)->elems[__idx + 1], \
+		((vec)->current - __idx - 1) * sizeof(*(vec)->elems)); \
+	(vec)->current--; \
+	__removed; \
+})
+
+#define AST_VECTOR_REMOVE_CMP_ORDERED(vec, value, cmp, cleanup) ({ \
+	int __res = -1; \
+	size_t __idx; \
+	typeof(value) __value = (value); \
+	for (__idx = 0; __idx < (vec)->current; ++__idx) { \
+		if (cmp((vec)->elems[__idx], __value)) { \
+			cleanup((vec)->elems[__idx]); \
+			memmove(&(vec)->elems[__idx], &(vec)->elems[__idx + 1], \
+				((vec)->current - __idx - 1) * sizeof(*(vec)->elems)); \
+			(vec)->current--; \
+			__res = 0; \
+			break; \
+		} \
+	} \
+	__res; \
+})
+
+#define AST_VECTOR_REMOVE_CMP_UNORDERED(vec, value, cmp, cleanup) ({ \
+	int __res = -1; \
+	size_t __idx; \
+	typeof(value) __value = (value); \
+	for (__idx = 0; __idx < (vec)->current; ++__idx) { \
+		if (cmp((vec)->elems[__idx], __value)) { \
+			cleanup((vec)->elems[__idx]); \
+			(vec)->elems[__idx] = (vec)->elems[--(vec)->current]; \
+			__res = 0; \
+			break; \
+		} \
+	} \
+	__res; \
+})
+
+#define AST_VECTOR_REMOVE_UNORDERED(vec, idx) ({ \
+	size_t __idx = (idx); \
+	typeof((vec)->elems[0]) __removed = (vec)->elems[__idx]; \
+	(vec)->elems[__idx] = (vec)->elems[--(vec)->current]; \
+	__removed; \
+})
+
+#define AST_VECTOR_RESET(vec, cleanup) do { \
+	AST_VECTOR_CALLBACK_VOID(vec, cleanup); \
+	(vec)->current = 0; \
+} while (0)
+
+#define AST_VECTOR_CALLBACK_VOID(vec, callback, ...) do { \
+	size_t __idx; \
+	for (__idx = 0; __idx < (vec)->current; __idx++) { \
+		callback((vec)->elems[__idx], ##__VA_ARGS__); \
+	} \
+} while (0)
+
+#define AST_VECTOR_ELEM_CLEANUP_NOOP(elem)
+
+/* module */
+
+enum ast_module_load_result {
+	AST_MODULE_LOAD_SUCCESS = 0,
+	AST_MODULE_LOAD_DECLINE = 1,
+	AST_MODULE_LOAD_SKIP = 2,
+	AST_MODULE_LOAD_PRIORITY = 3,
+	AST_MODULE_LOAD_FAILURE = -1,
+};
+
+enum ast_module_support_level {
+	AST_MODULE_SUPPORT_UNKNOWN,
+	AST_MODULE_SUPPORT_CORE,
+	AST_MODULE_SUPPORT_EXTENDED,
+	AST_MODULE_SUPPORT_DEPRECATED,
+};
+
+enum ast_module_flags {
+	AST_MODFLAG_DEFAULT = 0,
+	AST_MODFLAG_GLOBAL_SYMBOLS = (1 << 0),
+	AST_MODFLAG_LOAD_ORDER = (1 << 1),
+};
+
+/*! \brief A loaded module, the shim only keeps its use count */
+struct ast_module;
+
+struct ast_module_info {
+	struct ast_module *self;
+	const char *key;
+	unsigned int flags;
+	const char *description;
+	int (*load)(void);
+	int (*reload)(void);
+	int (*unload)(void);
+	enum ast_module_support_level support_level;
+	unsigned char load_pri;
+	const char *requires;
+	const char *optional_modules;
+};
+
+/*! \brief The module linked into the shim, set by AST_MODULE_INFO() */
+extern struct ast_module_info *shim_module_info;
+extern struct ast_module shim_module;
+
+/*! \brief The module's own info, for ast_module_info->self as in Asterisk */
+static const __attribute__((unused)) struct ast_module_info *ast_module_info;
+
+#define AST_MODULE_INFO(keystr, flags_to_set, desc, fields...) \
+	static struct ast_module_info __mod_info = { \
+		.self = &shim_module, \
+		.key = keystr, \
+		.flags = flags_to_set, \
+		.description = desc, \
+		fields \
+	}; \
+	struct ast_module_info *shim_module_info = &__mod_info; \
+	static const __attribute__((unused)) struct ast_module_info *ast_module_info = &__mod_info;
+
+/*! \brief Keep a module loaded while code of it is attached to something else */
+struct ast_module *ast_module_ref(struct ast_module *mod);
+void ast_module_unref(struct ast_module *mod);
+
+/* channel */
+
+struct ast_channel;
+struct ast_channel_iterator;
+
+const char *ast_channel_name(const struct ast_channel *chan);
+const char *ast_channel_uniqueid(const struct ast_channel *chan);
+const char *ast_channel_linkedid(const struct ast_channel *chan);
+struct ast_channel *ast_channel_get_by_name(const char *name);
+#define ast_channel_lock(chan) ao2_lock(chan)
+#define ast_channel_unlock(chan) ao2_unlock(chan)
+#define ast_channel_trylock(chan) ao2_trylock(chan)
+#define ast_channel_ref(c) ({ ao2_ref(c, +1); (c); })
+#define ast_channel_unref(c) ({ ao2_ref(c, -1); (struct ast_channel *) (NULL); })
+#define ast_channel_cleanup(c) ({ ao2_cleanup(c); (struct ast_channel *) (NULL); })
+struct ast_channel_iterator *ast_channel_iterator_all_new(void);
+struct ast_channel *ast_channel_iterator_next(struct ast_channel_iterator *i);
+struct ast_channel_iterator *ast_channel_iterator_destroy(struct ast_channel_iterator *i);
+char *ast_complete_channels(const char *line, const char *word, int pos, int state, int rpos);
+
+#define AST_FLAG_DEAD (1 << 24)
+
+/*! \brief Whether the channel is in a bridge, the channel must be locked */
+int ast_channel_is_bridged(const struct ast_channel *chan);
+
+/* format */
+
+/*! \brief An ao2 object, the cached formats below live as long as the process */
+struct ast_format;
+
+enum ast_format_cmp_res {
+	AST_FORMAT_CMP_EQUAL = 0,
+	AST_FORMAT_CMP_NOT_EQUAL,
+	AST_FORMAT_CMP_SUBSET,
+};
+
+extern struct ast_format *ast_format_slin;
+extern struct ast_format *ast_format_slin16;
+extern struct ast_format *ast_format_slin48;
+extern struct ast_format *ast_format_ulaw;
+
+const char *ast_format_get_name(const struct ast_format *format);
+unsigned int ast_format_get_sample_rate(const struct ast_format *format);
+enum ast_format_cmp_res ast_format_cmp(const struct ast_format *format1,
+	const struct ast_format *format2);
+int ast_format_cache_is_slinear(struct ast_format *format);
+struct ast_format *ast_format_cache_get_slin_by_rate(unsigned int rate);
+
+/* frame */
+
+enum ast_frame_type {
+	AST_FRAME_DTMF_END = 1,
+	AST_FRAME_VOICE,
+	AST_FRAME_VIDEO,
+	AST_FRAME_CONTROL,
+	AST_FRAME_NULL,
+};
+
+#define AST_MALLOCD_HDR (1 << 0)
+#define AST_MALLOCD_DATA (1 << 1)
+
+struct ast_frame {
+	enum ast_frame_type frametype;
+	struct {
+		struct ast_format *format;
+	} subclass;
+	int datalen;
+	int samples;
+	int mallocd;
+	long ts;
+	union {
+		void *ptr;
+	} data;
+};
+
+struct ast_frame *ast_read(struct ast_channel *chan);
+void ast_frfree(struct ast_frame *fr);
+struct ast_channel *ast_waitfor_nandfds(struct ast_channel **chan, int n, int *fds, int nfds,
+	int *exception, int *outfd, int *ms);
+
+/* translate */
+
+struct ast_trans_pvt;
+
+/*!
+ * \brief Build a translation path, NULL if there is none
+ *
+ * The shim only decodes ulaw to signed linear, and converts signed linear
+ * between rates by repeating or skipping samples.
+ */
+struct ast_trans_pvt *ast_translator_build_path(struct ast_format *dest, struct ast_format *source);
+void ast_translator_free_path(struct ast_trans_pvt *tr);
+struct ast_frame *ast_translate(struct ast_trans_pvt *tr, struct ast_frame *f, int consume);
+
+/* framehook */
+
+enum ast_framehook_event {
+	AST_FRAMEHOOK_EVENT_READ,
+	AST_FRAMEHOOK_EVENT_WRITE,
+	AST_FRAMEHOOK_EVENT_ATTACHED,
+	AST_FRAMEHOOK_EVENT_DETACHED,
+};
+
+typedef struct ast_frame *(*ast_framehook_event_callback)(struct ast_channel *chan,
+	struct ast_frame *frame, enum ast_framehook_event event, void *data);
+typedef void (*ast_framehook_destroy_callback)(void *data);
+typedef int (*ast_framehook_consume_callback)(void *data, enum ast_frame_type type);
+typedef void (*ast_framehook_chan_fixup_callback)(void *data, int framehook_id,
+	struct ast_channel *old_chan, struct ast_channel *new_chan);
+
+#define AST_FRAMEHOOK_INTERFACE_VERSION 4
+
+struct ast_framehook_interface {
+	uint16_t version;
+	ast_framehook_event_callback event_cb;
+	ast_framehook_destroy_callback destroy_cb;
+	ast_framehook_consume_callback consume_cb;
+	ast_framehook_chan_fixup_callback chan_fixup_cb;
+	ast_framehook_chan_fixup_callback chan_breakdown_cb;
+	int disable_inheritance;
+	void *data;
+};
+
+/*! \brief Attach a framehook, the channel must be locked */
+int ast_framehook_attach(struct ast_channel *chan, struct ast_framehook_interface *i);
+
+/*! \brief Detach a framehook, the channel must be locked */
+int ast_framehook_detach(struct ast_channel *chan, int framehook_id);
+
+/* beep */
+
+int ast_beep_start(struct ast_channel *chan, unsigned int interval, char *beep_id, size_t len);
+int ast_beep_stop(struct ast_channel *chan, const char *beep_id);
+
+/* tcptls */
+
+#define AST_SSL_DONT_VERIFY_SERVER (1 << 1)
+
+struct ast_tls_config {
+	int enabled;
+	char *certfile;
+	char *pvtfile;
+	char *cipher;
+	char *cafile;
+	char *capath;
+	struct ast_flags flags;
+	void *ssl_ctx;
+};
+
+int ast_ssl_setup(struct ast_tls_config *cfg);
+void ast_ssl_teardown(struct ast_tls_config *cfg);
+
+/* http_websocket */
+
+enum ast_websocket_opcode {
+	AST_WEBSOCKET_OPCODE_TEXT = 0x1,
+	AST_WEBSOCKET_OPCODE_BINARY = 0x2,
+	AST_WEBSOCKET_OPCODE_PING = 0x9,
+	AST_WEBSOCKET_OPCODE_PONG = 0xA,
+	AST_WEBSOCKET_OPCODE_CLOSE = 0x8,
+	AST_WEBSOCKET_OPCODE_CONTINUATION = 0x0,
+};
+
+enum ast_websocket_result {
+	WS_OK,
+	WS_ALLOCATE_ERROR,
+	WS_KEY_ERROR,
+	WS_URI_PARSE_ERROR,
+	WS_URI_RESOLVE_ERROR,
+	WS_BAD_STATUS,
+	WS_INVALID_RESPONSE,
+	WS_BAD_REQUEST,
+	WS_URL_NOT_FOUND,
+	WS_HEADER_MISMATCH,
+	WS_HEADER_MISSING,
+	WS_NOT_SUPPORTED,
+	WS_WRITE_ERROR,
+	WS_CLIENT_START_ERROR,
+};
+
+struct ast_websocket;
+
+/*!
+ * \brief Connect to a WebSocket server
+ *
+ * The shim speaks plain ws:// only and answers wss:// with WS_NOT_SUPPORTED.
+ */
+struct ast_websocket *ast_websocket_client_create(const char *uri, const char *protocols,
+	struct ast_tls_config *tls_cfg, enum ast_websocket_result *result);
+int ast_websocket_write(struct ast_websocket *session, enum ast_websocket_opcode opcode,
+	char *payload, uint64_t payload_size);
+int ast_websocket_read(struct ast_websocket *session, char **payload, uint64_t *payload_len,
+	enum ast_websocket_opcode *opcode, int *fragmented);
+int ast_websocket_close(struct ast_websocket *session, uint16_t reason);
+int ast_websocket_fd(struct ast_websocket *session);
+int ast_websocket_set_nonblock(struct ast_websocket *session);
+void ast_websocket_unref(struct ast_websocket *session);
+
+/* pbx */
+
+int pbx_builtin_setvar_helper(struct ast_channel *chan, const char *name, const char *value);
+const char *pbx_builtin_getvar_helper(struct ast_channel *chan, const char *name);
+int ast_register_application_xml(const char *app, int (*execute)(struct ast_channel *, const char *));
+int ast_unregister_application(const char *app);
+
+struct ast_custom_function {
+	const char *name;
+	int (*read)(struct ast_channel *chan, const char *function, char *data, char *buf, size_t len);
+	int (*read2)(struct ast_channel *chan, const char *function, char *data, struct ast_str **str, ssize_t len);
+	size_t read_max;
+	int (*write)(struct ast_channel *chan, const char *function, char *data, const char *value);
+};
+
+int ast_custom_function_register(struct ast_custom_function *acf);
+int ast_custom_function_unregister(struct ast_custom_function *acf);
+
+/* app */
+
+struct ast_app_option {
+	uint64_t flag;
+	unsigned int arg_index;
+};
+
+#define BEGIN_OPTIONS {
+#define END_OPTIONS }
+#define AST_APP_OPTIONS(holder, options...) \
+	static const struct ast_app_option holder[128] = options
+#define AST_APP_OPTION(option, flagno) \
+	[option] = { .flag = flagno }
+#define AST_APP_OPTION_ARG(option, flagno, argno) \
+	[option] = { .flag = flagno, .arg_index = argno + 1 }
+
+int ast_app_parse_options(const struct ast_app_option *options, struct ast_flags *flags,
+	char **args, char *optstr);
+
+#define AST_DECLARE_APP_ARGS(name, arglist) AST_DEFINE_APP_ARGS_TYPE(, arglist) name = { 0, }
+#define AST_DEFINE_APP_ARGS_TYPE(type, arglist) \
+	struct type { \
+		unsigned int argc; \
+		char *argv[0]; \
+		arglist \
+	}
+#define AST_APP_ARG(name) char *name;
+#define AST_STANDARD_APP_ARGS(args, parse) \
+	args.argc = __ast_app_separate_args(parse, ',', 1, args.argv, \
+		((sizeof(args) - offsetof(typeof(args), argv)) / sizeof(args.argv[0])))
+#define AST_NONSTANDARD_APP_ARGS(args, parse, sep) \
+	args.argc = __ast_app_separate_args(parse, sep, 1, args.argv, \
+		((sizeof(args) - offsetof(typeof(args), argv)) / sizeof(args.argv[0])))
+
+unsigned int __ast_app_separate_args(char *buf, char delim, int remove_chars, char **array,
+	int arraylen);
+
+/* datastore */
+
+struct ast_datastore_info {
+	const char *type;
+	void *(*duplicate)(void *data);
+	void (*destroy)(void *data);
+	void (*chan_fixup)(void *data, struct ast_channel *old_chan, struct ast_channel *new_chan);
+	void (*chan_breakdown)(void *data, struct ast_channel *old_chan, struct ast_channel *new_chan);
+};
+
+struct ast_datastore {
+	const char *uid;
+	void *data;
+	const struct ast_datastore_info *info;
+	unsigned int inheritance;
+	struct ast_datastore *next;
+};
+
+struct ast_datastore *ast_datastore_alloc(const struct ast_datastore_info *info, const char *uid);
+int ast_datastore_free(struct ast_datastore *datastore);
+int ast_channel_datastore_add(struct ast_channel *chan, struct ast_datastore *datastore);
+int ast_channel_datastore_remove(struct ast_channel *chan, struct ast_datastore *datastore);
+struct ast_datastore *ast_channel_datastore_find(struct ast_channel *chan,
+	const struct ast_datastore_info *info, const char *uid);
+
+/* bridge */
+
+struct ast_bridge {
+	const char *uniqueid;
+	/*! Channels in the bridge (shim only) */
+	struct ao2_container *channels;
+	char id[AST_MAX_UNIQUEID];
+};
+
+struct ast_bridge_channel {
+	struct ast_channel *chan;
+	struct ast_bridge *bridge;
+};
+
+struct ast_bridge_features;
+
+typedef int (*ast_bridge_hook_callback)(struct ast_bridge_channel *bridge_channel, void *hook_pvt);
+typedef void (*ast_bridge_hook_pvt_destructor)(void *hook_pvt);
+
+enum ast_bridge_hook_remove_flags {
+	AST_BRIDGE_HOOK_REMOVE_ON_PULL = (1 << 0),
+	AST_BRIDGE_HOOK_REMOVE_ON_PERSONALITY_CHANGE = (1 << 1),
+};
+
+#define ast_bridge_lock(bridge) ao2_lock(bridge)
+#define ast_bridge_unlock(bridge) ao2_unlock(bridge)
+
+struct ast_bridge_features *ast_bridge_features_new(void);
+void ast_bridge_features_destroy(struct ast_bridge_features *features);
+int ast_bridge_join_hook(struct ast_bridge_features *features, ast_bridge_hook_callback callback,
+	void *hook_pvt, ast_bridge_hook_pvt_destructor destructor,
+	enum ast_bridge_hook_remove_flags remove_flags);
+int ast_bridge_leave_hook(struct ast_bridge_features *features, ast_bridge_hook_callback callback,
+	void *hook_pvt, ast_bridge_hook_pvt_destructor destructor,
+	enum ast_bridge_hook_remove_flags remove_flags);
+int ast_channel_feature_hooks_append(struct ast_channel *chan, struct ast_bridge_features *features);
+struct ast_bridge *ast_channel_get_bridge(const struct ast_channel *chan);
+struct ast_channel *ast_bridge_peer(struct ast_bridge *bridge, struct ast_channel *chan);
+struct ao2_container *ast_bridge_peers(struct ast_bridge *bridge);
+
+/* stasis */
+
+struct stasis_topic;
+struct stasis_message;
+struct stasis_message_type;
+struct stasis_subscription;
+struct stasis_message_router;
+
+typedef void (*stasis_subscription_cb)(void *data, struct stasis_subscription *sub,
+	struct stasis_message *message);
+
+void *stasis_message_data(const struct stasis_message *msg);
+struct stasis_message_type *stasis_message_type(const struct stasis_message *msg);
+struct stasis_message_router *stasis_message_router_create(struct stasis_topic *topic);
+int stasis_message_router_add(struct stasis_message_router *router,
+	struct stasis_message_type *message_type, stasis_subscription_cb callback, void *data);
+void stasis_message_router_unsubscribe_and_join(struct stasis_message_router *router);
+
+struct ast_channel_snapshot_base {
+	const char *name;
+	const char *uniqueid;
+	const char *type;
+};
+
+struct ast_channel_snapshot_peer {
+	char *linkedid;
+	char account[0];
+};
+
+struct ast_channel_snapshot_dialplan {
+	const char *context;
+};
+
+struct ast_channel_snapshot {
+	struct ast_channel_snapshot_base *base;
+	struct ast_channel_snapshot_peer *peer;
+	struct ast_channel_snapshot_dialplan *dialplan;
+	struct ast_flags flags;
+};
+
+struct ast_channel_snapshot_update {
+	struct ast_channel_snapshot *old_snapshot;
+	struct ast_channel_snapshot *new_snapshot;
+};
+
+struct stasis_topic *ast_channel_topic_all(void);
+struct stasis_message_type *ast_channel_snapshot_type(void);
+
+struct ast_bridge_snapshot {
+	const char *uniqueid;
+	const char *technology;
+	/*! Uniqueids of the channels in the bridge */
+	struct ao2_container *channels;
+	unsigned int num_channels;
+};
+
+struct ast_json;
+
+struct ast_bridge_blob {
+	struct ast_bridge_snapshot *bridge;
+	struct ast_channel_snapshot *channel;
+	struct ast_json *blob;
+};
+
+struct stasis_topic *ast_bridge_topic_all(void);
+struct stasis_message_type *ast_channel_entered_bridge_type(void);
+struct stasis_message_type *ast_channel_left_bridge_type(void);
+
+/*! \brief Snapshots of the channels a message is about, keyed by role */
+struct ast_multi_channel_blob;
+
+struct ast_channel_snapshot *ast_multi_channel_blob_get_channel(
+	struct ast_multi_channel_blob *obj, const char *role);
+
+/* local channels */
+
+/*! \brief Get a reference to the other half of a Local channel, NULL if not Local */
+struct ast_channel *ast_local_get_peer(struct ast_channel *ast);
+
+/*! \brief Raised on the channel topic when a Local pair has optimized itself away */
+struct stasis_message_type *ast_local_optimization_end_type(void);
+
+/*! \brief Get a reference to the other channel of a two party bridge */
+struct ast_channel *ast_channel_bridge_peer(struct ast_channel *chan);
+
+/* taskprocessor */
+
+#define AST_TASKPROCESSOR_MAX_NAME 70
+
+struct ast_taskprocessor;
+
+enum ast_tps_options {
+	TPS_REF_DEFAULT = 0,
+	TPS_REF_IF_EXISTS = (1 << 0),
+};
+
+struct ast_taskprocessor *ast_taskprocessor_get(const char *name, enum ast_tps_options create);
+void *ast_taskprocessor_unreference(struct ast_taskprocessor *tps);
+int ast_taskprocessor_push(struct ast_taskprocessor *tps, int (*task_exe)(void *datap), void *datap);
+
+/* alertpipe */
+
+typedef enum {
+	AST_ALERT_READ_SUCCESS = 0,
+	AST_ALERT_NOT_READABLE,
+	AST_ALERT_READ_FAIL,
+	AST_ALERT_READ_FATAL,
+} ast_alert_status_t;
+
+int ast_alertpipe_init(int alert_pipe[2]);
+void ast_alertpipe_close(int alert_pipe[2]);
+ast_alert_status_t ast_alertpipe_read(int alert_pipe[2]);
+ssize_t ast_alertpipe_write(int alert_pipe[2]);
+
+static inline int ast_alertpipe_readfd(int alert_pipe[2])
+{
+	return alert_pipe[0];
+}
+
+/* poll */
+
+#define ast_poll(a, b, c) poll(a, b, c)
+
+/*! \brief Add flags such as O_NONBLOCK to a file descriptor */
+int ast_fd_set_flags(int fd, int flags);
+
+/* config */
+
+struct ast_config;
+
+struct ast_variable {
+	const char *name;
+	const char *value;
+	struct ast_variable *next;
+};
+
+#define CONFIG_FLAG_FILEUNCHANGED (1 << 1)
+#define CONFIG_STATUS_FILEMISSING (void *) 0
+#define CONFIG_STATUS_FILEUNCHANGED (void *) -1
+#define CONFIG_STATUS_FILEINVALID (void *) -2
+
+struct ast_config *ast_config_load2(const char *filename, const char *who_asked,
+	struct ast_flags flags);
+#define ast_config_load(filename, flags) ast_config_load2(filename, AST_MODULE, flags)
+void ast_config_destroy(struct ast_config *cfg);
+const char *ast_variable_retrieve(struct ast_config *config, const char *category,
+	const char *variable);
+struct ast_variable *ast_variable_browse(const struct ast_config *config, const char *category);
+
+/* cli */
+
+#define RESULT_SUCCESS 0
+#define RESULT_SHOWUSAGE 1
+#define RESULT_FAILURE 2
+#define CLI_SUCCESS (char *) RESULT_SUCCESS
+#define CLI_SHOWUSAGE (char *) RESULT_SHOWUSAGE
+#define CLI_FAILURE (char *) RESULT_FAILURE
+
+enum {
+	CLI_INIT = -2,
+	CLI_GENERATE = -3,
+};
+
+struct ast_cli_args {
+	const int fd;
+	const int argc;
+	const char * const *argv;
+	const char *line;
+	const char *word;
+	const int pos;
+	int n;
+};
+
+struct ast_cli_entry {
+	const char * const summary;
+	const char *usage;
+	const char *command;
+	char *(*handler)(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
+};
+
+#define AST_CLI_DEFINE(fn, txt, ...) { .handler = fn, .summary = txt, ## __VA_ARGS__ }
+
+void ast_cli(int fd, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int ast_cli_register_multiple(struct ast_cli_entry *e, int len);
+int ast_cli_unregister_multiple(struct ast_cli_entry *e, int len);
+
+/* manager */
+
+#define AST_MAX_MANHEADERS 128
+
+struct mansession;
+
+struct message {
+	unsigned int hdrcount;
+	const char *headers[AST_MAX_MANHEADERS];
+};
+
+#define EVENT_FLAG_SYSTEM (1 << 0)
+#define EVENT_FLAG_CALL (1 << 1)
+#define EVENT_FLAG_REPORTING (1 << 9)
+#define AMI_SUCCESS 0
+
+const char *astman_get_header(const struct message *m, char *var);
+void astman_send_ack(struct mansession *s, const struct message *m, char *msg);
+void astman_send_error(struct mansession *s, const struct message *m, char *error);
+void astman_start_ack(struct mansession *s, const struct message *m);
+void astman_send_listack(struct mansession *s, const struct message *m, char *msg, char *listflag);
+void astman_send_list_complete_start(struct mansession *s, const struct message *m,
+	const char *event_name, int count);
+void astman_send_list_complete_end(struct mansession *s);
+void astman_append(struct mansession *s, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int ast_manager_register_xml(const char *action, int authority,
+	int (*func)(struct mansession *s, const struct message *m));
+int ast_manager_unregister(const char *action);
+void __manager_event(int category, const char *event, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+#define manager_event(category, event, contents, ...) \
+	__manager_event(category, event, contents, ## __VA_ARGS__)
+
+#endif /* _SHIM_ASTERISK_H */
@@ -0,0 +1,2 @@
+/* Asterisk API shim, see asterisk.h */
+#include "asterisk.h"
@@ -0,0 +1,3382 @@
+/*
+ * Asterisk API shim
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the COPYING file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Just enough of the Asterisk core to run the modules in-process
+ *
+ * The objects behave like their Asterisk counterparts where the module can
+ * tell the difference: ao2 objects are reference counted and carry their own
+ * mutex or rwlock, channel locks are recursive, containers are hashed, bridge
+ * hooks run outside the channel lock and taskprocessors run tasks in order on
+ * their own thread. Everything else is kept as simple as possible so that the
+ * cost measured in a benchmark is the module's, not the shim's.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <netdb.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#include "asterisk.h"
+#include "shim.h"
+
+int option_verbose;
+int option_debug;
+
+static ast_mutex_t logger_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* utils */
+
+void ast_free_ptr(void *ptr)
+{
+	ast_free(ptr);
+}
+
+int ast_get_tid(void)
+{
+	return syscall(SYS_gettid);
+}
+
+long int ast_random(void)
+{
+	/* glibc's random() takes a lock of its own */
+	return random();
+}
+
+int ast_true(const char *s)
+{
+	if (ast_strlen_zero(s)) {
+		return 0;
+	}
+	if (!strcasecmp(s, "yes") || !strcasecmp(s, "true") || !strcasecmp(s, "y")
+		|| !strcasecmp(s, "t") || !strcasecmp(s, "1") || !strcasecmp(s, "on")) {
+		return -1;
+	}
+	return 0;
+}
+
+int ast_false(const char *s)
+{
+	if (ast_strlen_zero(s)) {
+		return 0;
+	}
+	if (!strcasecmp(s, "no") || !strcasecmp(s, "false") || !strcasecmp(s, "n")
+		|| !strcasecmp(s, "f") || !strcasecmp(s, "0") || !strcasecmp(s, "off")) {
+		return -1;
+	}
+	return 0;
+}
+
+int ast_pthread_create_detached_background(pthread_t *thread, pthread_attr_t *attr,
+	void *(*start_routine)(void *), void *data)
+{
+	int res = pthread_create(thread, attr, start_routine, data);
+
+	if (!res) {
+		pthread_detach(*thread);
+	}
+	return res;
+}
+
+int ast_mutex_init(ast_mutex_t *m)
+{
+	pthread_mutexattr_t attr;
+	int res;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	res = pthread_mutex_init(m, &attr);
+	pthread_mutexattr_destroy(&attr);
+	return res;
+}
+
+struct timeval ast_tvadd(struct timeval a, struct timeval b)
+{
+	a.tv_sec += b.tv_sec;
+	a.tv_usec += b.tv_usec;
+	if (a.tv_usec >= 1000000) {
+		a.tv_sec++;
+		a.tv_usec -= 1000000;
+	}
+	return a;
+}
+
+struct timeval ast_tvsub(struct timeval a, struct timeval b)
+{
+	a.tv_sec -= b.tv_sec;
+	a.tv_usec -= b.tv_usec;
+	if (a.tv_usec < 0) {
+		a.tv_sec--;
+		a.tv_usec += 1000000;
+	}
+	return a;
+}
+
+/* localtime, without %q and the other Asterisk extensions */
+
+struct ast_tm *ast_localtime(const struct timeval *timep, struct ast_tm *p_tm, const char *zone)
+{
+	struct tm tm;
+	time_t t = timep->tv_sec;
+
+	if (!localtime_r(&t, &tm)) {
+		return NULL;
+	}
+	memcpy(p_tm, &tm, MIN(sizeof(tm), offsetof(struct ast_tm, tm_usec)));
+	p_tm->tm_usec = timep->tv_usec;
+	return p_tm;
+}
+
+int ast_strftime(char *buf, size_t len, const char *format, const struct ast_tm *tm)
+{
+	struct tm copy = { 0, };
+
+	memcpy(&copy, tm, MIN(sizeof(copy), offsetof(struct ast_tm, tm_usec)));
+	return strftime(buf, len, format, &copy);
+}
+
+/* logger */
+
+void ast_log(int level, const char *file, int line, const char *function, const char *fmt, ...)
+{
+	static const char *names[] = { "DEBUG", "", "NOTICE", "WARNING", "ERROR" };
+	va_list ap;
+
+	if (level < __LOG_WARNING && !option_debug) {
+		return;
+	}
+
+	ast_mutex_lock(&logger_lock);
+	fprintf(stderr, "[%s] %s:%d %s: ", names[level], file, line, function);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	ast_mutex_unlock(&logger_lock);
+}
+
+void __ast_verbose(const char *file, int line, const char *func, int level, const char *fmt, ...)
+{
+	char buf[512];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	/* Formatted first and written under one lock, as the real logger does */
+	ast_mutex_lock(&logger_lock);
+	fprintf(stderr, "    -- %s", buf);
+	ast_mutex_unlock(&logger_lock);
+}
+
+/* strings */
+
+struct ast_str {
+	size_t len;
+	size_t used;
+	char str[0];
+};
+
+struct ast_str *ast_str_create(size_t init_len)
+{
+	struct ast_str *buf;
+
+	if (!init_len) {
+		init_len = 1;
+	}
+	buf = ast_malloc(sizeof(*buf) + init_len);
+	if (!buf) {
+		return NULL;
+	}
+	buf->len = init_len;
+	buf->used = 0;
+	buf->str[0] = '\0';
+	return buf;
+}
+
+static int str_vappend(struct ast_str **buf, ssize_t max_len, int append, const char *fmt, va_list ap)
+{
+	size_t offset = append ? (*buf)->used : 0;
+	va_list aq;
+	int res;
+
+	for (;;) {
+		size_t need;
+
+		va_copy(aq, ap);
+		res = vsnprintf((*buf)->str + offset, (*buf)->len - offset, fmt, aq);
+		va_end(aq);
+		if (res < 0) {
+			return res;
+		}
+		need = offset + res + 1;
+		if (need <= (*buf)->len || max_len < 0) {
+			break;
+		}
+		if (max_len > 0 && (size_t) max_len <= (*buf)->len) {
+			break;
+		}
+		if (max_len > 0 && need > (size_t) max_len) {
+			need = max_len;
+		}
+		{
+			struct ast_str *grown = ast_realloc(*buf, sizeof(**buf) + need);
+
+			if (!grown) {
+				break;
+			}
+			*buf = grown;
+			(*buf)->len = need;
+		}
+	}
+	(*buf)->used = MIN(offset + res, (*buf)->len - 1);
+	return (*buf)->used;
+}
+
+int ast_str_set(struct ast_str **buf, ssize_t max_len, const char *fmt, ...)
+{
+	va_list ap;
+	int res;
+
+	va_start(ap, fmt);
+	res = str_vappend(buf, max_len, 0, fmt, ap);
+	va_end(ap);
+	return res;
+}
+
+int ast_str_append(struct ast_str **buf, ssize_t max_len, const char *fmt, ...)
+{
+	va_list ap;
+	int res;
+
+	va_start(ap, fmt);
+	res = str_vappend(buf, max_len, 1, fmt, ap);
+	va_end(ap);
+	return res;
+}
+
+char *ast_str_buffer(const struct ast_str *buf)
+{
+	return (char *) buf->str;
+}
+
+size_t ast_str_strlen(const struct ast_str *buf)
+{
+	return buf->used;
+}
+
+void ast_str_reset(struct ast_str *buf)
+{
+	buf->used = 0;
+	buf->str[0] = '\0';
+}
+
+/* astobj2 */
+
+#define AO2_MAGIC 0xa70b123
+#define AO2_ITERATOR_MALLOCD (1 << 1)
+
+struct astobj2 {
+	ao2_destructor_fn destructor;
+	volatile int ref_counter;
+	unsigned int options;
+	unsigned int magic;
+	union {
+		pthread_mutex_t mutex;
+		pthread_rwlock_t rwlock;
+	} lock;
+	void *user_data[0] __attribute__((aligned(16)));
+};
+
+#define INTERNAL_OBJ(user_data) \
+	((struct astobj2 *) ((char *) (user_data) - offsetof(struct astobj2, user_data)))
+
+static struct astobj2 *internal_obj(void *user_data)
+{
+	struct astobj2 *p = INTERNAL_OBJ(user_data);
+
+	ast_assert(user_data && p->magic == AO2_MAGIC);
+	return p;
+}
+
+void *ao2_alloc_options(size_t data_size, ao2_destructor_fn destructor_fn, unsigned int options)
+{
+	struct astobj2 *obj = ast_calloc(1, sizeof(*obj) + data_size);
+
+	if (!obj) {
+		return NULL;
+	}
+	obj->destructor = destructor_fn;
+	obj->ref_counter = 1;
+	obj->options = options;
+	obj->magic = AO2_MAGIC;
+	switch (options & AO2_ALLOC_OPT_LOCK_MASK) {
+	case AO2_ALLOC_OPT_LOCK_MUTEX:
+		ast_mutex_init(&obj->lock.mutex);
+		break;
+	case AO2_ALLOC_OPT_LOCK_RWLOCK:
+		pthread_rwlock_init(&obj->lock.rwlock, NULL);
+		break;
+	}
+	return obj->user_data;
+}
+
+int ao2_ref(void *user_data, int delta)
+{
+	struct astobj2 *obj;
+	int old;
+
+	if (!user_data) {
+		return -1;
+	}
+	obj = internal_obj(user_data);
+	old = ast_atomic_fetchadd_int(&obj->ref_counter, delta);
+	if (old + delta > 0) {
+		return old;
+	}
+	ast_assert(old + delta == 0);
+
+	if (obj->destructor) {
+		obj->destructor(user_data);
+	}
+	switch (obj->options & AO2_ALLOC_OPT_LOCK_MASK) {
+	case AO2_ALLOC_OPT_LOCK_MUTEX:
+		pthread_mutex_destroy(&obj->lock.mutex);
+		break;
+	case AO2_ALLOC_OPT_LOCK_RWLOCK:
+		pthread_rwlock_destroy(&obj->lock.rwlock);
+		break;
+	}
+	obj->magic = 0;
+	ast_free(obj);
+	return old;
+}
+
+void ao2_cleanup(void *obj)
+{
+	if (obj) {
+		ao2_ref(obj, -1);
+	}
+}
+
+static __thread struct shim_lock_stats lock_stats;
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void shim_lock_stats_get(struct shim_lock_stats *stats)
+{
+	*stats = lock_stats;
+}
+
+void shim_lock_stats_reset(void)
+{
+	memset(&lock_stats, 0, sizeof(lock_stats));
+}
+
+/*
+ * The clock is only read when the trylock fails, so uncontended acquisitions
+ * cost one extra counter increment.
+ */
+#define LOCK_TIMED(trylock, lock) ({ \
+	int __res = (trylock); \
+	lock_stats.acquired++; \
+	if (__res == EBUSY) { \
+		uint64_t __start = monotonic_ns(); \
+		__res = (lock); \
+		lock_stats.contended++; \
+		lock_stats.wait_ns += monotonic_ns() - __start; \
+	} \
+	__res; \
+})
+
+int ao2_lock(void *user_data)
+{
+	struct astobj2 *obj = internal_obj(user_data);
+
+	switch (obj->options & AO2_ALLOC_OPT_LOCK_MASK) {
+	case AO2_ALLOC_OPT_LOCK_MUTEX:
+		return LOCK_TIMED(pthread_mutex_trylock(&obj->lock.mutex),
+			pthread_mutex_lock(&obj->lock.mutex));
+	case AO2_ALLOC_OPT_LOCK_RWLOCK:
+		return LOCK_TIMED(pthread_rwlock_trywrlock(&obj->lock.rwlock),
+			pthread_rwlock_wrlock(&obj->lock.rwlock));
+	}
+	return 0;
+}
+
+int ao2_wrlock(void *user_data)
+{
+	return ao2_lock(user_data);
+}
+
+int ao2_rdlock(void *user_data)
+{
+	struct astobj2 *obj = internal_obj(user_data);
+
+	if ((obj->options & AO2_ALLOC_OPT_LOCK_MASK) == AO2_ALLOC_OPT_LOCK_RWLOCK) {
+		return LOCK_TIMED(pthread_rwlock_tryrdlock(&obj->lock.rwlock),
+			pthread_rwlock_rdlock(&obj->lock.rwlock));
+	}
+	return ao2_lock(user_data);
+}
+
+int ao2_trylock(void *user_data)
+{
+	struct astobj2 *obj = internal_obj(user_data);
+
+	switch (obj->options & AO2_ALLOC_OPT_LOCK_MASK) {
+	case AO2_ALLOC_OPT_LOCK_MUTEX:
+		return pthread_mutex_trylock(&obj->lock.mutex);
+	case AO2_ALLOC_OPT_LOCK_RWLOCK:
+		return pthread_rwlock_trywrlock(&obj->lock.rwlock);
+	}
+	return 0;
+}
+
+int ao2_unlock(void *user_data)
+{
+	struct astobj2 *obj = internal_obj(user_data);
+
+	switch (obj->options & AO2_ALLOC_OPT_LOCK_MASK) {
+	case AO2_ALLOC_OPT_LOCK_MUTEX:
+		return pthread_mutex_unlock(&obj->lock.mutex);
+	case AO2_ALLOC_OPT_LOCK_RWLOCK:
+		return pthread_rwlock_unlock(&obj->lock.rwlock);
+	}
+	return 0;
+}
+
+struct bucket_node {
+	void *obj;
+	struct bucket_node *next;
+};
+
+struct ao2_container {
+	ao2_hash_fn *hash_fn;
+	ao2_sort_fn *sort_fn;
+	ao2_callback_fn *cmp_fn;
+	unsigned int options;
+	unsigned int n_buckets;
+	volatile int elements;
+	struct bucket_node **buckets;
+};
+
+static void container_destroy(void *obj)
+{
+	struct ao2_container *c = obj;
+	unsigned int i;
+
+	for (i = 0; i < c->n_buckets; i++) {
+		struct bucket_node *node = c->buckets[i];
+
+		while (node) {
+			struct bucket_node *next = node->next;
+
+			ao2_ref(node->obj, -1);
+			ast_free(node);
+			node = next;
+		}
+	}
+	ast_free(c->buckets);
+}
+
+struct ao2_container *ao2_container_alloc_hash(unsigned int ao2_options,
+	unsigned int container_options, unsigned int n_buckets, ao2_hash_fn *hash_fn,
+	ao2_sort_fn *sort_fn, ao2_callback_fn *cmp_fn)
+{
+	struct ao2_container *c;
+
+	c = ao2_alloc_options(sizeof(*c), container_destroy, ao2_options);
+	if (!c) {
+		return NULL;
+	}
+	c->hash_fn = n_buckets > 1 ? hash_fn : NULL;
+	c->sort_fn = sort_fn;
+	c->cmp_fn = cmp_fn;
+	c->options = container_options;
+	c->n_buckets = n_buckets ? n_buckets : 1;
+	c->buckets = ast_calloc(c->n_buckets, sizeof(*c->buckets));
+	if (!c->buckets) {
+		ao2_ref(c, -1);
+		return NULL;
+	}
+	return c;
+}
+
+struct ao2_container *ao2_container_alloc_list(unsigned int ao2_options,
+	unsigned int container_options, ao2_sort_fn *sort_fn, ao2_callback_fn *cmp_fn)
+{
+	return ao2_container_alloc_hash(ao2_options, container_options, 1, NULL, sort_fn, cmp_fn);
+}
+
+int ao2_container_count(struct ao2_container *c)
+{
+	return c->elements;
+}
+
+static unsigned int container_bucket(struct ao2_container *c, const void *arg, int flags)
+{
+	if (!c->hash_fn) {
+		return 0;
+	}
+	return (unsigned int) abs(c->hash_fn(arg, flags & OBJ_SEARCH_MASK)) % c->n_buckets;
+}
+
+int ao2_link_flags(struct ao2_container *c, void *obj_new, int flags)
+{
+	struct bucket_node **pos;
+	struct bucket_node *node;
+	int res = 0;
+
+	node = ast_malloc(sizeof(*node));
+	if (!node) {
+		return 0;
+	}
+	node->obj = obj_new;
+
+	if (!(flags & OBJ_NOLOCK)) {
+		ao2_wrlock(c);
+	}
+	pos = &c->buckets[container_bucket(c, obj_new, OBJ_SEARCH_OBJECT)];
+	if (c->sort_fn) {
+		int cmp = 1;
+
+		while (*pos && (cmp = c->sort_fn((*pos)->obj, obj_new, OBJ_SEARCH_OBJECT)) < 0) {
+			pos = &(*pos)->next;
+		}
+		if (!cmp && (c->options & AO2_CONTAINER_ALLOC_OPT_DUPS_REJECT)) {
+			ast_free(node);
+			goto done;
+		}
+	} else {
+		while (*pos) {
+			pos = &(*pos)->next;
+		}
+	}
+	node->next = *pos;
+	*pos = node;
+	ao2_ref(obj_new, +1);
+	ast_atomic_fetchadd_int(&c->elements, 1);
+	res = 1;
+
+done:
+	if (!(flags & OBJ_NOLOCK)) {
+		ao2_unlock(c);
+	}
+	return res;
+}
+
+int ao2_match_by_addr(void *obj, void *arg, int flags)
+{
+	return obj == arg ? CMP_MATCH | CMP_STOP : 0;
+}
+
+void *ao2_unlink_flags(struct ao2_container *c, void *obj, int flags)
+{
+	ao2_callback(c, flags | OBJ_UNLINK | OBJ_SEARCH_OBJECT | OBJ_NODATA, ao2_match_by_addr, obj);
+	return NULL;
+}
+
+void *ao2_callback(struct ao2_container *c, int flags, ao2_callback_fn *cb_fn, void *arg)
+{
+	struct ao2_iterator *multi = NULL;
+	void *found = NULL;
+	unsigned int first = 0;
+	unsigned int last = c->n_buckets;
+	unsigned int i;
+	int search = flags & OBJ_SEARCH_MASK;
+
+	if (flags & OBJ_MULTIPLE && !(flags & OBJ_NODATA)) {
+		multi = ast_calloc(1, sizeof(*multi));
+		if (!multi) {
+			return NULL;
+		}
+		multi->flags = AO2_ITERATOR_MALLOCD;
+	}
+
+	if (c->hash_fn && (search == OBJ_SEARCH_OBJECT || search == OBJ_SEARCH_KEY)) {
+		first = container_bucket(c, arg, flags);
+		last = first + 1;
+	}
+
+	if (!(flags & OBJ_NOLOCK)) {
+		if (flags & OBJ_UNLINK) {
+			ao2_wrlock(c);
+		} else {
+			ao2_rdlock(c);
+		}
+	}
+
+	for (i = first; i < last; i++) {
+		struct bucket_node **pos = &c->buckets[i];
+
+		while (*pos) {
+			struct bucket_node *node = *pos;
+			int match = cb_fn ? cb_fn(node->obj, arg, flags) : CMP_MATCH;
+
+			if (!(match & CMP_MATCH)) {
+				if (match & CMP_STOP) {
+					goto done;
+				}
+				pos = &node->next;
+				continue;
+			}
+
+			if (!(flags & OBJ_NODATA)) {
+				if (!(flags & OBJ_UNLINK)) {
+					ao2_ref(node->obj, +1);
+				}
+				if (multi) {
+					void **objs = ast_realloc(multi->objs, (multi->count + 1) * sizeof(void *));
+
+					if (objs) {
+						multi->objs = objs;
+						multi->objs[multi->count++] = node->obj;
+					}
+				} else {
+					found = node->obj;
+				}
+			} else if (flags & OBJ_UNLINK) {
+				ao2_ref(node->obj, -1);
+			}
+
+			if (flags & OBJ_UNLINK) {
+				*pos = node->next;
+				ast_free(node);
+				ast_atomic_fetchadd_int(&c->elements, -1);
+			} else {
+				pos = &node->next;
+			}
+
+			if (!(flags & OBJ_MULTIPLE) || (match & CMP_STOP)) {
+				goto done;
+			}
+		}
+	}
+
+done:
+	if (!(flags & OBJ_NOLOCK)) {
+		ao2_unlock(c);
+	}
+	return multi ? (void *) multi : found;
+}
+
+void *ao2_find(struct ao2_container *c, const void *arg, int flags)
+{
+	return ao2_callback(c, flags, c->cmp_fn, (void *) arg);
+}
+
+struct ao2_iterator ao2_iterator_init(struct ao2_container *c, int flags)
+{
+	struct ao2_iterator iter = { .c = c, .flags = flags & ~AO2_ITERATOR_MALLOCD, };
+	unsigned int i;
+
+	ao2_ref(c, +1);
+	if (!(flags & AO2_ITERATOR_DONTLOCK)) {
+		ao2_rdlock(c);
+	}
+	iter.objs = ast_malloc(MAX(c->elements, 1) * sizeof(void *));
+	for (i = 0; iter.objs && i < c->n_buckets; i++) {
+		struct bucket_node *node;
+
+		for (node = c->buckets[i]; node; node = node->next) {
+			ao2_ref(node->obj, +1);
+			iter.objs[iter.count++] = node->obj;
+		}
+	}
+	if (!(flags & AO2_ITERATOR_DONTLOCK)) {
+		ao2_unlock(c);
+	}
+	return iter;
+}
+
+void *ao2_iterator_next(struct ao2_iterator *iter)
+{
+	void *obj;
+
+	if (iter->next >= iter->count) {
+		return NULL;
+	}
+	obj = iter->objs[iter->next++];
+	if (iter->c && (iter->flags & AO2_ITERATOR_UNLINK)) {
+		ao2_unlink(iter->c, obj);
+	}
+	return obj;
+}
+
+void ao2_iterator_destroy(struct ao2_iterator *iter)
+{
+	while (iter->next < iter->count) {
+		ao2_ref(iter->objs[iter->next++], -1);
+	}
+	ast_free(iter->objs);
+	ao2_cleanup(iter->c);
+	iter->c = NULL;
+	iter->objs = NULL;
+	if (iter->flags & AO2_ITERATOR_MALLOCD) {
+		ast_free(iter);
+	}
+}
+
+/* stasis */
+
+struct stasis_message_type {
+	const char *name;
+};
+
+struct stasis_message {
+	struct stasis_message_type *type;
+	void *data;
+};
+
+struct stasis_route {
+	struct stasis_message_type *type;
+	stasis_subscription_cb callback;
+	void *data;
+};
+
+struct stasis_message_router {
+	struct stasis_topic *topic;
+	ast_mutex_t lock;
+	AST_VECTOR(, struct stasis_route) routes;
+	struct stasis_message_router *next;
+};
+
+struct stasis_topic {
+	pthread_rwlock_t lock;
+	struct stasis_message_router *routers;
+};
+
+static struct stasis_message_type channel_snapshot_type = { "ast_channel_snapshot_type" };
+static struct stasis_message_type entered_bridge_type = { "ast_channel_entered_bridge_type" };
+static struct stasis_message_type left_bridge_type = { "ast_channel_left_bridge_type" };
+static struct stasis_message_type local_optimization_end_type = { "ast_local_optimization_end_type" };
+
+static struct stasis_topic channel_topic_all = { .lock = PTHREAD_RWLOCK_INITIALIZER, };
+static struct stasis_topic bridge_topic_all = { .lock = PTHREAD_RWLOCK_INITIALIZER, };
+
+struct stasis_topic *ast_channel_topic_all(void)
+{
+	return &channel_topic_all;
+}
+
+struct stasis_topic *ast_bridge_topic_all(void)
+{
+	return &bridge_topic_all;
+}
+
+struct stasis_message_type *ast_channel_snapshot_type(void)
+{
+	return &channel_snapshot_type;
+}
+
+struct stasis_message_type *ast_channel_entered_bridge_type(void)
+{
+	return &entered_bridge_type;
+}
+
+struct stasis_message_type *ast_channel_left_bridge_type(void)
+{
+	return &left_bridge_type;
+}
+
+struct stasis_message_type *ast_local_optimization_end_type(void)
+{
+	return &local_optimization_end_type;
+}
+
+void *stasis_message_data(const struct stasis_message *msg)
+{
+	return msg->data;
+}
+
+struct stasis_message_type *stasis_message_type(const struct stasis_message *msg)
+{
+	return msg->type;
+}
+
+struct stasis_message_router *stasis_message_router_create(struct stasis_topic *topic)
+{
+	struct stasis_message_router *router = ast_calloc(1, sizeof(*router));
+
+	if (!router) {
+		return NULL;
+	}
+	router->topic = topic;
+	ast_mutex_init(&router->lock);
+	AST_VECTOR_INIT(&router->routes, 2);
+
+	pthread_rwlock_wrlock(&topic->lock);
+	router->next = topic->routers;
+	topic->routers = router;
+	pthread_rwlock_unlock(&topic->lock);
+	return router;
+}
+
+int stasis_message_router_add(struct stasis_message_router *router,
+	struct stasis_message_type *message_type, stasis_subscription_cb callback, void *data)
+{
+	struct stasis_route route = {
+		.type = message_type,
+		.callback = callback,
+		.data = data,
+	};
+	int res;
+
+	ast_mutex_lock(&router->lock);
+	res = AST_VECTOR_APPEND(&router->routes, route);
+	ast_mutex_unlock(&router->lock);
+	return res;
+}
+
+void stasis_message_router_unsubscribe_and_join(struct stasis_message_router *router)
+{
+	struct stasis_message_router **pos;
+
+	if (!router) {
+		return;
+	}
+
+	/* Publishers hold the topic read lock while delivering */
+	pthread_rwlock_wrlock(&router->topic->lock);
+	for (pos = &router->topic->routers; *pos; pos = &(*pos)->next) {
+		if (*pos == router) {
+			*pos = router->next;
+			break;
+		}
+	}
+	pthread_rwlock_unlock(&router->topic->lock);
+
+	AST_VECTOR_FREE(&router->routes);
+	ast_mutex_destroy(&router->lock);
+	ast_free(router);
+}
+
+static void stasis_message_destroy(void *obj)
+{
+	struct stasis_message *msg = obj;
+
+	ao2_cleanup(msg->data);
+}
+
+/*! \brief Deliver a message to every router on a topic, stealing the ref to \a data */
+static void stasis_publish(struct stasis_topic *topic, struct stasis_message_type *type, void *data)
+{
+	struct stasis_message_router *router;
+	struct stasis_message *msg;
+	size_t i;
+
+	msg = ao2_alloc_options(sizeof(*msg), stasis_message_destroy, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!msg) {
+		ao2_cleanup(data);
+		return;
+	}
+	msg->type = type;
+	msg->data = data;
+
+	pthread_rwlock_rdlock(&topic->lock);
+	for (router = topic->routers; router; router = router->next) {
+		ast_mutex_lock(&router->lock);
+		for (i = 0; i < AST_VECTOR_SIZE(&router->routes); i++) {
+			struct stasis_route *route = AST_VECTOR_GET_ADDR(&router->routes, i);
+
+			if (route->type == type) {
+				route->callback(route->data, NULL, msg);
+				break;
+			}
+		}
+		ast_mutex_unlock(&router->lock);
+	}
+	pthread_rwlock_unlock(&topic->lock);
+
+	ao2_ref(msg, -1);
+}
+
+/* channel */
+
+struct ast_var {
+	struct ast_var *next;
+	char *value;
+	char name[0];
+};
+
+struct shim_hook {
+	ast_bridge_hook_callback callback;
+	void *hook_pvt;
+	ast_bridge_hook_pvt_destructor destructor;
+	enum ast_bridge_hook_remove_flags remove_flags;
+};
+
+AST_VECTOR(shim_hooks, struct shim_hook *);
+
+struct shim_framehook {
+	int id;
+	/*! Set by ast_framehook_detach(), destroyed at the next frame or hangup */
+	int detached;
+	struct ast_framehook_interface i;
+};
+
+AST_VECTOR(shim_framehooks, struct shim_framehook);
+
+struct ast_bridge_features {
+	struct shim_hooks join_hooks;
+	struct shim_hooks leave_hooks;
+};
+
+struct ast_channel {
+	char name[AST_CHANNEL_NAME];
+	char uniqueid[AST_MAX_UNIQUEID];
+	char linkedid[AST_MAX_UNIQUEID];
+	char context[AST_MAX_CONTEXT];
+	/*! Name of the other half for a Local channel, empty otherwise */
+	char local_peer[AST_CHANNEL_NAME];
+	struct ast_var *varshead;
+	struct ast_datastore *datastores;
+	struct ast_bridge_features hooks;
+	struct shim_framehooks framehooks;
+	int framehook_seq;
+	struct ast_bridge *bridge;
+	struct ast_channel_snapshot *snapshot;
+	/*! Readable when a hangup has been queued, created by the first wait */
+	int alert_pipe[2];
+	int hangup;
+};
+
+struct ast_channel_iterator {
+	struct ao2_iterator iter;
+};
+
+static struct ao2_container *channels;
+static long uniqueid_epoch;
+static volatile int uniqueid_seq;
+static volatile int bridge_seq;
+
+static int channel_name_hash(const void *obj, int flags)
+{
+	const char *name = (flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY
+		? obj : ((const struct ast_channel *) obj)->name;
+	unsigned int hash = 5381;
+
+	while (*name) {
+		hash = hash * 33 ^ (unsigned char) tolower(*name++);
+	}
+	return (int) (hash & 0x7fffffff);
+}
+
+static int channel_name_cmp(void *obj, void *arg, int flags)
+{
+	const char *name = (flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY
+		? arg : ((const struct ast_channel *) arg)->name;
+
+	return strcasecmp(((struct ast_channel *) obj)->name, name) ? 0 : CMP_MATCH | CMP_STOP;
+}
+
+static int channel_uniqueid_cmp(void *obj, void *arg, int flags)
+{
+	return strcmp(((struct ast_channel *) obj)->uniqueid, arg) ? 0 : CMP_MATCH | CMP_STOP;
+}
+
+static void formats_init(void);
+
+static void __attribute__((constructor)) shim_init(void)
+{
+	uniqueid_epoch = time(NULL);
+	formats_init();
+	channels = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, 1567,
+		channel_name_hash, NULL, channel_name_cmp);
+}
+
+const char *ast_channel_name(const struct ast_channel *chan)
+{
+	return chan->name;
+}
+
+const char *ast_channel_uniqueid(const struct ast_channel *chan)
+{
+	return chan->uniqueid;
+}
+
+const char *ast_channel_linkedid(const struct ast_channel *chan)
+{
+	return chan->linkedid;
+}
+
+struct ast_channel *ast_channel_get_by_name(const char *name)
+{
+	struct ast_channel *chan;
+
+	if (ast_strlen_zero(name)) {
+		return NULL;
+	}
+	chan = ao2_find(channels, name, OBJ_SEARCH_KEY);
+	if (chan) {
+		return chan;
+	}
+	/* Like the core, fall back to matching the uniqueid */
+	return ao2_callback(channels, 0, channel_uniqueid_cmp, (void *) name);
+}
+
+struct ast_channel_iterator *ast_channel_iterator_all_new(void)
+{
+	struct ast_channel_iterator *i = ast_malloc(sizeof(*i));
+
+	if (!i) {
+		return NULL;
+	}
+	i->iter = ao2_iterator_init(channels, 0);
+	return i;
+}
+
+struct ast_channel *ast_channel_iterator_next(struct ast_channel_iterator *i)
+{
+	return ao2_iterator_next(&i->iter);
+}
+
+struct ast_channel_iterator *ast_channel_iterator_destroy(struct ast_channel_iterator *i)
+{
+	ao2_iterator_destroy(&i->iter);
+	ast_free(i);
+	return NULL;
+}
+
+char *ast_complete_channels(const char *line, const char *word, int pos, int state, int rpos)
+{
+	return NULL;
+}
+
+/*! \brief Build a snapshot of \a chan, which must be locked */
+static struct ast_channel_snapshot *channel_snapshot_create(struct ast_channel *chan, int dead)
+{
+	struct {
+		struct ast_channel_snapshot snapshot;
+		struct ast_channel_snapshot_base base;
+		struct ast_channel_snapshot_peer peer;
+		struct ast_channel_snapshot_dialplan dialplan;
+	} *s;
+	size_t name_len = strlen(chan->name) + 1;
+	size_t uniqueid_len = strlen(chan->uniqueid) + 1;
+	size_t linkedid_len = strlen(chan->linkedid) + 1;
+	size_t context_len = strlen(chan->context) + 1;
+	/* The technology is the name up to the slash, as the core names channels */
+	size_t type_len = strcspn(chan->name, "/") + 1;
+	char *strings;
+
+	s = ao2_alloc_options(sizeof(*s) + name_len + uniqueid_len + linkedid_len + context_len
+		+ type_len, NULL, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!s) {
+		return NULL;
+	}
+	strings = (char *) (s + 1);
+	s->snapshot.base = &s->base;
+	s->snapshot.peer = &s->peer;
+	s->snapshot.dialplan = &s->dialplan;
+	s->base.name = memcpy(strings, chan->name, name_len);
+	strings += name_len;
+	s->base.uniqueid = memcpy(strings, chan->uniqueid, uniqueid_len);
+	strings += uniqueid_len;
+	s->peer.linkedid = memcpy(strings, chan->linkedid, linkedid_len);
+	strings += linkedid_len;
+	s->dialplan.context = memcpy(strings, chan->context, context_len);
+	strings += context_len;
+	ast_copy_string(strings, chan->name, type_len);
+	s->base.type = strings;
+	if (dead) {
+		ast_set_flag(&s->snapshot.flags, AST_FLAG_DEAD);
+	}
+	return &s->snapshot;
+}
+
+static void snapshot_update_destroy(void *obj)
+{
+	struct ast_channel_snapshot_update *update = obj;
+
+	ao2_cleanup(update->old_snapshot);
+	ao2_cleanup(update->new_snapshot);
+}
+
+/*! \brief Take a new snapshot of \a chan and publish the update */
+static void channel_publish_snapshot(struct ast_channel *chan, int dead)
+{
+	struct ast_channel_snapshot_update *update;
+
+	update = ao2_alloc_options(sizeof(*update), snapshot_update_destroy, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!update) {
+		return;
+	}
+
+	ast_channel_lock(chan);
+	update->new_snapshot = channel_snapshot_create(chan, dead);
+	if (!update->new_snapshot) {
+		ast_channel_unlock(chan);
+		ao2_ref(update, -1);
+		return;
+	}
+	update->old_snapshot = chan->snapshot;
+	chan->snapshot = ao2_bump(update->new_snapshot);
+	ast_channel_unlock(chan);
+
+	stasis_publish(&channel_topic_all, &channel_snapshot_type, update);
+}
+
+static void hooks_destroy(struct shim_hooks *hooks)
+{
+	AST_VECTOR_CALLBACK_VOID(hooks, ao2_cleanup);
+	AST_VECTOR_FREE(hooks);
+}
+
+static void framehooks_destroy(struct ast_channel *chan);
+static void framehook_destroy(struct ast_channel *chan, struct shim_framehook *hook);
+
+static void channel_destroy(void *obj)
+{
+	struct ast_channel *chan = obj;
+	struct ast_datastore *datastore;
+	struct ast_var *var;
+
+	while ((datastore = chan->datastores)) {
+		chan->datastores = datastore->next;
+		ast_datastore_free(datastore);
+	}
+	while ((var = chan->varshead)) {
+		chan->varshead = var->next;
+		ast_free(var->value);
+		ast_free(var);
+	}
+	hooks_destroy(&chan->hooks.join_hooks);
+	hooks_destroy(&chan->hooks.leave_hooks);
+	framehooks_destroy(chan);
+	AST_VECTOR_FREE(&chan->framehooks);
+	ao2_cleanup(chan->bridge);
+	ao2_cleanup(chan->snapshot);
+	ast_alertpipe_close(chan->alert_pipe);
+}
+
+struct ast_channel *shim_channel_alloc(const char *name, const char *linkedid)
+{
+	struct ast_channel *chan;
+
+	chan = ao2_alloc(sizeof(*chan), channel_destroy);
+	if (!chan) {
+		return NULL;
+	}
+	chan->alert_pipe[0] = chan->alert_pipe[1] = -1;
+	ast_copy_string(chan->name, name, sizeof(chan->name));
+	snprintf(chan->uniqueid, sizeof(chan->uniqueid), "%ld.%d", uniqueid_epoch,
+		ast_atomic_fetchadd_int(&uniqueid_seq, 1));
+	ast_copy_string(chan->linkedid, S_OR(linkedid, chan->uniqueid), sizeof(chan->linkedid));
+	AST_VECTOR_INIT(&chan->hooks.join_hooks, 0);
+	AST_VECTOR_INIT(&chan->hooks.leave_hooks, 0);
+	AST_VECTOR_INIT(&chan->framehooks, 0);
+
+	ao2_link(channels, chan);
+	channel_publish_snapshot(chan, 0);
+	return chan;
+}
+
+void shim_channel_set_linkedid(struct ast_channel *chan, const char *linkedid)
+{
+	ast_channel_lock(chan);
+	ast_copy_string(chan->linkedid, linkedid, sizeof(chan->linkedid));
+	ast_channel_unlock(chan);
+	channel_publish_snapshot(chan, 0);
+}
+
+void shim_local_alloc(const char *name, const char *linkedid, struct ast_channel **one,
+	struct ast_channel **two)
+{
+	char base[AST_CHANNEL_NAME - 2];
+	char half[AST_CHANNEL_NAME];
+
+	snprintf(base, sizeof(base), "Local/%s-%08x", name,
+		(unsigned int) ast_atomic_fetchadd_int(&uniqueid_seq, 0));
+	snprintf(half, sizeof(half), "%s;1", base);
+	*one = shim_channel_alloc(half, linkedid);
+	snprintf(half, sizeof(half), "%s;2", base);
+	*two = shim_channel_alloc(half, linkedid);
+
+	ast_channel_lock(*one);
+	ast_copy_string((*one)->local_peer, ast_channel_name(*two), sizeof((*one)->local_peer));
+	ast_channel_unlock(*one);
+	ast_channel_lock(*two);
+	ast_copy_string((*two)->local_peer, ast_channel_name(*one), sizeof((*two)->local_peer));
+	ast_channel_unlock(*two);
+}
+
+struct ast_channel *ast_local_get_peer(struct ast_channel *ast)
+{
+	char name[AST_CHANNEL_NAME];
+
+	ast_channel_lock(ast);
+	ast_copy_string(name, ast->local_peer, sizeof(name));
+	ast_channel_unlock(ast);
+	return ast_strlen_zero(name) ? NULL : ast_channel_get_by_name(name);
+}
+
+struct ast_channel *ast_channel_bridge_peer(struct ast_channel *chan)
+{
+	struct ast_bridge *bridge;
+	struct ast_channel *peer;
+
+	ast_channel_lock(chan);
+	bridge = ast_channel_get_bridge(chan);
+	ast_channel_unlock(chan);
+	if (!bridge) {
+		return NULL;
+	}
+	peer = ast_bridge_peer(bridge, chan);
+	ao2_ref(bridge, -1);
+	return peer;
+}
+
+struct ast_multi_channel_blob {
+	struct ast_channel_snapshot *one;
+	struct ast_channel_snapshot *two;
+};
+
+struct ast_channel_snapshot *ast_multi_channel_blob_get_channel(
+	struct ast_multi_channel_blob *obj, const char *role)
+{
+	if (!strcmp(role, "1")) {
+		return obj->one;
+	}
+	return !strcmp(role, "2") ? obj->two : NULL;
+}
+
+static void multi_channel_blob_destroy(void *obj)
+{
+	struct ast_multi_channel_blob *blob = obj;
+
+	ao2_cleanup(blob->one);
+	ao2_cleanup(blob->two);
+}
+
+void shim_local_optimize(struct ast_channel *one, struct ast_channel *two)
+{
+	struct ast_multi_channel_blob *blob;
+
+	blob = ao2_alloc_options(sizeof(*blob), multi_channel_blob_destroy, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!blob) {
+		return;
+	}
+	ast_channel_lock(one);
+	blob->one = ao2_bump(one->snapshot);
+	ast_channel_unlock(one);
+	ast_channel_lock(two);
+	blob->two = ao2_bump(two->snapshot);
+	ast_channel_unlock(two);
+	stasis_publish(&channel_topic_all, &local_optimization_end_type, blob);
+}
+
+void shim_channel_set_context(struct ast_channel *chan, const char *context)
+{
+	ast_channel_lock(chan);
+	ast_copy_string(chan->context, context, sizeof(chan->context));
+	ast_channel_unlock(chan);
+	channel_publish_snapshot(chan, 0);
+}
+
+void shim_channel_hangup(struct ast_channel *chan)
+{
+	shim_bridge_leave(chan);
+	/* Like ast_hangup(), which destroys the framehook list */
+	ast_channel_lock(chan);
+	framehooks_destroy(chan);
+	ast_channel_unlock(chan);
+	ao2_unlink(channels, chan);
+	channel_publish_snapshot(chan, 1);
+	ast_channel_unref(chan);
+}
+
+void shim_channel_softhangup(struct ast_channel *chan)
+{
+	ast_channel_lock(chan);
+	if (!chan->hangup) {
+		chan->hangup = 1;
+		if (chan->alert_pipe[1] > -1) {
+			ast_alertpipe_write(chan->alert_pipe);
+		}
+	}
+	ast_channel_unlock(chan);
+}
+
+int shim_channel_count(void)
+{
+	return ao2_container_count(channels);
+}
+
+int ast_channel_is_bridged(const struct ast_channel *chan)
+{
+	return chan->bridge != NULL;
+}
+
+/* format */
+
+struct ast_format {
+	const char *name;
+	unsigned int rate;
+	int slinear;
+};
+
+struct ast_format *ast_format_slin;
+struct ast_format *ast_format_slin16;
+struct ast_format *ast_format_slin48;
+struct ast_format *ast_format_ulaw;
+
+static struct ast_format *format_alloc(const char *name, unsigned int rate, int slinear)
+{
+	struct ast_format *format;
+
+	format = ao2_alloc_options(sizeof(*format), NULL, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (format) {
+		format->name = name;
+		format->rate = rate;
+		format->slinear = slinear;
+	}
+	return format;
+}
+
+static void formats_init(void)
+{
+	ast_format_slin = format_alloc("slin", 8000, 1);
+	ast_format_slin16 = format_alloc("slin16", 16000, 1);
+	ast_format_slin48 = format_alloc("slin48", 48000, 1);
+	ast_format_ulaw = format_alloc("ulaw", 8000, 0);
+}
+
+const char *ast_format_get_name(const struct ast_format *format)
+{
+	return format->name;
+}
+
+unsigned int ast_format_get_sample_rate(const struct ast_format *format)
+{
+	return format->rate;
+}
+
+enum ast_format_cmp_res ast_format_cmp(const struct ast_format *format1,
+	const struct ast_format *format2)
+{
+	return format1 == format2 ? AST_FORMAT_CMP_EQUAL : AST_FORMAT_CMP_NOT_EQUAL;
+}
+
+int ast_format_cache_is_slinear(struct ast_format *format)
+{
+	return format->slinear;
+}
+
+struct ast_format *ast_format_cache_get_slin_by_rate(unsigned int rate)
+{
+	if (rate >= 48000) {
+		return ast_format_slin48;
+	}
+	return rate >= 16000 ? ast_format_slin16 : ast_format_slin;
+}
+
+/* frame */
+
+static struct ast_frame null_frame = { .frametype = AST_FRAME_NULL, };
+
+struct ast_frame *ast_read(struct ast_channel *chan)
+{
+	int hangup;
+
+	ast_channel_lock(chan);
+	hangup = chan->hangup;
+	ast_channel_unlock(chan);
+	return hangup ? NULL : &null_frame;
+}
+
+void ast_frfree(struct ast_frame *fr)
+{
+	if (fr->mallocd & AST_MALLOCD_HDR) {
+		ast_free(fr);
+	}
+}
+
+struct ast_frame *shim_channel_frame(struct ast_channel *chan, struct ast_frame *frame, int write)
+{
+	size_t i;
+
+	ast_channel_lock(chan);
+	for (i = 0; frame && i < AST_VECTOR_SIZE(&chan->framehooks); i++) {
+		struct shim_framehook *hook = AST_VECTOR_GET_ADDR(&chan->framehooks, i);
+
+		if (hook->detached) {
+			struct shim_framehook gone = *hook;
+
+			/* As the core does, on the channel's own thread with the next frame */
+			AST_VECTOR_REMOVE_ORDERED(&chan->framehooks, i);
+			framehook_destroy(chan, &gone);
+			i--;
+			continue;
+		}
+		if (hook->i.consume_cb && !hook->i.consume_cb(hook->i.data, frame->frametype)) {
+			continue;
+		}
+		frame = hook->i.event_cb(chan, frame,
+			write ? AST_FRAMEHOOK_EVENT_WRITE : AST_FRAMEHOOK_EVENT_READ, hook->i.data);
+	}
+	ast_channel_unlock(chan);
+	return frame;
+}
+
+/* translate */
+
+struct ast_trans_pvt {
+	struct ast_format *dest;
+	struct ast_format *source;
+};
+
+struct ast_trans_pvt *ast_translator_build_path(struct ast_format *dest, struct ast_format *source)
+{
+	struct ast_trans_pvt *tr;
+
+	if (!(dest == ast_format_slin && source == ast_format_ulaw)
+		&& !(dest->slinear && source->slinear && dest != source)) {
+		return NULL;
+	}
+	tr = ast_calloc(1, sizeof(*tr));
+	if (tr) {
+		tr->dest = dest;
+		tr->source = source;
+	}
+	return tr;
+}
+
+void ast_translator_free_path(struct ast_trans_pvt *tr)
+{
+	ast_free(tr);
+}
+
+static int16_t ulaw_decode(uint8_t ulaw)
+{
+	int t;
+
+	ulaw = ~ulaw;
+	t = (((ulaw & 0x0f) << 3) + 0x84) << ((ulaw & 0x70) >> 4);
+	return (ulaw & 0x80) ? 0x84 - t : t - 0x84;
+}
+
+/*! \brief Signed linear from one rate to another, nearest sample, no filtering */
+static struct ast_frame *slin_resample(struct ast_trans_pvt *tr, struct ast_frame *f)
+{
+	const int16_t *src = f->data.ptr;
+	int in = f->datalen / sizeof(int16_t);
+	int samples = (int64_t) in * tr->dest->rate / tr->source->rate;
+	struct ast_frame *out;
+	int16_t *dst;
+	int i;
+
+	out = ast_calloc(1, sizeof(*out) + samples * sizeof(int16_t));
+	if (out) {
+		dst = (int16_t *) (out + 1);
+		for (i = 0; i < samples; i++) {
+			dst[i] = src[(int64_t) i * tr->source->rate / tr->dest->rate];
+		}
+		out->frametype = AST_FRAME_VOICE;
+		out->subclass.format = tr->dest;
+		out->datalen = samples * sizeof(int16_t);
+		out->samples = samples;
+		out->mallocd = AST_MALLOCD_HDR;
+		out->ts = f->ts;
+		out->data.ptr = dst;
+	}
+	return out;
+}
+
+struct ast_frame *ast_translate(struct ast_trans_pvt *tr, struct ast_frame *f, int consume)
+{
+	struct ast_frame *out;
+	const uint8_t *src = f->data.ptr;
+	int16_t *dst;
+	int i;
+
+	if (tr->source->slinear) {
+		out = slin_resample(tr, f);
+		if (consume) {
+			ast_frfree(f);
+		}
+		return out;
+	}
+	out = ast_calloc(1, sizeof(*out) + f->datalen * sizeof(int16_t));
+	if (out) {
+		dst = (int16_t *) (out + 1);
+		for (i = 0; i < f->datalen; i++) {
+			dst[i] = ulaw_decode(src[i]);
+		}
+		out->frametype = AST_FRAME_VOICE;
+		out->subclass.format = tr->dest;
+		out->datalen = f->datalen * sizeof(int16_t);
+		out->samples = f->datalen;
+		out->mallocd = AST_MALLOCD_HDR;
+		out->ts = f->ts;
+		out->data.ptr = dst;
+	}
+	if (consume) {
+		ast_frfree(f);
+	}
+	return out;
+}
+
+/* framehook */
+
+static void framehook_destroy(struct ast_channel *chan, struct shim_framehook *hook)
+{
+	hook->i.event_cb(chan, NULL, AST_FRAMEHOOK_EVENT_DETACHED, hook->i.data);
+	if (hook->i.destroy_cb) {
+		hook->i.destroy_cb(hook->i.data);
+	}
+}
+
+static void framehooks_destroy(struct ast_channel *chan)
+{
+	while (AST_VECTOR_SIZE(&chan->framehooks)) {
+		struct shim_framehook hook = AST_VECTOR_GET(&chan->framehooks, 0);
+
+		AST_VECTOR_REMOVE_ORDERED(&chan->framehooks, 0);
+		framehook_destroy(chan, &hook);
+	}
+}
+
+int ast_framehook_attach(struct ast_channel *chan, struct ast_framehook_interface *i)
+{
+	struct shim_framehook hook = { .id = ++chan->framehook_seq, .i = *i, };
+
+	if (i->version != AST_FRAMEHOOK_INTERFACE_VERSION || !i->event_cb
+		|| AST_VECTOR_APPEND(&chan->framehooks, hook)) {
+		return -1;
+	}
+	i->event_cb(chan, NULL, AST_FRAMEHOOK_EVENT_ATTACHED, i->data);
+	return hook.id;
+}
+
+int ast_framehook_detach(struct ast_channel *chan, int framehook_id)
+{
+	size_t i;
+
+	/* Only marked, like the core: the hook goes with the next frame or at hangup */
+	for (i = 0; i < AST_VECTOR_SIZE(&chan->framehooks); i++) {
+		struct shim_framehook *hook = AST_VECTOR_GET_ADDR(&chan->framehooks, i);
+
+		if (hook->id == framehook_id) {
+			hook->detached = 1;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* beep */
+
+int ast_beep_start(struct ast_channel *chan, unsigned int interval, char *beep_id, size_t len)
+{
+	static volatile int beep_seq;
+
+	snprintf(beep_id, len, "beep-%d", ast_atomic_fetchadd_int(&beep_seq, 1));
+	return 0;
+}
+
+int ast_beep_stop(struct ast_channel *chan, const char *beep_id)
+{
+	return 0;
+}
+
+struct ast_channel *ast_waitfor_nandfds(struct ast_channel **chans, int n, int *fds, int nfds,
+	int *exception, int *outfd, int *ms)
+{
+	struct pollfd pfds[n + nfds];
+	struct timeval start = ast_tvnow();
+	int timeout = ms ? *ms : -1;
+	int res;
+	int i;
+
+	if (outfd) {
+		*outfd = -1;
+	}
+	for (i = 0; i < n; i++) {
+		ast_channel_lock(chans[i]);
+		if (chans[i]->alert_pipe[0] < 0 && !ast_alertpipe_init(chans[i]->alert_pipe)
+			&& chans[i]->hangup) {
+			ast_alertpipe_write(chans[i]->alert_pipe);
+		}
+		pfds[i].fd = ast_alertpipe_readfd(chans[i]->alert_pipe);
+		pfds[i].events = POLLIN;
+		ast_channel_unlock(chans[i]);
+	}
+	for (i = 0; i < nfds; i++) {
+		pfds[n + i].fd = fds[i];
+		pfds[n + i].events = POLLIN;
+	}
+
+	res = poll(pfds, n + nfds, timeout);
+	if (ms && *ms > 0) {
+		*ms = MAX(0, *ms - (int) ast_tvdiff_ms(ast_tvnow(), start));
+	}
+	if (res <= 0) {
+		return NULL;
+	}
+	for (i = 0; i < n; i++) {
+		if (pfds[i].revents) {
+			return chans[i];
+		}
+	}
+	for (i = 0; i < nfds; i++) {
+		if (pfds[n + i].revents && outfd) {
+			*outfd = fds[i];
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* pbx */
+
+struct shim_app {
+	char *name;
+	int (*execute)(struct ast_channel *, const char *);
+};
+
+static AST_VECTOR(, struct shim_app) apps;
+static shim_setvar_observer setvar_observer;
+static AST_VECTOR(, struct ast_custom_function *) functions;
+static ast_mutex_t pbx_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int pbx_builtin_setvar_helper(struct ast_channel *chan, const char *name, const char *value)
+{
+	struct ast_var **pos;
+	struct ast_var *var;
+
+	ast_channel_lock(chan);
+	for (pos = &chan->varshead; *pos; pos = &(*pos)->next) {
+		if (!strcmp((*pos)->name, name)) {
+			break;
+		}
+	}
+	if (*pos) {
+		var = *pos;
+		*pos = var->next;
+		ast_free(var->value);
+		ast_free(var);
+	}
+	if (value) {
+		var = ast_malloc(sizeof(*var) + strlen(name) + 1);
+		if (var) {
+			strcpy(var->name, name); /* Safe */
+			var->value = ast_strdup(value);
+			var->next = chan->varshead;
+			chan->varshead = var;
+		}
+	}
+	ast_channel_unlock(chan);
+
+	if (setvar_observer) {
+		setvar_observer(chan, name, value);
+	}
+	return 0;
+}
+
+void shim_setvar_observer_set(shim_setvar_observer observer)
+{
+	setvar_observer = observer;
+}
+
+const char *pbx_builtin_getvar_helper(struct ast_channel *chan, const char *name)
+{
+	const char *value = NULL;
+	struct ast_var *var;
+
+	ast_channel_lock(chan);
+	for (var = chan->varshead; var; var = var->next) {
+		if (!strcmp(var->name, name)) {
+			value = var->value;
+			break;
+		}
+	}
+	ast_channel_unlock(chan);
+	return value;
+}
+
+int ast_register_application_xml(const char *app, int (*execute)(struct ast_channel *, const char *))
+{
+	struct shim_app entry = { .name = ast_strdup(app), .execute = execute, };
+	int res;
+
+	ast_mutex_lock(&pbx_lock);
+	res = AST_VECTOR_APPEND(&apps, entry);
+	ast_mutex_unlock(&pbx_lock);
+	return res;
+}
+
+int ast_unregister_application(const char *app)
+{
+	size_t i;
+	int res = -1;
+
+	ast_mutex_lock(&pbx_lock);
+	for (i = 0; i < AST_VECTOR_SIZE(&apps); i++) {
+		if (!strcasecmp(AST_VECTOR_GET(&apps, i).name, app)) {
+			ast_free(AST_VECTOR_GET(&apps, i).name);
+			AST_VECTOR_GET(&apps, i) = AST_VECTOR_GET(&apps, --apps.current);
+			res = 0;
+			break;
+		}
+	}
+	ast_mutex_unlock(&pbx_lock);
+	return res;
+}
+
+int shim_app_exec(const char *app, struct ast_channel *chan, const char *data)
+{
+	int (*execute)(struct ast_channel *, const char *) = NULL;
+	size_t i;
+
+	ast_mutex_lock(&pbx_lock);
+	for (i = 0; i < AST_VECTOR_SIZE(&apps); i++) {
+		if (!strcasecmp(AST_VECTOR_GET(&apps, i).name, app)) {
+			execute = AST_VECTOR_GET(&apps, i).execute;
+			break;
+		}
+	}
+	ast_mutex_unlock(&pbx_lock);
+
+	return execute ? execute(chan, S_OR(data, "")) : -2;
+}
+
+int ast_custom_function_register(struct ast_custom_function *acf)
+{
+	int res;
+
+	ast_mutex_lock(&pbx_lock);
+	res = AST_VECTOR_APPEND(&functions, acf);
+	ast_mutex_unlock(&pbx_lock);
+	return res;
+}
+
+static int function_cmp(struct ast_custom_function *elem, struct ast_custom_function *acf)
+{
+	return elem == acf;
+}
+
+int ast_custom_function_unregister(struct ast_custom_function *acf)
+{
+	int res;
+
+	ast_mutex_lock(&pbx_lock);
+	res = AST_VECTOR_REMOVE_CMP_UNORDERED(&functions, acf, function_cmp, AST_VECTOR_ELEM_CLEANUP_NOOP);
+	ast_mutex_unlock(&pbx_lock);
+	return res;
+}
+
+int shim_func_read(struct ast_channel *chan, const char *expression, char *buf, size_t len)
+{
+	struct ast_custom_function *acf = NULL;
+	char *name = ast_strdupa(expression);
+	char *args = strchr(name, '(');
+	char *end;
+	size_t i;
+
+	if (args) {
+		*args++ = '\0';
+		end = strrchr(args, ')');
+		if (end) {
+			*end = '\0';
+		}
+	} else {
+		args = "";
+	}
+
+	ast_mutex_lock(&pbx_lock);
+	for (i = 0; i < AST_VECTOR_SIZE(&functions); i++) {
+		if (!strcasecmp(AST_VECTOR_GET(&functions, i)->name, name)) {
+			acf = AST_VECTOR_GET(&functions, i);
+			break;
+		}
+	}
+	ast_mutex_unlock(&pbx_lock);
+
+	*buf = '\0';
+	if (!acf) {
+		return -1;
+	}
+	if (acf->read) {
+		return acf->read(chan, name, args, buf, len);
+	}
+	if (acf->read2) {
+		struct ast_str *str = ast_str_create(len);
+		int res;
+
+		if (!str) {
+			return -1;
+		}
+		res = acf->read2(chan, name, args, &str, len);
+		ast_copy_string(buf, ast_str_buffer(str), len);
+		ast_free(str);
+		return res;
+	}
+	return -1;
+}
+
+/* app */
+
+int ast_app_parse_options(const struct ast_app_option *options, struct ast_flags *flags,
+	char **args, char *optstr)
+{
+	char *s = optstr;
+
+	flags->flags = 0;
+	while (s && *s) {
+		unsigned int curarg = *s++ & 0x7f;
+		unsigned int argloc = options[curarg].arg_index;
+
+		if (*s == '(') {
+			int paren = 1;
+			char *arg = ++s;
+
+			for (; *s; s++) {
+				if (*s == '(') {
+					paren++;
+				} else if (*s == ')' && !--paren) {
+					break;
+				}
+			}
+			if (*s) {
+				*s++ = '\0';
+			}
+			if (argloc) {
+				args[argloc - 1] = arg;
+			}
+		} else if (argloc) {
+			args[argloc - 1] = "";
+		}
+		if (!options[curarg].flag) {
+			ast_log(LOG_WARNING, "Unknown option: '%c'\n", curarg);
+		}
+		ast_set_flag(flags, options[curarg].flag);
+	}
+	return 0;
+}
+
+unsigned int __ast_app_separate_args(char *buf, char delim, int remove_chars, char **array,
+	int arraylen)
+{
+	unsigned int argc;
+	char *scan = buf;
+	int ended_on_delim = 0;
+
+	if (!array || !arraylen) {
+		return 0;
+	}
+	memset(array, 0, arraylen * sizeof(*array));
+	if (!buf) {
+		return 0;
+	}
+
+	for (argc = 0; *scan && argc < (unsigned int) arraylen - 1; argc++) {
+		int paren = 0;
+		int quote = 0;
+
+		array[argc] = scan;
+		ended_on_delim = 0;
+		for (; *scan; scan++) {
+			if (*scan == '(') {
+				paren++;
+			} else if (*scan == ')') {
+				if (paren) {
+					paren--;
+				}
+			} else if (*scan == '"' && delim != '"') {
+				quote = !quote;
+				if (remove_chars) {
+					memmove(scan, scan + 1, strlen(scan));
+					scan--;
+				}
+			} else if (*scan == '\\') {
+				if (remove_chars) {
+					memmove(scan, scan + 1, strlen(scan));
+				} else {
+					scan++;
+				}
+				if (!*scan) {
+					break;
+				}
+			} else if (*scan == delim && !paren && !quote) {
+				*scan++ = '\0';
+				ended_on_delim = 1;
+				break;
+			}
+		}
+	}
+
+	if (*scan || ended_on_delim) {
+		array[argc++] = scan;
+	}
+	return argc;
+}
+
+/* datastore */
+
+struct ast_datastore *ast_datastore_alloc(const struct ast_datastore_info *info, const char *uid)
+{
+	struct ast_datastore *datastore = ast_calloc(1, sizeof(*datastore));
+
+	if (!datastore) {
+		return NULL;
+	}
+	datastore->info = info;
+	datastore->uid = ast_strdup(uid);
+	return datastore;
+}
+
+int ast_datastore_free(struct ast_datastore *datastore)
+{
+	if (datastore->info->destroy && datastore->data) {
+		datastore->info->destroy(datastore->data);
+	}
+	ast_free((char *) datastore->uid);
+	ast_free(datastore);
+	return 0;
+}
+
+int ast_channel_datastore_add(struct ast_channel *chan, struct ast_datastore *datastore)
+{
+	datastore->next = chan->datastores;
+	chan->datastores = datastore;
+	return 0;
+}
+
+int ast_channel_datastore_remove(struct ast_channel *chan, struct ast_datastore *datastore)
+{
+	struct ast_datastore **pos;
+
+	for (pos = &chan->datastores; *pos; pos = &(*pos)->next) {
+		if (*pos == datastore) {
+			*pos = datastore->next;
+			datastore->next = NULL;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+struct ast_datastore *ast_channel_datastore_find(struct ast_channel *chan,
+	const struct ast_datastore_info *info, const char *uid)
+{
+	struct ast_datastore *datastore;
+
+	for (datastore = chan->datastores; datastore; datastore = datastore->next) {
+		if (datastore->info != info) {
+			continue;
+		}
+		if (!uid || (datastore->uid && !strcasecmp(uid, datastore->uid))) {
+			return datastore;
+		}
+	}
+	return NULL;
+}
+
+/* bridge */
+
+static void hook_destroy(void *obj)
+{
+	struct shim_hook *hook = obj;
+
+	if (hook->destructor) {
+		hook->destructor(hook->hook_pvt);
+	}
+}
+
+struct ast_bridge_features *ast_bridge_features_new(void)
+{
+	struct ast_bridge_features *features = ast_calloc(1, sizeof(*features));
+
+	if (!features) {
+		return NULL;
+	}
+	AST_VECTOR_INIT(&features->join_hooks, 0);
+	AST_VECTOR_INIT(&features->leave_hooks, 0);
+	return features;
+}
+
+void ast_bridge_features_destroy(struct ast_bridge_features *features)
+{
+	if (!features) {
+		return;
+	}
+	hooks_destroy(&features->join_hooks);
+	hooks_destroy(&features->leave_hooks);
+	ast_free(features);
+}
+
+static int hook_add(struct shim_hooks *hooks, ast_bridge_hook_callback callback, void *hook_pvt,
+	ast_bridge_hook_pvt_destructor destructor, enum ast_bridge_hook_remove_flags remove_flags)
+{
+	struct shim_hook *hook;
+
+	hook = ao2_alloc_options(sizeof(*hook), hook_destroy, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!hook) {
+		return -1;
+	}
+	hook->callback = callback;
+	hook->hook_pvt = hook_pvt;
+	hook->destructor = destructor;
+	hook->remove_flags = remove_flags;
+	if (AST_VECTOR_APPEND(hooks, hook)) {
+		/* Like the core, the caller still owns hook_pvt on failure */
+		hook->destructor = NULL;
+		ao2_ref(hook, -1);
+		return -1;
+	}
+	return 0;
+}
+
+int ast_bridge_join_hook(struct ast_bridge_features *features, ast_bridge_hook_callback callback,
+	void *hook_pvt, ast_bridge_hook_pvt_destructor destructor,
+	enum ast_bridge_hook_remove_flags remove_flags)
+{
+	return hook_add(&features->join_hooks, callback, hook_pvt, destructor, remove_flags);
+}
+
+int ast_bridge_leave_hook(struct ast_bridge_features *features, ast_bridge_hook_callback callback,
+	void *hook_pvt, ast_bridge_hook_pvt_destructor destructor,
+	enum ast_bridge_hook_remove_flags remove_flags)
+{
+	return hook_add(&features->leave_hooks, callback, hook_pvt, destructor, remove_flags);
+}
+
+static int hooks_copy(struct shim_hooks *dst, struct shim_hooks *src)
+{
+	size_t i;
+
+	for (i = 0; i < AST_VECTOR_SIZE(src); i++) {
+		struct shim_hook *hook = AST_VECTOR_GET(src, i);
+
+		if (AST_VECTOR_APPEND(dst, hook)) {
+			return -1;
+		}
+		ao2_ref(hook, +1);
+	}
+	return 0;
+}
+
+int ast_channel_feature_hooks_append(struct ast_channel *chan, struct ast_bridge_features *features)
+{
+	if (hooks_copy(&chan->hooks.join_hooks, &features->join_hooks)
+		|| hooks_copy(&chan->hooks.leave_hooks, &features->leave_hooks)) {
+		return -1;
+	}
+	return 0;
+}
+
+struct ast_bridge *ast_channel_get_bridge(const struct ast_channel *chan)
+{
+	return ao2_bump(chan->bridge);
+}
+
+struct ast_channel *ast_bridge_peer(struct ast_bridge *bridge, struct ast_channel *chan)
+{
+	struct ast_channel *peer = NULL;
+	struct ao2_iterator iter;
+	struct ast_channel *member;
+
+	ast_bridge_lock(bridge);
+	if (ao2_container_count(bridge->channels) == 2) {
+		iter = ao2_iterator_init(bridge->channels, AO2_ITERATOR_DONTLOCK);
+		while ((member = ao2_iterator_next(&iter))) {
+			if (member != chan && !peer) {
+				peer = member;
+			} else {
+				ast_channel_unref(member);
+			}
+		}
+		ao2_iterator_destroy(&iter);
+	}
+	ast_bridge_unlock(bridge);
+	return peer;
+}
+
+struct ao2_container *ast_bridge_peers(struct ast_bridge *bridge)
+{
+	struct ao2_container *peers;
+	struct ao2_iterator iter;
+	struct ast_channel *member;
+
+	peers = ao2_container_alloc_list(AO2_ALLOC_OPT_LOCK_NOLOCK, 0, NULL, NULL);
+	if (!peers) {
+		return NULL;
+	}
+	ast_bridge_lock(bridge);
+	iter = ao2_iterator_init(bridge->channels, AO2_ITERATOR_DONTLOCK);
+	for (; (member = ao2_iterator_next(&iter)); ast_channel_unref(member)) {
+		ao2_link(peers, member);
+	}
+	ao2_iterator_destroy(&iter);
+	ast_bridge_unlock(bridge);
+	return peers;
+}
+
+static void bridge_destroy(void *obj)
+{
+	struct ast_bridge *bridge = obj;
+
+	ao2_cleanup(bridge->channels);
+}
+
+struct ast_bridge *shim_bridge_alloc(void)
+{
+	struct ast_bridge *bridge;
+
+	bridge = ao2_alloc(sizeof(*bridge), bridge_destroy);
+	if (!bridge) {
+		return NULL;
+	}
+	snprintf(bridge->id, sizeof(bridge->id), "%08lx-shim-bridge-%d", uniqueid_epoch,
+		ast_atomic_fetchadd_int(&bridge_seq, 1));
+	bridge->uniqueid = bridge->id;
+	bridge->channels = ao2_container_alloc_list(AO2_ALLOC_OPT_LOCK_NOLOCK, 0, NULL, NULL);
+	if (!bridge->channels) {
+		ao2_ref(bridge, -1);
+		return NULL;
+	}
+	return bridge;
+}
+
+static void bridge_snapshot_destroy(void *obj)
+{
+	struct ast_bridge_snapshot *snapshot = obj;
+
+	ao2_cleanup(snapshot->channels);
+}
+
+static struct ast_bridge_snapshot *bridge_snapshot_create(struct ast_bridge *bridge)
+{
+	struct ast_bridge_snapshot *snapshot;
+	struct ao2_iterator iter;
+	struct ast_channel *member;
+
+	snapshot = ao2_alloc_options(sizeof(*snapshot) + strlen(bridge->uniqueid) + 1,
+		bridge_snapshot_destroy, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!snapshot) {
+		return NULL;
+	}
+	snapshot->uniqueid = strcpy((char *) (snapshot + 1), bridge->uniqueid); /* Safe */
+	snapshot->technology = "simple_bridge";
+	snapshot->channels = ao2_container_alloc_list(AO2_ALLOC_OPT_LOCK_NOLOCK, 0, NULL, NULL);
+	if (!snapshot->channels) {
+		ao2_ref(snapshot, -1);
+		return NULL;
+	}
+
+	ast_bridge_lock(bridge);
+	iter = ao2_iterator_init(bridge->channels, AO2_ITERATOR_DONTLOCK);
+	for (; (member = ao2_iterator_next(&iter)); ast_channel_unref(member)) {
+		char *id = ao2_alloc_options(strlen(member->uniqueid) + 1, NULL, AO2_ALLOC_OPT_LOCK_NOLOCK);
+
+		if (id) {
+			strcpy(id, member->uniqueid); /* Safe */
+			ao2_link(snapshot->channels, id);
+			ao2_ref(id, -1);
+		}
+	}
+	ao2_iterator_destroy(&iter);
+	snapshot->num_channels = ao2_container_count(snapshot->channels);
+	ast_bridge_unlock(bridge);
+	return snapshot;
+}
+
+static void bridge_blob_destroy(void *obj)
+{
+	struct ast_bridge_blob *blob = obj;
+
+	ao2_cleanup(blob->bridge);
+	ao2_cleanup(blob->channel);
+}
+
+static void bridge_publish(struct ast_bridge *bridge, struct ast_channel *chan,
+	struct stasis_message_type *type)
+{
+	struct ast_bridge_blob *blob;
+
+	blob = ao2_alloc_options(sizeof(*blob), bridge_blob_destroy, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!blob) {
+		return;
+	}
+	blob->bridge = bridge_snapshot_create(bridge);
+	ast_channel_lock(chan);
+	blob->channel = ao2_bump(chan->snapshot);
+	ast_channel_unlock(chan);
+	if (!blob->bridge || !blob->channel) {
+		ao2_ref(blob, -1);
+		return;
+	}
+	stasis_publish(&bridge_topic_all, type, blob);
+}
+
+static int hook_cmp(struct shim_hook *elem, struct shim_hook *hook)
+{
+	return elem == hook;
+}
+
+/*! \brief Run the hooks of one type, outside the channel lock as the core does */
+static void hooks_run(struct ast_channel *chan, struct ast_bridge *bridge, int leave)
+{
+	struct ast_bridge_channel bridge_channel = { .chan = chan, .bridge = bridge, };
+	struct shim_hooks *hooks = leave ? &chan->hooks.leave_hooks : &chan->hooks.join_hooks;
+	struct shim_hooks run;
+	size_t i;
+
+	ast_channel_lock(chan);
+	if (AST_VECTOR_INIT(&run, AST_VECTOR_SIZE(hooks)) || hooks_copy(&run, hooks)) {
+		ast_channel_unlock(chan);
+		hooks_destroy(&run);
+		return;
+	}
+	ast_channel_unlock(chan);
+
+	for (i = 0; i < AST_VECTOR_SIZE(&run); i++) {
+		struct shim_hook *hook = AST_VECTOR_GET(&run, i);
+
+		if (hook->callback(&bridge_channel, hook->hook_pvt)
+			|| (leave && (hook->remove_flags & AST_BRIDGE_HOOK_REMOVE_ON_PULL))) {
+			ast_channel_lock(chan);
+			AST_VECTOR_REMOVE_CMP_UNORDERED(hooks, hook, hook_cmp, ao2_cleanup);
+			ast_channel_unlock(chan);
+		}
+	}
+	hooks_destroy(&run);
+}
+
+int shim_bridge_join(struct ast_bridge *bridge, struct ast_channel *chan)
+{
+	shim_bridge_leave(chan);
+
+	ast_bridge_lock(bridge);
+	ao2_link(bridge->channels, chan);
+	ast_bridge_unlock(bridge);
+
+	ast_channel_lock(chan);
+	ao2_replace(chan->bridge, bridge);
+	ast_channel_unlock(chan);
+
+	bridge_publish(bridge, chan, &entered_bridge_type);
+	hooks_run(chan, bridge, 0);
+	return 0;
+}
+
+void shim_bridge_leave(struct ast_channel *chan)
+{
+	struct ast_bridge *bridge;
+
+	ast_channel_lock(chan);
+	bridge = ao2_bump(chan->bridge);
+	ast_channel_unlock(chan);
+	if (!bridge) {
+		return;
+	}
+
+	/* Leave hooks see the channel still in the bridge */
+	hooks_run(chan, bridge, 1);
+
+	ast_bridge_lock(bridge);
+	ao2_unlink(bridge->channels, chan);
+	ast_bridge_unlock(bridge);
+
+	ast_channel_lock(chan);
+	ao2_cleanup(chan->bridge);
+	chan->bridge = NULL;
+	ast_channel_unlock(chan);
+
+	bridge_publish(bridge, chan, &left_bridge_type);
+	ao2_ref(bridge, -1);
+}
+
+/* taskprocessor */
+
+struct tps_task {
+	int (*execute)(void *datap);
+	void *datap;
+	struct tps_task *next;
+};
+
+struct ast_taskprocessor {
+	char name[AST_TASKPROCESSOR_MAX_NAME + 1];
+	int refs;
+	pthread_t thread;
+	ast_mutex_t lock;
+	ast_cond_t cond;
+	ast_cond_t idle;
+	struct tps_task *head;
+	struct tps_task *tail;
+	/*! Tasks queued or running */
+	int pending;
+	int stop;
+	struct ast_taskprocessor *next;
+};
+
+static struct ast_taskprocessor *taskprocessors;
+static ast_mutex_t tps_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *tps_thread(void *data)
+{
+	struct ast_taskprocessor *tps = data;
+
+	ast_mutex_lock(&tps->lock);
+	for (;;) {
+		struct tps_task *task;
+
+		while (!tps->head && !tps->stop) {
+			ast_cond_wait(&tps->cond, &tps->lock);
+		}
+		task = tps->head;
+		if (!task) {
+			break;
+		}
+		tps->head = task->next;
+		if (!tps->head) {
+			tps->tail = NULL;
+		}
+		ast_mutex_unlock(&tps->lock);
+
+		task->execute(task->datap);
+		ast_free(task);
+
+		ast_mutex_lock(&tps->lock);
+		if (!--tps->pending) {
+			ast_cond_broadcast(&tps->idle);
+		}
+	}
+	ast_mutex_unlock(&tps->lock);
+	return NULL;
+}
+
+struct ast_taskprocessor *ast_taskprocessor_get(const char *name, enum ast_tps_options create)
+{
+	struct ast_taskprocessor *tps;
+
+	ast_mutex_lock(&tps_lock);
+	for (tps = taskprocessors; tps; tps = tps->next) {
+		if (!strcmp(tps->name, name)) {
+			tps->refs++;
+			ast_mutex_unlock(&tps_lock);
+			return tps;
+		}
+	}
+	if (create & TPS_REF_IF_EXISTS) {
+		ast_mutex_unlock(&tps_lock);
+		return NULL;
+	}
+
+	tps = ast_calloc(1, sizeof(*tps));
+	if (!tps) {
+		ast_mutex_unlock(&tps_lock);
+		return NULL;
+	}
+	ast_copy_string(tps->name, name, sizeof(tps->name));
+	tps->refs = 1;
+	ast_mutex_init(&tps->lock);
+	ast_cond_init(&tps->cond, NULL);
+	ast_cond_init(&tps->idle, NULL);
+	if (pthread_create(&tps->thread, NULL, tps_thread, tps)) {
+		ast_mutex_unlock(&tps_lock);
+		ast_free(tps);
+		return NULL;
+	}
+	tps->next = taskprocessors;
+	taskprocessors = tps;
+	ast_mutex_unlock(&tps_lock);
+	return tps;
+}
+
+void *ast_taskprocessor_unreference(struct ast_taskprocessor *tps)
+{
+	struct ast_taskprocessor **pos;
+
+	if (!tps) {
+		return NULL;
+	}
+
+	ast_mutex_lock(&tps_lock);
+	if (--tps->refs) {
+		ast_mutex_unlock(&tps_lock);
+		return NULL;
+	}
+	for (pos = &taskprocessors; *pos; pos = &(*pos)->next) {
+		if (*pos == tps) {
+			*pos = tps->next;
+			break;
+		}
+	}
+	ast_mutex_unlock(&tps_lock);
+
+	/* Queued tasks still run before the thread exits */
+	ast_mutex_lock(&tps->lock);
+	tps->stop = 1;
+	ast_cond_signal(&tps->cond);
+	ast_mutex_unlock(&tps->lock);
+	pthread_join(tps->thread, NULL);
+
+	ast_cond_destroy(&tps->idle);
+	ast_cond_destroy(&tps->cond);
+	ast_mutex_destroy(&tps->lock);
+	ast_free(tps);
+	return NULL;
+}
+
+int ast_taskprocessor_push(struct ast_taskprocessor *tps, int (*task_exe)(void *datap), void *datap)
+{
+	struct tps_task *task = ast_malloc(sizeof(*task));
+
+	if (!task) {
+		return -1;
+	}
+	task->execute = task_exe;
+	task->datap = datap;
+	task->next = NULL;
+
+	ast_mutex_lock(&tps->lock);
+	if (tps->tail) {
+		tps->tail->next = task;
+	} else {
+		tps->head = task;
+	}
+	tps->tail = task;
+	tps->pending++;
+	ast_cond_signal(&tps->cond);
+	ast_mutex_unlock(&tps->lock);
+	return 0;
+}
+
+void shim_taskprocessors_wait(void)
+{
+	int busy;
+
+	/* Tasks may queue more tasks elsewhere, so go round until nothing was pending */
+	do {
+		struct ast_taskprocessor *tps;
+
+		busy = 0;
+		ast_mutex_lock(&tps_lock);
+		for (tps = taskprocessors; tps; tps = tps->next) {
+			ast_mutex_lock(&tps->lock);
+			while (tps->pending) {
+				busy = 1;
+				ast_cond_wait(&tps->idle, &tps->lock);
+			}
+			ast_mutex_unlock(&tps->lock);
+		}
+		ast_mutex_unlock(&tps_lock);
+	} while (busy);
+}
+
+/* alertpipe */
+
+int ast_alertpipe_init(int alert_pipe[2])
+{
+	alert_pipe[0] = alert_pipe[1] = -1;
+	return pipe2(alert_pipe, O_NONBLOCK | O_CLOEXEC);
+}
+
+void ast_alertpipe_close(int alert_pipe[2])
+{
+	if (alert_pipe[0] > -1) {
+		close(alert_pipe[0]);
+	}
+	if (alert_pipe[1] > -1) {
+		close(alert_pipe[1]);
+	}
+	alert_pipe[0] = alert_pipe[1] = -1;
+}
+
+ast_alert_status_t ast_alertpipe_read(int alert_pipe[2])
+{
+	char c;
+
+	if (read(alert_pipe[0], &c, 1) == 1) {
+		return AST_ALERT_READ_SUCCESS;
+	}
+	return errno == EAGAIN || errno == EINTR ? AST_ALERT_NOT_READABLE : AST_ALERT_READ_FAIL;
+}
+
+ssize_t ast_alertpipe_write(int alert_pipe[2])
+{
+	char c = 1;
+
+	return write(alert_pipe[1], &c, 1);
+}
+
+/* poll */
+
+int ast_fd_set_flags(int fd, int flags)
+{
+	int current = fcntl(fd, F_GETFL);
+
+	if (current < 0) {
+		return -1;
+	}
+	return fcntl(fd, F_SETFL, current | flags);
+}
+
+/* tcptls */
+
+int ast_ssl_setup(struct ast_tls_config *cfg)
+{
+	return 1;
+}
+
+void ast_ssl_teardown(struct ast_tls_config *cfg)
+{
+}
+
+/* http_websocket */
+
+struct ast_websocket {
+	int fd;
+	/*! Payload of the last frame read */
+	char *payload;
+	size_t payload_max;
+};
+
+static void websocket_destroy(void *obj)
+{
+	struct ast_websocket *session = obj;
+
+	if (session->fd > -1) {
+		close(session->fd);
+	}
+	ast_free(session->payload);
+}
+
+static int websocket_wait(int fd, short events)
+{
+	struct pollfd pfd = { .fd = fd, .events = events, };
+
+	return poll(&pfd, 1, -1) < 0 && errno != EINTR ? -1 : 0;
+}
+
+static int websocket_send(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t res = send(fd, buf, len, MSG_NOSIGNAL);
+
+		if (res < 0) {
+			if ((errno != EAGAIN && errno != EINTR) || websocket_wait(fd, POLLOUT)) {
+				return -1;
+			}
+			continue;
+		}
+		buf += res;
+		len -= res;
+	}
+	return 0;
+}
+
+static int websocket_recv(int fd, void *buf, size_t len)
+{
+	char *pos = buf;
+
+	while (len) {
+		ssize_t res = recv(fd, pos, len, 0);
+
+		if (res < 0) {
+			if ((errno != EAGAIN && errno != EINTR) || websocket_wait(fd, POLLIN)) {
+				return -1;
+			}
+			continue;
+		}
+		if (!res) {
+			return -1;
+		}
+		pos += res;
+		len -= res;
+	}
+	return 0;
+}
+
+struct ast_websocket *ast_websocket_client_create(const char *uri, const char *protocols,
+	struct ast_tls_config *tls_cfg, enum ast_websocket_result *result)
+{
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, };
+	struct addrinfo *addrs;
+	struct ast_websocket *session;
+	char host[256];
+	const char *port = "80";
+	const char *path;
+	char *colon;
+	char response[4096];
+	size_t len = 0;
+	int fd;
+
+	if (strncasecmp(uri, "ws://", 5)) {
+		*result = strncasecmp(uri, "wss://", 6) ? WS_URI_PARSE_ERROR : WS_NOT_SUPPORTED;
+		return NULL;
+	}
+	uri += 5;
+	path = strchr(uri, '/');
+	ast_copy_string(host, uri, MIN(sizeof(host), path ? (size_t) (path - uri) + 1 : sizeof(host)));
+	if ((colon = strchr(host, ':'))) {
+		*colon = '\0';
+		port = colon + 1;
+	}
+	if (getaddrinfo(host, port, &hints, &addrs)) {
+		*result = WS_URI_RESOLVE_ERROR;
+		return NULL;
+	}
+	fd = socket(addrs->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, addrs->ai_addr, addrs->ai_addrlen)) {
+		freeaddrinfo(addrs);
+		if (fd > -1) {
+			close(fd);
+		}
+		*result = WS_CLIENT_START_ERROR;
+		return NULL;
+	}
+	freeaddrinfo(addrs);
+
+	session = ao2_alloc(sizeof(*session), websocket_destroy);
+	if (!session) {
+		close(fd);
+		*result = WS_ALLOCATE_ERROR;
+		return NULL;
+	}
+	session->fd = fd;
+
+	len = snprintf(response, sizeof(response),
+		"GET %s HTTP/1.1\r\nHost: %s\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+		"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n"
+		"%s%s%s\r\n", S_OR(path, "/"), host,
+		ast_strlen_zero(protocols) ? "" : "Sec-WebSocket-Protocol: ", S_OR(protocols, ""),
+		ast_strlen_zero(protocols) ? "" : "\r\n");
+	if (websocket_send(fd, response, len)) {
+		ao2_ref(session, -1);
+		*result = WS_WRITE_ERROR;
+		return NULL;
+	}
+	/* Read the response headers a byte at a time so no frame data is consumed */
+	for (len = 0; len < sizeof(response) - 1; len++) {
+		if (websocket_recv(fd, &response[len], 1)) {
+			break;
+		}
+		if (len >= 3 && !memcmp(&response[len - 3], "\r\n\r\n", 4)) {
+			break;
+		}
+	}
+	response[len] = '\0';
+	if (strncmp(response, "HTTP/1.1 101", 12)) {
+		ao2_ref(session, -1);
+		*result = len ? WS_BAD_STATUS : WS_INVALID_RESPONSE;
+		return NULL;
+	}
+	*result = WS_OK;
+	return session;
+}
+
+int ast_websocket_write(struct ast_websocket *session, enum ast_websocket_opcode opcode,
+	char *payload, uint64_t payload_size)
+{
+	uint8_t mask[4] = { 0x5a, 0x17, 0xb0, 0x0c, };
+	size_t header_len = 2;
+	char *frame;
+	uint64_t i;
+	int res;
+
+	frame = ast_malloc(14 + payload_size);
+	if (!frame) {
+		return -1;
+	}
+	frame[0] = 0x80 | opcode;
+	if (payload_size < 126) {
+		frame[1] = 0x80 | payload_size;
+	} else if (payload_size < 65536) {
+		frame[1] = 0x80 | 126;
+		frame[2] = payload_size >> 8;
+		frame[3] = payload_size;
+		header_len = 4;
+	} else {
+		frame[1] = (char) (0x80 | 127);
+		for (i = 0; i < 8; i++) {
+			frame[2 + i] = payload_size >> (56 - 8 * i);
+		}
+		header_len = 10;
+	}
+	memcpy(frame + header_len, mask, sizeof(mask));
+	header_len += sizeof(mask);
+	for (i = 0; i < payload_size; i++) {
+		frame[header_len + i] = payload[i] ^ mask[i & 3];
+	}
+
+	ao2_lock(session);
+	res = websocket_send(session->fd, frame, header_len + payload_size);
+	ao2_unlock(session);
+	ast_free(frame);
+	return res;
+}
+
+int ast_websocket_read(struct ast_websocket *session, char **payload, uint64_t *payload_len,
+	enum ast_websocket_opcode *opcode, int *fragmented)
+{
+	uint8_t header[8];
+	uint8_t mask[4];
+	uint64_t len;
+	uint64_t i;
+
+	*payload = NULL;
+	*payload_len = 0;
+	*fragmented = 0;
+	if (websocket_recv(session->fd, header, 2)) {
+		return -1;
+	}
+	*opcode = header[0] & 0x0f;
+	len = header[1] & 0x7f;
+	if (len == 126 || len == 127) {
+		size_t ext = len == 126 ? 2 : 8;
+
+		if (websocket_recv(session->fd, header, ext)) {
+			return -1;
+		}
+		for (len = 0, i = 0; i < ext; i++) {
+			len = (len << 8) | header[i];
+		}
+	}
+	if ((header[1] & 0x80) && websocket_recv(session->fd, mask, sizeof(mask))) {
+		return -1;
+	}
+	if (len > session->payload_max) {
+		char *grown = ast_realloc(session->payload, len);
+
+		if (!grown) {
+			return -1;
+		}
+		session->payload = grown;
+		session->payload_max = len;
+	}
+	if (len && websocket_recv(session->fd, session->payload, len)) {
+		return -1;
+	}
+	if (header[1] & 0x80) {
+		for (i = 0; i < len; i++) {
+			session->payload[i] ^= mask[i & 3];
+		}
+	}
+	*payload = session->payload;
+	*payload_len = len;
+	return 0;
+}
+
+int ast_websocket_close(struct ast_websocket *session, uint16_t reason)
+{
+	char payload[2] = { reason >> 8, reason & 0xff, };
+
+	return ast_websocket_write(session, AST_WEBSOCKET_OPCODE_CLOSE, payload, sizeof(payload));
+}
+
+int ast_websocket_fd(struct ast_websocket *session)
+{
+	return session->fd;
+}
+
+int ast_websocket_set_nonblock(struct ast_websocket *session)
+{
+	return ast_fd_set_flags(session->fd, O_NONBLOCK);
+}
+
+void ast_websocket_unref(struct ast_websocket *session)
+{
+	ao2_cleanup(session);
+}
+
+/* config */
+
+struct shim_category {
+	char *name;
+	struct ast_variable *root;
+	struct shim_category *next;
+};
+
+struct ast_config {
+	char *filename;
+	/*! Set since the last load */
+	int changed;
+	struct shim_category *categories;
+	struct ast_config *next;
+};
+
+static struct ast_config *configs;
+static ast_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct ast_config *config_find(const char *filename, int create)
+{
+	struct ast_config *cfg;
+
+	for (cfg = configs; cfg; cfg = cfg->next) {
+		if (!strcmp(cfg->filename, filename)) {
+			return cfg;
+		}
+	}
+	if (!create || !(cfg = ast_calloc(1, sizeof(*cfg)))) {
+		return NULL;
+	}
+	cfg->filename = ast_strdup(filename);
+	cfg->next = configs;
+	configs = cfg;
+	return cfg;
+}
+
+void shim_config_set(const char *filename, const char *category, const char *name,
+	const char *value)
+{
+	struct ast_config *cfg;
+	struct shim_category *cat;
+	struct ast_variable **pos;
+	struct ast_variable *var;
+
+	ast_mutex_lock(&config_lock);
+	cfg = config_find(filename, 1);
+	if (!cfg) {
+		ast_mutex_unlock(&config_lock);
+		return;
+	}
+	cfg->changed = 1;
+	for (cat = cfg->categories; cat; cat = cat->next) {
+		if (!strcasecmp(cat->name, category)) {
+			break;
+		}
+	}
+	if (!cat && (cat = ast_calloc(1, sizeof(*cat)))) {
+		cat->name = ast_strdup(category);
+		cat->next = cfg->categories;
+		cfg->categories = cat;
+	}
+	if (!cat) {
+		ast_mutex_unlock(&config_lock);
+		return;
+	}
+	for (pos = &cat->root; *pos; pos = &(*pos)->next) {
+		if (!strcasecmp((*pos)->name, name)) {
+			ast_free((char *) (*pos)->value);
+			(*pos)->value = ast_strdup(value);
+			ast_mutex_unlock(&config_lock);
+			return;
+		}
+	}
+	var = ast_calloc(1, sizeof(*var));
+	if (var) {
+		var->name = ast_strdup(name);
+		var->value = ast_strdup(value);
+		*pos = var;
+	}
+	ast_mutex_unlock(&config_lock);
+}
+
+void shim_config_clear(const char *filename)
+{
+	struct ast_config **pos;
+	struct ast_config *cfg;
+
+	ast_mutex_lock(&config_lock);
+	for (pos = &configs; *pos; pos = &(*pos)->next) {
+		if (!strcmp((*pos)->filename, filename)) {
+			break;
+		}
+	}
+	cfg = *pos;
+	if (cfg) {
+		*pos = cfg->next;
+	}
+	ast_mutex_unlock(&config_lock);
+	if (!cfg) {
+		return;
+	}
+
+	while (cfg->categories) {
+		struct shim_category *cat = cfg->categories;
+
+		cfg->categories = cat->next;
+		while (cat->root) {
+			struct ast_variable *var = cat->root;
+
+			cat->root = var->next;
+			ast_free((char *) var->name);
+			ast_free((char *) var->value);
+			ast_free(var);
+		}
+		ast_free(cat->name);
+		ast_free(cat);
+	}
+	ast_free(cfg->filename);
+	ast_free(cfg);
+}
+
+struct ast_config *ast_config_load2(const char *filename, const char *who_asked,
+	struct ast_flags flags)
+{
+	struct ast_config *cfg;
+
+	ast_mutex_lock(&config_lock);
+	cfg = config_find(filename, 0);
+	if (cfg && !cfg->changed && ast_test_flag(&flags, CONFIG_FLAG_FILEUNCHANGED)) {
+		cfg = CONFIG_STATUS_FILEUNCHANGED;
+	} else if (cfg) {
+		cfg->changed = 0;
+	}
+	ast_mutex_unlock(&config_lock);
+	return cfg;
+}
+
+void ast_config_destroy(struct ast_config *cfg)
+{
+	/* Loaded configurations are the shim's own copy */
+}
+
+struct ast_variable *ast_variable_browse(const struct ast_config *config, const char *category)
+{
+	struct shim_category *cat;
+
+	for (cat = config->categories; cat; cat = cat->next) {
+		if (!strcasecmp(cat->name, category)) {
+			return cat->root;
+		}
+	}
+	return NULL;
+}
+
+const char *ast_variable_retrieve(struct ast_config *config, const char *category,
+	const char *variable)
+{
+	struct shim_category *cat;
+	struct ast_variable *var;
+
+	for (cat = config->categories; cat; cat = cat->next) {
+		if (category && strcasecmp(cat->name, category)) {
+			continue;
+		}
+		for (var = cat->root; var; var = var->next) {
+			if (!strcasecmp(var->name, variable)) {
+				return var->value;
+			}
+		}
+	}
+	return NULL;
+}
+
+/* cli */
+
+static AST_VECTOR(, struct ast_cli_entry *) cli_entries;
+
+void ast_cli(int fd, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vdprintf(fd, fmt, ap);
+	va_end(ap);
+}
+
+int ast_cli_register_multiple(struct ast_cli_entry *e, int len)
+{
+	int i;
+
+	ast_mutex_lock(&pbx_lock);
+	for (i = 0; i < len; i++) {
+		e[i].handler(&e[i], CLI_INIT, NULL);
+		AST_VECTOR_APPEND(&cli_entries, &e[i]);
+	}
+	ast_mutex_unlock(&pbx_lock);
+	return 0;
+}
+
+static int cli_entry_cmp(struct ast_cli_entry *elem, struct ast_cli_entry *e)
+{
+	return elem == e;
+}
+
+int ast_cli_unregister_multiple(struct ast_cli_entry *e, int len)
+{
+	int i;
+
+	ast_mutex_lock(&pbx_lock);
+	for (i = 0; i < len; i++) {
+		AST_VECTOR_REMOVE_CMP_ORDERED(&cli_entries, &e[i], cli_entry_cmp,
+			AST_VECTOR_ELEM_CLEANUP_NOOP);
+	}
+	ast_mutex_unlock(&pbx_lock);
+	return 0;
+}
+
+static int split_words(char *line, const char **words, int max)
+{
+	char *saveptr;
+	char *word;
+	int count = 0;
+
+	for (word = strtok_r(line, " \t", &saveptr); word && count < max;
+		word = strtok_r(NULL, " \t", &saveptr)) {
+		words[count++] = word;
+	}
+	return count;
+}
+
+/*!
+ * \brief How many words of a command line a CLI entry matches
+ *
+ * Literal words must match, {a|b} matches any one alternative and matching
+ * stops at the first optional or variable word, leaving the rest to the
+ * handler.
+ *
+ * \retval -1 if the entry does not match
+ */
+static int cli_match(const char *command, const char * const *argv, int argc)
+{
+	const char *words[32];
+	char *copy = ast_strdupa(command);
+	int count = split_words(copy, words, ARRAY_LEN(words));
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (words[i][0] == '[' || words[i][0] == '<') {
+			return i;
+		}
+		if (i >= argc) {
+			return -1;
+		}
+		if (words[i][0] == '{') {
+			char *alternatives = ast_strdupa(words[i] + 1);
+			char *alternative;
+			int found = 0;
+
+			alternatives[strcspn(alternatives, "}")] = '\0';
+			while ((alternative = strsep(&alternatives, "|"))) {
+				if (!strcasecmp(alternative, argv[i])) {
+					found = 1;
+					break;
+				}
+			}
+			if (!found) {
+				return -1;
+			}
+		} else if (strcasecmp(words[i], argv[i])) {
+			return -1;
+		}
+	}
+	return i;
+}
+
+int shim_cli_exec(const char *line, char *out, size_t len)
+{
+	struct ast_cli_entry *entry = NULL;
+	const char *argv[32];
+	char *copy = ast_strdupa(line);
+	int argc = split_words(copy, argv, ARRAY_LEN(argv));
+	int best = 0;
+	char *res;
+	size_t i;
+	ssize_t got;
+	int fd;
+
+	ast_mutex_lock(&pbx_lock);
+	for (i = 0; i < AST_VECTOR_SIZE(&cli_entries); i++) {
+		struct ast_cli_entry *e = AST_VECTOR_GET(&cli_entries, i);
+		int matched = cli_match(e->command, argv, argc);
+
+		if (matched > best) {
+			best = matched;
+			entry = e;
+		}
+	}
+	ast_mutex_unlock(&pbx_lock);
+
+	if (len) {
+		*out = '\0';
+	}
+	if (!entry) {
+		return -1;
+	}
+
+	fd = memfd_create("shim_cli", MFD_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	{
+		struct ast_cli_args args = {
+			.fd = fd,
+			.argc = argc,
+			.argv = argv,
+			.line = line,
+			.word = "",
+			.pos = argc,
+		};
+
+		res = entry->handler(entry, 0, &args);
+	}
+	if (res == CLI_SHOWUSAGE) {
+		ast_cli(fd, "%s", S_OR(entry->usage, ""));
+	}
+
+	if (len) {
+		lseek(fd, 0, SEEK_SET);
+		got = read(fd, out, len - 1);
+		out[got > 0 ? got : 0] = '\0';
+	}
+	close(fd);
+	return (int) (intptr_t) res;
+}
+
+/* manager */
+
+struct mansession {
+	struct ast_str *out;
+};
+
+struct manager_action {
+	char *action;
+	int (*func)(struct mansession *s, const struct message *m);
+};
+
+static AST_VECTOR(, struct manager_action) manager_actions;
+static struct ast_str *manager_events;
+static int manager_event_count;
+static ast_mutex_t manager_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const char *astman_get_header(const struct message *m, char *var)
+{
+	size_t len = strlen(var);
+	unsigned int i;
+
+	for (i = 0; i < m->hdrcount; i++) {
+		const char *h = m->headers[i];
+
+		if (!strncasecmp(var, h, len) && h[len] == ':') {
+			h += len + 1;
+			while (*h == ' ') {
+				h++;
+			}
+			return h;
+		}
+	}
+	return "";
+}
+
+static void astman_action_id(struct mansession *s, const struct message *m)
+{
+	const char *id = astman_get_header(m, "ActionID");
+
+	if (!ast_strlen_zero(id)) {
+		ast_str_append(&s->out, 0, "ActionID: %s\r\n", id);
+	}
+}
+
+void astman_send_ack(struct mansession *s, const struct message *m, char *msg)
+{
+	ast_str_append(&s->out, 0, "Response: Success\r\n");
+	astman_action_id(s, m);
+	ast_str_append(&s->out, 0, "Message: %s\r\n\r\n", msg);
+}
+
+void astman_send_error(struct mansession *s, const struct message *m, char *error)
+{
+	ast_str_append(&s->out, 0, "Response: Error\r\n");
+	astman_action_id(s, m);
+	ast_str_append(&s->out, 0, "Message: %s\r\n\r\n", error);
+}
+
+void astman_start_ack(struct mansession *s, const struct message *m)
+{
+	ast_str_append(&s->out, 0, "Response: Success\r\n");
+	astman_action_id(s, m);
+}
+
+void astman_send_listack(struct mansession *s, const struct message *m, char *msg, char *listflag)
+{
+	ast_str_append(&s->out, 0, "Response: Success\r\n");
+	astman_action_id(s, m);
+	ast_str_append(&s->out, 0, "EventList: %s\r\nMessage: %s\r\n\r\n", listflag, msg);
+}
+
+void astman_send_list_complete_start(struct mansession *s, const struct message *m,
+	const char *event_name, int count)
+{
+	ast_str_append(&s->out, 0, "Event: %s\r\n", event_name);
+	astman_action_id(s, m);
+	ast_str_append(&s->out, 0, "EventList: Complete\r\nListItems: %d\r\n", count);
+}
+
+void astman_send_list_complete_end(struct mansession *s)
+{
+	ast_str_append(&s->out, 0, "\r\n");
+}
+
+void astman_append(struct mansession *s, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	str_vappend(&s->out, 0, 1, fmt, ap);
+	va_end(ap);
+}
+
+int ast_manager_register_xml(const char *action, int authority,
+	int (*func)(struct mansession *s, const struct message *m))
+{
+	struct manager_action entry = { .action = ast_strdup(action), .func = func, };
+	int res;
+
+	ast_mutex_lock(&manager_lock);
+	res = AST_VECTOR_APPEND(&manager_actions, entry);
+	ast_mutex_unlock(&manager_lock);
+	return res;
+}
+
+int ast_manager_unregister(const char *action)
+{
+	size_t i;
+
+	ast_mutex_lock(&manager_lock);
+	for (i = 0; i < AST_VECTOR_SIZE(&manager_actions); i++) {
+		if (!strcasecmp(AST_VECTOR_GET(&manager_actions, i).action, action)) {
+			ast_free(AST_VECTOR_GET(&manager_actions, i).action);
+			AST_VECTOR_GET(&manager_actions, i) =
+				AST_VECTOR_GET(&manager_actions, --manager_actions.current);
+			break;
+		}
+	}
+	ast_mutex_unlock(&manager_lock);
+	return 0;
+}
+
+void __manager_event(int category, const char *event, const char *fmt, ...)
+{
+	va_list ap;
+
+	ast_mutex_lock(&manager_lock);
+	if (!manager_events) {
+		manager_events = ast_str_create(1024);
+	}
+	if (manager_events) {
+		ast_str_append(&manager_events, 0, "Event: %s\r\n", event);
+		va_start(ap, fmt);
+		str_vappend(&manager_events, 0, 1, fmt, ap);
+		va_end(ap);
+		ast_str_append(&manager_events, 0, "\r\n");
+		manager_event_count++;
+	}
+	ast_mutex_unlock(&manager_lock);
+}
+
+int shim_manager_events(char *out, size_t len)
+{
+	int count;
+
+	ast_mutex_lock(&manager_lock);
+	count = manager_event_count;
+	if (len) {
+		ast_copy_string(out, manager_events ? ast_str_buffer(manager_events) : "", len);
+	}
+	if (manager_events) {
+		ast_str_reset(manager_events);
+	}
+	manager_event_count = 0;
+	ast_mutex_unlock(&manager_lock);
+	return count;
+}
+
+int shim_manager_action(const char *action, const char * const *headers, char *out, size_t len)
+{
+	int (*func)(struct mansession *s, const struct message *m) = NULL;
+	struct message m = { .hdrcount = 0, };
+	struct mansession s;
+	size_t i;
+	int res;
+
+	ast_mutex_lock(&manager_lock);
+	for (i = 0; i < AST_VECTOR_SIZE(&manager_actions); i++) {
+		if (!strcasecmp(AST_VECTOR_GET(&manager_actions, i).action, action)) {
+			func = AST_VECTOR_GET(&manager_actions, i).func;
+			break;
+		}
+	}
+	ast_mutex_unlock(&manager_lock);
+	if (!func) {
+		return -1;
+	}
+
+	for (; headers && *headers && m.hdrcount < AST_MAX_MANHEADERS; headers++) {
+		m.headers[m.hdrcount++] = *headers;
+	}
+	s.out = ast_str_create(256);
+	if (!s.out) {
+		return -1;
+	}
+	res = func(&s, &m);
+	if (len) {
+		ast_copy_string(out, ast_str_buffer(s.out), len);
+	}
+	ast_free(s.out);
+	return res;
+}
+
+/* module */
+
+struct ast_module {
+	int usecount;
+};
+
+struct ast_module shim_module;
+
+struct ast_module *ast_module_ref(struct ast_module *mod)
+{
+	if (mod) {
+		ast_atomic_fetchadd_int(&mod->usecount, 1);
+	}
+	return mod;
+}
+
+void ast_module_unref(struct ast_module *mod)
+{
+	if (mod) {
+		ast_atomic_fetchadd_int(&mod->usecount, -1);
+	}
+}
+
+int shim_module_usecount(void)
+{
+	return ast_atomic_fetchadd_int(&shim_module.usecount, 0);
+}
+
+int shim_module_load(void)
+{
+	return shim_module_info->load();
+}
+
+int shim_module_reload(void)
+{
+	return shim_module_info->reload ? shim_module_info->reload() : 0;
+}
+
+int shim_module_unload(void)
+{
+	int usecount = shim_module_usecount();
+
+	/* A soft unload, as "module unload" without -h does */
+	if (usecount) {
+		ast_log(LOG_WARNING, "Soft unload failed, '%s' has use count %d\n",
+			shim_module_info->description, usecount);
+		return -1;
+	}
+	return shim_module_info->unload();
+}
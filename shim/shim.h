@@ -0,0 +1,200 @@
+/*
+ * Asterisk API shim
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the COPYING file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Driver interface of the Asterisk API shim
+ *
+ * Tests and benchmarks link one module, app_bridgemon.o or app_audiofork.o,
+ * against shim.o and use these calls to play the part of the PBX core: create
+ * and hang up channels, pass frames through them, move them in and out of
+ * bridges, execute the registered applications, functions, CLI commands and
+ * manager actions, and feed configuration.
+ *
+ * Stasis messages are delivered synchronously on the publishing thread, one
+ * router at a time. Taskprocessors run on their own threads; use
+ * shim_taskprocessors_wait() before checking the results of queued work.
+ */
+
+#ifndef _SHIM_H
+#define _SHIM_H
+
+#include "asterisk.h"
+
+/*! \brief Load the module linked into the shim */
+int shim_module_load(void);
+
+/*! \brief Reload the module linked into the shim */
+int shim_module_reload(void);
+
+/*!
+ * \brief Unload the module linked into the shim
+ *
+ * \retval -1 without calling its unload_module() while it is in use
+ */
+int shim_module_unload(void);
+
+/*! \brief References held on the module linked into the shim */
+int shim_module_usecount(void);
+
+/*!
+ * \brief Create a channel
+ *
+ * \param name Channel name
+ * \param linkedid Linkedid, NULL to make the channel its own originator
+ *
+ * \return The channel with a reference held by the caller, NULL on error
+ */
+struct ast_channel *shim_channel_alloc(const char *name, const char *linkedid);
+
+/*! \brief Change the linkedid of a channel */
+void shim_channel_set_linkedid(struct ast_channel *chan, const char *linkedid);
+
+/*!
+ * \brief Create a Local channel pair, Local/<name>-<n>;1 and ;2
+ *
+ * Both halves share \a linkedid, as when the ;1 half is dialed from a call.
+ */
+void shim_local_alloc(const char *name, const char *linkedid, struct ast_channel **one,
+	struct ast_channel **two);
+
+/*!
+ * \brief Raise the end of a Local channel optimization
+ *
+ * The core then hangs the pair up, which is left to the caller.
+ */
+void shim_local_optimize(struct ast_channel *one, struct ast_channel *two);
+
+/*! \brief Change the dialplan context of a channel */
+void shim_channel_set_context(struct ast_channel *chan, const char *context);
+
+/*!
+ * \brief Hang up a channel
+ *
+ * Removes the channel from its bridge and the channel list, publishes its
+ * final snapshot and drops the caller's reference.
+ */
+void shim_channel_hangup(struct ast_channel *chan);
+
+/*! \brief Queue a hangup that wakes anything waiting on the channel */
+void shim_channel_softhangup(struct ast_channel *chan);
+
+/*! \brief Number of channels in the channel list */
+int shim_channel_count(void);
+
+/*!
+ * \brief Pass a frame through the channel's framehooks
+ *
+ * \param chan Channel the frame was read from or is written to
+ * \param frame Frame to pass
+ * \param write Non-zero for a frame written to the channel (heard), zero for
+ * one read from it (spoken)
+ *
+ * \return The frame the hooks hand back
+ */
+struct ast_frame *shim_channel_frame(struct ast_channel *chan, struct ast_frame *frame, int write);
+
+/*! \brief Create an empty bridge, returned with a reference */
+struct ast_bridge *shim_bridge_alloc(void);
+
+/*! \brief Put a channel in a bridge, running its join hooks */
+int shim_bridge_join(struct ast_bridge *bridge, struct ast_channel *chan);
+
+/*! \brief Take a channel out of its bridge, running its leave hooks */
+void shim_bridge_leave(struct ast_channel *chan);
+
+/*! \brief Called after every channel variable write */
+typedef void (*shim_setvar_observer)(struct ast_channel *chan, const char *name, const char *value);
+
+/*!
+ * \brief Watch channel variable writes
+ *
+ * \param observer Called on the writing thread, outside the channel lock; NULL
+ * to stop watching
+ */
+void shim_setvar_observer_set(shim_setvar_observer observer);
+
+/*!
+ * \brief Execute a registered application
+ *
+ * \retval -2 if no such application is registered
+ * \return The application's return value otherwise
+ */
+int shim_app_exec(const char *app, struct ast_channel *chan, const char *data);
+
+/*!
+ * \brief Read a registered dialplan function
+ *
+ * \param chan Channel to evaluate on, may be NULL
+ * \param expression Function call such as "PEERID()" or "PEERCOUNT(1234.5)"
+ * \param buf Result
+ * \param len Size of \a buf
+ *
+ * \retval 0 on success
+ * \retval -1 on failure or if the function is not registered
+ */
+int shim_func_read(struct ast_channel *chan, const char *expression, char *buf, size_t len);
+
+/*!
+ * \brief Run a registered CLI command
+ *
+ * \param line Command line, e.g. "findpeer show cache"
+ * \param out Receives the command output
+ * \param len Size of \a out
+ *
+ * \return The handler's result (RESULT_SUCCESS, RESULT_SHOWUSAGE, ...) or -1
+ * if no command matches
+ */
+int shim_cli_exec(const char *line, char *out, size_t len);
+
+/*!
+ * \brief Invoke a registered manager action
+ *
+ * \param action Action name
+ * \param headers NULL terminated "Header: value" strings, may be NULL
+ * \param out Receives the response
+ * \param len Size of \a out
+ *
+ * \return The handler's return value or -1 if no action matches
+ */
+int shim_manager_action(const char *action, const char * const *headers, char *out, size_t len);
+
+/*!
+ * \brief Copy out and clear the manager events raised so far
+ *
+ * \return Number of events raised since the last call
+ */
+int shim_manager_events(char *out, size_t len);
+
+/*! \brief Set a configuration value, marking the file as changed */
+void shim_config_set(const char *filename, const char *category, const char *name,
+	const char *value);
+
+/*! \brief Forget everything set for a configuration file */
+void shim_config_clear(const char *filename);
+
+/*! \brief Wait until every taskprocessor has run all the tasks queued on it */
+void shim_taskprocessors_wait(void);
+
+/*! \brief ao2 lock acquisitions made by one thread */
+struct shim_lock_stats {
+	/*! Locks taken */
+	uint64_t acquired;
+	/*! Locks that were held by someone else when asked for */
+	uint64_t contended;
+	/*! Time spent waiting for contended locks */
+	uint64_t wait_ns;
+};
+
+/*! \brief Get the calling thread's ao2 lock statistics */
+void shim_lock_stats_get(struct shim_lock_stats *stats);
+
+/*! \brief Reset the calling thread's ao2 lock statistics */
+void shim_lock_stats_reset(void);
+
+#endif /* _SHIM_H */
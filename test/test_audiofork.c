@@ -0,0 +1,768 @@
+/*
+ * app_audiofork tests
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the COPYING file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Functional tests of AudioFork() against the Asterisk API shim
+ *
+ * Frames are passed through the channel's framehooks by the test and the
+ * module forks them to a WebSocket sink running in-process.
+ *
+ * Build and run with "make test".
+ */
+
+#include <time.h>
+
+#include "shim.h"
+#include "ws_sink.h"
+
+#define SAMPLES 160
+#define FRAME_BYTES (SAMPLES * 2)
+#define FLOOD 50000
+
+static int failures;
+
+#define CHECK(expr) do { \
+	if (!(expr)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+		__sync_fetch_and_add(&failures, 1); \
+	} \
+} while (0)
+
+#define CHECK_STR(actual, expected) do { \
+	const char *__a = (actual); \
+	const char *__e = (expected); \
+	if (!__a || strcmp(__a, __e)) { \
+		fprintf(stderr, "%s:%d: %s is '%s', expected '%s'\n", __FILE__, __LINE__, \
+			#actual, S_OR(__a, "(null)"), __e); \
+		__sync_fetch_and_add(&failures, 1); \
+	} \
+} while (0)
+
+struct counters {
+	unsigned long long frames;
+	unsigned long long sent;
+	unsigned long long overruns;
+	unsigned long long lost;
+	char in[16];
+	char out[16];
+};
+
+static struct ws_sink *sink;
+
+static void module_start(const char *slots)
+{
+	shim_config_clear("audiofork.conf");
+	if (slots) {
+		shim_config_set("audiofork.conf", "general", "ring_slots", slots);
+	}
+	CHECK(shim_module_load() == AST_MODULE_LOAD_SUCCESS);
+	sink = ws_sink_start(256 * 1024, NULL, NULL);
+	CHECK(sink != NULL);
+}
+
+static void sleep_ms(long ms)
+{
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+	nanosleep(&ts, NULL);
+}
+
+/*! \brief Wait for the forks to let go of the module */
+static int wait_usecount(int count, int timeout_ms)
+{
+	while (shim_module_usecount() != count) {
+		if (timeout_ms <= 0) {
+			return -1;
+		}
+		sleep_ms(10);
+		timeout_ms -= 10;
+	}
+	return 0;
+}
+
+static void module_stop(void)
+{
+	/* A hung up fork may still be flushing or retrying a connection */
+	CHECK(wait_usecount(0, 5000) == 0);
+	CHECK(shim_module_unload() == 0);
+	ws_sink_stop(sink);
+	sink = NULL;
+}
+
+static long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*! \brief Run AudioFork() against the sink with \a options */
+static int audiofork(struct ast_channel *chan, const char *options)
+{
+	char data[256];
+
+	snprintf(data, sizeof(data), "ws://127.0.0.1:%d/fork,%s", ws_sink_port(sink), options);
+	return shim_app_exec("AudioFork", chan, data);
+}
+
+/*! \brief Pass \a count slin frames of \a value, or of a running count if \a value is 0 */
+static void send_frames(struct ast_channel *chan, int write, int count, int16_t value)
+{
+	int16_t samples[SAMPLES];
+	int i;
+	int n;
+
+	for (n = 0; n < count; n++) {
+		struct ast_frame frame = {
+			.frametype = AST_FRAME_VOICE,
+			.subclass.format = ast_format_slin,
+			.datalen = sizeof(samples),
+			.samples = SAMPLES,
+			.data.ptr = samples,
+		};
+
+		for (i = 0; i < SAMPLES; i++) {
+			samples[i] = value ? value : (int16_t) (n * SAMPLES + i);
+		}
+		CHECK(shim_channel_frame(chan, &frame, write) == &frame);
+	}
+}
+
+/*! \brief Read one fork's row of "audiofork show forks" */
+static int fork_counters(const char *id, struct counters *counters)
+{
+	char buf[8192];
+	const char *line;
+
+	if (shim_cli_exec("audiofork show forks", buf, sizeof(buf)) != RESULT_SUCCESS
+		|| !(line = strstr(buf, id))) {
+		return -1;
+	}
+	return sscanf(line, "%*s %*s %llu %llu %llu %llu %15s %15s", &counters->frames,
+		&counters->sent, &counters->overruns, &counters->lost, counters->in,
+		counters->out) == 6 ? 0 : -1;
+}
+
+/*! \brief Wait until the worker has dealt with every frame taken off the channel */
+static int wait_drained(const char *id, struct counters *counters)
+{
+	int i;
+
+	for (i = 0; i < 5000; i++) {
+		if (!fork_counters(id, counters)
+			&& counters->sent + counters->lost == counters->frames) {
+			return 0;
+		}
+		sleep_ms(1);
+	}
+	return -1;
+}
+
+static int fork_count(void)
+{
+	char buf[8192];
+	const char *line;
+	int count = -1;
+
+	if (shim_cli_exec("audiofork show forks", buf, sizeof(buf)) == RESULT_SUCCESS
+		&& (line = strrchr(buf, '\n'))) {
+		while (line > buf && line[-1] != '\n') {
+			line--;
+		}
+		sscanf(line, "%d fork(s)", &count);
+	}
+	return count;
+}
+
+static void test_stream(void)
+{
+	struct ast_channel *chan;
+	int16_t capture[50 * SAMPLES];
+	struct ws_sink_conn_stats stats;
+	struct counters counters;
+	char id[256];
+	int i;
+
+	module_start(NULL);
+	chan = shim_channel_alloc("PJSIP/caller-00000001", NULL);
+	CHECK(audiofork(chan, "D(in)i(FORKID)") == 0);
+	ast_copy_string(id, S_OR(pbx_builtin_getvar_helper(chan, "FORKID"), ""), sizeof(id));
+	CHECK(!ast_strlen_zero(id));
+	CHECK(ws_sink_wait_connections(sink, 1, 1, 5000) == 0);
+
+	/* Spoken audio is forked, heard audio is not */
+	send_frames(chan, 0, 50, 0);
+	send_frames(chan, 1, 10, 1);
+	CHECK(ws_sink_wait_bytes(sink, sizeof(capture), 5000) == 0);
+	CHECK(wait_drained(id, &counters) == 0);
+	CHECK(counters.frames == 50);
+	CHECK(counters.sent == 50);
+	CHECK(counters.overruns == 0);
+	CHECK_STR(counters.in, "up");
+	CHECK_STR(counters.out, "-");
+
+	CHECK(ws_sink_conn(sink, 0, &stats, capture, sizeof(capture)) == sizeof(capture));
+	CHECK_STR(stats.path, "/fork");
+	CHECK(stats.messages == 50);
+	for (i = 0; i < 50 * SAMPLES; i++) {
+		if (capture[i] != (int16_t) i) {
+			CHECK(capture[i] == (int16_t) i);
+			break;
+		}
+	}
+
+	/* Stopping closes the connection once the ring is sent */
+	CHECK(shim_app_exec("StopAudioFork", chan, id) == 0);
+	CHECK(ws_sink_wait_connections(sink, 1, 0, 5000) == 0);
+	CHECK(fork_count() == 0);
+
+	shim_channel_hangup(chan);
+	module_stop();
+}
+
+static void test_both_gain(void)
+{
+	struct ast_channel *chan;
+	int16_t capture[SAMPLES];
+	int seen[2] = { 0, 0 };
+	size_t i;
+
+	module_start(NULL);
+	chan = shim_channel_alloc("PJSIP/caller-00000001", NULL);
+
+	/* V is the spoken volume, v the heard one */
+	CHECK(audiofork(chan, "V(1)v(-1)") == 0);
+	CHECK(ws_sink_wait_connections(sink, 2, 2, 5000) == 0);
+	send_frames(chan, 0, 20, 1000);
+	send_frames(chan, 1, 20, 1000);
+	send_frames(chan, 0, 1, 30000);
+	CHECK(ws_sink_wait_bytes(sink, 41 * FRAME_BYTES, 5000) == 0);
+
+	/* One connection per direction */
+	for (i = 0; i < 2; i++) {
+		struct ws_sink_conn_stats stats;
+
+		CHECK(ws_sink_conn(sink, i, &stats, capture, sizeof(capture)) == sizeof(capture));
+		if (capture[0] == 2000) {
+			CHECK(stats.messages == 21);
+			seen[0]++;
+		} else {
+			CHECK(capture[0] == 500);
+			CHECK(stats.messages == 20);
+			seen[1]++;
+		}
+	}
+	CHECK(seen[0] == 1 && seen[1] == 1);
+
+	/* Doubling saturates rather than wrapping */
+	for (i = 0; i < 2; i++) {
+		int16_t all[21 * SAMPLES];
+
+		if (ws_sink_conn(sink, i, NULL, all, sizeof(all)) == sizeof(all)) {
+			CHECK(all[20 * SAMPLES] == INT16_MAX);
+		}
+	}
+
+	shim_channel_hangup(chan);
+	CHECK(ws_sink_wait_connections(sink, 2, 0, 5000) == 0);
+	module_stop();
+}
+
+static void test_ulaw(void)
+{
+	struct ast_channel *chan;
+	uint8_t ulaw[SAMPLES];
+	int16_t capture[SAMPLES];
+	struct ast_frame frame = {
+		.frametype = AST_FRAME_VOICE,
+		.datalen = sizeof(ulaw),
+		.samples = SAMPLES,
+		.data.ptr = ulaw,
+	};
+
+	module_start(NULL);
+	chan = shim_channel_alloc("PJSIP/caller-00000001", NULL);
+	CHECK(audiofork(chan, "D(in)") == 0);
+
+	/* Decoded to signed linear before it is forked */
+	frame.subclass.format = ast_format_ulaw;
+	memset(ulaw, 0x80, sizeof(ulaw));
+	CHECK(shim_channel_frame(chan, &frame, 0) == &frame);
+	CHECK(ws_sink_wait_bytes(sink, sizeof(capture), 5000) == 0);
+	CHECK(ws_sink_conn(sink, 0, NULL, capture, sizeof(capture)) == sizeof(capture));
+	CHECK(capture[0] == 32124 && capture[SAMPLES - 1] == 32124);
+
+	shim_channel_hangup(chan);
+	module_stop();
+}
+
+static void test_bridged(void)
+{
+	struct ast_channel *chan;
+	struct ast_channel *peer;
+	struct ast_bridge *bridge;
+	struct counters counters;
+	char id[256];
+
+	module_start(NULL);
+	chan = shim_channel_alloc("PJSIP/caller-00000001", NULL);
+	peer = shim_channel_alloc("PJSIP/callee-00000002", ast_channel_uniqueid(chan));
+	CHECK(audiofork(chan, "bD(in)i(FORKID)") == 0);
+	ast_copy_string(id, S_OR(pbx_builtin_getvar_helper(chan, "FORKID"), ""), sizeof(id));
+
+	/* Only the frames while bridged are forked */
+	send_frames(chan, 0, 5, 1);
+	bridge = shim_bridge_alloc();
+	shim_bridge_join(bridge, chan);
+	shim_bridge_join(bridge, peer);
+	send_frames(chan, 0, 7, 1);
+	shim_bridge_leave(chan);
+	send_frames(chan, 0, 5, 1);
+	CHECK(ws_sink_wait_bytes(sink, 7 * FRAME_BYTES, 5000) == 0);
+	CHECK(wait_drained(id, &counters) == 0);
+	CHECK(counters.frames == 7);
+	CHECK(ws_sink_bytes(sink) == 7 * FRAME_BYTES);
+
+	shim_channel_hangup(peer);
+	shim_channel_hangup(chan);
+	ao2_ref(bridge, -1);
+	module_stop();
+}
+
+static void test_overrun(void)
+{
+	struct ast_channel *chan;
+	struct counters counters;
+	long long start;
+	long long slowest = 0;
+	char id[256];
+	int i;
+
+	module_start("16");
+	chan = shim_channel_alloc("PJSIP/caller-00000001", NULL);
+	CHECK(audiofork(chan, "D(in)i(FORKID)") == 0);
+	ast_copy_string(id, S_OR(pbx_builtin_getvar_helper(chan, "FORKID"), ""), sizeof(id));
+	CHECK(ws_sink_wait_connections(sink, 1, 1, 5000) == 0);
+
+	/* The server stops reading: the worker backs off, the media thread must not */
+	ws_sink_pause(sink, 1);
+	for (i = 0; i < FLOOD; i++) {
+		long long elapsed;
+
+		start = now_us();
+		send_frames(chan, 0, 1, 1);
+		elapsed = now_us() - start;
+		slowest = MAX(slowest, elapsed);
+	}
+	CHECK(slowest < 100000);
+	CHECK(!fork_counters(id, &counters));
+	CHECK(counters.overruns > 0);
+	CHECK(counters.frames + counters.overruns == FLOOD);
+
+	/* Every frame that made it into the ring reaches the server */
+	ws_sink_pause(sink, 0);
+	CHECK(wait_drained(id, &counters) == 0);
+	CHECK(counters.lost == 0);
+	CHECK(ws_sink_wait_bytes(sink, counters.frames * FRAME_BYTES, 5000) == 0);
+	CHECK(ws_sink_bytes(sink) == counters.frames * FRAME_BYTES);
+
+	shim_channel_hangup(chan);
+	module_stop();
+}
+
+static void test_reconnect(void)
+{
+	struct ast_channel *chan;
+	struct ws_sink_conn_stats stats;
+	struct counters counters;
+	char id[256];
+	int i;
+
+	module_start(NULL);
+	chan = shim_channel_alloc("PJSIP/caller-00000001", NULL);
+	CHECK(audiofork(chan, "D(in)R(0)r(3)i(FORKID)") == 0);
+	ast_copy_string(id, S_OR(pbx_builtin_getvar_helper(chan, "FORKID"), ""), sizeof(id));
+	CHECK(ws_sink_wait_connections(sink, 1, 1, 5000) == 0);
+
+	/* The server drops the connection and the fork comes back on a new one */
+	ws_sink_drop(sink);
+	CHECK(ws_sink_wait_connections(sink, 2, 1, 5000) == 0);
+	for (i = 0; i < 100 && !fork_counters(id, &counters) && strcmp(counters.in, "up"); i++) {
+		sleep_ms(10);
+	}
+	send_frames(chan, 0, 10, 1);
+	CHECK(wait_drained(id, &counters) == 0);
+	CHECK(ws_sink_wait_bytes(sink, 10 * FRAME_BYTES, 5000) == 0);
+	CHECK(ws_sink_conn(sink, 1, &stats, NULL, 0) == 0);
+	CHECK(stats.messages == 10);
+
+	shim_channel_hangup(chan);
+	module_stop();
+}
+
+static void test_unreachable(void)
+{
+	struct ast_channel *chan;
+	struct counters counters;
+	char id[256];
+	int port;
+	int i;
+
+	module_start(NULL);
+	/* Nothing listens on the port of a stopped sink */
+	port = ws_sink_port(sink);
+	ws_sink_stop(sink);
+	sink = ws_sink_start(0, NULL, NULL);
+
+	chan = shim_channel_alloc("PJSIP/caller-00000001", NULL);
+	{
+		char data[128];
+
+		snprintf(data, sizeof(data), "ws://127.0.0.1:%d/fork,D(out)R(0)r(2)i(FORKID)", port);
+		CHECK(shim_app_exec("AudioFork", chan, data) == 0);
+	}
+	ast_copy_string(id, S_OR(pbx_builtin_getvar_helper(chan, "FORKID"), ""), sizeof(id));
+
+	/* Given up after the attempts, frames are then left alone */
+	for (i = 0; i < 500 && !fork_counters(id, &counters) && strcmp(counters.out, "failed"); i++) {
+		sleep_ms(10);
+	}
+	CHECK_STR(counters.out, "failed");
+	send_frames(chan, 1, 10, 1);
+	CHECK(!fork_counters(id, &counters));
+	CHECK(counters.frames == 0);
+
+	shim_channel_hangup(chan);
+	CHECK(fork_count() == 0);
+	module_stop();
+}
+
+static void test_unload(void)
+{
+	struct ast_channel *chan;
+
+	module_start(NULL);
+	chan = shim_channel_alloc("PJSIP/caller-00000001", NULL);
+	CHECK(audiofork(chan, "") == 0);
+	CHECK(ws_sink_wait_connections(sink, 2, 2, 5000) == 0);
+	send_frames(chan, 0, 5, 1);
+
+	/* A live fork holds the module */
+	CHECK(shim_module_usecount() > 0);
+	CHECK(shim_module_unload() == -1);
+
+	/* Stopping flushes and closes without waiting for another frame */
+	CHECK(shim_app_exec("StopAudioFork", chan, "") == 0);
+	CHECK(ws_sink_wait_connections(sink, 2, 0, 5000) == 0);
+	CHECK(ws_sink_bytes(sink) == 5 * FRAME_BYTES);
+	CHECK(fork_count() == 0);
+
+	/* But the detached framehook stays on a quiet channel, and with it the fork */
+	CHECK(wait_usecount(1, 5000) == 0);
+	CHECK(shim_module_unload() == -1);
+
+	/* The next frame takes the framehook away */
+	send_frames(chan, 0, 1, 1);
+	CHECK(wait_usecount(0, 5000) == 0);
+	CHECK(ws_sink_bytes(sink) == 5 * FRAME_BYTES);
+	shim_channel_hangup(chan);
+	module_stop();
+}
+
+static void test_workers(void)
+{
+	struct ast_channel *chans[4];
+	char buf[4096];
+	unsigned int streams[2] = { 0, 0 };
+	unsigned int conns[2] = { 0, 0 };
+	const char *line;
+	size_t i;
+
+	shim_config_clear("audiofork.conf");
+	shim_config_set("audiofork.conf", "general", "workers", "2");
+	CHECK(shim_module_load() == AST_MODULE_LOAD_SUCCESS);
+	sink = ws_sink_start(0, NULL, NULL);
+
+	/* Forks spread over the workers by the streams they carry */
+	for (i = 0; i < ARRAY_LEN(chans); i++) {
+		char name[AST_CHANNEL_NAME];
+
+		snprintf(name, sizeof(name), "PJSIP/caller-%08zx", i);
+		chans[i] = shim_channel_alloc(name, NULL);
+		CHECK(audiofork(chans[i], i ? "D(in)" : "") == 0);
+	}
+	CHECK(ws_sink_wait_connections(sink, 5, 5, 5000) == 0);
+	for (i = 0; i < 500; i++) {
+		CHECK(shim_cli_exec("audiofork show workers", buf, sizeof(buf)) == RESULT_SUCCESS);
+		line = strchr(buf, '\n') + 1;
+		CHECK(sscanf(line, "0 %u %u", &streams[0], &conns[0]) == 2);
+		line = strchr(line, '\n') + 1;
+		CHECK(sscanf(line, "1 %u %u", &streams[1], &conns[1]) == 2);
+		if (conns[0] + conns[1] == 5) {
+			break;
+		}
+		sleep_ms(10);
+	}
+	CHECK(strstr(buf, "2 worker(s)") != NULL);
+	CHECK(streams[0] + streams[1] == 5);
+	CHECK(streams[0] >= 2 && streams[1] >= 2);
+	CHECK(conns[0] == streams[0] && conns[1] == streams[1]);
+
+	/* The streams come off the workers with the forks */
+	for (i = 0; i < ARRAY_LEN(chans); i++) {
+		shim_channel_hangup(chans[i]);
+	}
+	CHECK(ws_sink_wait_connections(sink, 5, 0, 5000) == 0);
+	for (i = 0; i < 500; i++) {
+		CHECK(shim_cli_exec("audiofork show workers", buf, sizeof(buf)) == RESULT_SUCCESS);
+		line = strchr(buf, '\n') + 1;
+		CHECK(sscanf(line, "0 %u", &streams[0]) == 1);
+		line = strchr(line, '\n') + 1;
+		CHECK(sscanf(line, "1 %u", &streams[1]) == 1);
+		if (!streams[0] && !streams[1]) {
+			break;
+		}
+		sleep_ms(10);
+	}
+	CHECK(!streams[0] && !streams[1]);
+	module_stop();
+}
+
+/*! \brief Sizes of the messages the sink received, in order */
+static struct {
+	size_t len[64];
+	size_t count;
+} messages;
+
+static void record_message(void *data attribute_unused, size_t conn attribute_unused,
+	const char *payload attribute_unused, size_t len)
+{
+	if (messages.count < ARRAY_LEN(messages.len)) {
+		messages.len[messages.count] = len;
+	}
+	__atomic_add_fetch(&messages.count, 1, __ATOMIC_RELEASE);
+}
+
+/*! \brief Restart the sink recording the message sizes */
+static void sink_record(void)
+{
+	ws_sink_stop(sink);
+	memset(&messages, 0, sizeof(messages));
+	sink = ws_sink_start(256 * 1024, record_message, NULL);
+}
+
+static void test_aggregate(void)
+{
+	struct ast_channel *chan;
+	struct counters counters;
+	int16_t capture[12 * SAMPLES];
+	char id[256];
+	int i;
+
+	module_start(NULL);
+	shim_config_set("audiofork.conf", "general", "aggregate_latency", "50");
+	CHECK(shim_module_reload() == 0);
+	sink_record();
+	chan = shim_channel_alloc("PJSIP/caller-00000001", NULL);
+	CHECK(audiofork(chan, "D(in)A(100)i(FORKID)") == 0);
+	ast_copy_string(id, S_OR(pbx_builtin_getvar_helper(chan, "FORKID"), ""), sizeof(id));
+	CHECK(ws_sink_wait_connections(sink, 1, 1, 5000) == 0);
+
+	/* Five 20 ms frames to a message, the last two go out on the latency cap */
+	send_frames(chan, 0, 12, 0);
+	CHECK(ws_sink_wait_bytes(sink, sizeof(capture), 5000) == 0);
+	CHECK(wait_drained(id, &counters) == 0);
+	CHECK(__atomic_load_n(&messages.count, __ATOMIC_ACQUIRE) == 3);
+	CHECK(messages.len[0] == 5 * FRAME_BYTES);
+	CHECK(messages.len[1] == 5 * FRAME_BYTES);
+	CHECK(messages.len[2] == 2 * FRAME_BYTES);
+	CHECK(counters.sent == 12);
+	CHECK(ws_sink_conn(sink, 0, NULL, capture, sizeof(capture)) == sizeof(capture));
+	for (i = 0; i < 12 * SAMPLES; i++) {
+		if (capture[i] != (int16_t) (i % (12 * SAMPLES))) {
+			CHECK(capture[i] == (int16_t) i);
+			break;
+		}
+	}
+
+	/* A part message still goes out when the fork stops */
+	send_frames(chan, 0, 3, 1);
+	CHECK(shim_app_exec("StopAudioFork", chan, id) == 0);
+	CHECK(ws_sink_wait_connections(sink, 1, 0, 5000) == 0);
+	CHECK(__atomic_load_n(&messages.count, __ATOMIC_ACQUIRE) == 4);
+	CHECK(messages.len[3] == 3 * FRAME_BYTES);
+
+	shim_channel_hangup(chan);
+	module_stop();
+}
+
+static void test_gather(void)
+{
+	struct ast_channel *chan;
+	struct counters counters;
+	unsigned long long writes = 0;
+	unsigned long long sent_messages = 0;
+	int16_t capture[10 * SAMPLES];
+	char buf[8192];
+	const char *line;
+	char id[256];
+	int i;
+
+	module_start(NULL);
+	sink_record();
+	chan = shim_channel_alloc("PJSIP/caller-00000001", NULL);
+
+	/* Held back while the first connection is made, then written together */
+	ws_sink_pause(sink, 1);
+	CHECK(audiofork(chan, "D(in)gi(FORKID)") == 0);
+	ast_copy_string(id, S_OR(pbx_builtin_getvar_helper(chan, "FORKID"), ""), sizeof(id));
+	send_frames(chan, 0, 10, 0);
+	ws_sink_pause(sink, 0);
+	CHECK(ws_sink_wait_bytes(sink, sizeof(capture), 5000) == 0);
+	CHECK(wait_drained(id, &counters) == 0);
+	CHECK(counters.sent == 10);
+	CHECK(__atomic_load_n(&messages.count, __ATOMIC_ACQUIRE) == 10);
+	CHECK(messages.len[0] == FRAME_BYTES && messages.len[9] == FRAME_BYTES);
+
+	CHECK(shim_cli_exec("audiofork show forks", buf, sizeof(buf)) == RESULT_SUCCESS);
+	CHECK((line = strstr(buf, id)) != NULL);
+	if (line) {
+		CHECK(sscanf(line, "%*s %*s %*u %*u %*u %*u %*s %*s %llu %llu", &sent_messages,
+			&writes) == 2);
+	}
+	CHECK(sent_messages == 10);
+	CHECK(writes == 1);
+
+	/* The masking on the way out is undone by the server */
+	CHECK(ws_sink_conn(sink, 0, NULL, capture, sizeof(capture)) == sizeof(capture));
+	for (i = 0; i < 10 * SAMPLES; i++) {
+		if (capture[i] != (int16_t) i) {
+			CHECK(capture[i] == (int16_t) i);
+			break;
+		}
+	}
+
+	shim_channel_hangup(chan);
+	CHECK(ws_sink_wait_connections(sink, 1, 0, 5000) == 0);
+	module_stop();
+}
+
+/*! \brief Pass one slin frame at \a format's rate, every sample \a value */
+static void send_frame(struct ast_channel *chan, int write, struct ast_format *format,
+	int16_t value)
+{
+	int16_t samples[SAMPLES * 6];
+	size_t count = SAMPLES * ast_format_get_sample_rate(format) / 8000;
+	size_t i;
+	struct ast_frame frame = {
+		.frametype = AST_FRAME_VOICE,
+		.subclass.format = format,
+		.datalen = count * sizeof(int16_t),
+		.samples = count,
+		.data.ptr = samples,
+	};
+
+	for (i = 0; i < count; i++) {
+		samples[i] = value;
+	}
+	CHECK(shim_channel_frame(chan, &frame, write) == &frame);
+}
+
+static void test_stereo(void)
+{
+	struct ast_channel *chan;
+	struct counters counters;
+	int16_t capture[2 * 10 * SAMPLES];
+	size_t pairs = 0;
+	size_t left = 0;
+	size_t right = 0;
+	char id[256];
+	size_t i;
+	int k;
+
+	module_start(NULL);
+	chan = shim_channel_alloc("PJSIP/caller-00000001", NULL);
+	CHECK(audiofork(chan, "D(both)Si(FORKID)") == 0);
+	ast_copy_string(id, S_OR(pbx_builtin_getvar_helper(chan, "FORKID"), ""), sizeof(id));
+	CHECK(ws_sink_wait_connections(sink, 1, 1, 5000) == 0);
+	CHECK(fork_count() == 1);
+
+	/* Heard audio at 16 kHz is brought down to the 8 kHz of the first frame */
+	for (k = 0; k < 10; k++) {
+		send_frame(chan, 0, ast_format_slin, 1000);
+		send_frame(chan, 1, ast_format_slin16, 2000);
+		sleep_ms(20);
+	}
+	CHECK(wait_drained(id, &counters) == 0);
+	CHECK(counters.frames == 20 && counters.sent == 20 && !counters.lost);
+	CHECK_STR(counters.in, "up");
+	CHECK_STR(counters.out, "up");
+
+	/* Stopping pairs what is left, so every sample of both sides is there */
+	CHECK(shim_app_exec("StopAudioFork", chan, id) == 0);
+	CHECK(ws_sink_wait_connections(sink, 1, 0, 5000) == 0);
+	CHECK(ws_sink_connections(sink) == 1);
+	CHECK(ws_sink_conn(sink, 0, NULL, capture, sizeof(capture)) >= (int) sizeof(capture));
+	for (i = 0; i < ARRAY_LEN(capture) / 2; i++) {
+		left += capture[2 * i] == 1000;
+		right += capture[2 * i + 1] == 2000;
+		pairs += capture[2 * i] == 1000 && capture[2 * i + 1] == 2000;
+		CHECK((capture[2 * i] == 1000 || !capture[2 * i])
+			&& (capture[2 * i + 1] == 2000 || !capture[2 * i + 1]));
+	}
+	CHECK(left == 10 * SAMPLES && right == 10 * SAMPLES);
+	/* The sides were taken off the channel together, so they line up */
+	CHECK(pairs == 10 * SAMPLES);
+
+	/* S needs both directions */
+	CHECK(audiofork(chan, "D(in)S") == 0);
+	CHECK(ws_sink_wait_connections(sink, 2, 1, 5000) == 0);
+	send_frame(chan, 0, ast_format_slin, 1000);
+	CHECK(ws_sink_wait_bytes(sink, sizeof(capture) + FRAME_BYTES, 5000) == 0);
+	CHECK(ws_sink_conn(sink, 1, NULL, capture, FRAME_BYTES) == FRAME_BYTES);
+	CHECK(capture[0] == 1000 && capture[1] == 1000);
+
+	shim_channel_hangup(chan);
+	CHECK(ws_sink_wait_connections(sink, 2, 0, 5000) == 0);
+	module_stop();
+}
+
+int main(void)
+{
+	static const struct {
+		const char *name;
+		void (*fn)(void);
+	} tests[] = {
+		{ "stream", test_stream },
+		{ "both_gain", test_both_gain },
+		{ "ulaw", test_ulaw },
+		{ "bridged", test_bridged },
+		{ "overrun", test_overrun },
+		{ "reconnect", test_reconnect },
+		{ "unreachable", test_unreachable },
+		{ "unload", test_unload },
+		{ "workers", test_workers },
+		{ "aggregate", test_aggregate },
+		{ "gather", test_gather },
+		{ "stereo", test_stereo },
+	};
+	size_t i;
+
+	for (i = 0; i < ARRAY_LEN(tests); i++) {
+		int before = failures;
+
+		tests[i].fn();
+		printf("%-32s %s\n", tests[i].name, failures == before ? "PASS" : "FAIL");
+	}
+	CHECK(shim_channel_count() == 0);
+
+	printf("%d failure(s)\n", failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,820 @@
+/*
+ * app_bridgemon tests
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the COPYING file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Functional tests for app_bridgemon, run against the API shim
+ *
+ * Build and run with "make test".
+ */
+
+#include "shim.h"
+
+static int failures;
+
+#define CHECK(expr) do { \
+	if (!(expr)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+		failures++; \
+	} \
+} while (0)
+
+#define CHECK_STR(actual, expected) do { \
+	const char *__a = (actual); \
+	const char *__e = (expected); \
+	if (!__a || strcmp(__a, __e)) { \
+		fprintf(stderr, "%s:%d: %s is '%s', expected '%s'\n", __FILE__, __LINE__, \
+			#actual, S_OR(__a, "(null)"), __e); \
+		failures++; \
+	} \
+} while (0)
+
+static const char *peerid(struct ast_channel *chan)
+{
+	return pbx_builtin_getvar_helper(chan, "BRIDGEPEERID");
+}
+
+/*! \brief Load the module with a fresh bridgemon.conf */
+static void module_start(const char *mode, const char *resolve)
+{
+	shim_config_clear("bridgemon.conf");
+	if (mode) {
+		shim_config_set("bridgemon.conf", "general", "mode", mode);
+	}
+	if (resolve) {
+		shim_config_set("bridgemon.conf", "general", "resolve", resolve);
+	}
+	CHECK(shim_module_load() == AST_MODULE_LOAD_SUCCESS);
+}
+
+static void module_stop(void)
+{
+	shim_taskprocessors_wait();
+	CHECK(shim_module_unload() == 0);
+}
+
+static void test_findpeer_linkedid(void)
+{
+	struct ast_channel *caller;
+	struct ast_channel *callee;
+	char buf[256];
+
+	module_start(NULL, NULL);
+
+	caller = shim_channel_alloc("PJSIP/caller-00000001", NULL);
+	callee = shim_channel_alloc("PJSIP/callee-00000002", ast_channel_uniqueid(caller));
+
+	CHECK(shim_app_exec("FindPeer", callee, "") == 0);
+	CHECK_STR(peerid(caller), ast_channel_uniqueid(callee));
+
+	CHECK(shim_func_read(caller, "PEERID()", buf, sizeof(buf)) == 0);
+	CHECK_STR(buf, ast_channel_uniqueid(callee));
+
+	CHECK(shim_func_read(callee, "PEERIDS()", buf, sizeof(buf)) == 0);
+	CHECK_STR(buf, ast_channel_uniqueid(callee));
+	CHECK(shim_func_read(callee, "PEERCOUNT()", buf, sizeof(buf)) == 0);
+	CHECK_STR(buf, "1");
+
+	shim_channel_hangup(callee);
+	CHECK(shim_func_read(caller, "PEERCOUNT()", buf, sizeof(buf)) == 0);
+	CHECK_STR(buf, "0");
+
+	shim_channel_hangup(caller);
+	module_stop();
+}
+
+static void test_peerid_cache(void)
+{
+	struct ast_channel *caller;
+	struct ast_channel *legs[2];
+	char name[64];
+	char buf[256];
+
+	module_start(NULL, NULL);
+
+	caller = shim_channel_alloc("PJSIP/caller-00000003", NULL);
+	legs[0] = shim_channel_alloc("PJSIP/agent-00000004", ast_channel_uniqueid(caller));
+
+	/* Derived from the linkedid group, then answered again from the index entry */
+	CHECK(shim_func_read(caller, "PEERID()", buf, sizeof(buf)) == 0);
+	CHECK_STR(buf, ast_channel_uniqueid(legs[0]));
+	snprintf(name, sizeof(name), "PEERID(%s)", ast_channel_uniqueid(caller));
+	CHECK(shim_func_read(NULL, name, buf, sizeof(buf)) == 0);
+	CHECK_STR(buf, ast_channel_uniqueid(legs[0]));
+
+	/* The group changing moves the generation on */
+	shim_channel_hangup(legs[0]);
+	CHECK(shim_func_read(caller, "PEERID()", buf, sizeof(buf)) == 0);
+	CHECK_STR(buf, "");
+	legs[1] = shim_channel_alloc("PJSIP/agent-00000005", ast_channel_uniqueid(caller));
+	CHECK(shim_func_read(caller, "PEERID()", buf, sizeof(buf)) == 0);
+	CHECK_STR(buf, ast_channel_uniqueid(legs[1]));
+
+	/* As does a recorded peer */
+	CHECK(shim_app_exec("FindPeer", legs[1], "") == 0);
+	CHECK(shim_func_read(legs[1], "PEERID()", buf, sizeof(buf)) == 0);
+	CHECK_STR(buf, ast_channel_uniqueid(caller));
+
+	CHECK(shim_func_read(NULL, "PEERID(no-such-channel)", buf, sizeof(buf)) == 0);
+	CHECK_STR(buf, "");
+
+	shim_channel_hangup(legs[1]);
+	shim_channel_hangup(caller);
+	module_stop();
+}
+
+static void test_peerids_fanout(void)
+{
+	struct ast_channel *caller;
+	struct ast_channel *legs[4];
+	char expected[256];
+	char name[64];
+	char buf[256];
+	int i;
+
+	module_start(NULL, NULL);
+
+	caller = shim_channel_alloc("PJSIP/caller-00000010", NULL);
+	for (i = 0; i < 4; i++) {
+		snprintf(name, sizeof(name), "PJSIP/agent-%08x", 0x11 + i);
+		legs[i] = shim_channel_alloc(name, ast_channel_uniqueid(caller));
+	}
+
+	/* In the order the legs were created, the originator left out */
+	snprintf(expected, sizeof(expected), "%s,%s,%s,%s", ast_channel_uniqueid(legs[0]),
+		ast_channel_uniqueid(legs[1]), ast_channel_uniqueid(legs[2]),
+		ast_channel_uniqueid(legs[3]));
+	CHECK(shim_func_read(caller, "PEERIDS()", buf, sizeof(buf)) == 0);
+	CHECK_STR(buf, expected);
+	CHECK(shim_func_read(legs[2], "PEERIDS()", buf, sizeof(buf)) == 0);
+	CHECK_STR(buf, expected);
+	snprintf(name, sizeof(name), "PEERIDS(%s)", ast_channel_uniqueid(caller));
+	CHECK(shim_func_read(NULL, name, buf, sizeof(buf)) == 0);
+	CHECK_STR(buf, expected);
+	CHECK(shim_func_read(caller, "PEERCOUNT()", buf, sizeof(buf)) == 0);
+	CHECK_STR(buf, "4");
+
+	/* A leg in the middle hangs up, the rest keep their order */
+	shim_channel_hangup(legs[1]);
+	snprintf(expected, sizeof(expected), "%s,%s,%s", ast_channel_uniqueid(legs[0]),
+		ast_channel_uniqueid(legs[2]), ast_channel_uniqueid(legs[3]));
+	CHECK(shim_func_read(caller, "PEERIDS()", buf, sizeof(buf)) == 0);
+	CHECK_STR(buf, expected);
+	CHECK(shim_func_read(caller, "PEERCOUNT()", buf, sizeof(buf)) == 0);
+	CHECK_STR(buf, "3");
+
+	/* Then the first and the last, leaving no separator behind */
+	shim_channel_hangup(legs[0]);
+	shim_channel_hangup(legs[3]);
+	CHECK(shim_func_read(caller, "PEERIDS()", buf, sizeof(buf)) == 0);
+	CHECK_STR(buf, ast_channel_uniqueid(legs[2]));
+	CHECK(shim_func_read(caller, "PEERCOUNT()", buf, sizeof(buf)) == 0);
+	CHECK_STR(buf, "1");
+
+	shim_channel_hangup(legs[2]);
+	CHECK(shim_func_read(caller, "PEERIDS()", buf, sizeof(buf)) == 0);
+	CHECK_STR(buf, "");
+	CHECK(shim_func_read(caller, "PEERCOUNT()", buf, sizeof(buf)) == 0);
+	CHECK_STR(buf, "0");
+
+	shim_channel_hangup(caller);
+	module_stop();
+}
+
+static void test_findpeer_missing_originator(void)
+{
+	struct ast_channel *orphan;
+
+	module_start(NULL, NULL);
+
+	orphan = shim_channel_alloc("PJSIP/orphan-00000003", "1.gone");
+	CHECK(shim_app_exec("FindPeer", orphan, "") == 0);
+	CHECK(shim_app_exec("FindPeer", orphan, "w(0.05)") == 0);
+	CHECK_STR(pbx_builtin_getvar_helper(orphan, "FINDPEERSTATUS"), "TIMEOUT");
+
+	shim_channel_hangup(orphan);
+	module_stop();
+}
+
+/*! \brief Read the negative cache counters off "findpeer show cache" */
+static void negcache_counts(int *hits, int *misses, int *invalidations)
+{
+	char buf[512];
+	const char *line;
+
+	*hits = *misses = *invalidations = -1;
+	CHECK(shim_cli_exec("findpeer show cache", buf, sizeof(buf)) == RESULT_SUCCESS);
+	if ((line = strstr(buf, "Hits:"))) {
+		sscanf(line, "Hits: %d", hits);
+	}
+	if ((line = strstr(buf, "Misses:"))) {
+		sscanf(line, "Misses: %d", misses);
+	}
+	if ((line = strstr(buf, "Invalidations:"))) {
+		sscanf(line, "Invalidations: %d", invalidations);
+	}
+}
+
+static void test_negcache(void)
+{
+	struct ast_channel *probe;
+	struct ast_channel *caller;
+	struct ast_channel *callee;
+	struct timespec ts = { 0, 300 * 1000000L };
+	char linkedid[AST_MAX_UNIQUEID];
+	long epoch;
+	int seq;
+	int hits[2];
+	int misses[2];
+	int invalidations[2];
+
+	shim_config_clear("bridgemon.conf");
+	shim_config_set("bridgemon.conf", "general", "negative_cache_ttl", "200");
+	CHECK(shim_module_load() == AST_MODULE_LOAD_SUCCESS);
+
+	/* The shim hands uniqueids out in order, the caller gets the one after the callee */
+	probe = shim_channel_alloc("PJSIP/probe-0000000c", NULL);
+	CHECK(sscanf(ast_channel_uniqueid(probe), "%ld.%d", &epoch, &seq) == 2);
+	shim_channel_hangup(probe);
+	snprintf(linkedid, sizeof(linkedid), "%ld.%d", epoch, seq + 2);
+	callee = shim_channel_alloc("PJSIP/callee-0000000d", linkedid);
+
+	negcache_counts(&hits[0], &misses[0], &invalidations[0]);
+	CHECK(shim_app_exec("FindPeer", callee, "") == 0);
+	CHECK(shim_app_exec("FindPeer", callee, "") == 0);
+	negcache_counts(&hits[1], &misses[1], &invalidations[1]);
+	CHECK(misses[1] - misses[0] == 1);
+	CHECK(hits[1] - hits[0] == 1);
+
+	/* Past the TTL the originator is looked for again */
+	nanosleep(&ts, NULL);
+	CHECK(shim_app_exec("FindPeer", callee, "") == 0);
+	negcache_counts(&hits[1], &misses[1], &invalidations[1]);
+	CHECK(misses[1] - misses[0] == 2);
+	CHECK(hits[1] - hits[0] == 1);
+	CHECK(invalidations[1] == invalidations[0]);
+
+	/* Its arrival clears the entry, so the next lookup finds it */
+	caller = shim_channel_alloc("PJSIP/caller-0000000e", NULL);
+	CHECK_STR(ast_channel_uniqueid(caller), linkedid);
+	negcache_counts(&hits[1], &misses[1], &invalidations[1]);
+	CHECK(invalidations[1] - invalidations[0] == 1);
+	CHECK(shim_app_exec("FindPeer", callee, "") == 0);
+	CHECK_STR(peerid(caller), ast_channel_uniqueid(callee));
+	negcache_counts(&hits[1], &misses[1], &invalidations[1]);
+	CHECK(hits[1] - hits[0] == 1);
+
+	shim_channel_hangup(callee);
+	shim_channel_hangup(caller);
+	module_stop();
+}
+
+static void test_bridgemon_hook(void)
+{
+	struct ast_channel *a;
+	struct ast_channel *b;
+	struct ast_bridge *bridge;
+
+	module_start(NULL, NULL);
+
+	a = shim_channel_alloc("PJSIP/a-00000004", NULL);
+	b = shim_channel_alloc("PJSIP/b-00000005", NULL);
+	CHECK(shim_app_exec("BridgeMon", a, "") == 0);
+	CHECK(shim_app_exec("BridgeMon", b, "") == 0);
+
+	bridge = shim_bridge_alloc();
+	shim_bridge_join(bridge, a);
+	shim_bridge_join(bridge, b);
+	CHECK_STR(peerid(a), ast_channel_uniqueid(b));
+	CHECK_STR(peerid(b), ast_channel_uniqueid(a));
+
+	CHECK(shim_app_exec("StopBridgeMon", a, "") == 0);
+	shim_channel_hangup(a);
+	shim_channel_hangup(b);
+	ao2_ref(bridge, -1);
+	module_stop();
+}
+
+/*! \brief A channel under BridgeMon() keeps the module loaded until it is gone */
+static void test_bridgemon_unload_busy(void)
+{
+	struct ast_channel *a;
+	struct ast_channel *b;
+	struct ast_bridge *bridge;
+
+	module_start(NULL, NULL);
+
+	a = shim_channel_alloc("PJSIP/a-00000014", NULL);
+	b = shim_channel_alloc("PJSIP/b-00000015", NULL);
+	CHECK(shim_app_exec("BridgeMon", a, "") == 0);
+	CHECK(shim_app_exec("BridgeMon", a, "") == 0);
+	CHECK(shim_module_usecount() == 1);
+	CHECK(shim_module_unload() == -1);
+
+	/* Refused before anything was torn down, the hooks still work */
+	bridge = shim_bridge_alloc();
+	shim_bridge_join(bridge, b);
+	shim_bridge_join(bridge, a);
+	CHECK_STR(peerid(a), ast_channel_uniqueid(b));
+
+	shim_channel_hangup(a);
+	CHECK(shim_module_usecount() == 0);
+	shim_channel_hangup(b);
+	ao2_ref(bridge, -1);
+	module_stop();
+}
+
+static void test_bridgemon_stasis_roster(void)
+{
+	struct ast_channel *chans[3];
+	struct ast_bridge *bridge;
+	char expected[256];
+	int i;
+
+	module_start("stasis", "bridge");
+
+	bridge = shim_bridge_alloc();
+	for (i = 0; i < 3; i++) {
+		char name[32];
+
+		snprintf(name, sizeof(name), "PJSIP/conf-%08d", i);
+		chans[i] = shim_channel_alloc(name, NULL);
+		CHECK(shim_app_exec("BridgeMon", chans[i], "") == 0);
+		shim_bridge_join(bridge, chans[i]);
+	}
+	shim_taskprocessors_wait();
+
+	snprintf(expected, sizeof(expected), "%s,%s",
+		ast_channel_uniqueid(chans[1]), ast_channel_uniqueid(chans[2]));
+	CHECK_STR(peerid(chans[0]), expected);
+
+	for (i = 0; i < 3; i++) {
+		shim_channel_hangup(chans[i]);
+	}
+	ao2_ref(bridge, -1);
+	module_stop();
+}
+
+static void test_autotag(void)
+{
+	static const struct {
+		const char *caller;
+		const char *callee;
+		const char *context;
+		int tagged;
+	} calls[] = {
+		{ "PJSIP/trunk-00000001", "PJSIP/agent-00000002", "from-pstn", 1 },
+		{ "SIP/trunk-00000003", "SIP/agent-00000004", "from-pstn", 0 },
+		{ "PJSIP/desk-00000005", "PJSIP/desk-00000006", "internal", 0 },
+	};
+	struct ast_channel *chans[ARRAY_LEN(calls)][2];
+	struct ast_bridge *bridges[ARRAY_LEN(calls)];
+	size_t i;
+
+	shim_config_clear("bridgemon.conf");
+	shim_config_set("bridgemon.conf", "general", "autotag", "yes");
+	shim_config_set("bridgemon.conf", "general", "autotag_context", "queues, from-pstn");
+	shim_config_set("bridgemon.conf", "general", "autotag_tech", "pjsip");
+	CHECK(shim_module_load() == AST_MODULE_LOAD_SUCCESS);
+
+	/* No FindPeer() or BridgeMon() anywhere, only the caller's context matters */
+	for (i = 0; i < ARRAY_LEN(calls); i++) {
+		chans[i][0] = shim_channel_alloc(calls[i].caller, NULL);
+		chans[i][1] = shim_channel_alloc(calls[i].callee, ast_channel_uniqueid(chans[i][0]));
+		shim_channel_set_context(chans[i][0], calls[i].context);
+		shim_channel_set_context(chans[i][1], "agents");
+		bridges[i] = shim_bridge_alloc();
+		shim_bridge_join(bridges[i], chans[i][0]);
+		shim_bridge_join(bridges[i], chans[i][1]);
+	}
+	shim_taskprocessors_wait();
+
+	for (i = 0; i < ARRAY_LEN(calls); i++) {
+		if (calls[i].tagged) {
+			CHECK_STR(peerid(chans[i][0]), ast_channel_uniqueid(chans[i][1]));
+			CHECK_STR(peerid(chans[i][1]), ast_channel_uniqueid(chans[i][0]));
+		} else {
+			CHECK(peerid(chans[i][0]) == NULL);
+			CHECK(peerid(chans[i][1]) == NULL);
+		}
+	}
+
+	for (i = 0; i < ARRAY_LEN(calls); i++) {
+		shim_channel_hangup(chans[i][0]);
+		shim_channel_hangup(chans[i][1]);
+		ao2_ref(bridges[i], -1);
+	}
+	module_stop();
+}
+
+static void test_local_chain(void)
+{
+	struct ast_channel *caller;
+	struct ast_channel *locals[2][2];
+	struct ast_channel *agents[2];
+	struct ast_bridge *bridges[3];
+	const char *linkedid;
+	char buf[256];
+	int i;
+
+	module_start(NULL, NULL);
+
+	/* caller <-> Local;1, Local;2 <-> Local;1, Local;2 <-> agent */
+	caller = shim_channel_alloc("PJSIP/caller-00000001", NULL);
+	linkedid = ast_channel_uniqueid(caller);
+	shim_local_alloc("queue@members", linkedid, &locals[0][0], &locals[0][1]);
+	shim_local_alloc("agent@agents", linkedid, &locals[1][0], &locals[1][1]);
+	agents[0] = shim_channel_alloc("PJSIP/agent-00000002", linkedid);
+	agents[1] = shim_channel_alloc("PJSIP/agent-00000003", linkedid);
+	for (i = 0; i < 3; i++) {
+		bridges[i] = shim_bridge_alloc();
+	}
+	shim_bridge_join(bridges[0], caller);
+	shim_bridge_join(bridges[0], locals[0][0]);
+	shim_bridge_join(bridges[1], locals[0][1]);
+	shim_bridge_join(bridges[1], locals[1][0]);
+	shim_bridge_join(bridges[2], locals[1][1]);
+	shim_bridge_join(bridges[2], agents[0]);
+
+	/* Run from the first Local's dialplan, the peer is the agent at the far end */
+	CHECK(shim_app_exec("FindPeer", locals[0][1], "") == 0);
+	CHECK_STR(peerid(caller), ast_channel_uniqueid(agents[0]));
+	CHECK(shim_func_read(caller, "PEERID()", buf, sizeof(buf)) == 0);
+	CHECK_STR(buf, ast_channel_uniqueid(agents[0]));
+
+	/* Answered from the cache while the chain stands */
+	shim_bridge_leave(agents[0]);
+	shim_bridge_join(bridges[2], agents[1]);
+	CHECK(shim_app_exec("FindPeer", locals[0][1], "") == 0);
+	CHECK_STR(peerid(caller), ast_channel_uniqueid(agents[0]));
+
+	/* An optimization drops it and the chain is walked again */
+	shim_local_optimize(locals[1][0], locals[1][1]);
+	CHECK(shim_app_exec("FindPeer", locals[0][1], "") == 0);
+	CHECK_STR(peerid(caller), ast_channel_uniqueid(agents[1]));
+
+	for (i = 0; i < 2; i++) {
+		shim_channel_hangup(locals[i][0]);
+		shim_channel_hangup(locals[i][1]);
+		shim_channel_hangup(agents[i]);
+	}
+	shim_channel_hangup(caller);
+	for (i = 0; i < 3; i++) {
+		ao2_ref(bridges[i], -1);
+	}
+	module_stop();
+}
+
+static void test_sweep(void)
+{
+	static const char * const parallel[] = { "Parallel: yes", NULL };
+	struct ast_channel *caller;
+	struct ast_channel *callee;
+	char buf[512];
+
+	module_start(NULL, NULL);
+
+	caller = shim_channel_alloc("PJSIP/caller-00000006", NULL);
+	callee = shim_channel_alloc("PJSIP/callee-00000007", ast_channel_uniqueid(caller));
+
+	CHECK(shim_cli_exec("findpeer sweep", buf, sizeof(buf)) == RESULT_SUCCESS);
+	CHECK(strstr(buf, "Tagged 1 peers across 2 channels") != NULL);
+	CHECK_STR(peerid(caller), ast_channel_uniqueid(callee));
+
+	pbx_builtin_setvar_helper(caller, "BRIDGEPEERID", NULL);
+	CHECK(shim_manager_action("FindPeerSweep", parallel, buf, sizeof(buf)) == 0);
+	CHECK(strstr(buf, "Tagged: 1\r\n") != NULL);
+	CHECK_STR(peerid(caller), ast_channel_uniqueid(callee));
+
+	shim_channel_hangup(callee);
+	shim_channel_hangup(caller);
+	module_stop();
+}
+
+static void test_findpeer_stats(void)
+{
+	struct ast_channel *caller;
+	struct ast_channel *callee;
+	struct ast_channel *orphan;
+	char buf[2048];
+
+	module_start(NULL, NULL);
+
+	caller = shim_channel_alloc("PJSIP/caller-00000008", NULL);
+	callee = shim_channel_alloc("PJSIP/callee-00000009", ast_channel_uniqueid(caller));
+	orphan = shim_channel_alloc("PJSIP/orphan-0000000a", "1234.404");
+
+	CHECK(shim_app_exec("FindPeer", callee, "") == 0);
+	CHECK(shim_app_exec("FindPeer", callee, "") == 0);
+	CHECK(shim_app_exec("FindPeer", orphan, "") == 0);
+
+	CHECK(shim_manager_action("FindPeerStats", NULL, buf, sizeof(buf)) == 0);
+	CHECK(strstr(buf, "TotalCount: 3\r\n") != NULL);
+	CHECK(strstr(buf, "LookupCount: 3\r\n") != NULL);
+	CHECK(strstr(buf, "LockWaitCount: 2\r\n") != NULL);
+	CHECK(strstr(buf, "SetVarCount: 2\r\n") != NULL);
+	CHECK(strstr(buf, "SetVarHistogram: ") != NULL);
+
+	CHECK(shim_cli_exec("findpeer show stats", buf, sizeof(buf)) == RESULT_SUCCESS);
+	CHECK(strstr(buf, "lockwait") != NULL);
+
+	shim_channel_hangup(orphan);
+	shim_channel_hangup(callee);
+	shim_channel_hangup(caller);
+	module_stop();
+}
+
+static void test_findpeer_log(void)
+{
+	struct ast_channel *orphan;
+	char buf[4096];
+	const char *line;
+	int i;
+
+	module_start(NULL, NULL);
+
+	orphan = shim_channel_alloc("PJSIP/orphan-0000000b", "1234.405");
+	for (i = 0; i < 5; i++) {
+		CHECK(shim_app_exec("FindPeer", orphan, "") == 0);
+	}
+
+	CHECK(shim_cli_exec("findpeer show log 3", buf, sizeof(buf)) == RESULT_SUCCESS);
+	for (i = 0, line = buf; (line = strstr(line, "[PJSIP/orphan-0000000b] no peer found")); line++) {
+		i++;
+	}
+	CHECK(i == 3);
+	CHECK(shim_cli_exec("findpeer show log 0", buf, sizeof(buf)) == RESULT_SHOWUSAGE);
+
+	shim_channel_hangup(orphan);
+	module_stop();
+}
+
+static int count_matches(const char *haystack, const char *needle)
+{
+	int count = 0;
+
+	for (; (haystack = strstr(haystack, needle)); haystack++) {
+		count++;
+	}
+	return count;
+}
+
+#define LOG_THREADS 48
+#define LOG_OPS 2000
+
+struct log_call {
+	pthread_t thread;
+	struct ast_channel *caller;
+	struct ast_channel *callee;
+};
+
+static void *log_run(void *data)
+{
+	struct log_call *call = data;
+	int i;
+
+	for (i = 0; i < LOG_OPS; i++) {
+		shim_app_exec("FindPeer", call->callee, "");
+	}
+	return NULL;
+}
+
+static void *log_mark(void *data)
+{
+	shim_app_exec("FindPeer", data, "");
+	return NULL;
+}
+
+/*! \brief Threads sharing log stripes never mix their entries or hold the drain up */
+static void test_findpeer_log_shared(void)
+{
+	static struct log_call calls[LOG_THREADS];
+	static char buf[1 << 20];
+	struct ast_channel *marks[LOG_THREADS];
+	struct timespec ts = { 1, 0 };
+	const char *line;
+	int torn = 0;
+	int stderr_fd;
+	FILE *out;
+	int i;
+
+	shim_config_clear("bridgemon.conf");
+	shim_config_set("bridgemon.conf", "general", "log_rate", "0");
+	CHECK(shim_module_load() == AST_MODULE_LOAD_SUCCESS);
+
+	/* Three threads to a stripe, each lapping it while the others are switched out */
+	for (i = 0; i < LOG_THREADS; i++) {
+		snprintf(buf, sizeof(buf), "PJSIP/caller-%08x", i);
+		calls[i].caller = shim_channel_alloc(buf, NULL);
+		snprintf(buf, sizeof(buf), "PJSIP/callee-%08x", i);
+		calls[i].callee = shim_channel_alloc(buf, ast_channel_uniqueid(calls[i].caller));
+	}
+	for (i = 0; i < LOG_THREADS; i++) {
+		pthread_create(&calls[i].thread, NULL, log_run, &calls[i]);
+	}
+	for (i = 0; i < LOG_THREADS; i++) {
+		pthread_join(calls[i].thread, NULL);
+	}
+
+	CHECK(shim_cli_exec("findpeer show log 4096", buf, sizeof(buf)) == RESULT_SUCCESS);
+	for (line = buf; (line = strstr(line, "bridge found peer=")); line++) {
+		char peer[AST_MAX_UNIQUEID];
+		char uniqueid[AST_MAX_UNIQUEID];
+		int matched = 0;
+
+		if (sscanf(line, "bridge found peer=%39[^,], bridgepeerid=%39s", peer, uniqueid) != 2) {
+			torn++;
+			continue;
+		}
+		for (i = 0; i < LOG_THREADS; i++) {
+			matched |= !strcmp(peer, ast_channel_uniqueid(calls[i].caller))
+				&& !strcmp(uniqueid, ast_channel_uniqueid(calls[i].callee));
+		}
+		torn += !matched;
+	}
+	if (torn) {
+		fprintf(stderr, "%d log entries mixed two writers\n", torn);
+	}
+	CHECK(torn == 0);
+
+	/* One message from every stripe, all written out within a few drain passes */
+	fflush(stderr);
+	out = tmpfile();
+	stderr_fd = dup(STDERR_FILENO);
+	dup2(fileno(out), STDERR_FILENO);
+	option_verbose = 2;
+	for (i = 0; i < LOG_THREADS; i++) {
+		pthread_t thread;
+
+		snprintf(buf, sizeof(buf), "PJSIP/mark-%08x", i);
+		marks[i] = shim_channel_alloc(buf, "1234.406");
+		pthread_create(&thread, NULL, log_mark, marks[i]);
+		pthread_join(thread, NULL);
+	}
+	nanosleep(&ts, NULL);
+	option_verbose = 0;
+	dup2(stderr_fd, STDERR_FILENO);
+	close(stderr_fd);
+	rewind(out);
+	buf[fread(buf, 1, sizeof(buf) - 1, out)] = '\0';
+	fclose(out);
+	CHECK(count_matches(buf, "FindPeer: [PJSIP/mark-") == LOG_THREADS);
+
+	for (i = 0; i < LOG_THREADS; i++) {
+		shim_channel_hangup(marks[i]);
+		shim_channel_hangup(calls[i].callee);
+		shim_channel_hangup(calls[i].caller);
+	}
+	module_stop();
+}
+
+static void test_findpeer_bulk(void)
+{
+	struct ast_channel *callers[2];
+	struct ast_channel *callees[2];
+	char uniqueids[256];
+	char linkedid[256];
+	char buf[4096];
+	char expected[512];
+	const char *headers[] = { uniqueids, "UniqueID: 1234.999", linkedid, NULL };
+	int i;
+
+	module_start(NULL, NULL);
+
+	for (i = 0; i < 2; i++) {
+		snprintf(buf, sizeof(buf), "PJSIP/caller-%08x", i);
+		callers[i] = shim_channel_alloc(buf, NULL);
+		snprintf(buf, sizeof(buf), "PJSIP/callee-%08x", i);
+		callees[i] = shim_channel_alloc(buf, ast_channel_uniqueid(callers[i]));
+	}
+	CHECK(shim_app_exec("FindPeer", callees[0], "") == 0);
+
+	snprintf(uniqueids, sizeof(uniqueids), "UniqueID: %s, %s", ast_channel_uniqueid(callers[0]),
+		ast_channel_uniqueid(callees[0]));
+	snprintf(linkedid, sizeof(linkedid), "LinkedID: %s", ast_channel_uniqueid(callers[1]));
+	CHECK(shim_manager_action("FindPeerBulk", headers, buf, sizeof(buf)) == 0);
+	CHECK(strstr(buf, "Response: Success\r\n") != NULL);
+	CHECK(strstr(buf, "Requested: 4\r\nChannels: 4\r\nFound: 4\r\n") != NULL);
+	CHECK(strstr(buf, "Missing: 1234.999\r\n") != NULL);
+
+	snprintf(expected, sizeof(expected), "UniqueID0: %s\r\nPeerID0: %s\r\n",
+		ast_channel_uniqueid(callers[0]), ast_channel_uniqueid(callees[0]));
+	CHECK(strstr(buf, expected) != NULL);
+	snprintf(expected, sizeof(expected), "UniqueID1: %s\r\nPeerID1: %s\r\n",
+		ast_channel_uniqueid(callees[0]), ast_channel_uniqueid(callers[0]));
+	CHECK(strstr(buf, expected) != NULL);
+	/* Never tagged, answered from the linkedid group like PEERID() */
+	snprintf(expected, sizeof(expected), "UniqueID2: %s\r\nPeerID2: %s\r\n"
+		"UniqueID3: %s\r\nPeerID3: %s\r\n",
+		ast_channel_uniqueid(callers[1]), ast_channel_uniqueid(callees[1]),
+		ast_channel_uniqueid(callees[1]), ast_channel_uniqueid(callers[1]));
+	CHECK(strstr(buf, expected) != NULL);
+
+	CHECK(shim_manager_action("FindPeerBulk", NULL, buf, sizeof(buf)) == 0);
+	CHECK(strstr(buf, "Response: Error\r\n") != NULL);
+
+	for (i = 0; i < 2; i++) {
+		shim_channel_hangup(callees[i]);
+		shim_channel_hangup(callers[i]);
+	}
+	module_stop();
+}
+
+static void test_peer_events(void)
+{
+	struct ast_channel *callers[3];
+	struct ast_channel *legs[3][2];
+	char events[16384];
+	char buf[1024];
+	int i;
+	int j;
+
+	shim_config_clear("bridgemon.conf");
+	shim_config_set("bridgemon.conf", "general", "peer_events", "yes");
+	shim_config_set("bridgemon.conf", "general", "peer_event_window", "200");
+	CHECK(shim_module_load() == AST_MODULE_LOAD_SUCCESS);
+	shim_manager_events(NULL, 0);
+
+	for (i = 0; i < 3; i++) {
+		snprintf(buf, sizeof(buf), "PJSIP/caller-%08x", i);
+		callers[i] = shim_channel_alloc(buf, NULL);
+		for (j = 0; j < 2; j++) {
+			snprintf(buf, sizeof(buf), "PJSIP/callee-%08x;%d", i, j);
+			legs[i][j] = shim_channel_alloc(buf, ast_channel_uniqueid(callers[i]));
+		}
+	}
+	/* Each caller's peer changes four times inside the window */
+	for (j = 0; j < 4; j++) {
+		for (i = 0; i < 3; i++) {
+			CHECK(shim_app_exec("FindPeer", legs[i][j & 1], "") == 0);
+		}
+	}
+	CHECK(shim_manager_events(NULL, 0) == 0);
+
+	usleep(400 * 1000);
+	CHECK(shim_manager_events(events, sizeof(events)) == 1);
+	CHECK(count_matches(events, "Event: BridgePeers\r\n") == 1);
+	CHECK(strstr(events, "LinkedIDs: 3\r\n") != NULL);
+	for (i = 0; i < 3; i++) {
+		/* Listed once, with the peer it ended up with */
+		snprintf(buf, sizeof(buf), ": %s\r\nPeer", ast_channel_uniqueid(callers[i]));
+		CHECK(count_matches(events, buf) == 1);
+		snprintf(buf, sizeof(buf), ": %s\r\n", ast_channel_uniqueid(legs[i][1]));
+		CHECK(count_matches(events, buf) >= 1);
+		snprintf(buf, sizeof(buf), ": %s\r\n", ast_channel_uniqueid(legs[i][0]));
+		CHECK(count_matches(events, buf) == 0);
+	}
+
+	CHECK(shim_cli_exec("findpeer show events", buf, sizeof(buf)) == RESULT_SUCCESS);
+	CHECK(strstr(buf, "Events sent: 1\n") != NULL);
+
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 2; j++) {
+			shim_channel_hangup(legs[i][j]);
+		}
+		shim_channel_hangup(callers[i]);
+	}
+	module_stop();
+}
+
+int main(void)
+{
+	static const struct {
+		const char *name;
+		void (*fn)(void);
+	} tests[] = {
+		{ "findpeer_linkedid", test_findpeer_linkedid },
+		{ "peerid_cache", test_peerid_cache },
+		{ "peerids_fanout", test_peerids_fanout },
+		{ "findpeer_missing_originator", test_findpeer_missing_originator },
+		{ "negcache", test_negcache },
+		{ "bridgemon_hook", test_bridgemon_hook },
+		{ "bridgemon_unload_busy", test_bridgemon_unload_busy },
+		{ "bridgemon_stasis_roster", test_bridgemon_stasis_roster },
+		{ "autotag", test_autotag },
+		{ "local_chain", test_local_chain },
+		{ "sweep", test_sweep },
+		{ "findpeer_stats", test_findpeer_stats },
+		{ "findpeer_log", test_findpeer_log },
+		{ "findpeer_log_shared", test_findpeer_log_shared },
+		{ "peer_events", test_peer_events },
+		{ "findpeer_bulk", test_findpeer_bulk },
+	};
+	size_t i;
+
+	for (i = 0; i < ARRAY_LEN(tests); i++) {
+		int before = failures;
+
+		tests[i].fn();
+		printf("%-32s %s\n", tests[i].name, failures == before ? "PASS" : "FAIL");
+	}
+	CHECK(shim_channel_count() == 0);
+
+	printf("%d failure(s)\n", failures);
+	return failures ? 1 : 0;
+}
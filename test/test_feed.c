@@ -0,0 +1,402 @@
+/*
+ * app_bridgemon tests
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the COPYING file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Tests of the peer change feed
+ *
+ * Subscribers connect to the module's Unix socket and decode the records
+ * it pushes while FindPeer() runs through the API shim.
+ *
+ * Build and run with "make test".
+ */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+
+#include "shim.h"
+#include "peertable/bridgemon_feed.h"
+
+#define FLOOD 50000
+#define RACES 600
+
+static int failures;
+
+#define CHECK(expr) do { \
+	if (!(expr)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+		__sync_fetch_and_add(&failures, 1); \
+	} \
+} while (0)
+
+#define CHECK_STR(actual, expected) do { \
+	const char *__a = (actual); \
+	const char *__e = (expected); \
+	if (!__a || strcmp(__a, __e)) { \
+		fprintf(stderr, "%s:%d: %s is '%s', expected '%s'\n", __FILE__, __LINE__, \
+			#actual, S_OR(__a, "(null)"), __e); \
+		__sync_fetch_and_add(&failures, 1); \
+	} \
+} while (0)
+
+static char socket_path[108];
+
+struct record {
+	struct bridgemon_feed_record header;
+	char uniqueid[256];
+	char peer[1024];
+};
+
+static void module_start(unsigned int queue)
+{
+	char value[16];
+
+	snprintf(value, sizeof(value), "%u", queue);
+	shim_config_clear("bridgemon.conf");
+	shim_config_set("bridgemon.conf", "general", "peer_feed", socket_path);
+	shim_config_set("bridgemon.conf", "general", "peer_feed_queue", value);
+	CHECK(shim_module_load() == AST_MODULE_LOAD_SUCCESS);
+}
+
+static void module_stop(void)
+{
+	shim_taskprocessors_wait();
+	CHECK(shim_module_unload() == 0);
+}
+
+static void sleep_ms(long ms)
+{
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+	nanosleep(&ts, NULL);
+}
+
+/*! \brief Connect, then wait until the feed thread has taken the subscriber on */
+static int subscribe(int expected)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX, };
+	struct timeval timeout = { 5, 0 };
+	char buf[4096];
+	char want[32];
+	int fd;
+	int i;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	ast_copy_string(addr.sun_path, socket_path, sizeof(addr.sun_path));
+	if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+		CHECK(!"unable to connect to the peer feed");
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	snprintf(want, sizeof(want), "\n%d subscriber(s)", expected);
+	for (i = 0; i < 500; i++) {
+		if (shim_cli_exec("findpeer show feed", buf, sizeof(buf)) == RESULT_SUCCESS
+			&& strstr(buf, want)) {
+			return fd;
+		}
+		sleep_ms(10);
+	}
+	CHECK(!"subscriber never showed up");
+	return fd;
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t res = recv(fd, (char *) buf + done, len - done, 0);
+
+		if (res <= 0) {
+			return -1;
+		}
+		done += res;
+	}
+	return 0;
+}
+
+static int read_record(int fd, struct record *record)
+{
+	size_t rest;
+
+	if (read_full(fd, &record->header, sizeof(record->header))) {
+		return -1;
+	}
+	rest = record->header.length - (sizeof(record->header) - sizeof(record->header.length));
+	if (rest != (size_t) record->header.uniqueid_len + record->header.peer_len
+		|| record->header.peer_len >= sizeof(record->peer)) {
+		return -1;
+	}
+	if (read_full(fd, record->uniqueid, record->header.uniqueid_len)
+		|| read_full(fd, record->peer, record->header.peer_len)) {
+		return -1;
+	}
+	record->uniqueid[record->header.uniqueid_len] = '\0';
+	record->peer[record->header.peer_len] = '\0';
+	return 0;
+}
+
+static void test_records(void)
+{
+	struct ast_channel *caller;
+	struct ast_channel *callee;
+	struct record record;
+	char caller_id[AST_MAX_UNIQUEID];
+	int fds[2];
+	int i;
+
+	module_start(64);
+	fds[0] = subscribe(1);
+	fds[1] = subscribe(2);
+
+	caller = shim_channel_alloc("PJSIP/caller-00000001", NULL);
+	callee = shim_channel_alloc("PJSIP/callee-00000002", ast_channel_uniqueid(caller));
+	ast_copy_string(caller_id, ast_channel_uniqueid(caller), sizeof(caller_id));
+	CHECK(shim_app_exec("FindPeer", callee, "") == 0);
+	shim_channel_hangup(caller);
+
+	for (i = 0; i < 2; i++) {
+		int assigned = 0;
+		int removed = 0;
+		uint64_t seq = 0;
+
+		/* The caller's assignment precedes its removal, with nothing lost */
+		while (!removed && !read_record(fds[i], &record)) {
+			CHECK(record.header.seq == seq++);
+			CHECK(record.header.time_us > 0);
+			if (strcmp(record.uniqueid, caller_id)) {
+				continue;
+			}
+			if (record.header.type == BRIDGEMON_FEED_ASSIGN) {
+				CHECK_STR(record.peer, ast_channel_uniqueid(callee));
+				assigned = 1;
+			} else {
+				CHECK(record.header.type == BRIDGEMON_FEED_REMOVE);
+				CHECK(record.header.peer_len == 0);
+				CHECK(assigned);
+				removed = 1;
+			}
+		}
+		CHECK(removed);
+	}
+
+	shim_channel_hangup(callee);
+	module_stop();
+
+	/* Unloading closes the subscribers and removes the socket */
+	CHECK(read_record(fds[0], &record) == -1);
+	CHECK(access(socket_path, F_OK) == -1);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+struct consumer {
+	int fd;
+	uint64_t last;
+	uint64_t received;
+	uint64_t missed;
+};
+
+/*! \brief Read until record \a last, counting the sequence gaps */
+static void *consume(void *data)
+{
+	struct consumer *consumer = data;
+	struct record record;
+	uint64_t next = 0;
+
+	while (next <= consumer->last && !read_record(consumer->fd, &record)) {
+		CHECK(record.header.seq >= next);
+		consumer->missed += record.header.seq - next;
+		consumer->received++;
+		next = record.header.seq + 1;
+	}
+	CHECK(next == consumer->last + 1);
+	return NULL;
+}
+
+static void test_slow_consumer(void)
+{
+	struct ast_channel *caller;
+	struct ast_channel *legs[2];
+	struct consumer fast = { .last = UINT64_MAX, };
+	struct consumer slow = { .last = UINT64_MAX, };
+	pthread_t thread;
+	char buf[4096];
+	unsigned long long records = 0;
+	unsigned long long dropped = 0;
+	const char *line;
+	int i;
+
+	module_start(16);
+	fast.fd = subscribe(1);
+	slow.fd = subscribe(2);
+
+	caller = shim_channel_alloc("PJSIP/caller-00000001", NULL);
+	legs[0] = shim_channel_alloc("PJSIP/callee-00000002", ast_channel_uniqueid(caller));
+	legs[1] = shim_channel_alloc("PJSIP/callee-00000003", ast_channel_uniqueid(caller));
+
+	/* Every run moves the caller's peer, far more than the slow socket buffers */
+	for (i = 0; i < FLOOD; i++) {
+		shim_app_exec("FindPeer", legs[i & 1], "");
+	}
+	CHECK(shim_cli_exec("findpeer show feed", buf, sizeof(buf)) == RESULT_SUCCESS);
+	line = strstr(buf, "Records: ");
+	CHECK(line && sscanf(line, "Records: %llu", &records) == 1);
+	CHECK(records >= FLOOD);
+
+	fast.last = slow.last = records - 1;
+	pthread_create(&thread, NULL, consume, &fast);
+	consume(&slow);
+	pthread_join(thread, NULL);
+
+	/* Whatever a subscriber did not get, the module counted as dropped */
+	CHECK(slow.missed > 0);
+	CHECK(slow.received + slow.missed == records);
+	CHECK(fast.received + fast.missed == records);
+	CHECK(shim_cli_exec("findpeer show feed", buf, sizeof(buf)) == RESULT_SUCCESS);
+	for (line = strstr(buf, "Lag\n"); line && (line = strchr(line, '\n')); line++) {
+		unsigned long long sent;
+		unsigned long long lost;
+		int fd;
+
+		if (sscanf(line + 1, "%d %llu %llu", &fd, &sent, &lost) == 3) {
+			CHECK(sent + lost == records);
+			dropped += lost;
+		}
+	}
+	CHECK(dropped == slow.missed + fast.missed);
+
+	for (i = 0; i < 2; i++) {
+		shim_channel_hangup(legs[i]);
+	}
+	shim_channel_hangup(caller);
+	module_stop();
+	close(fast.fd);
+	close(slow.fd);
+}
+
+/*! \brief Legs of a call whose caller the main thread hangs up */
+static struct ast_channel *racing[2];
+static volatile int race_over;
+static volatile int race_lookups;
+
+/*! \brief Keep moving the caller's peer between its two legs, publishing every time */
+static void *race_run(void *data attribute_unused)
+{
+	int n = 0;
+
+	while (!race_over) {
+		shim_app_exec("FindPeer", racing[n++ & 1], "");
+		race_lookups = n;
+	}
+	return NULL;
+}
+
+/*! \brief A peer assigned as the channel goes away is always followed by its removal */
+static void test_hangup_race(void)
+{
+	struct ast_channel *marker;
+	struct ast_channel *marker_legs[2];
+	struct record record;
+	char caller_id[AST_MAX_UNIQUEID];
+	uint64_t seq = 0;
+	int phantoms = 0;
+	int spin;
+	int fd;
+	int i;
+
+	/* Large enough that nothing is dropped while a race runs unread */
+	module_start(1 << 20);
+	fd = subscribe(1);
+	marker = shim_channel_alloc("PJSIP/marker", NULL);
+	marker_legs[0] = shim_channel_alloc("PJSIP/marker", ast_channel_uniqueid(marker));
+	marker_legs[1] = shim_channel_alloc("PJSIP/marker", ast_channel_uniqueid(marker));
+
+	for (i = 0; fd >= 0 && i < RACES; i++) {
+		struct ast_channel *caller = shim_channel_alloc("PJSIP/race", NULL);
+		pthread_t thread;
+		int assigned = 0;
+
+		racing[0] = shim_channel_alloc("PJSIP/race", ast_channel_uniqueid(caller));
+		racing[1] = shim_channel_alloc("PJSIP/race", ast_channel_uniqueid(caller));
+		ast_copy_string(caller_id, ast_channel_uniqueid(caller), sizeof(caller_id));
+		race_over = 0;
+		race_lookups = 0;
+		pthread_create(&thread, NULL, race_run, NULL);
+		while (!race_lookups) {
+			sched_yield();
+		}
+		/* Hang up a little later every time, to land anywhere in a lookup */
+		for (spin = 0; spin < (i % 100) * 50; spin++) {
+			__asm__ volatile("" ::: "memory");
+		}
+		shim_channel_hangup(caller);
+		race_over = 1;
+		pthread_join(thread, NULL);
+
+		/* Everything about the caller comes before the marker's next assignment */
+		shim_app_exec("FindPeer", marker_legs[i & 1], "");
+		while (!read_record(fd, &record)) {
+			CHECK(record.header.seq == seq);
+			seq = record.header.seq + 1;
+			if (!strcmp(record.uniqueid, ast_channel_uniqueid(marker))) {
+				break;
+			}
+			if (!strcmp(record.uniqueid, caller_id)) {
+				assigned = record.header.type == BRIDGEMON_FEED_ASSIGN;
+			}
+		}
+		phantoms += assigned;
+		shim_channel_hangup(racing[0]);
+		shim_channel_hangup(racing[1]);
+	}
+	if (phantoms) {
+		fprintf(stderr, "%d of %d assignments never removed\n", phantoms, RACES);
+	}
+	CHECK(phantoms == 0);
+
+	for (i = 0; i < 2; i++) {
+		shim_channel_hangup(marker_legs[i]);
+	}
+	shim_channel_hangup(marker);
+	module_stop();
+	if (fd >= 0) {
+		close(fd);
+	}
+}
+
+int main(void)
+{
+	static const struct {
+		const char *name;
+		void (*fn)(void);
+	} tests[] = {
+		{ "records", test_records },
+		{ "slow_consumer", test_slow_consumer },
+		{ "hangup_race", test_hangup_race },
+	};
+	size_t i;
+
+	snprintf(socket_path, sizeof(socket_path), "/tmp/bridgemon-feed-test-%d.sock", (int) getpid());
+
+	for (i = 0; i < ARRAY_LEN(tests); i++) {
+		int before = failures;
+
+		tests[i].fn();
+		printf("%-32s %s\n", tests[i].name, failures == before ? "PASS" : "FAIL");
+	}
+	CHECK(shim_channel_count() == 0);
+
+	printf("%d failure(s)\n", failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,205 @@
+/*
+ * app_audiofork tests
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the COPYING file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Tests of the AudioFork volume kernels
+ *
+ * Every kernel this CPU runs must give exactly the output of the scalar
+ * reference, for every volume factor, for the limits of the sample range and
+ * for lengths and offsets that leave partial vectors at either end.
+ * bench/bench_simd.c measures how fast they are.
+ *
+ * Build and run with "make test".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "audiofork/audiofork_simd.h"
+
+#define ARRAY_LEN(a) (sizeof(a) / sizeof(a[0]))
+#define SAMPLES 2048
+#define GUARD 32
+
+static int failures;
+
+#define CHECK(expr) do { \
+	if (!(expr)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+		failures++; \
+	} \
+} while (0)
+
+/*! \brief The factors volumes -4..4 give, and a few ast_frame_adjust_volume() takes too */
+static const int factors[] = { -16, -8, -4, -2, 0, 2, 4, 8, 16, -3, 3, 1, -1, 100, 32767 };
+
+static int16_t src[SAMPLES + GUARD];
+
+static void fill(unsigned int seed)
+{
+	static const int16_t edges[] = { INT16_MIN, INT16_MIN + 1, -16385, -2049, -17, -16, -15,
+		-9, -8, -7, -3, -2, -1, 0, 1, 2, 3, 7, 8, 9, 15, 16, 17, 2047, 2048, 16384,
+		INT16_MAX - 1, INT16_MAX };
+	size_t i;
+
+	srandom(seed);
+	for (i = 0; i < ARRAY_LEN(src); i++) {
+		src[i] = i % 3 ? (int16_t) random() : edges[random() % ARRAY_LEN(edges)];
+	}
+}
+
+/*! \brief Run \a fn and the reference over the same samples and compare, guards included */
+static int matches(audiofork_gain_fn fn, size_t offset, size_t samples, int factor)
+{
+	int16_t expected[SAMPLES + GUARD];
+	int16_t actual[SAMPLES + GUARD];
+
+	memset(expected, 0x5a, sizeof(expected));
+	memset(actual, 0x5a, sizeof(actual));
+	audiofork_gain_scalar(expected + offset, src + offset, samples, factor);
+	fn(actual + offset, src + offset, samples, factor);
+	return !memcmp(expected, actual, sizeof(actual));
+}
+
+static void test_reference(void)
+{
+	int16_t out[8];
+	int16_t in[8] = { INT16_MIN, -32767, -7, -1, 0, 1, 7, INT16_MAX };
+	size_t i;
+
+	/* Multiplying saturates */
+	audiofork_gain_scalar(out, in, ARRAY_LEN(in), 16);
+	CHECK(out[0] == INT16_MIN && out[1] == INT16_MIN && out[2] == -112 && out[3] == -16);
+	CHECK(out[4] == 0 && out[5] == 16 && out[6] == 112 && out[7] == INT16_MAX);
+
+	/* Dividing truncates toward zero */
+	audiofork_gain_scalar(out, in, ARRAY_LEN(in), -4);
+	CHECK(out[0] == -8192 && out[1] == -8191 && out[2] == -1 && out[3] == 0);
+	CHECK(out[4] == 0 && out[5] == 0 && out[6] == 1 && out[7] == 8191);
+
+	audiofork_gain_scalar(out, in, ARRAY_LEN(in), 0);
+	for (i = 0; i < ARRAY_LEN(in); i++) {
+		CHECK(out[i] == in[i]);
+	}
+
+	CHECK(audiofork_gain_shift(1) == 0);
+	CHECK(audiofork_gain_shift(16) == 4);
+	CHECK(audiofork_gain_shift(3) == -1);
+	CHECK(audiofork_gain_shift(0) == -1);
+}
+
+static void test_dispatch(void)
+{
+	enum audiofork_simd_isa best = audiofork_simd_best();
+
+	CHECK(audiofork_gain_kernel(AUDIOFORK_SIMD_SCALAR) == audiofork_gain_scalar);
+	CHECK(audiofork_gain_kernel(best) != NULL);
+	CHECK(audiofork_gain_kernel(AUDIOFORK_SIMD_ISAS) == NULL);
+#ifdef AUDIOFORK_SIMD_X86
+	/* SSE2 is part of x86-64 */
+#ifdef __x86_64__
+	CHECK(best >= AUDIOFORK_SIMD_SSE2);
+#endif
+	CHECK(!__builtin_cpu_supports("avx2") || best == AUDIOFORK_SIMD_AVX2);
+#endif
+}
+
+/*! \brief Compare \a fn with the reference on one set of samples, reporting the first difference */
+static void check_kernel(enum audiofork_simd_isa isa, audiofork_gain_fn fn)
+{
+	size_t f;
+
+	for (f = 0; f < ARRAY_LEN(factors); f++) {
+		size_t offset;
+		size_t samples;
+
+		/* Every head and tail length of the widest vector */
+		for (offset = 0; offset < 17; offset++) {
+			for (samples = 0; samples <= 80; samples++) {
+				if (!matches(fn, offset, samples, factors[f])) {
+					fprintf(stderr, "%s: factor %d, offset %zu, %zu samples differ\n",
+						audiofork_simd_name(isa), factors[f], offset, samples);
+					failures++;
+					return;
+				}
+			}
+		}
+		/* 20 ms at 8, 16 and 48 kHz and a whole buffer */
+		CHECK(matches(fn, 0, 160, factors[f]));
+		CHECK(matches(fn, 3, 320, factors[f]));
+		CHECK(matches(fn, 1, 960, factors[f]));
+		CHECK(matches(fn, 0, SAMPLES, factors[f]));
+	}
+}
+
+static void test_kernels(void)
+{
+	int isa;
+	unsigned int seed;
+
+	for (isa = AUDIOFORK_SIMD_SCALAR + 1; isa < AUDIOFORK_SIMD_ISAS; isa++) {
+		audiofork_gain_fn fn = audiofork_gain_kernel(isa);
+
+		if (!fn) {
+			printf("%-32s skipped, not supported\n", audiofork_simd_name(isa));
+			continue;
+		}
+		for (seed = 1; seed <= 8; seed++) {
+			fill(seed);
+			check_kernel(isa, fn);
+		}
+	}
+}
+
+/*! \brief Every 16 bit input through every volume, in place */
+static void test_exhaustive(void)
+{
+	static int16_t all[65536];
+	static int16_t expected[65536];
+	int isa;
+	size_t f;
+	size_t i;
+
+	for (isa = AUDIOFORK_SIMD_SCALAR + 1; isa < AUDIOFORK_SIMD_ISAS; isa++) {
+		audiofork_gain_fn fn = audiofork_gain_kernel(isa);
+
+		for (f = 0; fn && f < ARRAY_LEN(factors); f++) {
+			for (i = 0; i < ARRAY_LEN(all); i++) {
+				all[i] = (int16_t) (i + INT16_MIN);
+			}
+			audiofork_gain_scalar(expected, all, ARRAY_LEN(all), factors[f]);
+			fn(all, all, ARRAY_LEN(all), factors[f]);
+			CHECK(!memcmp(all, expected, sizeof(all)));
+		}
+	}
+}
+
+int main(void)
+{
+	static const struct {
+		const char *name;
+		void (*fn)(void);
+	} tests[] = {
+		{ "reference", test_reference },
+		{ "dispatch", test_dispatch },
+		{ "kernels", test_kernels },
+		{ "exhaustive", test_exhaustive },
+	};
+	size_t i;
+
+	for (i = 0; i < ARRAY_LEN(tests); i++) {
+		int before = failures;
+
+		tests[i].fn();
+		printf("%-32s %s\n", tests[i].name, failures == before ? "PASS" : "FAIL");
+	}
+
+	printf("%d failure(s)\n", failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,359 @@
+/*
+ * app_bridgemon tests
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the COPYING file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Tests of the shared memory peer table and its reader library
+ *
+ * The module publishes through the API shim while reader threads look peers
+ * up through the library, and every value read must be one the module wrote.
+ *
+ * Build and run with "make test".
+ */
+
+#include <time.h>
+
+#include "shim.h"
+#include "peertable/bridgemon_peertable.h"
+
+#define CALLS 64
+#define LEGS 4
+#define CHURN_MAX 8192
+#define RUN_MS 1000
+#define RACES 500
+
+static int failures;
+
+#define CHECK(expr) do { \
+	if (!(expr)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+		__sync_fetch_and_add(&failures, 1); \
+	} \
+} while (0)
+
+#define CHECK_STR(actual, expected) do { \
+	const char *__a = (actual); \
+	const char *__e = (expected); \
+	if (!__a || strcmp(__a, __e)) { \
+		fprintf(stderr, "%s:%d: %s is '%s', expected '%s'\n", __FILE__, __LINE__, \
+			#actual, S_OR(__a, "(null)"), __e); \
+		__sync_fetch_and_add(&failures, 1); \
+	} \
+} while (0)
+
+static char table_name[64];
+
+struct call {
+	struct ast_channel *caller;
+	struct ast_channel *legs[LEGS];
+};
+
+static struct call calls[CALLS];
+static volatile int running;
+
+/*! \brief Uniqueids of channels created and hung up by the churn thread */
+static char churned[CHURN_MAX][AST_MAX_UNIQUEID];
+static int churned_count;
+
+static void module_start(unsigned int slots)
+{
+	char value[16];
+
+	snprintf(value, sizeof(value), "%u", slots);
+	shim_config_clear("bridgemon.conf");
+	shim_config_set("bridgemon.conf", "general", "peer_table", table_name);
+	shim_config_set("bridgemon.conf", "general", "peer_table_slots", value);
+	CHECK(shim_module_load() == AST_MODULE_LOAD_SUCCESS);
+}
+
+static void module_stop(void)
+{
+	shim_taskprocessors_wait();
+	CHECK(shim_module_unload() == 0);
+}
+
+static void test_publish(void)
+{
+	struct bridgemon_peertable *table;
+	struct ast_channel *caller;
+	struct ast_channel *callee;
+	char peer[BRIDGEMON_PEERTABLE_PEER_LEN];
+	char caller_id[AST_MAX_UNIQUEID];
+
+	module_start(64);
+	table = bridgemon_peertable_open(table_name);
+	CHECK(table != NULL);
+	if (!table) {
+		module_stop();
+		return;
+	}
+
+	caller = shim_channel_alloc("PJSIP/caller-00000001", NULL);
+	callee = shim_channel_alloc("PJSIP/callee-00000002", ast_channel_uniqueid(caller));
+	CHECK(bridgemon_peertable_lookup(table, ast_channel_uniqueid(caller), peer, sizeof(peer)) == -1);
+
+	CHECK(shim_app_exec("FindPeer", callee, "") == 0);
+	CHECK(bridgemon_peertable_lookup(table, ast_channel_uniqueid(caller), peer, sizeof(peer)) == 0);
+	CHECK_STR(peer, ast_channel_uniqueid(callee));
+
+	ast_copy_string(caller_id, ast_channel_uniqueid(caller), sizeof(caller_id));
+	shim_channel_hangup(caller);
+	CHECK(bridgemon_peertable_lookup(table, caller_id, peer, sizeof(peer)) == -1);
+	shim_channel_hangup(callee);
+
+	module_stop();
+	CHECK(bridgemon_peertable_lookup(table, "1234.1", peer, sizeof(peer)) == -2);
+	bridgemon_peertable_close(table);
+	CHECK(bridgemon_peertable_open(table_name) == NULL);
+}
+
+/*! \brief A table that cannot be created declines the load, and the next load starts clean */
+static void test_load_declined(void)
+{
+	shim_config_clear("bridgemon.conf");
+	shim_config_set("bridgemon.conf", "general", "peer_table", "/bridgemon/not-a-name");
+	CHECK(shim_module_load() == AST_MODULE_LOAD_DECLINE);
+
+	module_start(64);
+	module_stop();
+}
+
+static unsigned int xorshift(unsigned int *state)
+{
+	unsigned int x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+/*! \brief Keep retagging every caller with one of its legs */
+static void *writer_run(void *data)
+{
+	unsigned int seed = (uintptr_t) data;
+
+	while (running) {
+		struct call *call = &calls[xorshift(&seed) % CALLS];
+
+		shim_app_exec("FindPeer", call->legs[xorshift(&seed) % LEGS], "");
+	}
+	return NULL;
+}
+
+/*! \brief Publish and withdraw short calls, leaving tombstones and forcing compactions */
+static void *churn_run(void *data attribute_unused)
+{
+	while (running && churned_count + 2 <= CHURN_MAX) {
+		struct ast_channel *caller = shim_channel_alloc("PJSIP/churn", NULL);
+		struct ast_channel *callee = shim_channel_alloc("PJSIP/churn",
+			ast_channel_uniqueid(caller));
+
+		shim_app_exec("FindPeer", callee, "");
+		ast_copy_string(churned[churned_count++], ast_channel_uniqueid(caller), AST_MAX_UNIQUEID);
+		ast_copy_string(churned[churned_count++], ast_channel_uniqueid(callee), AST_MAX_UNIQUEID);
+		shim_channel_hangup(callee);
+		shim_channel_hangup(caller);
+	}
+	return NULL;
+}
+
+/*! \brief Every peer read must be, exactly, one of the caller's legs */
+static void *reader_run(void *data)
+{
+	struct bridgemon_peertable *table = bridgemon_peertable_open(table_name);
+	unsigned int seed = (uintptr_t) data;
+	long reads = 0;
+
+	CHECK(table != NULL);
+	while (table && running) {
+		struct call *call = &calls[xorshift(&seed) % CALLS];
+		char peer[BRIDGEMON_PEERTABLE_PEER_LEN];
+		int matched = 0;
+		int i;
+
+		if (bridgemon_peertable_lookup(table, ast_channel_uniqueid(call->caller),
+			peer, sizeof(peer))) {
+			/* Callers get their peer before the readers start */
+			CHECK(!"caller missing from the peer table");
+			break;
+		}
+		for (i = 0; i < LEGS; i++) {
+			matched |= !strcmp(peer, ast_channel_uniqueid(call->legs[i]));
+		}
+		if (!matched) {
+			fprintf(stderr, "torn or foreign peer '%s' for %s\n", peer,
+				ast_channel_uniqueid(call->caller));
+			CHECK(matched);
+			break;
+		}
+		reads++;
+	}
+	CHECK(reads > 0);
+	bridgemon_peertable_close(table);
+	return NULL;
+}
+
+static void test_concurrent(void)
+{
+	struct bridgemon_peertable *table;
+	pthread_t writers[2];
+	pthread_t readers[2];
+	pthread_t churn;
+	struct timespec ts = { RUN_MS / 1000, (RUN_MS % 1000) * 1000000L };
+	char peer[BRIDGEMON_PEERTABLE_PEER_LEN];
+	char value[256];
+	int i;
+	int j;
+
+	/* Small enough that the churn fills it with tombstones many times over */
+	module_start(256);
+
+	for (i = 0; i < CALLS; i++) {
+		char name[AST_CHANNEL_NAME];
+
+		snprintf(name, sizeof(name), "PJSIP/caller-%08x", i);
+		calls[i].caller = shim_channel_alloc(name, NULL);
+		for (j = 0; j < LEGS; j++) {
+			snprintf(name, sizeof(name), "PJSIP/callee-%08x;%d", i, j);
+			calls[i].legs[j] = shim_channel_alloc(name, ast_channel_uniqueid(calls[i].caller));
+		}
+		CHECK(shim_app_exec("FindPeer", calls[i].legs[0], "") == 0);
+	}
+
+	running = 1;
+	churned_count = 0;
+	for (i = 0; i < 2; i++) {
+		pthread_create(&writers[i], NULL, writer_run, (void *) (uintptr_t) (2463534242U + i));
+		pthread_create(&readers[i], NULL, reader_run, (void *) (uintptr_t) (88675123U + i));
+	}
+	pthread_create(&churn, NULL, churn_run, NULL);
+	nanosleep(&ts, NULL);
+	running = 0;
+	for (i = 0; i < 2; i++) {
+		pthread_join(writers[i], NULL);
+		pthread_join(readers[i], NULL);
+	}
+	pthread_join(churn, NULL);
+	CHECK(churned_count > 0);
+
+	/* Once quiet, the table agrees with the module's own index */
+	table = bridgemon_peertable_open(table_name);
+	CHECK(table != NULL);
+	for (i = 0; table && i < CALLS; i++) {
+		CHECK(bridgemon_peertable_lookup(table, ast_channel_uniqueid(calls[i].caller),
+			peer, sizeof(peer)) == 0);
+		CHECK(shim_func_read(calls[i].caller, "PEERID()", value, sizeof(value)) == 0);
+		CHECK_STR(peer, value);
+	}
+	for (i = 0; table && i < churned_count; i++) {
+		CHECK(bridgemon_peertable_lookup(table, churned[i], peer, sizeof(peer)) == -1);
+	}
+	bridgemon_peertable_close(table);
+
+	for (i = 0; i < CALLS; i++) {
+		for (j = 0; j < LEGS; j++) {
+			shim_channel_hangup(calls[i].legs[j]);
+		}
+		shim_channel_hangup(calls[i].caller);
+	}
+	module_stop();
+}
+
+/*! \brief Legs of a call whose caller the main thread hangs up */
+static struct ast_channel *racing[2];
+static volatile int race_over;
+static volatile int race_lookups;
+
+/*! \brief Keep moving the caller's peer between its two legs, publishing every time */
+static void *race_run(void *data attribute_unused)
+{
+	int n = 0;
+
+	while (!race_over) {
+		shim_app_exec("FindPeer", racing[n++ & 1], "");
+		race_lookups = n;
+	}
+	return NULL;
+}
+
+/*! \brief A peer recorded as the channel goes away never outlives it in the table */
+static void test_hangup_race(void)
+{
+	struct bridgemon_peertable *table;
+	char peer[BRIDGEMON_PEERTABLE_PEER_LEN];
+	char caller_id[AST_MAX_UNIQUEID];
+	int leaked = 0;
+	int spin;
+	int i;
+
+	module_start(4 * RACES);
+	table = bridgemon_peertable_open(table_name);
+	CHECK(table != NULL);
+
+	for (i = 0; table && i < RACES; i++) {
+		struct ast_channel *caller = shim_channel_alloc("PJSIP/race", NULL);
+		pthread_t thread;
+
+		racing[0] = shim_channel_alloc("PJSIP/race", ast_channel_uniqueid(caller));
+		racing[1] = shim_channel_alloc("PJSIP/race", ast_channel_uniqueid(caller));
+		ast_copy_string(caller_id, ast_channel_uniqueid(caller), sizeof(caller_id));
+		race_over = 0;
+		race_lookups = 0;
+		pthread_create(&thread, NULL, race_run, NULL);
+		while (!race_lookups) {
+			sched_yield();
+		}
+		/* Hang up a little later every time, to land anywhere in a lookup */
+		for (spin = 0; spin < (i % 100) * 50; spin++) {
+			__asm__ volatile("" ::: "memory");
+		}
+		shim_channel_hangup(caller);
+		race_over = 1;
+		pthread_join(thread, NULL);
+		if (bridgemon_peertable_lookup(table, caller_id, peer, sizeof(peer)) != -1) {
+			leaked++;
+		}
+		shim_channel_hangup(racing[0]);
+		shim_channel_hangup(racing[1]);
+	}
+	if (leaked) {
+		fprintf(stderr, "%d of %d peers outlived their channel\n", leaked, RACES);
+	}
+	CHECK(leaked == 0);
+
+	bridgemon_peertable_close(table);
+	module_stop();
+}
+
+int main(void)
+{
+	static const struct {
+		const char *name;
+		void (*fn)(void);
+	} tests[] = {
+		{ "publish", test_publish },
+		{ "load_declined", test_load_declined },
+		{ "concurrent", test_concurrent },
+		{ "hangup_race", test_hangup_race },
+	};
+	size_t i;
+
+	snprintf(table_name, sizeof(table_name), "/bridgemon-test-%d", (int) getpid());
+
+	for (i = 0; i < ARRAY_LEN(tests); i++) {
+		int before = failures;
+
+		tests[i].fn();
+		printf("%-32s %s\n", tests[i].name, failures == before ? "PASS" : "FAIL");
+	}
+	CHECK(shim_channel_count() == 0);
+
+	printf("%d failure(s)\n", failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,309 @@
+/*
+ * app_audiofork tests
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the COPYING file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Tests of the AudioFork stereo aligner and interleave kernels
+ *
+ * The aligner is driven with 20 ms frames at 8 kHz and made-up arrival
+ * times. Every sample carries the time it stands for, left and right apart
+ * by OFFSET, so a stereo frame is in line when its right sample is its left
+ * one plus OFFSET.
+ *
+ * Build and run with "make test".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "audiofork/audiofork_stereo.h"
+
+#define ARRAY_LEN(a) (sizeof(a) / sizeof(a[0]))
+#define RATE 8000
+#define WINDOW_MS 60
+#define SAMPLES 160
+#define FRAME_US 20000
+#define OFFSET 10000
+#define MAX_FRAMES 256
+#define GUARD 32
+
+static int failures;
+
+#define CHECK(expr) do { \
+	if (!(expr)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+		failures++; \
+	} \
+} while (0)
+
+/*! \brief Stereo frames taken so far */
+static int16_t out[2 * MAX_FRAMES * SAMPLES];
+static size_t taken;
+
+static void start(struct audiofork_aligner *aligner)
+{
+	CHECK(audiofork_aligner_init(aligner, RATE, WINDOW_MS, SAMPLES,
+		audiofork_interleave_kernel(audiofork_simd_best())) == 0);
+	taken = 0;
+}
+
+/*! \brief Take every ready pair, as the worker does */
+static void take(struct audiofork_aligner *aligner)
+{
+	taken += audiofork_aligner_take(aligner, out + 2 * taken, ARRAY_LEN(out) / 2 - taken);
+	CHECK(!audiofork_aligner_ready(aligner));
+}
+
+/*! \brief Add frame \a frame of a channel, taken off the channel at \a end_us */
+static void add(struct audiofork_aligner *aligner, int channel, int frame, int64_t end_us)
+{
+	int16_t samples[SAMPLES];
+	int i;
+
+	for (i = 0; i < SAMPLES; i++) {
+		samples[i] = (frame * SAMPLES + i) % OFFSET + 1 + (channel == AUDIOFORK_STEREO_RIGHT ? OFFSET : 0);
+	}
+	audiofork_aligner_add(aligner, channel, samples, SAMPLES, end_us);
+	take(aligner);
+}
+
+/*! \brief Whether the stereo frames from \a first on are all in line, with no silence */
+static int in_line(size_t first, size_t last)
+{
+	size_t i;
+
+	for (i = first; i < last; i++) {
+		if (!out[2 * i] || out[2 * i + 1] != out[2 * i] + OFFSET) {
+			fprintf(stderr, "stereo frame %zu is %d/%d\n", i, out[2 * i], out[2 * i + 1]);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void test_interleave(void)
+{
+	int16_t left[1024 + GUARD];
+	int16_t right[1024 + GUARD];
+	int16_t expected[2 * (1024 + GUARD)];
+	int16_t actual[2 * (1024 + GUARD)];
+	static const size_t lengths[] = { 160, 320, 960, 1024 };
+	size_t offset;
+	size_t samples;
+	size_t i;
+	int isa;
+
+	srandom(1);
+	for (i = 0; i < ARRAY_LEN(left); i++) {
+		left[i] = (int16_t) random();
+		right[i] = (int16_t) random();
+	}
+
+	audiofork_interleave_scalar(expected, left, right, 4);
+	CHECK(expected[0] == left[0] && expected[1] == right[0]);
+	CHECK(expected[6] == left[3] && expected[7] == right[3]);
+
+	CHECK(audiofork_interleave_kernel(AUDIOFORK_SIMD_SCALAR) == audiofork_interleave_scalar);
+	CHECK(audiofork_interleave_kernel(audiofork_simd_best()) != NULL);
+	CHECK(audiofork_interleave_kernel(AUDIOFORK_SIMD_ISAS) == NULL);
+
+	for (isa = AUDIOFORK_SIMD_SCALAR + 1; isa < AUDIOFORK_SIMD_ISAS; isa++) {
+		audiofork_interleave_fn fn = audiofork_interleave_kernel(isa);
+
+		if (!fn) {
+			printf("%-32s skipped, not supported\n", audiofork_simd_name(isa));
+			continue;
+		}
+		/* Every head and tail length of the widest vector, and whole frames */
+		for (offset = 0; offset < 17; offset++) {
+			for (samples = 0; samples <= 80 + ARRAY_LEN(lengths); samples++) {
+				size_t count = samples <= 80 ? samples : lengths[samples - 81];
+
+				memset(expected, 0x5a, sizeof(expected));
+				memset(actual, 0x5a, sizeof(actual));
+				audiofork_interleave_scalar(expected + 2 * offset, left + offset,
+					right + offset, count);
+				fn(actual + 2 * offset, left + offset, right + offset, count);
+				if (memcmp(expected, actual, sizeof(actual))) {
+					fprintf(stderr, "%s: offset %zu, %zu samples differ\n",
+						audiofork_simd_name(isa), offset, count);
+					failures++;
+					break;
+				}
+			}
+		}
+	}
+}
+
+/*! \brief Right a millisecond behind left, every frame: paired as they were taken */
+static void test_steady(void)
+{
+	struct audiofork_aligner aligner;
+	int k;
+
+	start(&aligner);
+	for (k = 0; k < 100; k++) {
+		add(&aligner, AUDIOFORK_STEREO_LEFT, k, (k + 1) * FRAME_US);
+		add(&aligner, AUDIOFORK_STEREO_RIGHT, k, (k + 1) * FRAME_US + 1000);
+	}
+	audiofork_aligner_flush(&aligner);
+	take(&aligner);
+	CHECK(taken == 100 * SAMPLES);
+	CHECK(in_line(0, taken));
+	CHECK(!aligner.padded[0] && !aligner.padded[1]);
+	CHECK(!aligner.trimmed[0] && !aligner.trimmed[1]);
+	audiofork_aligner_free(&aligner);
+}
+
+/*! \brief Right up to 30 ms late, in bursts: still paired as taken, nothing padded or cut */
+static void test_jitter(void)
+{
+	struct audiofork_aligner aligner;
+	int64_t right_end[100];
+	int64_t last = 0;
+	int left = 0;
+	int right = 0;
+	int k;
+
+	srandom(2);
+	for (k = 0; k < 100; k++) {
+		right_end[k] = MAX(last, (k + 1) * FRAME_US + random() % 30000);
+		last = right_end[k];
+	}
+
+	start(&aligner);
+	while (left < 100 || right < 100) {
+		if (left < 100 && (right == 100 || (left + 1) * FRAME_US <= right_end[right])) {
+			add(&aligner, AUDIOFORK_STEREO_LEFT, left, (left + 1) * FRAME_US);
+			left++;
+		} else {
+			add(&aligner, AUDIOFORK_STEREO_RIGHT, right, right_end[right]);
+			right++;
+		}
+		/* Never further apart than the window */
+		CHECK(aligner.len[0] <= aligner.window && aligner.len[1] <= aligner.window);
+	}
+	audiofork_aligner_flush(&aligner);
+	take(&aligner);
+	CHECK(taken == 100 * SAMPLES);
+	CHECK(in_line(0, taken));
+	CHECK(!aligner.padded[0] && !aligner.padded[1]);
+	CHECK(!aligner.trimmed[0] && !aligner.trimmed[1]);
+	audiofork_aligner_free(&aligner);
+}
+
+/*! \brief Only left has audio: right is silence, left waits no longer than the window */
+static void test_one_side(void)
+{
+	struct audiofork_aligner aligner;
+	size_t i;
+	int k;
+
+	start(&aligner);
+	for (k = 0; k < 100; k++) {
+		add(&aligner, AUDIOFORK_STEREO_LEFT, k, (k + 1) * FRAME_US);
+		CHECK(aligner.len[AUDIOFORK_STEREO_LEFT] <= aligner.window);
+	}
+	CHECK(taken == 100 * SAMPLES - aligner.window);
+	audiofork_aligner_flush(&aligner);
+	take(&aligner);
+	CHECK(taken == 100 * SAMPLES);
+	for (i = 0; i < taken; i++) {
+		if (out[2 * i] != (int16_t) (i % OFFSET + 1) || out[2 * i + 1]) {
+			CHECK(out[2 * i] == (int16_t) (i % OFFSET + 1) && !out[2 * i + 1]);
+			break;
+		}
+	}
+	CHECK(aligner.padded[AUDIOFORK_STEREO_RIGHT] == 100 * SAMPLES);
+	audiofork_aligner_free(&aligner);
+}
+
+/*! \brief Both sides quiet for five seconds: the gap is cut, not sent as silence */
+static void test_gap(void)
+{
+	struct audiofork_aligner aligner;
+	int k;
+
+	start(&aligner);
+	for (k = 0; k < 20; k++) {
+		int frame = k < 10 ? k : k + 250;
+
+		add(&aligner, AUDIOFORK_STEREO_LEFT, frame, (frame + 1) * FRAME_US);
+		add(&aligner, AUDIOFORK_STEREO_RIGHT, frame, (frame + 1) * FRAME_US);
+	}
+	CHECK(taken == 20 * SAMPLES);
+	CHECK(in_line(0, taken));
+	CHECK(!aligner.padded[0] && !aligner.padded[1]);
+	audiofork_aligner_free(&aligner);
+}
+
+/*! \brief Ten frames of right held up and then delivered at once: cut to the window, then back in line */
+static void test_burst(void)
+{
+	struct audiofork_aligner aligner;
+	int k;
+
+	start(&aligner);
+	for (k = 0; k < 200; k++) {
+		add(&aligner, AUDIOFORK_STEREO_LEFT, k, (k + 1) * FRAME_US);
+		if (k == 30) {
+			int late;
+
+			for (late = 20; late < 30; late++) {
+				add(&aligner, AUDIOFORK_STEREO_RIGHT, late, (k + 1) * FRAME_US);
+			}
+		}
+		if (k < 20 || k >= 30) {
+			add(&aligner, AUDIOFORK_STEREO_RIGHT, k, (k + 1) * FRAME_US);
+		}
+		CHECK(aligner.len[0] <= aligner.window && aligner.len[1] <= aligner.window);
+	}
+	CHECK(aligner.padded[AUDIOFORK_STEREO_RIGHT] > 0);
+	CHECK(aligner.trimmed[AUDIOFORK_STEREO_RIGHT] > 0);
+	CHECK(!aligner.padded[AUDIOFORK_STEREO_LEFT] && !aligner.trimmed[AUDIOFORK_STEREO_LEFT]);
+	CHECK(in_line(0, 20 * SAMPLES));
+	/* The last second is in line again */
+	CHECK(taken == 200 * SAMPLES);
+	CHECK(in_line(taken - 50 * SAMPLES, taken));
+
+	/* After a reset the next audio starts afresh */
+	audiofork_aligner_reset(&aligner);
+	CHECK(!audiofork_aligner_ready(&aligner));
+	taken = 0;
+	add(&aligner, AUDIOFORK_STEREO_LEFT, 0, 100 * FRAME_US);
+	add(&aligner, AUDIOFORK_STEREO_RIGHT, 0, 100 * FRAME_US);
+	CHECK(taken == SAMPLES);
+	CHECK(in_line(0, taken));
+	audiofork_aligner_free(&aligner);
+}
+
+int main(void)
+{
+	static const struct {
+		const char *name;
+		void (*fn)(void);
+	} tests[] = {
+		{ "interleave", test_interleave },
+		{ "steady", test_steady },
+		{ "jitter", test_jitter },
+		{ "one_side", test_one_side },
+		{ "gap", test_gap },
+		{ "burst", test_burst },
+	};
+	size_t i;
+
+	for (i = 0; i < ARRAY_LEN(tests); i++) {
+		int before = failures;
+
+		tests[i].fn();
+		printf("%-32s %s\n", tests[i].name, failures == before ? "PASS" : "FAIL");
+	}
+
+	printf("%d failure(s)\n", failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,468 @@
+/*
+ * app_audiofork tests
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the COPYING file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief WebSocket server the AudioFork tests and benchmarks fork to
+ *
+ * Only what a client that sends binary messages needs: the upgrade response,
+ * masked frames with 7, 16 and 64 bit lengths, and close frames. The
+ * Sec-WebSocket-Accept value is not derived from the key, the shim's client
+ * does not check it.
+ */
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ws_sink.h"
+
+#define SINK_READ 65536
+
+struct sink_conn {
+	size_t idx;
+	int fd;
+	int upgraded;
+	struct ws_sink_conn_stats stats;
+	/*! Bytes read and not yet parsed */
+	char *in;
+	size_t in_len;
+	size_t in_max;
+	/*! Message being reassembled from fragments */
+	char *msg;
+	size_t msg_len;
+	size_t msg_max;
+	char *capture;
+	size_t captured;
+};
+
+struct ws_sink {
+	int listen_fd;
+	int epoll_fd;
+	int port;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	struct sink_conn **conns;
+	size_t count;
+	size_t open;
+	size_t capture;
+	uint64_t messages;
+	uint64_t bytes;
+	ws_sink_message_cb cb;
+	void *data;
+	int paused;
+	int stop;
+};
+
+static void sleep_ms(long ms)
+{
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+	nanosleep(&ts, NULL);
+}
+
+static int grow(char **buf, size_t *max, size_t need)
+{
+	char *grown;
+	size_t size = *max ? *max : 4096;
+
+	if (need <= *max) {
+		return 0;
+	}
+	while (size < need) {
+		size *= 2;
+	}
+	grown = realloc(*buf, size);
+	if (!grown) {
+		return -1;
+	}
+	*buf = grown;
+	*max = size;
+	return 0;
+}
+
+static void conn_close(struct ws_sink *sink, struct sink_conn *conn)
+{
+	if (conn->fd < 0) {
+		return;
+	}
+	close(conn->fd);
+	conn->fd = -1;
+	conn->stats.closed = 1;
+	sink->open--;
+}
+
+static void conn_message(struct ws_sink *sink, struct sink_conn *conn, const char *payload,
+	size_t len)
+{
+	size_t keep = sink->capture - conn->captured;
+
+	conn->stats.messages++;
+	conn->stats.bytes += len;
+	sink->messages++;
+	sink->bytes += len;
+	if (keep) {
+		keep = len < keep ? len : keep;
+		memcpy(conn->capture + conn->captured, payload, keep);
+		conn->captured += keep;
+	}
+	if (sink->cb) {
+		sink->cb(sink->data, conn->idx, payload, len);
+	}
+}
+
+/*! \brief Answer the upgrade request once its headers are in */
+static size_t conn_upgrade(struct sink_conn *conn)
+{
+	static const char response[] = "HTTP/1.1 101 Switching Protocols\r\n"
+		"Upgrade: websocket\r\nConnection: Upgrade\r\n"
+		"Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n\r\n";
+	char *end = memmem(conn->in, conn->in_len, "\r\n\r\n", 4);
+
+	if (!end) {
+		return 0;
+	}
+	*end = '\0';
+	if (sscanf(conn->in, "GET %127s", conn->stats.path) != 1) {
+		conn->stats.path[0] = '\0';
+	}
+	if (send(conn->fd, response, sizeof(response) - 1, MSG_NOSIGNAL) < 0) {
+		return 0;
+	}
+	conn->upgraded = 1;
+	return end + 4 - conn->in;
+}
+
+/*!
+ * \brief Parse one frame off the input
+ *
+ * \return Bytes consumed, 0 if the frame is not complete yet, -1 to close
+ */
+static ssize_t conn_frame(struct ws_sink *sink, struct sink_conn *conn)
+{
+	unsigned char *in = (unsigned char *) conn->in;
+	size_t header = 2;
+	uint64_t len;
+	size_t i;
+	int opcode;
+
+	if (conn->in_len < 2) {
+		return 0;
+	}
+	opcode = in[0] & 0x0f;
+	len = in[1] & 0x7f;
+	if (len == 126 || len == 127) {
+		size_t ext = len == 126 ? 2 : 8;
+
+		if (conn->in_len < 2 + ext) {
+			return 0;
+		}
+		for (len = 0, i = 0; i < ext; i++) {
+			len = (len << 8) | in[2 + i];
+		}
+		header += ext;
+	}
+	if (in[1] & 0x80) {
+		header += 4;
+	}
+	if (conn->in_len < header + len) {
+		return 0;
+	}
+	if (in[1] & 0x80) {
+		for (i = 0; i < len; i++) {
+			in[header + i] ^= in[header - 4 + (i & 3)];
+		}
+	}
+
+	if (opcode == 0x8) {
+		return -1;
+	}
+	if (opcode == 0x0 || opcode == 0x1 || opcode == 0x2) {
+		if (grow(&conn->msg, &conn->msg_max, conn->msg_len + len + 1)) {
+			return -1;
+		}
+		memcpy(conn->msg + conn->msg_len, in + header, len);
+		conn->msg_len += len;
+		if (in[0] & 0x80) {
+			conn_message(sink, conn, conn->msg, conn->msg_len);
+			conn->msg_len = 0;
+		}
+	}
+	return header + len;
+}
+
+static void conn_read(struct ws_sink *sink, struct sink_conn *conn)
+{
+	for (;;) {
+		ssize_t res;
+		size_t used = 0;
+
+		if (grow(&conn->in, &conn->in_max, conn->in_len + SINK_READ)) {
+			conn_close(sink, conn);
+			return;
+		}
+		res = recv(conn->fd, conn->in + conn->in_len, SINK_READ, 0);
+		if (res < 0 && (errno == EAGAIN || errno == EINTR)) {
+			return;
+		}
+		if (res <= 0) {
+			conn_close(sink, conn);
+			return;
+		}
+		conn->in_len += res;
+
+		if (!conn->upgraded) {
+			used = conn_upgrade(conn);
+			if (!conn->upgraded) {
+				continue;
+			}
+		}
+		for (;;) {
+			ssize_t frame;
+
+			memmove(conn->in, conn->in + used, conn->in_len - used);
+			conn->in_len -= used;
+			frame = conn_frame(sink, conn);
+			if (frame < 0) {
+				conn_close(sink, conn);
+				return;
+			}
+			if (!frame) {
+				break;
+			}
+			used = frame;
+		}
+	}
+}
+
+static void sink_accept(struct ws_sink *sink)
+{
+	int fd;
+
+	while ((fd = accept4(sink->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		struct sink_conn *conn = calloc(1, sizeof(*conn));
+		struct sink_conn **conns = realloc(sink->conns, (sink->count + 1) * sizeof(*conns));
+		struct epoll_event event = { .events = EPOLLIN, };
+
+		if (!conn || !conns || (sink->capture && !(conn->capture = malloc(sink->capture)))) {
+			free(conn);
+			if (conns) {
+				sink->conns = conns;
+			}
+			close(fd);
+			continue;
+		}
+		sink->conns = conns;
+		conn->idx = sink->count;
+		conn->fd = fd;
+		event.data.ptr = conn;
+		sink->conns[sink->count++] = conn;
+		sink->open++;
+		epoll_ctl(sink->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+	}
+}
+
+static void *sink_thread(void *data)
+{
+	struct ws_sink *sink = data;
+	struct epoll_event events[64];
+
+	while (!__atomic_load_n(&sink->stop, __ATOMIC_ACQUIRE)) {
+		int n;
+		int i;
+
+		if (__atomic_load_n(&sink->paused, __ATOMIC_ACQUIRE)) {
+			sleep_ms(2);
+			continue;
+		}
+		n = epoll_wait(sink->epoll_fd, events, 64, 50);
+		pthread_mutex_lock(&sink->lock);
+		for (i = 0; i < n; i++) {
+			struct sink_conn *conn = events[i].data.ptr;
+
+			if (!conn) {
+				sink_accept(sink);
+			} else if (conn->fd >= 0) {
+				conn_read(sink, conn);
+			}
+		}
+		pthread_mutex_unlock(&sink->lock);
+	}
+	return NULL;
+}
+
+struct ws_sink *ws_sink_start(size_t capture, ws_sink_message_cb cb, void *data)
+{
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK), };
+	socklen_t addr_len = sizeof(addr);
+	struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL, };
+	struct ws_sink *sink = calloc(1, sizeof(*sink));
+
+	if (!sink) {
+		return NULL;
+	}
+	sink->capture = capture;
+	sink->cb = cb;
+	sink->data = data;
+	pthread_mutex_init(&sink->lock, NULL);
+	sink->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	sink->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (sink->listen_fd < 0 || sink->epoll_fd < 0
+		|| bind(sink->listen_fd, (struct sockaddr *) &addr, sizeof(addr))
+		|| listen(sink->listen_fd, 4096)
+		|| getsockname(sink->listen_fd, (struct sockaddr *) &addr, &addr_len)
+		|| epoll_ctl(sink->epoll_fd, EPOLL_CTL_ADD, sink->listen_fd, &event)
+		|| pthread_create(&sink->thread, NULL, sink_thread, sink)) {
+		if (sink->listen_fd >= 0) {
+			close(sink->listen_fd);
+		}
+		if (sink->epoll_fd >= 0) {
+			close(sink->epoll_fd);
+		}
+		free(sink);
+		return NULL;
+	}
+	sink->port = ntohs(addr.sin_port);
+	return sink;
+}
+
+void ws_sink_stop(struct ws_sink *sink)
+{
+	size_t i;
+
+	__atomic_store_n(&sink->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(sink->thread, NULL);
+	for (i = 0; i < sink->count; i++) {
+		conn_close(sink, sink->conns[i]);
+		free(sink->conns[i]->in);
+		free(sink->conns[i]->msg);
+		free(sink->conns[i]->capture);
+		free(sink->conns[i]);
+	}
+	free(sink->conns);
+	close(sink->listen_fd);
+	close(sink->epoll_fd);
+	pthread_mutex_destroy(&sink->lock);
+	free(sink);
+}
+
+int ws_sink_port(const struct ws_sink *sink)
+{
+	return sink->port;
+}
+
+void ws_sink_pause(struct ws_sink *sink, int paused)
+{
+	__atomic_store_n(&sink->paused, paused, __ATOMIC_RELEASE);
+}
+
+void ws_sink_drop(struct ws_sink *sink)
+{
+	size_t i;
+
+	pthread_mutex_lock(&sink->lock);
+	for (i = 0; i < sink->count; i++) {
+		conn_close(sink, sink->conns[i]);
+	}
+	pthread_mutex_unlock(&sink->lock);
+}
+
+size_t ws_sink_connections(struct ws_sink *sink)
+{
+	size_t count;
+
+	pthread_mutex_lock(&sink->lock);
+	count = sink->count;
+	pthread_mutex_unlock(&sink->lock);
+	return count;
+}
+
+size_t ws_sink_open(struct ws_sink *sink)
+{
+	size_t open;
+
+	pthread_mutex_lock(&sink->lock);
+	open = sink->open;
+	pthread_mutex_unlock(&sink->lock);
+	return open;
+}
+
+uint64_t ws_sink_bytes(struct ws_sink *sink)
+{
+	uint64_t bytes;
+
+	pthread_mutex_lock(&sink->lock);
+	bytes = sink->bytes;
+	pthread_mutex_unlock(&sink->lock);
+	return bytes;
+}
+
+uint64_t ws_sink_messages(struct ws_sink *sink)
+{
+	uint64_t messages;
+
+	pthread_mutex_lock(&sink->lock);
+	messages = sink->messages;
+	pthread_mutex_unlock(&sink->lock);
+	return messages;
+}
+
+int ws_sink_conn(struct ws_sink *sink, size_t conn, struct ws_sink_conn_stats *stats,
+	void *capture, size_t len)
+{
+	int copied = -1;
+
+	pthread_mutex_lock(&sink->lock);
+	if (conn < sink->count) {
+		struct sink_conn *c = sink->conns[conn];
+
+		if (stats) {
+			*stats = c->stats;
+		}
+		copied = c->captured < len ? c->captured : len;
+		if (capture) {
+			memcpy(capture, c->capture, copied);
+		}
+	}
+	pthread_mutex_unlock(&sink->lock);
+	return copied;
+}
+
+int ws_sink_wait_bytes(struct ws_sink *sink, uint64_t bytes, int timeout_ms)
+{
+	for (; timeout_ms > 0; timeout_ms--) {
+		if (ws_sink_bytes(sink) >= bytes) {
+			return 0;
+		}
+		sleep_ms(1);
+	}
+	return ws_sink_bytes(sink) >= bytes ? 0 : -1;
+}
+
+int ws_sink_wait_connections(struct ws_sink *sink, size_t count, size_t open, int timeout_ms)
+{
+	for (; timeout_ms >= 0; timeout_ms--) {
+		int done;
+
+		pthread_mutex_lock(&sink->lock);
+		done = sink->count >= count && sink->open <= open;
+		pthread_mutex_unlock(&sink->lock);
+		if (done) {
+			return 0;
+		}
+		sleep_ms(1);
+	}
+	return -1;
+}
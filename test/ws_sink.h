@@ -0,0 +1,101 @@
+/*
+ * app_audiofork tests
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the COPYING file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief WebSocket server the AudioFork tests and benchmarks fork to
+ *
+ * Listens on a loopback port, answers any upgrade request and counts the
+ * messages and payload bytes every connection sends. One epoll thread serves
+ * all the connections, so a benchmark can open thousands of them.
+ */
+
+#ifndef _WS_SINK_H
+#define _WS_SINK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct ws_sink;
+
+/*!
+ * \brief Called on the sink thread for every complete message
+ *
+ * \param data As given to ws_sink_start()
+ * \param conn Index of the connection, in the order they were accepted
+ * \param payload Unmasked payload
+ * \param len Bytes of payload
+ */
+typedef void (*ws_sink_message_cb)(void *data, size_t conn, const char *payload, size_t len);
+
+struct ws_sink_conn_stats {
+	/*! Request target of the upgrade, e.g. "/audio" */
+	char path[128];
+	uint64_t messages;
+	uint64_t bytes;
+	/*! Non-zero once the client closed or the connection dropped */
+	int closed;
+};
+
+/*!
+ * \brief Start a sink on an ephemeral loopback port
+ *
+ * \param capture Payload bytes to keep per connection, see ws_sink_conn()
+ * \param cb Called for every message, may be NULL
+ * \param data Passed to \a cb
+ */
+struct ws_sink *ws_sink_start(size_t capture, ws_sink_message_cb cb, void *data);
+
+/*! \brief Close every connection and stop the sink */
+void ws_sink_stop(struct ws_sink *sink);
+
+int ws_sink_port(const struct ws_sink *sink);
+
+/*! \brief Stop or resume reading, so clients back up against full socket buffers */
+void ws_sink_pause(struct ws_sink *sink, int paused);
+
+/*! \brief Drop every open connection from the server side */
+void ws_sink_drop(struct ws_sink *sink);
+
+/*! \brief Connections accepted so far */
+size_t ws_sink_connections(struct ws_sink *sink);
+
+/*! \brief Connections accepted and not yet closed */
+size_t ws_sink_open(struct ws_sink *sink);
+
+/*! \brief Payload bytes received on every connection together */
+uint64_t ws_sink_bytes(struct ws_sink *sink);
+
+/*! \brief Messages received on every connection together */
+uint64_t ws_sink_messages(struct ws_sink *sink);
+
+/*!
+ * \brief Get the counters and captured payload of one connection
+ *
+ * \return Bytes copied to \a capture, or -1 if there is no such connection
+ */
+int ws_sink_conn(struct ws_sink *sink, size_t conn, struct ws_sink_conn_stats *stats,
+	void *capture, size_t len);
+
+/*!
+ * \brief Wait until the sink has received at least \a bytes payload bytes
+ *
+ * \retval 0 once it has
+ * \retval -1 on timeout
+ */
+int ws_sink_wait_bytes(struct ws_sink *sink, uint64_t bytes, int timeout_ms);
+
+/*!
+ * \brief Wait until \a count connections were accepted and at most \a open are still open
+ *
+ * \retval 0 once they are
+ * \retval -1 on timeout
+ */
+int ws_sink_wait_connections(struct ws_sink *sink, size_t count, size_t open, int timeout_ms);
+
+#endif /* _WS_SINK_H */